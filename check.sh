@@ -1,11 +1,11 @@
 #!/bin/bash
 
 while true; do
-HTTP_CODE=`curl -G -I -m 2 -o /dev/null -s -w %{http_code}"\n" -H "Connection:Upgrade" -H "Upgrade:websocket" -H "Sec-WebSocket-Key:t6QkrxoCFWCRezSZApB/5w==" http://127.0.0.1/stats?name=admin`;
+HTTP_CODE=`curl -m 2 -o /dev/null -s -w %{http_code}"\n" http://127.0.0.1/healthz`;
 
 echo "Status code: ${HTTP_CODE}."
 
-if [ $HTTP_CODE != 101 ]; then
+if [ $HTTP_CODE != 200 ]; then
 	echo "Unexpected status code: ${HTTP_CODE}."
 	
 	pids=$(ps x | grep chatease-server | grep -v grep | awk '{print $1}')
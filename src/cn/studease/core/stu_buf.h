@@ -17,4 +17,6 @@ typedef struct {
 	u_char *end;
 } stu_buf_t;
 
+u_char *stu_buf_printf(stu_buf_t *b, const char *fmt, ...);
+
 #endif /* STU_BUF_H_ */
@@ -5,11 +5,14 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_CHANNEL
+
 #include "stu_config.h"
 #include "stu_core.h"
 
 stu_str_t           STU_CHANNEL_TIMER_PUSH_USERS = stu_string("push_users");
 stu_str_t           STU_CHANNEL_TIMER_PUSH_STATUS = stu_string("push_status");
+stu_str_t           STU_CHANNEL_TIMER_SNAPSHOT = stu_string("snapshot");
 
 extern stu_cycle_t *stu_cycle;
 extern stu_str_t    STU_HTTP_UPSTREAM_STATUS;
@@ -86,6 +89,8 @@ stu_channel_insert_locked(stu_channel_t *ch, stu_connection_t *c) {
 
 	c->user.channel = ch;
 
+	stu_evlog_write(STU_EVLOG_JOIN, &ch->id, &c->user.id, 0, 0, 0);
+
 	stu_log_debug(4, "Inserted user \"%s\" into channel \"%s\", total=%lu.", c->user.id.data, ch->id.data, ch->userlist.length);
 
 	return STU_OK;
@@ -93,17 +98,37 @@ stu_channel_insert_locked(stu_channel_t *ch, stu_connection_t *c) {
 
 void
 stu_channel_remove(stu_channel_t *ch, stu_connection_t *c) {
+	stu_bool_t  empty;
+
+	// in the same order as inserting
+	stu_mutex_lock(&stu_cycle->channels.lock);
 	stu_mutex_lock(&ch->userlist.lock);
+
 	stu_channel_remove_locked(ch, c);
+	empty = ch->userlist.length == 0;
+
 	stu_mutex_unlock(&ch->userlist.lock);
+	stu_mutex_unlock(&stu_cycle->channels.lock);
+
+	// unlinked, and nobody else could reach it
+	if (empty) {
+		stu_log_debug(4, "removed channel \"%s\", total=%lu.", ch->id.data, stu_cycle->channels.length);
+
+		stu_free(ch->id.data);
+		stu_free(ch);
+	}
 }
 
+/* called with stu_cycle->channels.lock & ch->userlist.lock held, and the caller frees an empty channel. */
 void
 stu_channel_remove_locked(stu_channel_t *ch, stu_connection_t *c) {
 	stu_str_t     *key;
 	stu_uint_t     kh;
 
 	stu_channel_remove_user_locked(ch, c);
+	c->user.channel = NULL;
+
+	stu_evlog_write(STU_EVLOG_LEAVE, &ch->id, &c->user.id, 0, 0, 0);
 
 	if (ch->userlist.length == 0) {
 		if (ch->userlist.free) {
@@ -114,12 +139,7 @@ stu_channel_remove_locked(stu_channel_t *ch, stu_connection_t *c) {
 		key = &ch->id;
 		kh = stu_hash_key_lc(key->data, key->len);
 
-		stu_hash_remove(&stu_cycle->channels, kh, key->data, key->len);
-
-		stu_free(key->data);
-		stu_free(ch);
-
-		stu_log_debug(4, "removed channel \"%s\", total=%lu.", key->data, ch->userlist.length);
+		stu_hash_remove_locked(&stu_cycle->channels, kh, key->data, key->len);
 	}
 }
 
@@ -151,6 +171,8 @@ stu_channel_remove_user_locked(stu_channel_t *ch, stu_connection_t *c) {
 			stu_queue_remove(&e->queue);
 			stu_queue_remove(&e->q);
 
+			stu_log_debug(1, "Removed %p from hash: key=%lu, i=%lu, name=%s.", e->value, kh, i, c->user.id.data);
+
 			if (hash->free) {
 				hash->free(e->key.data);
 				hash->free(e);
@@ -158,8 +180,6 @@ stu_channel_remove_user_locked(stu_channel_t *ch, stu_connection_t *c) {
 
 			hash->length--;
 
-			stu_log_debug(1, "Removed %p from hash: key=%lu, i=%lu, name=%s.", e->value, kh, i, c->user.id.data);
-
 			break;
 		}
 	}
@@ -242,6 +262,27 @@ stu_channel_add_timers() {
 		stu_timer_add(&c->write, stu_cycle->config.push_status_interval);
 	}
 
+	if (stu_cycle->config.snapshot_interval) {
+		hk = stu_hash_key_lc(STU_CHANNEL_TIMER_SNAPSHOT.data, STU_CHANNEL_TIMER_SNAPSHOT.len);
+
+		c = stu_hash_find_locked(&stu_cycle->timers, hk, STU_CHANNEL_TIMER_SNAPSHOT.data, STU_CHANNEL_TIMER_SNAPSHOT.len);
+		if (c == NULL) {
+			c = stu_connection_get((stu_socket_t) -2);
+			if (c == NULL) {
+				stu_log_error(0, "Failed to get connection for channel snapshot.");
+				goto done;
+			}
+
+			if (stu_hash_insert_locked(&stu_cycle->timers, &STU_CHANNEL_TIMER_SNAPSHOT, c, STU_HASH_LOWCASE) == STU_ERROR) {
+				stu_log_error(0, "Failed to insert timer \"%s\", total=%lu.", STU_CHANNEL_TIMER_SNAPSHOT.data, stu_cycle->timers.length);
+				goto done;
+			}
+		}
+
+		c->write.handler = stu_channel_snapshot_handler;
+		stu_timer_add(&c->write, stu_cycle->config.snapshot_interval);
+	}
+
 	rc = STU_OK;
 
 done:
@@ -270,9 +311,10 @@ stu_channel_push_users(stu_str_t *key, void *value) {
 	stu_connection_t *c;
 	stu_json_t       *res, *raw, *rschannel, *rscid, *rscstate, *rsctotal;
 	u_char           *data, temp[STU_HTTP_REQUEST_DEFAULT_SIZE];
+	u_char           *tlv, tlvtemp[STU_HTTP_REQUEST_DEFAULT_SIZE];
 	stu_socket_t      fd;
-	uint64_t          size;
-	stu_int_t         extened, n;
+	uint64_t          size, tlvsize;
+	stu_int_t         extened, tlvextened, n;
 
 	ch = (stu_channel_t *) value;
 
@@ -296,21 +338,48 @@ stu_channel_push_users(stu_str_t *key, void *value) {
 	stu_json_add_item_to_object(res, raw);
 	stu_json_add_item_to_object(res, rschannel);
 
-	data = stu_json_stringify(res, (u_char *) temp + 10);
-	*data = '\0';
+	size = stu_json_stringify(res, temp + 10, STU_HTTP_REQUEST_DEFAULT_SIZE - 10 - 1);
 
-	stu_json_delete(res);
+	if (size > STU_HTTP_REQUEST_DEFAULT_SIZE - 10 - 1) {
+		stu_log_error(0, "Users frame too large in channel \"%s\": size=%lu.", key->data, size);
+		stu_json_delete(res);
+		stu_mutex_unlock(&ch->userlist.lock);
+		return;
+	}
+	temp[10 + size] = '\0';
 
-	size = data - temp - 10;
 	data = stu_websocket_encode_frame(STU_WEBSOCKET_OPCODE_BINARY, temp, size, &extened);
 
+	// encoded for the first tlv peer, and may be longer than json
+	tlv = NULL;
+	tlvsize = 0;
+	tlvextened = 0;
+
 	elts = &ch->userlist.keys.elts;
 	for (q = stu_queue_head(&elts->queue); q != NULL && q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
 		e = stu_queue_data(q, stu_hash_elt_t, q);
 		c = (stu_connection_t *) e->value;
 		fd = stu_atomic_fetch(&c->fd);
 
-		n = send(fd, data, size + 2 + extened, 0);
+		if (c->protocol == STU_PROTOCOL_TLV) {
+			if (tlvsize == 0) {
+				tlvsize = stu_protocol_encode(res, tlvtemp + 10, STU_HTTP_REQUEST_DEFAULT_SIZE - 10);
+				if (tlvsize > STU_HTTP_REQUEST_DEFAULT_SIZE - 10) {
+					stu_log_error(0, "Users tlv frame too large in channel \"%s\": size=%lu.", key->data, tlvsize);
+				} else {
+					tlv = stu_websocket_encode_frame(STU_WEBSOCKET_OPCODE_BINARY, tlvtemp, tlvsize, &tlvextened);
+				}
+			}
+
+			if (tlv == NULL) {
+				continue;
+			}
+
+			n = send(fd, tlv, tlvsize + 2 + tlvextened, 0);
+		} else {
+			n = send(fd, data, size + 2 + extened, 0);
+		}
+
 		if (n == -1) {
 			//stu_log_error(stu_errno, "Failed to broadcast in channel \"%s\": , fd=%d.", id->data, fd);
 			continue;
@@ -318,6 +387,8 @@ stu_channel_push_users(stu_str_t *key, void *value) {
 	}
 
 	stu_mutex_unlock(&ch->userlist.lock);
+
+	stu_json_delete(res);
 }
 
 void
@@ -358,6 +429,7 @@ stu_channel_push_status_generate_request(stu_connection_t *c) {
 	stu_queue_t        *q;
 	stu_json_t         *res, *rschannel, *rscstate, *rsctotal;
 	u_char             *p;
+	size_t              size;
 	stu_table_elt_t    *h;
 	stu_int_t           total;
 
@@ -405,7 +477,25 @@ stu_channel_push_status_generate_request(stu_connection_t *c) {
 		pr->request_body.end = pr->request_body.start + STU_HTTP_REQUEST_DEFAULT_SIZE;
 	}
 
-	p = stu_json_stringify(res, pr->request_body.start);
+	// as many channels as there are, so grow to the length required
+	size = stu_json_stringify(res, pr->request_body.start, pr->request_body.end - pr->request_body.start - 1);
+	if (size > (size_t) (pr->request_body.end - pr->request_body.start - 1)) {
+		stu_free(pr->request_body.start);
+
+		pr->request_body.start = stu_calloc(size + 1);
+		if (pr->request_body.start == NULL) {
+			stu_log_error(0, "Failed to palloc() request body: fd=%d, size=%lu.", c->fd, size + 1);
+			pr->request_body.end = NULL;
+			stu_json_delete(res);
+			return STU_ERROR;
+		}
+
+		pr->request_body.end = pr->request_body.start + size + 1;
+
+		stu_json_stringify(res, pr->request_body.start, size);
+	}
+
+	p = pr->request_body.start + size;
 	*p = '\0';
 
 	pr->request_body.last = p;
@@ -422,12 +512,13 @@ stu_channel_push_status_generate_request(stu_connection_t *c) {
 
 		r = (stu_http_request_t *) c->data;
 
-		h = stu_calloc(sizeof(stu_table_elt_t));
-		if (h == NULL) {
-			stu_log_error(0, "Failed to pcalloc table elt \"Host\" for http upstream %s request.", u->server->name.data);
+		if (r->headers_in.nheaders == STU_HTTP_HEADERS_IN_MAX_N) {
+			stu_log_error(0, "Too many header lines for upstream %s: n=%d.", u->server->name.data, r->headers_in.nheaders);
 			return STU_ERROR;
 		}
 
+		h = &r->headers_in.headers[r->headers_in.nheaders++];
+
 		h->key.data = stu_calloc(5);
 		if (h->key.data == NULL) {
 			return STU_ERROR;
@@ -451,10 +542,6 @@ stu_channel_push_status_generate_request(stu_connection_t *c) {
 		stu_strlow(h->lowcase_key, h->key.data, h->key.len);
 		h->lowcase_key[h->key.len] = '\0';
 
-		if (stu_list_push(&r->headers_in.headers, h, sizeof(stu_table_elt_t)) == STU_ERROR) {
-			return STU_ERROR;
-		}
-
 		r->headers_in.host = h;
 	}
 
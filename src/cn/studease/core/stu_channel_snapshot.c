@@ -0,0 +1,333 @@
+/*
+ * stu_channel_snapshot.c
+ *
+ *  Created on: 2017-7-8
+ *      Author: Tony Lau
+ */
+
+#define STU_LOG_MODULE  STU_LOG_CHANNEL
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+extern stu_cycle_t *stu_cycle;
+
+static stu_mutex_t              stu_channel_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static stu_channel_snapshot_t  *stu_channel_snapshot_current;
+
+static stu_channel_snapshot_t *stu_channel_snapshot_create();
+static void                    stu_channel_snapshot_rate(stu_channel_snapshot_t *s, stu_channel_snapshot_t *prev);
+static void                    stu_channel_snapshot_free(stu_channel_snapshot_t *s);
+
+static void                   *stu_channel_snapshot_palloc(stu_channel_snapshot_t *s, size_t size);
+static u_char                 *stu_channel_snapshot_strdup(stu_channel_snapshot_t *s, stu_str_t *dst, stu_str_t *src);
+
+static int                     stu_channel_snapshot_cmp_id(const void *one, const void *two);
+static int                     stu_channel_snapshot_cmp_rate(const void *one, const void *two);
+static stu_int_t               stu_channel_snapshot_cmp(stu_str_t *one, stu_str_t *two);
+
+#define stu_channel_snapshot_msec(tp)  ((uint64_t) (tp)->sec * 1000 + (tp)->msec)
+
+
+/*
+ * Copies the channel table on the timer thread, and publishes it for the
+ * admin API, which never takes the channel locks.
+ */
+void
+stu_channel_snapshot_handler(stu_event_t *ev) {
+	stu_connection_t       *c;
+	stu_channel_snapshot_t *s, *prev;
+
+	c = (stu_connection_t *) ev->data;
+
+	s = stu_channel_snapshot_create();
+	if (s == NULL) {
+		stu_log_error(0, "Failed to create channel snapshot.");
+		goto done;
+	}
+
+	// only this handler replaces the current one, so it is safe to read here
+	stu_channel_snapshot_rate(s, stu_channel_snapshot_current);
+
+	stu_mutex_lock(&stu_channel_snapshot_lock);
+	prev = stu_channel_snapshot_current;
+	stu_channel_snapshot_current = s;
+	s->ref = 1;
+	stu_mutex_unlock(&stu_channel_snapshot_lock);
+
+	if (prev) {
+		stu_channel_snapshot_release(prev);
+	}
+
+	stu_log_debug(4, "published channel snapshot: channels=%lu.", s->n);
+
+done:
+
+	stu_timer_add_locked(&c->write, stu_cycle->config.snapshot_interval);
+}
+
+stu_channel_snapshot_t *
+stu_channel_snapshot_acquire() {
+	stu_channel_snapshot_t *s;
+
+	stu_mutex_lock(&stu_channel_snapshot_lock);
+
+	s = stu_channel_snapshot_current;
+	if (s) {
+		s->ref++;
+	}
+
+	stu_mutex_unlock(&stu_channel_snapshot_lock);
+
+	return s;
+}
+
+void
+stu_channel_snapshot_release(stu_channel_snapshot_t *s) {
+	stu_uint_t  ref;
+
+	stu_mutex_lock(&stu_channel_snapshot_lock);
+	ref = --s->ref;
+	stu_mutex_unlock(&stu_channel_snapshot_lock);
+
+	if (ref == 0) {
+		stu_channel_snapshot_free(s);
+	}
+}
+
+stu_channel_snapshot_elt_t *
+stu_channel_snapshot_find(stu_channel_snapshot_t *s, stu_str_t *id) {
+	stu_uint_t  i;
+
+	i = stu_channel_snapshot_after(s, id);
+	if (i > 0 && stu_channel_snapshot_cmp(&s->channels[i - 1].id, id) == 0) {
+		return &s->channels[i - 1];
+	}
+
+	return NULL;
+}
+
+/* the index of the first channel ordered after id. */
+stu_uint_t
+stu_channel_snapshot_after(stu_channel_snapshot_t *s, stu_str_t *id) {
+	stu_uint_t  lo, hi, mid;
+
+	lo = 0;
+	hi = s->n;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (stu_channel_snapshot_cmp(&s->channels[mid].id, id) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+
+static stu_channel_snapshot_t *
+stu_channel_snapshot_create() {
+	stu_channel_snapshot_t      *s;
+	stu_channel_snapshot_elt_t  *elt;
+	stu_channel_snapshot_user_t *u;
+	stu_channel_t               *ch;
+	stu_connection_t            *c;
+	stu_list_elt_t              *elts, *uelts;
+	stu_hash_elt_t              *e, *ue;
+	stu_queue_t                 *q, *uq;
+	stu_uint_t                   i, n;
+
+	s = stu_calloc(sizeof(stu_channel_snapshot_t));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	s->time = stu_channel_snapshot_msec(stu_timeofday());
+
+	stu_mutex_lock(&stu_cycle->channels.lock);
+
+	n = stu_cycle->channels.length;
+
+	s->channels = stu_channel_snapshot_palloc(s, n * sizeof(stu_channel_snapshot_elt_t) + 1);
+	s->busiest = stu_channel_snapshot_palloc(s, n * sizeof(stu_channel_snapshot_elt_t *) + 1);
+	if (s->channels == NULL || s->busiest == NULL) {
+		goto failed;
+	}
+
+	elts = &stu_cycle->channels.keys.elts;
+	for (q = stu_queue_head(&elts->queue); q != NULL && q != stu_queue_sentinel(&elts->queue) && s->n < n; q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_hash_elt_t, q);
+		ch = (stu_channel_t *) e->value;
+		elt = &s->channels[s->n];
+
+		stu_mutex_lock(&ch->userlist.lock);
+
+		elt->state = ch->state;
+		elt->message_n = ch->message_n;
+		elt->total = ch->userlist.length;
+		elt->users = stu_channel_snapshot_palloc(s, elt->total * sizeof(stu_channel_snapshot_user_t) + 1);
+
+		if (elt->users == NULL || stu_channel_snapshot_strdup(s, &elt->id, &ch->id) == NULL) {
+			stu_mutex_unlock(&ch->userlist.lock);
+			goto failed;
+		}
+
+		i = 0;
+		uelts = &ch->userlist.keys.elts;
+		for (uq = stu_queue_head(&uelts->queue); uq != NULL && uq != stu_queue_sentinel(&uelts->queue) && i < elt->total; uq = stu_queue_next(uq)) {
+			ue = stu_queue_data(uq, stu_hash_elt_t, q);
+			c = (stu_connection_t *) ue->value;
+			u = &elt->users[i++];
+
+			u->role = c->user.role;
+
+			if (stu_channel_snapshot_strdup(s, &u->id, &c->user.id) == NULL
+					|| stu_channel_snapshot_strdup(s, &u->name, &c->user.name) == NULL) {
+				stu_mutex_unlock(&ch->userlist.lock);
+				goto failed;
+			}
+		}
+
+		elt->total = i;
+
+		stu_mutex_unlock(&ch->userlist.lock);
+
+		s->busiest[s->n++] = elt;
+	}
+
+	stu_mutex_unlock(&stu_cycle->channels.lock);
+
+	qsort(s->channels, s->n, sizeof(stu_channel_snapshot_elt_t), stu_channel_snapshot_cmp_id);
+
+	// re-point after sorting
+	for (i = 0; i < s->n; i++) {
+		s->busiest[i] = &s->channels[i];
+	}
+
+	return s;
+
+failed:
+
+	stu_mutex_unlock(&stu_cycle->channels.lock);
+
+	stu_channel_snapshot_free(s);
+
+	return NULL;
+}
+
+static void
+stu_channel_snapshot_rate(stu_channel_snapshot_t *s, stu_channel_snapshot_t *prev) {
+	stu_channel_snapshot_elt_t *elt, *old;
+	stu_int_t                   n;
+	uint64_t                    elapsed;
+	stu_uint_t                  i;
+
+	elapsed = prev && s->time > prev->time ? s->time - prev->time : stu_cycle->config.snapshot_interval;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	for (i = 0; i < s->n; i++) {
+		elt = &s->channels[i];
+		n = elt->message_n;
+
+		old = prev ? stu_channel_snapshot_find(prev, &elt->id) : NULL;
+		if (old && old->message_n <= n) {
+			n -= old->message_n;
+		}
+
+		elt->rate = n * 1000.0 / elapsed;
+	}
+
+	qsort(s->busiest, s->n, sizeof(stu_channel_snapshot_elt_t *), stu_channel_snapshot_cmp_rate);
+}
+
+static void
+stu_channel_snapshot_free(stu_channel_snapshot_t *s) {
+	stu_channel_snapshot_block_t *b, *next;
+
+	for (b = s->blocks; b; b = next) {
+		next = b->next;
+		stu_free(b);
+	}
+
+	stu_free(s);
+}
+
+static void *
+stu_channel_snapshot_palloc(stu_channel_snapshot_t *s, size_t size) {
+	stu_channel_snapshot_block_t *b;
+	u_char                       *p;
+	size_t                        n;
+
+	size = stu_align(size, sizeof(void *));
+
+	b = s->blocks;
+	if (b == NULL || (size_t) (b->end - b->last) < size) {
+		n = stu_max(size + sizeof(stu_channel_snapshot_block_t), STU_CHANNEL_SNAPSHOT_BLOCK_SIZE);
+
+		b = stu_alloc(n);
+		if (b == NULL) {
+			return NULL;
+		}
+
+		b->last = (u_char *) b + sizeof(stu_channel_snapshot_block_t);
+		b->end = (u_char *) b + n;
+		b->next = s->blocks;
+		s->blocks = b;
+	}
+
+	p = b->last;
+	b->last += size;
+
+	return p;
+}
+
+static u_char *
+stu_channel_snapshot_strdup(stu_channel_snapshot_t *s, stu_str_t *dst, stu_str_t *src) {
+	dst->data = stu_channel_snapshot_palloc(s, src->len + 1);
+	if (dst->data == NULL) {
+		return NULL;
+	}
+
+	memcpy(dst->data, src->data, src->len);
+	dst->data[src->len] = '\0';
+	dst->len = src->len;
+
+	return dst->data;
+}
+
+static int
+stu_channel_snapshot_cmp_id(const void *one, const void *two) {
+	return stu_channel_snapshot_cmp(&((stu_channel_snapshot_elt_t *) one)->id, &((stu_channel_snapshot_elt_t *) two)->id);
+}
+
+static int
+stu_channel_snapshot_cmp_rate(const void *one, const void *two) {
+	stu_channel_snapshot_elt_t *a, *b;
+
+	a = *(stu_channel_snapshot_elt_t **) one;
+	b = *(stu_channel_snapshot_elt_t **) two;
+
+	if (a->rate != b->rate) {
+		return a->rate < b->rate ? 1 : -1;
+	}
+
+	return stu_channel_snapshot_cmp(&a->id, &b->id);
+}
+
+static stu_int_t
+stu_channel_snapshot_cmp(stu_str_t *one, stu_str_t *two) {
+	stu_int_t  rc;
+
+	rc = memcmp(one->data, two->data, stu_min(one->len, two->len));
+	if (rc) {
+		return rc;
+	}
+
+	return (stu_int_t) one->len - (stu_int_t) two->len;
+}
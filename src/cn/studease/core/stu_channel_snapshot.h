@@ -0,0 +1,63 @@
+/*
+ * stu_channel_snapshot.h
+ *
+ *  Created on: 2017-7-8
+ *      Author: Tony Lau
+ */
+
+#ifndef STU_CHANNEL_SNAPSHOT_H_
+#define STU_CHANNEL_SNAPSHOT_H_
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#define STU_CHANNEL_SNAPSHOT_DEFAULT_INTERVAL  5
+#define STU_CHANNEL_SNAPSHOT_BLOCK_SIZE        (64 * 1024)
+
+typedef struct stu_channel_snapshot_block_s stu_channel_snapshot_block_t;
+
+struct stu_channel_snapshot_block_s {
+	stu_channel_snapshot_block_t *next;
+	u_char                       *last;
+	u_char                       *end;
+};
+
+typedef struct {
+	stu_str_t                     id;
+	stu_str_t                     name;
+	uint8_t                       role;
+} stu_channel_snapshot_user_t;
+
+typedef struct {
+	stu_str_t                     id;
+	uint8_t                       state;
+	stu_int_t                     message_n;
+	double                        rate;       // messages per second, since the previous snapshot
+
+	stu_uint_t                    total;
+	stu_channel_snapshot_user_t  *users;
+} stu_channel_snapshot_elt_t;
+
+/*
+ * Read only once published, and freed when the last reader releases it.
+ */
+typedef struct {
+	stu_uint_t                    ref;        // under stu_channel_snapshot_lock
+	uint64_t                      time;       // msec
+
+	stu_uint_t                    n;
+	stu_channel_snapshot_elt_t   *channels;   // ordered by id
+	stu_channel_snapshot_elt_t  **busiest;    // ordered by rate
+
+	stu_channel_snapshot_block_t *blocks;
+} stu_channel_snapshot_t;
+
+void                         stu_channel_snapshot_handler(stu_event_t *ev);
+
+stu_channel_snapshot_t      *stu_channel_snapshot_acquire();
+void                         stu_channel_snapshot_release(stu_channel_snapshot_t *s);
+
+stu_channel_snapshot_elt_t  *stu_channel_snapshot_find(stu_channel_snapshot_t *s, stu_str_t *id);
+stu_uint_t                   stu_channel_snapshot_after(stu_channel_snapshot_t *s, stu_str_t *id);
+
+#endif /* STU_CHANNEL_SNAPSHOT_H_ */
@@ -13,8 +13,15 @@ stu_str_t  STU_CONF_FILE_DEFAULT_PATH = stu_string("conf/chatd.conf");
 extern stu_conf_bitmask_t  stu_http_upstream_method_mask[];
 
 static stu_str_t  STU_CONF_FILE_LOG = stu_string("log");
+static stu_str_t  STU_CONF_FILE_LOG_LEVEL = stu_string("log_level");
+static stu_str_t  STU_CONF_FILE_LOG_MAX_SIZE = stu_string("log_max_size");
+static stu_str_t  STU_CONF_FILE_LOG_ROTATE_INTERVAL = stu_string("log_rotate_interval");
 static stu_str_t  STU_CONF_FILE_PID = stu_string("pid");
 
+static stu_str_t  STU_CONF_FILE_EVLOG = stu_string("evlog");
+static stu_str_t  STU_CONF_FILE_EVLOG_PATH = stu_string("path");
+static stu_str_t  STU_CONF_FILE_EVLOG_SEGMENT_SIZE = stu_string("segment_size");
+
 static stu_str_t  STU_CONF_FILE_EDITION = stu_string("edition");
 static stu_str_t  STU_CONF_FILE_MASTER_PROCESS = stu_string("master_process");
 static stu_str_t  STU_CONF_FILE_WORKER_PROCESSES = stu_string("worker_processes");
@@ -27,6 +34,15 @@ static stu_str_t  STU_CONF_FILE_SERVER_PUSH_USERS = stu_string("push_users");
 static stu_str_t  STU_CONF_FILE_SERVER_PUSH_USERS_INTERVAL = stu_string("push_users_interval");
 static stu_str_t  STU_CONF_FILE_SERVER_PUSH_STATUS = stu_string("push_status");
 static stu_str_t  STU_CONF_FILE_SERVER_PUSH_STATUS_INTERVAL = stu_string("push_status_interval");
+static stu_str_t  STU_CONF_FILE_SERVER_SNAPSHOT_INTERVAL = stu_string("snapshot_interval");
+static stu_str_t  STU_CONF_FILE_SERVER_ADMIN_ALLOW = stu_string("admin_allow");
+
+static stu_str_t  STU_CONF_FILE_RESOLVER = stu_string("resolver");
+static stu_str_t  STU_CONF_FILE_RESOLVER_ADDRESS = stu_string("address");
+static stu_str_t  STU_CONF_FILE_RESOLVER_PORT = stu_string("port");
+static stu_str_t  STU_CONF_FILE_RESOLVER_HOSTS = stu_string("hosts");
+static stu_str_t  STU_CONF_FILE_RESOLVER_VALID = stu_string("valid");
+static stu_str_t  STU_CONF_FILE_RESOLVER_TIMEOUT = stu_string("timeout");
 
 static stu_str_t  STU_CONF_FILE_UPSTREAM = stu_string("upstream");
 static stu_str_t  STU_CONF_FILE_UPSTREAM_PROTOCOL = stu_string("protocol");
@@ -36,13 +52,25 @@ static stu_str_t  STU_CONF_FILE_UPSTREAM_PORT = stu_string("port");
 static stu_str_t  STU_CONF_FILE_UPSTREAM_TARGET = stu_string("target");
 static stu_str_t  STU_CONF_FILE_UPSTREAM_WEIGHT = stu_string("weight");
 static stu_str_t  STU_CONF_FILE_UPSTREAM_MAX_FAILS = stu_string("max_fails");
+static stu_str_t  STU_CONF_FILE_UPSTREAM_FAIL_TIMEOUT = stu_string("fail_timeout");
 static stu_str_t  STU_CONF_FILE_UPSTREAM_TIMEOUT = stu_string("timeout");
+static stu_str_t  STU_CONF_FILE_UPSTREAM_BATCH = stu_string("batch");
+static stu_str_t  STU_CONF_FILE_UPSTREAM_BATCH_WINDOW = stu_string("batch_window");
+static stu_str_t  STU_CONF_FILE_UPSTREAM_BALANCE = stu_string("balance");
+static stu_str_t  STU_CONF_FILE_UPSTREAM_CHECK = stu_string("check");
+static stu_str_t  STU_CONF_FILE_UPSTREAM_CHECK_INTERVAL = stu_string("check_interval");
+
+static stu_str_t  STU_CONF_FILE_UPSTREAM_BALANCE_LEAST_CONN = stu_string("least_conn");
+
+
+static stu_json_t *stu_conf_file_read(u_char *name, u_char *temp);
+static void        stu_conf_file_set_log_level(stu_json_t *conf);
+static stu_int_t   stu_conf_file_parse_cidr(stu_str_t *text, stu_cidr_t *cidr);
 
 
 stu_int_t
 stu_conf_file_parse(stu_config_t *cf, u_char *name) {
-	u_char                 temp[STU_CONF_FILE_MAX_SIZE];
-	stu_file_t             file;
+	u_char                 temp[STU_CONF_FILE_MAX_SIZE], *p, metric[STU_METRICS_NAME_MAX_LEN];
 	stu_json_t            *conf, *item, *sub, *srv, *srv_property;
 	stu_str_t             *v_string;
 	stu_double_t          *v_double;
@@ -51,21 +79,8 @@ stu_conf_file_parse(stu_config_t *cf, u_char *name) {
 	stu_upstream_server_t *server;
 	stu_conf_bitmask_t    *method;
 
-	file.fd = stu_file_open(name, STU_FILE_RDONLY, STU_FILE_CREATE_OR_OPEN, STU_FILE_DEFAULT_ACCESS);
-	if (file.fd == STU_FILE_INVALID) {
-		stu_log_error(stu_errno, "Failed to " stu_file_open_n " conf file \"%s\".", name);
-		return STU_ERROR;
-	}
-
-	stu_memzero(temp, STU_CONF_FILE_MAX_SIZE);
-	if (stu_file_read(&file, temp, STU_CONF_FILE_MAX_SIZE, 0) == STU_ERROR) {
-		stu_log_error(stu_errno, "Failed to " stu_file_read_n " conf file \"%s\".", name);
-		return STU_ERROR;
-	}
-
-	conf = stu_json_parse((u_char *) temp, file.offset);
-	if (conf == NULL || conf->type != STU_JSON_TYPE_OBJECT) {
-		stu_log_error(0, "Bad configure file format.");
+	conf = stu_conf_file_read(name, temp);
+	if (conf == NULL) {
 		return STU_ERROR;
 	}
 
@@ -75,6 +90,20 @@ stu_conf_file_parse(stu_config_t *cf, u_char *name) {
 		// use default
 	}
 
+	stu_conf_file_set_log_level(conf);
+
+	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_LOG_MAX_SIZE);
+	if (item && item->type == STU_JSON_TYPE_NUMBER) {
+		v_double = (stu_double_t *) item->value;
+		cf->log_max_size = *v_double > 0 ? *v_double * 1024 * 1024 : 0; // MB
+	}
+
+	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_LOG_ROTATE_INTERVAL);
+	if (item && item->type == STU_JSON_TYPE_NUMBER) {
+		v_double = (stu_double_t *) item->value;
+		cf->log_rotate_interval = *v_double > 0 ? *v_double : 0;
+	}
+
 	// pid
 	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_PID);
 	if (item && item->type == STU_JSON_TYPE_STRING) {
@@ -84,6 +113,26 @@ stu_conf_file_parse(stu_config_t *cf, u_char *name) {
 		stu_strncpy(cf->pid.name.data, v_string->data, v_string->len);
 	}
 
+	// evlog
+	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_EVLOG);
+	if (item && item->type == STU_JSON_TYPE_OBJECT) {
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_EVLOG_PATH);
+		if (sub && sub->type == STU_JSON_TYPE_STRING) {
+			v_string = (stu_str_t *) sub->value;
+			cf->evlog.data = stu_calloc(v_string->len + 1);
+			cf->evlog.len = v_string->len;
+			stu_strncpy(cf->evlog.data, v_string->data, v_string->len);
+		}
+
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_EVLOG_SEGMENT_SIZE);
+		if (sub && sub->type == STU_JSON_TYPE_NUMBER) {
+			v_double = (stu_double_t *) sub->value;
+			if (*v_double > 0) {
+				cf->evlog_segment_size = *v_double * 1024 * 1024; // MB
+			}
+		}
+	}
+
 	// edition
 	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_EDITION);
 	if (item && item->type == STU_JSON_TYPE_STRING) {
@@ -156,6 +205,87 @@ stu_conf_file_parse(stu_config_t *cf, u_char *name) {
 			v_double = (stu_double_t *) sub->value;
 			cf->push_status_interval = *v_double * 1000;
 		}
+
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_SERVER_SNAPSHOT_INTERVAL);
+		if (sub) {
+			v_double = (stu_double_t *) sub->value;
+			cf->snapshot_interval = *v_double * 1000;
+		}
+
+		// ["0.0.0.0/32"] matches no client, and turns the admin API off
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_SERVER_ADMIN_ALLOW);
+		if (sub && sub->type == STU_JSON_TYPE_ARRAY) {
+			cf->admin_allow_n = 0;
+
+			for (srv = (stu_json_t *) sub->value; srv; srv = srv->next) {
+				if (cf->admin_allow_n == STU_CYCLE_ADMIN_ALLOW_MAX_N) {
+					stu_log_error(0, "Too many admin_allow items, max=%d.", STU_CYCLE_ADMIN_ALLOW_MAX_N);
+					goto failed;
+				}
+
+				if (srv->type != STU_JSON_TYPE_STRING
+						|| stu_conf_file_parse_cidr((stu_str_t *) srv->value, &cf->admin_allow[cf->admin_allow_n]) == STU_ERROR) {
+					stu_log_error(0, "Bad admin_allow item, expected \"a.b.c.d\" or \"a.b.c.d/n\".");
+					goto failed;
+				}
+
+				cf->admin_allow_n++;
+			}
+		}
+	}
+
+	// resolver
+	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_RESOLVER);
+	if (item && item->type == STU_JSON_TYPE_OBJECT) {
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_RESOLVER_ADDRESS);
+		if (sub && sub->type == STU_JSON_TYPE_STRING) {
+			v_string = (stu_str_t *) sub->value;
+			cf->resolver.name.data = stu_calloc(v_string->len + 1);
+			cf->resolver.name.len = v_string->len;
+			stu_strncpy(cf->resolver.name.data, v_string->data, v_string->len);
+
+			cf->resolver.sockaddr.sin_family = AF_INET;
+			cf->resolver.sockaddr.sin_port = htons(53);
+			cf->resolver.socklen = sizeof(struct sockaddr);
+
+			if (inet_aton((const char *) cf->resolver.name.data, &cf->resolver.sockaddr.sin_addr) == 0) {
+				stu_log_error(0, "Bad resolver address: \"%s\".", cf->resolver.name.data);
+				goto failed;
+			}
+		}
+
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_RESOLVER_PORT);
+		if (sub && sub->type == STU_JSON_TYPE_NUMBER) {
+			v_double = (stu_double_t *) sub->value;
+			cf->resolver.sockaddr.sin_port = htons(0xFFFF & (stu_uint_t) *v_double);
+		}
+
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_RESOLVER_HOSTS);
+		if (sub && sub->type == STU_JSON_TYPE_STRING) {
+			v_string = (stu_str_t *) sub->value;
+			cf->resolver_hosts.data = stu_calloc(v_string->len + 1);
+			cf->resolver_hosts.len = v_string->len;
+			stu_strncpy(cf->resolver_hosts.data, v_string->data, v_string->len);
+		}
+
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_RESOLVER_VALID);
+		if (sub && sub->type == STU_JSON_TYPE_NUMBER) {
+			v_double = (stu_double_t *) sub->value;
+			cf->resolver_valid = *v_double > 0 ? *v_double : 0;
+		}
+
+		sub = stu_json_get_object_item_by(item, &STU_CONF_FILE_RESOLVER_TIMEOUT);
+		if (sub && sub->type == STU_JSON_TYPE_NUMBER) {
+			v_double = (stu_double_t *) sub->value;
+			if (*v_double >= 1) {
+				cf->resolver_timeout = *v_double;
+			}
+		}
+	}
+
+	if (stu_resolver_init(cf) == STU_ERROR) {
+		stu_log_error(0, "Failed to init resolver.");
+		goto failed;
 	}
 
 	// upstream
@@ -238,10 +368,14 @@ stu_conf_file_parse(stu_config_t *cf, u_char *name) {
 					stu_strncpy(server->target.data, v_string->data, v_string->len);
 				}
 
+				server->weight = 1;
+
 				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_WEIGHT);
 				if (srv_property && srv_property->type == STU_JSON_TYPE_NUMBER) {
 					v_double = (stu_double_t *) srv_property->value;
-					server->weight = *v_double;
+					if (*v_double >= 1) {
+						server->weight = *v_double;
+					}
 				}
 
 				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_MAX_FAILS);
@@ -250,18 +384,91 @@ stu_conf_file_parse(stu_config_t *cf, u_char *name) {
 					server->max_fails = *v_double;
 				}
 
+				server->fail_timeout = STU_UPSTREAM_DEFAULT_FAIL_TIMEOUT;
+
+				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_FAIL_TIMEOUT);
+				if (srv_property && srv_property->type == STU_JSON_TYPE_NUMBER) {
+					v_double = (stu_double_t *) srv_property->value;
+					server->fail_timeout = *v_double;
+				}
+
+				server->timeout = STU_UPSTREAM_DEFAULT_TIMEOUT;
+
 				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_TIMEOUT);
 				if (srv_property && srv_property->type == STU_JSON_TYPE_NUMBER) {
 					v_double = (stu_double_t *) srv_property->value;
-					server->timeout = *v_double;
+					if (*v_double > 0) {
+						server->timeout = *v_double;
+					}
+				}
+
+				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_BATCH);
+				if (srv_property && srv_property->type == STU_JSON_TYPE_NUMBER) {
+					v_double = (stu_double_t *) srv_property->value;
+					server->batch = *v_double;
+				}
+
+				server->batch_window = STU_UPSTREAM_DEFAULT_BATCH_WINDOW;
+
+				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_BATCH_WINDOW);
+				if (srv_property && srv_property->type == STU_JSON_TYPE_NUMBER) {
+					v_double = (stu_double_t *) srv_property->value;
+					if (*v_double >= 1) {
+						server->batch_window = *v_double;
+					}
+				}
+
+				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_BALANCE);
+				if (srv_property && srv_property->type == STU_JSON_TYPE_STRING) {
+					v_string = (stu_str_t *) srv_property->value;
+					if (v_string->len == STU_CONF_FILE_UPSTREAM_BALANCE_LEAST_CONN.len
+							&& stu_strncasecmp(v_string->data, STU_CONF_FILE_UPSTREAM_BALANCE_LEAST_CONN.data, v_string->len) == 0) {
+						server->balance = STU_UPSTREAM_BALANCE_LEAST_CONN;
+					}
+				}
+
+				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_CHECK);
+				if (srv_property && srv_property->type == STU_JSON_TYPE_STRING) {
+					v_string = (stu_str_t *) srv_property->value;
+					server->check.data = stu_calloc(v_string->len + 1);
+					server->check.len = v_string->len;
+					stu_strncpy(server->check.data, v_string->data, v_string->len);
+				}
+
+				server->check_interval = STU_UPSTREAM_DEFAULT_CHECK_INTERVAL;
+
+				srv_property = stu_json_get_object_item_by(srv, &STU_CONF_FILE_UPSTREAM_CHECK_INTERVAL);
+				if (srv_property && srv_property->type == STU_JSON_TYPE_NUMBER) {
+					v_double = (stu_double_t *) srv_property->value;
+					if (*v_double >= 1) {
+						server->check_interval = *v_double;
+					}
+				}
+
+				server->upstream = upstream;
+				server->effective_weight = server->weight;
+
+				// the address is taken from the resolver on connecting
+				server->resolved = stu_resolver_add(&server->addr.name);
+				if (server->resolved == NULL) {
+					stu_log_error(0, "Failed to resolve upstream server \"%s\".", server->addr.name.data);
+					goto failed;
 				}
 
 				server->addr.sockaddr.sin_family = AF_INET;
-				server->addr.sockaddr.sin_addr.s_addr = inet_addr((const char *) server->addr.name.data);
+				server->addr.sockaddr.sin_addr.s_addr = INADDR_ANY;
 				server->addr.sockaddr.sin_port = htons(server->port);
 				bzero(&(server->addr.sockaddr.sin_zero), 8);
 				server->addr.socklen = sizeof(struct sockaddr);
 
+				// e.g. upstream_server_usec{upstream="ident",server="127.0.0.1:8080"}
+				server->metric = STU_ERROR;
+				if (server->name.len + server->addr.name.len < STU_METRICS_NAME_MAX_LEN - 56) {
+					p = stu_snprintf(metric, STU_METRICS_NAME_MAX_LEN, "upstream_server_usec{upstream=\"%V\",server=\"%V:%d\"}",
+							&server->name, &server->addr.name, (int) server->port);
+					server->metric = stu_metrics_register(metric, p - metric, STU_METRICS_HISTOGRAM);
+				}
+
 				stu_list_push(upstream, server, sizeof(stu_upstream_server_t));
 			}
 		}
@@ -277,3 +484,104 @@ failed:
 
 	return STU_ERROR;
 }
+
+/* "a.b.c.d" or "a.b.c.d/n". */
+static stu_int_t
+stu_conf_file_parse_cidr(stu_str_t *text, stu_cidr_t *cidr) {
+	u_char          buf[INET_ADDRSTRLEN + 3], *slash;
+	struct in_addr  in;
+	stu_int_t       bits;
+
+	if (text->len >= sizeof(buf)) {
+		return STU_ERROR;
+	}
+
+	stu_strncpy(buf, text->data, text->len);
+	buf[text->len] = '\0';
+
+	bits = 32;
+
+	slash = stu_strlchr(buf, buf + text->len, '/');
+	if (slash) {
+		*slash++ = '\0';
+
+		bits = atoi((const char *) slash);
+		if (*slash < '0' || *slash > '9' || bits > 32) {
+			return STU_ERROR;
+		}
+	}
+
+	if (inet_pton(AF_INET, (const char *) buf, &in) != 1) {
+		return STU_ERROR;
+	}
+
+	cidr->mask = bits ? htonl(0xFFFFFFFF << (32 - bits)) : 0;
+	cidr->addr = in.s_addr & cidr->mask;
+
+	return STU_OK;
+}
+
+/* reloads the debug log levels only, on STU_LOGLEVEL_SIGNAL. */
+stu_int_t
+stu_conf_file_reload_log_level(u_char *name) {
+	u_char      temp[STU_CONF_FILE_MAX_SIZE];
+	stu_json_t *conf;
+
+	conf = stu_conf_file_read(name, temp);
+	if (conf == NULL) {
+		return STU_ERROR;
+	}
+
+	stu_conf_file_set_log_level(conf);
+
+	stu_json_delete(conf);
+
+	return STU_OK;
+}
+
+
+static stu_json_t *
+stu_conf_file_read(u_char *name, u_char *temp) {
+	stu_file_t  file;
+	stu_json_t *conf;
+
+	file.fd = stu_file_open(name, STU_FILE_RDONLY, STU_FILE_CREATE_OR_OPEN, STU_FILE_DEFAULT_ACCESS);
+	if (file.fd == STU_FILE_INVALID) {
+		stu_log_error(stu_errno, "Failed to " stu_file_open_n " conf file \"%s\".", name);
+		return NULL;
+	}
+
+	stu_memzero(temp, STU_CONF_FILE_MAX_SIZE);
+	if (stu_file_read(&file, temp, STU_CONF_FILE_MAX_SIZE, 0) == STU_ERROR) {
+		stu_log_error(stu_errno, "Failed to " stu_file_read_n " conf file \"%s\".", name);
+		stu_file_close(file.fd);
+		return NULL;
+	}
+
+	stu_file_close(file.fd);
+
+	conf = stu_json_parse((u_char *) temp, file.offset);
+	if (conf == NULL || conf->type != STU_JSON_TYPE_OBJECT) {
+		stu_log_error(0, "Bad configure file format.");
+		if (conf) {
+			stu_json_delete(conf);
+		}
+		return NULL;
+	}
+
+	return conf;
+}
+
+static void
+stu_conf_file_set_log_level(stu_json_t *conf) {
+	stu_json_t *item;
+	stu_str_t  *v_string;
+
+	item = stu_json_get_object_item_by(conf, &STU_CONF_FILE_LOG_LEVEL);
+	if (item && item->type == STU_JSON_TYPE_STRING) {
+		v_string = (stu_str_t *) item->value;
+		if (stu_log_set_levels(v_string->data, v_string->len) == STU_ERROR) {
+			stu_log_error(0, "Bad log_level, partly applied.");
+		}
+	}
+}
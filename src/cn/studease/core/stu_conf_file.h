@@ -24,5 +24,6 @@ typedef struct {
 } stu_conf_bitmask_t;
 
 stu_int_t stu_conf_file_parse(stu_config_t *cf, u_char *name);
+stu_int_t stu_conf_file_reload_log_level(u_char *name);
 
 #endif /* STU_CONF_FILE_H_ */
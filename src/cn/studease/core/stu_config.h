@@ -23,6 +23,11 @@
 #define __VERSION "1.1.00"
 #define __LOGGER  0
 
+/* build with -DSTU_TRACE=1 to time the stages of every message. */
+#ifndef STU_TRACE
+#define STU_TRACE 0
+#endif
+
 #define STU_LINUX 1
 #define STU_WIN32 !STU_LINUX
 
@@ -36,11 +41,25 @@
 #define STU_HAVE_OPENSSL_SHA1_H  1
 #define STU_HAVE_OPENSSL_MD5_H   1
 
+#if defined(__SSE2__)
+#define STU_HAVE_SSE2            1
+#else
+#define STU_HAVE_SSE2            0
+#endif
+
+#if defined(__SSSE3__)
+#define STU_HAVE_SSSE3           1
+#else
+#define STU_HAVE_SSSE3           0
+#endif
+
 #define stu_signal_helper(n)     SIG##n
 #define stu_signal_value(n)      stu_signal_helper(n)
 
 #define STU_SHUTDOWN_SIGNAL      QUIT
 #define STU_CHANGEBIN_SIGNAL     XCPU
+#define STU_LOGLEVEL_SIGNAL      USR2
+#define STU_REOPEN_SIGNAL        USR1
 
 typedef signed long         stu_int_t;
 typedef unsigned long       stu_uint_t;
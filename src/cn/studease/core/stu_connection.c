@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_EVENT
+
 #include <unistd.h>
 #include <sys/socket.h>
 #include "stu_config.h"
@@ -13,22 +15,43 @@
 
 
 static void stu_connection_init(stu_connection_t *c, stu_socket_t s);
+static void stu_connection_free_user(stu_user_t *usr);
+
+/*
+ * Another worker thread may still be waiting on c->lock for an event of a
+ * closed fd, so freed connections are kept in FIFO order, and released only
+ * after STU_CONNECTION_RELEASE_DELAY. A waiter compares c->generation after
+ * taking the lock, as c may have been reused by then.
+ */
+static stu_queue_t  stu_connection_free_queue = { &stu_connection_free_queue, &stu_connection_free_queue };
+static stu_mutex_t  stu_connection_free_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 stu_connection_t *
 stu_connection_get(stu_socket_t s) {
 	stu_connection_t      *c;
+	stu_queue_t           *q;
+
+	c = NULL;
+
+	stu_mutex_lock(&stu_connection_free_lock);
+	if (!stu_queue_empty(&stu_connection_free_queue)) {
+		q = stu_queue_head(&stu_connection_free_queue);
+		stu_queue_remove(q);
+		c = stu_queue_data(q, stu_connection_t, queue);
+	}
+	stu_mutex_unlock(&stu_connection_free_lock);
 
-	c = stu_calloc(sizeof(stu_connection_t));
 	if (c == NULL) {
-		return NULL;
+		c = stu_calloc(sizeof(stu_connection_t));
+		if (c == NULL) {
+			return NULL;
+		}
 	}
 
 	stu_connection_init(c, s);
 
 	c->read.data = c->write.data = (void *) c;
-	c->read.type = c->write.type = 0;
-	c->read.active = 0;
 	c->write.active = 1;
 
 	stu_log_debug(2, "Got connection: c=%p, fd=%d.", c, c->fd);
@@ -38,14 +61,54 @@ stu_connection_get(stu_socket_t s) {
 
 void
 stu_connection_free(stu_connection_t *c) {
-	stu_socket_t  fd;
+	stu_connection_t *e;
+	stu_queue_t      *q;
+	stu_socket_t      fd;
 
 	fd = c->fd;
 	c->fd = (stu_socket_t) -1;
 	c->read.active = c->write.active = 0;
 
-	stu_upstream_cleanup(c);
-	stu_free((void *) c);
+	if (c->upstream) {
+		c->upstream->cleanup_pt(c);
+	}
+
+	if (c->read.timer_set) {
+		stu_timer_del(&c->read);
+	}
+
+	if (c->write.timer_set) {
+		stu_timer_del(&c->write);
+	}
+
+	if (c->buffer.start) {
+		stu_free(c->buffer.start);
+		c->buffer.start = c->buffer.last = c->buffer.end = NULL;
+	}
+
+	stu_connection_free_user(&c->user);
+
+	c->generation++;
+	c->freed = stu_current_msec;
+
+	stu_mutex_lock(&stu_connection_free_lock);
+
+	stu_queue_insert_tail(&stu_connection_free_queue, &c->queue);
+
+	for (q = stu_queue_head(&stu_connection_free_queue); q != stu_queue_sentinel(&stu_connection_free_queue); /* void */) {
+		e = stu_queue_data(q, stu_connection_t, queue);
+		if ((stu_msec_int_t) (stu_current_msec - e->freed) < STU_CONNECTION_RELEASE_DELAY) {
+			break;
+		}
+
+		q = stu_queue_next(q);
+		stu_queue_remove(&e->queue);
+
+		stu_log_debug(2, "Released connection: c=%p.", e);
+		stu_free(e);
+	}
+
+	stu_mutex_unlock(&stu_connection_free_lock);
 
 	stu_log_debug(2, "Freed connection: c=%p, fd=%d.", c, fd);
 }
@@ -69,13 +132,36 @@ stu_connection_init(stu_connection_t *c, stu_socket_t s) {
 	c->fd = s;
 
 	stu_user_init(&c->user, NULL, NULL);
+	c->protocol = STU_PROTOCOL_JSON;
 
 	c->buffer.start = c->buffer.last = c->buffer.end = NULL;
 	c->data = NULL;
-	c->read.active = c->write.active = 0;
+
+	// drop the handlers, timers and flags of the last use
+	stu_memzero(&c->read, sizeof(stu_event_t));
+	stu_memzero(&c->write, sizeof(stu_event_t));
 
 	c->upstream = NULL;
 
 	c->error = STU_CONNECTION_ERROR_NONE;
 }
 
+
+static void
+stu_connection_free_user(stu_user_t *usr) {
+	if (usr->id.data) {
+		stu_free(usr->id.data);
+	}
+
+	if (usr->name.data) {
+		stu_free(usr->name.data);
+	}
+
+	if (usr->icon.data) {
+		stu_free(usr->icon.data);
+	}
+
+	stu_str_null(&usr->id);
+	stu_str_null(&usr->name);
+	stu_str_null(&usr->icon);
+}
@@ -14,6 +14,10 @@
 #define STU_CONNECTIONS_PER_PAGE   4096
 #define STU_CONNECTION_PAGE_MAX_N  16
 
+/* low bits of the generation, tagged onto the epoll data of a connection */
+#define STU_CONNECTION_GENERATION_MASK  0x07
+#define STU_CONNECTION_RELEASE_DELAY    10000
+
 #define STU_CONNECTION_ERROR_NONE      0x00
 #define STU_CONNECTION_ERROR_TIMEDOUT  0x01
 #define STU_CONNECTION_ERROR_INNER     0x02
@@ -25,6 +29,7 @@ typedef struct {
 
 	stu_socket_t           fd;
 	stu_user_t             user;
+	uint8_t                protocol; // of websocket messages, json or tlv
 
 	stu_buf_t              buffer;
 	void                  *data;
@@ -34,6 +39,9 @@ typedef struct {
 	stu_upstream_t        *upstream;
 
 	stu_uint_t             error;  // timed out, inner error, destroyed
+
+	volatile stu_uint_t    generation; // bumped on each free
+	stu_msec_t             freed;
 } stu_connection_t;
 
 stu_connection_t *stu_connection_get(stu_socket_t s);
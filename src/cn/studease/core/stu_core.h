@@ -57,16 +57,21 @@ typedef enum {
 #include "stu_hash.h"
 #include "stu_inet.h"
 #include "stu_channel.h"
+#include "stu_channel_snapshot.h"
 #include "stu_user.h"
 #include "stu_connection.h"
 #include "stu_shmem.h"
 #include "stu_thread.h"
 #include "stu_cycle.h"
+#include "stu_evlog.h"
+#include "stu_metrics.h"
+#include "stu_trace.h"
 #include "stu_timer.h"
 #include "stu_conf_file.h"
 #include "stu_protocol.h"
 #include "stu_flash.h"
 #include "stu_http.h"
+#include "stu_resolver.h"
 #include "stu_upstream.h"
 #include "stu_http_upstream.h"
 #include "stu_http_upstream_ident.h"
@@ -33,12 +33,15 @@ stu_config_default(stu_config_t *cf) {
 		return;
 	}
 
-	stu_sprintf(cf->log.name.data, "logs/%4d-%02d-%02d %02d:%02d:%02d.log",
+	stu_snprintf(cf->log.name.data, STU_FILE_PATH_MAX_LEN - 1, "logs/%4d-%02d-%02d %02d:%02d:%02d.log",
 			tm.stu_tm_year, tm.stu_tm_mon, tm.stu_tm_mday,
 			tm.stu_tm_hour, tm.stu_tm_min, tm.stu_tm_sec
 		);
 	cf->log.name.len = stu_strlen(cf->log.name.data);
 
+	cf->log_max_size = 0;
+	cf->log_rotate_interval = 0;
+
 	// pid
 	stu_memzero(&cf->pid, sizeof(stu_file_t));
 	stu_str_set(&cf->pid.name, "chatd.pid");
@@ -56,6 +59,20 @@ stu_config_default(stu_config_t *cf) {
 
 	cf->push_status = TRUE;
 	cf->push_status_interval = STU_CHANNEL_PUSH_STATUS_DEFAULT_INTERVAL * 1000;
+
+	cf->snapshot_interval = STU_CHANNEL_SNAPSHOT_DEFAULT_INTERVAL * 1000;
+
+	cf->admin_allow[0].addr = htonl(INADDR_LOOPBACK & 0xFF000000);
+	cf->admin_allow[0].mask = htonl(0xFF000000);
+	cf->admin_allow_n = 1;
+
+	stu_str_null(&cf->evlog);
+	cf->evlog_segment_size = STU_EVLOG_DEFAULT_SEGMENT_SIZE;
+
+	stu_memzero(&cf->resolver, sizeof(stu_addr_t));
+	stu_str_set(&cf->resolver_hosts, STU_RESOLVER_DEFAULT_HOSTS);
+	cf->resolver_valid = 0;
+	cf->resolver_timeout = STU_RESOLVER_DEFAULT_TIMEOUT;
 }
 
 stu_cycle_t *
@@ -64,6 +81,15 @@ stu_cycle_create(stu_config_t *cf) {
 
 	stu_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
+	if (stu_metrics_init() == STU_ERROR) {
+		return NULL;
+	}
+
+	if (stu_trace_init() == STU_ERROR) {
+		stu_log_error(0, "Failed to init trace.");
+		return NULL;
+	}
+
 	cycle = stu_calloc(sizeof(stu_cycle_t));
 	if (cycle == NULL) {
 		stu_log_error(0, "Failed to pcalloc cycle.");
@@ -105,6 +131,8 @@ stu_config_copy(stu_config_t *dst, stu_config_t *src) {
 	dst->log.name.data = stu_calloc(src->log.name.len + 1);
 	dst->log.name.len = src->log.name.len;
 	memcpy(dst->log.name.data, src->log.name.data, src->log.name.len);
+	dst->log_max_size = src->log_max_size;
+	dst->log_rotate_interval = src->log_rotate_interval;
 
 	dst->pid.name.data = stu_calloc(src->pid.name.len + 1);
 	dst->pid.name.len = src->pid.name.len;
@@ -128,6 +156,19 @@ stu_config_copy(stu_config_t *dst, stu_config_t *src) {
 	dst->push_status = src->push_status;
 	dst->push_status_interval = src->push_status_interval;
 
+	dst->snapshot_interval = src->snapshot_interval;
+
+	memcpy(dst->admin_allow, src->admin_allow, src->admin_allow_n * sizeof(stu_cidr_t));
+	dst->admin_allow_n = src->admin_allow_n;
+
+	dst->evlog = src->evlog;
+	dst->evlog_segment_size = src->evlog_segment_size;
+
+	dst->resolver = src->resolver;
+	dst->resolver_hosts = src->resolver_hosts;
+	dst->resolver_valid = src->resolver_valid;
+	dst->resolver_timeout = src->resolver_timeout;
+
 	if (stu_hash_init(&dst->upstreams, NULL, STU_UPSTREAM_MAXIMUM, (stu_hash_palloc_pt) stu_calloc, stu_free) == STU_ERROR) {
 		stu_log_error(0, "Failed to init upstream hash.");
 		return;
@@ -148,7 +189,7 @@ stu_pidfile_create(stu_file_t *pid) {
 	}
 
 	stu_memzero(temp, STU_FILE_PATH_MAX_LEN);
-	stu_sprintf(temp, "%d", stu_getpid());
+	stu_snprintf(temp, STU_FILE_PATH_MAX_LEN - 1, "%d", (int) stu_getpid());
 
 	if (stu_file_write(pid, temp, stu_strlen(temp), pid->offset) == STU_ERROR) {
 		stu_log_error(stu_errno, "Failed to " stu_write_fd_n " pid file.");
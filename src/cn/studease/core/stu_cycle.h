@@ -11,11 +11,16 @@
 #include "stu_config.h"
 #include "stu_core.h"
 
-#define STU_CYCLE_POOL_SIZE  STU_POOL_DEFAULT_SIZE
+#define STU_CYCLE_POOL_SIZE         STU_POOL_DEFAULT_SIZE
+#define STU_CYCLE_ADMIN_ALLOW_MAX_N  16
 
 typedef struct {
 	stu_file_t     log;
+	size_t         log_max_size;         // rotated if larger, 0 for never
+	time_t         log_rotate_interval;  // seconds, 0 for never
 	stu_file_t     pid;
+	stu_str_t      evlog;                // path prefix of the segments, off if empty
+	size_t         evlog_segment_size;
 
 	stu_edition_t  edition;
 	stu_bool_t     master_process;
@@ -31,6 +36,15 @@ typedef struct {
 	stu_bool_t     push_status;
 	stu_msec_t     push_status_interval; // seconds
 
+	stu_msec_t     snapshot_interval;    // seconds, of the channel snapshot for the admin API, 0 to disable
+	stu_cidr_t     admin_allow[STU_CYCLE_ADMIN_ALLOW_MAX_N]; // clients of the admin API, loopback by default
+	stu_uint_t     admin_allow_n;
+
+	stu_addr_t     resolver;             // nameserver, or the one in resolv.conf
+	stu_str_t      resolver_hosts;
+	time_t         resolver_valid;       // seconds, overrides the TTL if not 0
+	time_t         resolver_timeout;     // seconds
+
 	stu_hash_t     upstreams;            // => stu_list_t => stu_http_upstream_server_t
 } stu_config_t;
 
@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_EVENT
+
 #include "stu_config.h"
 #include "stu_core.h"
 
@@ -40,7 +42,7 @@ stu_event_epoll_add(stu_event_t *ev, uint32_t event, stu_uint_t flags) {
 	op = ev->active ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 
 	ee.events = ev->type;
-	ee.data.ptr = (void *) c;
+	ee.data.ptr = (void *) ((uintptr_t) c | (c->generation & STU_CONNECTION_GENERATION_MASK));
 
 	stu_log_debug(3, "epoll add event: fd=%d, op=%d, ev=%X.", c->fd, op, ee.events);
 
@@ -83,7 +85,7 @@ stu_event_epoll_del(stu_event_t *ev, uint32_t event, stu_uint_t flags) {
 	if (ev->active) {
 		op = EPOLL_CTL_MOD;
 		ee.events = ev->type | flags;
-		ee.data.ptr = (void *) c;
+		ee.data.ptr = (void *) ((uintptr_t) c | (c->generation & STU_CONNECTION_GENERATION_MASK));
 	} else {
 		op = EPOLL_CTL_DEL;
 		ee.events = 0;
@@ -109,6 +111,7 @@ stu_event_epoll_process_events(stu_msec_t timer, stu_uint_t flags) {
 	struct epoll_event  events[STU_EPOLL_EVENTS], *ev;
 	stu_int_t           nev, i;
 	stu_connection_t   *c;
+	stu_uint_t          generation;
 
 	nev = epoll_wait(stu_epfd, events, STU_EPOLL_EVENTS, timer);
 
@@ -121,13 +124,23 @@ stu_event_epoll_process_events(stu_msec_t timer, stu_uint_t flags) {
 		return STU_ERROR;
 	}
 
+	stu_metrics_observe(STU_METRIC_EVENTS_PER_WAIT, nev);
+
 	for (i = 0; i < nev; i++) {
 		ev = &events[i];
-		c = (stu_connection_t *) events[i].data.ptr;
+		c = (stu_connection_t *) ((uintptr_t) ev->data.ptr & ~STU_CONNECTION_GENERATION_MASK);
+		generation = (uintptr_t) ev->data.ptr & STU_CONNECTION_GENERATION_MASK;
+
 		if (c == NULL || c->fd == (stu_socket_t) -1) {
 			continue;
 		}
 
+		// closed and reused, after this event was returned
+		if ((c->generation & STU_CONNECTION_GENERATION_MASK) != generation) {
+			stu_log_debug(3, "epoll stale event: fd=%d.", c->fd);
+			continue;
+		}
+
 		if ((ev->events & EPOLLIN) && c->read.active) {
 			c->read.handler(&c->read);
 		}
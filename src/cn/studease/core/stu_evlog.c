@@ -0,0 +1,280 @@
+/*
+ * stu_evlog.c
+ *
+ *  Created on: 2017-7-5
+ *      Author: Tony Lau
+ */
+
+#include "stu_config.h"
+#include "stu_core.h"
+#include <sys/mman.h>
+
+typedef struct {
+	u_char            *addr;
+	stu_fd_t           fd;
+	uint32_t           capacity;   // records
+	volatile uint32_t  next;       // slots claimed, may exceed capacity
+	stu_uint_t         seq;        // tells a segment from one reusing its memory
+} stu_evlog_segment_t;
+
+static stu_str_t                      stu_evlog_path;
+static size_t                         stu_evlog_segment_size;
+static stu_uint_t                     stu_evlog_seq;
+static volatile stu_msec_t            stu_evlog_retry;
+
+static stu_rwlock_t                   stu_evlog_lock;
+static stu_evlog_segment_t           *stu_evlog_current;
+
+static stu_evlog_segment_t *stu_evlog_open_segment();
+static stu_int_t            stu_evlog_rotate(stu_uint_t seq);
+static void                 stu_evlog_close_segment(stu_evlog_segment_t *seg);
+
+#define stu_evlog_msec(tp)  ((uint64_t) (tp)->sec * 1000 + (tp)->msec)
+
+
+/*
+ * Called in a worker process, each worker writes its own segments. Closed on
+ * exit() as well, so the count of the last segment is set.
+ */
+stu_int_t
+stu_evlog_init(stu_config_t *cf) {
+	if (cf->evlog.len == 0) {
+		return STU_OK;
+	}
+
+	// room for ".pid.msec-seq.evlog"
+	if (cf->evlog.len > STU_FILE_PATH_MAX_LEN - 64) {
+		stu_log_error(0, "evlog path too long: \"%s\".", cf->evlog.data);
+		return STU_ERROR;
+	}
+
+	stu_evlog_path = cf->evlog;
+	stu_evlog_segment_size = stu_max(cf->evlog_segment_size, STU_EVLOG_MIN_SEGMENT_SIZE);
+
+	stu_rwlock_init(&stu_evlog_lock, NULL);
+
+	stu_evlog_current = stu_evlog_open_segment();
+	if (stu_evlog_current == NULL) {
+		return STU_ERROR;
+	}
+
+	if (atexit(stu_evlog_close) != 0) {
+		stu_log_error(0, "Failed to register evlog close on exit.");
+	}
+
+	return STU_OK;
+}
+
+void
+stu_evlog_close() {
+	stu_evlog_segment_t *seg;
+
+	stu_rwlock_wrlock(&stu_evlog_lock);
+
+	seg = stu_evlog_current;
+	stu_evlog_current = NULL;
+
+	if (seg) {
+		stu_evlog_close_segment(seg);
+	}
+
+	stu_rwlock_unlock(&stu_evlog_lock);
+}
+
+/*
+ * A slot is claimed with an atomic add under the shared lock, the writers
+ * never wait for each other unless the segment is full. type is stored last,
+ * so a reader of a crashed segment skips the records claimed but not written.
+ */
+void
+stu_evlog_write(uint8_t type, stu_str_t *channel, stu_str_t *user, uint32_t bytes, uint32_t latency, uint32_t status) {
+	stu_evlog_segment_t *seg;
+	stu_evlog_record_t  *rec;
+	stu_time_t          *tp;
+	stu_uint_t           seq;
+	uint32_t             i;
+
+	for ( ;; ) {
+		stu_rwlock_rdlock(&stu_evlog_lock);
+
+		seg = stu_evlog_current;
+		if (seg == NULL) {
+			stu_rwlock_unlock(&stu_evlog_lock);
+			return;
+		}
+
+		// kept full while the rotation is failing, so never claim beyond it
+		if (seg->next < seg->capacity) {
+			i = stu_atomic_fetch_add(&seg->next, 1);
+			if (i < seg->capacity) {
+				break;
+			}
+		}
+
+		seq = seg->seq;
+
+		stu_rwlock_unlock(&stu_evlog_lock);
+
+		if (stu_evlog_rotate(seq) != STU_OK) {
+			return;
+		}
+	}
+
+	rec = (stu_evlog_record_t *) (seg->addr + sizeof(stu_evlog_header_t)) + i;
+
+	tp = stu_timeofday();
+	rec->time = stu_evlog_msec(tp);
+	rec->bytes = bytes;
+	rec->latency = latency;
+	rec->status = status;
+
+	if (channel) {
+		rec->channel_len = stu_min(channel->len, STU_EVLOG_ID_LEN);
+		memcpy(rec->channel, channel->data, rec->channel_len);
+	}
+
+	if (user) {
+		rec->user_len = stu_min(user->len, STU_EVLOG_ID_LEN);
+		memcpy(rec->user, user->data, rec->user_len);
+	}
+
+	stu_memory_barrier();
+	rec->type = type;
+
+	stu_rwlock_unlock(&stu_evlog_lock);
+}
+
+
+static stu_evlog_segment_t *
+stu_evlog_open_segment() {
+	u_char              *last, name[STU_FILE_PATH_MAX_LEN];
+	stu_evlog_segment_t *seg;
+	stu_evlog_header_t  *header;
+	stu_time_t          *tp;
+
+	seg = stu_calloc(sizeof(stu_evlog_segment_t));
+	if (seg == NULL) {
+		stu_log_error(0, "Failed to calloc evlog segment.");
+		return NULL;
+	}
+
+	seg->fd = STU_FILE_INVALID;
+
+	seg->seq = stu_evlog_seq++;
+
+	tp = stu_timeofday();
+
+	last = stu_snprintf(name, STU_FILE_PATH_MAX_LEN, "%V.%d.%ui-%ui" STU_EVLOG_SUFFIX "%Z",
+			&stu_evlog_path, (int) stu_getpid(), (stu_uint_t) stu_evlog_msec(tp), seg->seq);
+	if (last[-1] != '\0') {
+		stu_log_error(0, "Failed to name evlog segment.");
+		goto failed;
+	}
+
+	seg->fd = stu_file_open(name, STU_FILE_RDWR, STU_FILE_TRUNCATE, STU_FILE_DEFAULT_ACCESS);
+	if (seg->fd == STU_FILE_INVALID) {
+		stu_log_error(stu_errno, "Failed to " stu_file_open_n " evlog segment \"%s\".", name);
+		goto failed;
+	}
+
+	if (ftruncate(seg->fd, stu_evlog_segment_size) == -1) {
+		stu_log_error(stu_errno, "ftruncate() evlog segment \"%s\" failed.", name);
+		goto failed;
+	}
+
+	seg->addr = mmap(NULL, stu_evlog_segment_size, PROT_READ|PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (seg->addr == MAP_FAILED) {
+		stu_log_error(stu_errno, "mmap() evlog segment \"%s\" failed.", name);
+		goto failed;
+	}
+
+	seg->capacity = (stu_evlog_segment_size - sizeof(stu_evlog_header_t)) / sizeof(stu_evlog_record_t);
+
+	header = (stu_evlog_header_t *) seg->addr;
+	memcpy(header->magic, STU_EVLOG_MAGIC, sizeof(header->magic));
+	header->version = STU_EVLOG_VERSION;
+	header->record_size = sizeof(stu_evlog_record_t);
+	header->pid = stu_getpid();
+	header->created = stu_evlog_msec(tp);
+
+	stu_log_debug(4, "evlog segment opened: %s, capacity=%u.", name, seg->capacity);
+
+	return seg;
+
+failed:
+
+	if (seg->fd != STU_FILE_INVALID) {
+		stu_file_close(seg->fd);
+	}
+
+	stu_free(seg);
+
+	return NULL;
+}
+
+/*
+ * The exclusive lock waits for the writers still filling the full segment.
+ * seq is of the segment found full, as a later one may be allocated at the
+ * same address once it is freed. If the next segment fails to open, the full
+ * one is kept, and the events are dropped until STU_EVLOG_ROTATE_RETRY later.
+ */
+static stu_int_t
+stu_evlog_rotate(stu_uint_t seq) {
+	stu_evlog_segment_t *seg, *next;
+	stu_int_t            rc;
+
+	if ((stu_msec_int_t) (stu_current_msec - stu_evlog_retry) < 0) {
+		return STU_DECLINED;
+	}
+
+	stu_rwlock_wrlock(&stu_evlog_lock);
+
+	seg = stu_evlog_current;
+
+	// rotated by another thread already
+	if (seg == NULL || seg->seq != seq) {
+		rc = seg ? STU_OK : STU_ERROR;
+		goto done;
+	}
+
+	next = stu_evlog_open_segment();
+	if (next == NULL) {
+		stu_log_error(0, "Failed to rotate evlog, retrying in %d msec.", STU_EVLOG_ROTATE_RETRY);
+		stu_evlog_retry = stu_current_msec + STU_EVLOG_ROTATE_RETRY;
+		rc = STU_DECLINED;
+		goto done;
+	}
+
+	stu_evlog_close_segment(seg);
+	stu_evlog_current = next;
+
+	rc = STU_OK;
+
+done:
+
+	stu_rwlock_unlock(&stu_evlog_lock);
+
+	return rc;
+}
+
+static void
+stu_evlog_close_segment(stu_evlog_segment_t *seg) {
+	stu_evlog_header_t *header;
+	uint32_t            n;
+
+	n = stu_min(seg->next, seg->capacity);
+
+	header = (stu_evlog_header_t *) seg->addr;
+	header->count = n;
+
+	if (munmap(seg->addr, stu_evlog_segment_size) == -1) {
+		stu_log_error(stu_errno, "munmap() evlog segment failed.");
+	}
+
+	if (ftruncate(seg->fd, sizeof(stu_evlog_header_t) + (off_t) n * sizeof(stu_evlog_record_t)) == -1) {
+		stu_log_error(stu_errno, "ftruncate() evlog segment failed.");
+	}
+
+	stu_file_close(seg->fd);
+	stu_free(seg);
+}
@@ -0,0 +1,63 @@
+/*
+ * stu_evlog.h
+ *
+ *  Created on: 2017-7-5
+ *      Author: Tony Lau
+ */
+
+#ifndef STU_EVLOG_H_
+#define STU_EVLOG_H_
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#define STU_EVLOG_MAGIC                 "STUEVLOG"
+#define STU_EVLOG_VERSION               1
+
+#define STU_EVLOG_DEFAULT_SEGMENT_SIZE  (64 * 1024 * 1024)
+#define STU_EVLOG_MIN_SEGMENT_SIZE      (64 * 1024)
+#define STU_EVLOG_SUFFIX                ".evlog"
+#define STU_EVLOG_ROTATE_RETRY          1000 // msec
+
+#define STU_EVLOG_NONE                  0    // a slot claimed but never written
+#define STU_EVLOG_JOIN                  1
+#define STU_EVLOG_LEAVE                 2
+#define STU_EVLOG_MESSAGE               3
+#define STU_EVLOG_REFUSED               4
+
+#define STU_EVLOG_ID_LEN                16
+
+/*
+ * Segment layout: a header, followed by fixed size records, in the byte
+ * order of the host which wrote it. A reader stops at the end of the file,
+ * and skips the records of type STU_EVLOG_NONE.
+ */
+typedef struct {
+	u_char        magic[8];
+	uint16_t      version;
+	uint16_t      record_size;
+	uint32_t      pid;
+	uint64_t      created;        // msec
+	uint64_t      count;          // records, set on rotation
+	u_char        reserved[32];
+} stu_evlog_header_t;
+
+typedef struct {
+	uint64_t      time;           // msec, from stu_cached_time
+	uint8_t       type;
+	uint8_t       channel_len;
+	uint8_t       user_len;
+	uint8_t       reserved;
+	uint32_t      bytes;
+	uint32_t      latency;        // usec
+	uint32_t      status;
+	u_char        channel[STU_EVLOG_ID_LEN];
+	u_char        user[STU_EVLOG_ID_LEN];
+} stu_evlog_record_t;
+
+stu_int_t  stu_evlog_init(stu_config_t *cf);
+void       stu_evlog_close();
+
+void       stu_evlog_write(uint8_t type, stu_str_t *channel, stu_str_t *user, uint32_t bytes, uint32_t latency, uint32_t status);
+
+#endif /* STU_EVLOG_H_ */
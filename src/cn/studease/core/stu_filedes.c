@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_PROCESS
+
 #include <sys/socket.h>
 #include <unistd.h>
 #include "stu_config.h"
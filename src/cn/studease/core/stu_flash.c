@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_FLASH
+
 #include "stu_config.h"
 #include "stu_core.h"
 
@@ -125,12 +127,14 @@ again:
 static void
 stu_flash_wait_request_handler(stu_event_t *rev) {
 	stu_connection_t *c;
+	stu_uint_t        generation;
 	stu_int_t         n, err;
 
 	c = (stu_connection_t *) rev->data;
+	generation = c->generation;
 
 	stu_mutex_lock(&c->lock);
-	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID) {
+	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID || c->generation != generation) {
 		goto done;
 	}
 
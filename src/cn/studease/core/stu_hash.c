@@ -195,7 +195,7 @@ void
 stu_hash_remove_locked(stu_hash_t *hash, stu_uint_t key, u_char *name, size_t len) {
 	stu_uint_t      i;
 	stu_hash_elt_t *elts, *e;
-	stu_queue_t    *q;
+	stu_queue_t    *q, *next;
 
 	i = key % hash->size;
 
@@ -205,7 +205,8 @@ stu_hash_remove_locked(stu_hash_t *hash, stu_uint_t key, u_char *name, size_t le
 		return;
 	}
 
-	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = next) {
+		next = stu_queue_next(q);
 		e = stu_queue_data(q, stu_hash_elt_t, queue);
 		if (e->key_hash != key || e->key.len != len) {
 			continue;
@@ -219,6 +220,8 @@ stu_hash_remove_locked(stu_hash_t *hash, stu_uint_t key, u_char *name, size_t le
 			e->queue.prev->next = e->queue.next;
 			stu_queue_remove(&e->q);
 
+			stu_log_debug(1, "Removed %p from hash: key=%lu, i=%lu, name=%s.", e->value, key, i, name);
+
 			if (hash->free) {
 				hash->free(e->key.data);
 				hash->free(e);
@@ -226,8 +229,6 @@ stu_hash_remove_locked(stu_hash_t *hash, stu_uint_t key, u_char *name, size_t le
 
 			hash->length--;
 
-			stu_log_debug(1, "Removed %p from hash: key=%lu, i=%lu, name=%s.", e->value, key, i, name);
-
 			//break; // don't break here.
 		}
 	}
@@ -279,7 +280,7 @@ stu_hash_test(stu_hash_t *hash) {
 	stu_log_debug(1, "hash insert starting...");
 
 	for (n = 0; n < 1024; n++) {
-		p = stu_sprintf(idstr, "%ld", n);
+		p = stu_snprintf(idstr, sizeof(idstr) - 1, "%i", n);
 		*p = '\0';
 
 		key.data = idstr;
@@ -291,7 +292,7 @@ stu_hash_test(stu_hash_t *hash) {
 	stu_log_debug(1, "hash remove starting...");
 
 	for (n = 0; n < 512; n++) {
-		p = stu_sprintf(idstr, "%ld", n);
+		p = stu_snprintf(idstr, sizeof(idstr) - 1, "%i", n);
 		*p = '\0';
 
 		key.data = idstr;
@@ -304,7 +305,7 @@ stu_hash_test(stu_hash_t *hash) {
 	stu_log_debug(1, "hash remove starting...");
 
 	for (n = 1023; n >= 512; n--) {
-		p = stu_sprintf(idstr, "%ld", n);
+		p = stu_snprintf(idstr, sizeof(idstr) - 1, "%i", n);
 		*p = '\0';
 
 		key.data = idstr;
@@ -5,17 +5,19 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_HTTP
+
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include "stu_config.h"
 #include "stu_core.h"
 
-extern stu_hash_t         stu_http_headers_in_hash;
-extern stu_http_header_t  stu_http_headers_in[];
+extern stu_http_header_phash_t  stu_http_headers_in_phash;
+extern stu_http_header_t        stu_http_headers_in[];
 
-extern stu_hash_t         stu_http_upstream_headers_in_hash;
-extern stu_http_header_t  stu_http_upstream_headers_in[];
+extern stu_http_header_phash_t  stu_http_upstream_headers_in_phash;
+extern stu_http_header_t        stu_http_upstream_headers_in[];
 
 static stu_socket_t       stu_httpfd;
 
@@ -37,6 +39,11 @@ stu_http_add_listen(stu_config_t *cf) {
 		return STU_ERROR;
 	}
 
+	if (stu_http_upstream_ident_init_flights() == STU_ERROR) {
+		stu_log_error(0, "Failed to init http upstream ident flights.");
+		return STU_ERROR;
+	}
+
 	stu_httpfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (stu_httpfd == -1) {
 		stu_log_error(stu_errno, "Failed to create http server fd.");
@@ -147,52 +154,95 @@ again:
 		stu_log_error(0, "Failed to add http client read event.");
 		return;
 	}
+
+	stu_metrics_inc(STU_METRIC_ACCEPTED);
+	stu_metrics_inc(STU_METRIC_CONNECTIONS);
 }
 
 
 static stu_int_t
 stu_http_init_headers_in_hash(stu_config_t *cf) {
-	stu_http_header_t *header;
-	stu_str_t          lc;
-	u_char             data[STU_HTTP_LC_HEADER_LEN];
-
-	//
-	if (stu_hash_init(&stu_http_headers_in_hash, NULL, STU_HTTP_HEADERS_MAX_SIZE,
-			(stu_hash_palloc_pt) stu_calloc, stu_free) == STU_ERROR) {
+	if (stu_http_header_phash_init(&stu_http_headers_in_phash, stu_http_headers_in) == STU_ERROR) {
 		return STU_ERROR;
 	}
 
-	for (header = stu_http_headers_in; header->name.len; header++) {
-		stu_strlow(data, header->name.data, header->name.len);
+	if (stu_http_header_phash_init(&stu_http_upstream_headers_in_phash, stu_http_upstream_headers_in) == STU_ERROR) {
+		return STU_ERROR;
+	}
 
-		lc.data = data;
-		lc.len = header->name.len;
+	return STU_OK;
+}
 
-		data[lc.len] = '\0';
 
-		if (stu_hash_insert(&stu_http_headers_in_hash, &lc, header, STU_HASH_LOWCASE|STU_HASH_REPLACE) == STU_ERROR) {
+/*
+ * The known headers are fixed, so the smallest table size at which their
+ * hashes, as computed by stu_http_parse_header_line(), fall into distinct
+ * slots is searched for once. A lookup is then one modulo and one compare.
+ */
+stu_int_t
+stu_http_header_phash_init(stu_http_header_phash_t *ph, stu_http_header_t *headers) {
+	stu_http_header_phash_elt_t *e;
+	stu_http_header_t           *header;
+	stu_uint_t                   n, size, hash;
+	u_char                       data[STU_HTTP_LC_HEADER_LEN];
+
+	for (n = 0, header = headers; header->name.len; header++) {
+		if (header->name.len >= STU_HTTP_LC_HEADER_LEN) {
+			stu_log_error(0, "http header name too long: %s.", header->name.data);
 			return STU_ERROR;
 		}
+
+		n++;
 	}
 
-	if (stu_hash_init(&stu_http_upstream_headers_in_hash, NULL, STU_HTTP_HEADERS_MAX_SIZE,
-			(stu_hash_palloc_pt) stu_calloc, stu_free) == STU_ERROR) {
+	ph->elts = stu_calloc(STU_HTTP_HEADERS_PHASH_MAX_SIZE * sizeof(stu_http_header_phash_elt_t));
+	if (ph->elts == NULL) {
 		return STU_ERROR;
 	}
 
-	for (header = stu_http_upstream_headers_in; header->name.len; header++) {
-		stu_strlow(data, header->name.data, header->name.len);
+	for (size = stu_max(n, 1); size <= STU_HTTP_HEADERS_PHASH_MAX_SIZE; size++) {
+		stu_memzero(ph->elts, size * sizeof(stu_http_header_phash_elt_t));
 
-		lc.data = data;
-		lc.len = header->name.len;
+		for (header = headers; header->name.len; header++) {
+			stu_strlow(data, header->name.data, header->name.len);
+			hash = stu_hash_key(data, header->name.len);
 
-		data[lc.len] = '\0';
+			e = &ph->elts[hash % size];
+			if (e->header && (e->hash != hash || e->header->name.len != header->name.len
+					|| memcmp(e->lowcase, data, header->name.len) != 0)) {
+				break;
+			}
 
-		if (stu_hash_insert(&stu_http_upstream_headers_in_hash, &lc, header, STU_HASH_LOWCASE|STU_HASH_REPLACE) == STU_ERROR) {
-			return STU_ERROR;
+			e->header = header;
+			e->hash = hash;
+			memcpy(e->lowcase, data, header->name.len);
+			e->lowcase[header->name.len] = '\0';
+		}
+
+		if (header->name.len == 0) {
+			ph->size = size;
+			stu_log_debug(4, "http header phash: n=%lu, size=%lu.", n, size);
+			return STU_OK;
 		}
 	}
 
-	return STU_OK;
+	stu_free(ph->elts);
+	ph->elts = NULL;
+
+	stu_log_error(0, "Failed to find a perfect hash size for http headers: n=%lu.", n);
+
+	return STU_ERROR;
+}
+
+stu_http_header_t *
+stu_http_header_phash_find(stu_http_header_phash_t *ph, stu_uint_t hash, u_char *lowcase, size_t len) {
+	stu_http_header_phash_elt_t *e;
+
+	e = &ph->elts[hash % ph->size];
+	if (e->header == NULL || e->hash != hash || e->header->name.len != len || memcmp(e->lowcase, lowcase, len) != 0) {
+		return NULL;
+	}
+
+	return e->header;
 }
 
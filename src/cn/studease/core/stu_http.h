@@ -11,7 +11,7 @@
 #include "stu_config.h"
 #include "stu_core.h"
 
-#define STU_HTTP_HEADERS_MAX_SIZE  32
+#define STU_HTTP_HEADERS_PHASH_MAX_SIZE  1024
 
 typedef struct stu_http_request_s stu_http_request_t;
 
@@ -19,9 +19,13 @@ typedef stu_int_t (*stu_http_header_handler_pt)(stu_http_request_t *r, stu_table
 
 #include "stu_http_request.h"
 #include "stu_http_parse.h"
+#include "stu_http_admin.h"
 #include "stu_websocket_request.h"
 #include "stu_websocket_parse.h"
 
 stu_int_t stu_http_add_listen(stu_config_t *cf);
 
+stu_int_t stu_http_header_phash_init(stu_http_header_phash_t *ph, stu_http_header_t *headers);
+stu_http_header_t *stu_http_header_phash_find(stu_http_header_phash_t *ph, stu_uint_t hash, u_char *lowcase, size_t len);
+
 #endif /* STU_HTTP_H_ */
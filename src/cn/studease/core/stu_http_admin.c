@@ -0,0 +1,776 @@
+/*
+ * stu_http_admin.c
+ *
+ *  Created on: 2017-7-7
+ *      Author: Tony Lau
+ */
+
+#define STU_LOG_MODULE  STU_LOG_HTTP
+
+#include "stu_config.h"
+#include "stu_core.h"
+#include <sys/uio.h>
+
+extern stu_cycle_t *stu_cycle;
+
+static stu_int_t  stu_http_admin_metrics(stu_http_request_t *r);
+static stu_int_t  stu_http_admin_healthz(stu_http_request_t *r);
+static stu_int_t  stu_http_admin_channels(stu_http_request_t *r);
+static stu_int_t  stu_http_admin_channels_top(stu_http_request_t *r);
+static stu_int_t  stu_http_admin_channel(stu_http_request_t *r);
+#if (STU_TRACE)
+static stu_int_t  stu_http_admin_trace(stu_http_request_t *r);
+#endif
+
+static u_char    *stu_http_admin_metric(u_char *p, u_char *end, stu_int_t id, stu_str_t *last);
+
+static stu_bool_t  stu_http_admin_allowed(stu_connection_t *c);
+
+static stu_json_t *stu_http_admin_channel_json(stu_channel_snapshot_elt_t *elt);
+static stu_uint_t  stu_http_admin_arg_uint(stu_http_request_t *r, stu_str_t *name, stu_uint_t def, stu_uint_t max);
+static stu_int_t   stu_http_admin_send_json(stu_http_request_t *r, stu_uint_t status, stu_json_t *res, size_t size);
+static stu_int_t   stu_http_admin_send_later(stu_http_request_t *r, struct iovec *iov);
+static void        stu_http_admin_write_handler(stu_event_t *wev);
+static stu_int_t   stu_http_admin_write_timeout(stu_event_t *wev);
+static void        stu_http_admin_finalize_write(stu_connection_t *c);
+
+static stu_str_t  STU_HTTP_ADMIN_TEXT_PLAIN = stu_string("text/plain; charset=utf-8");
+static stu_str_t  STU_HTTP_ADMIN_PROMETHEUS = stu_string("text/plain; version=0.0.4");
+static stu_str_t  STU_HTTP_ADMIN_JSON = stu_string("application/json");
+
+static stu_str_t  STU_HTTP_ADMIN_TIME = stu_string("time");
+static stu_str_t  STU_HTTP_ADMIN_CHANNELS = stu_string("channels");
+static stu_str_t  STU_HTTP_ADMIN_USERS = stu_string("users");
+static stu_str_t  STU_HTTP_ADMIN_MESSAGES = stu_string("messages");
+static stu_str_t  STU_HTTP_ADMIN_RATE = stu_string("rate");
+static stu_str_t  STU_HTTP_ADMIN_NEXT = stu_string("next");
+static stu_str_t  STU_HTTP_ADMIN_AFTER = stu_string("after");
+static stu_str_t  STU_HTTP_ADMIN_LIMIT = stu_string("limit");
+static stu_str_t  STU_HTTP_ADMIN_N = stu_string("n");
+#if (STU_TRACE)
+static stu_str_t  STU_HTTP_ADMIN_STAGES = stu_string("stages");
+static stu_str_t  STU_HTTP_ADMIN_SAMPLES = stu_string("samples");
+static stu_str_t  STU_HTTP_ADMIN_COUNT = stu_string("count");
+static stu_str_t  STU_HTTP_ADMIN_MAX = stu_string("max");
+static stu_str_t  STU_HTTP_ADMIN_START = stu_string("start");
+static stu_str_t  STU_HTTP_ADMIN_RECIPIENTS = stu_string("recipients");
+static stu_str_t  STU_HTTP_ADMIN_BYTES = stu_string("bytes");
+static stu_str_t  STU_HTTP_ADMIN_PERCENTILES[] = {
+	stu_string("p50"),
+	stu_string("p90"),
+	stu_string("p99"),
+	stu_string("p999")
+};
+#endif
+
+extern stu_str_t  STU_PROTOCOL_ID;
+extern stu_str_t  STU_PROTOCOL_NAME;
+extern stu_str_t  STU_PROTOCOL_ROLE;
+extern stu_str_t  STU_PROTOCOL_STATE;
+extern stu_str_t  STU_PROTOCOL_TOTAL;
+extern stu_str_t  STU_PROTOCOL_STATUS;
+
+static stu_http_admin_route_t  stu_http_admin_routes[] = {
+	{ stu_string("/metrics"), stu_http_admin_metrics },
+	{ stu_string("/healthz"), stu_http_admin_healthz },
+	{ stu_string("/admin/channels"), stu_http_admin_channels },
+	{ stu_string("/admin/channels/top"), stu_http_admin_channels_top },
+	{ stu_string("/admin/channel"), stu_http_admin_channel },
+#if (STU_TRACE)
+	{ stu_string("/admin/trace"), stu_http_admin_trace },
+#endif
+	{ stu_null_string, NULL }
+};
+
+static const char *stu_http_admin_quantiles[] = { "0.5", "0.9", "0.99", "0.999", NULL };
+static double      stu_http_admin_quantile_values[] = { 0.5, 0.9, 0.99, 0.999 };
+
+
+/*
+ * Plain GET routes on the websocket listener, for the clients in
+ * admin_allow only. Returns STU_DECLINED if the uri is not routed or the
+ * client is not allowed, STU_AGAIN if the rest of the response goes on the
+ * write event, which closes the connection, otherwise the response has been
+ * sent, and the connection should be closed.
+ */
+stu_int_t
+stu_http_admin_handler(stu_http_request_t *r) {
+	stu_http_admin_route_t *route;
+
+	for (route = stu_http_admin_routes; route->handler; route++) {
+		if (r->uri.len == route->uri.len && stu_strncmp(r->uri.data, route->uri.data, route->uri.len) == 0) {
+			break;
+		}
+	}
+
+	if (route->handler == NULL) {
+		return STU_DECLINED;
+	}
+
+	// as if not routed, not to tell the public there is an admin API
+	if (stu_http_admin_allowed(r->connection) == FALSE) {
+		return STU_DECLINED;
+	}
+
+	if (r->method != STU_HTTP_GET) {
+		return stu_http_admin_send(r, STU_HTTP_METHOD_NOT_ALLOWED, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "method not allowed\n", 19);
+	}
+
+	return route->handler(r);
+}
+
+stu_int_t
+stu_http_admin_send(stu_http_request_t *r, stu_uint_t status, stu_str_t *type, u_char *body, size_t len) {
+	stu_connection_t *c;
+	struct iovec      iov[2];
+	u_char            header[256], *p;
+	const char       *reason;
+	ssize_t           n;
+
+	c = r->connection;
+
+	switch (status) {
+	case STU_HTTP_OK:
+		reason = "200 OK";
+		break;
+	case STU_HTTP_BAD_REQUEST:
+		reason = "400 Bad Request";
+		break;
+	case STU_HTTP_NOT_FOUND:
+		reason = "404 Not Found";
+		break;
+	case STU_HTTP_METHOD_NOT_ALLOWED:
+		reason = "405 Not Allowed";
+		break;
+	case STU_HTTP_SERVICE_UNAVAILABLE:
+		reason = "503 Service Temporarily Unavailable";
+		break;
+	default:
+		reason = "500 Internal Server Error";
+		break;
+	}
+
+	p = stu_snprintf(header, sizeof(header), "HTTP/1.1 %s" CRLF "Server: " __NAME "/" __VERSION CRLF
+			"Content-Type: %V" CRLF "Content-Length: %uz" CRLF "Connection: close" CRLF CRLF,
+			reason, type, len);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = p - header;
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+
+	while (iov[0].iov_len + iov[1].iov_len) {
+		n = writev(c->fd, iov[0].iov_len ? iov : iov + 1, iov[0].iov_len ? 2 : 1);
+		if (n == -1) {
+			if (stu_errno == EINTR) {
+				continue;
+			}
+
+			if (stu_errno == EAGAIN) {
+				// a large page fills the socket buffer, keep the rest for the write event
+				return stu_http_admin_send_later(r, iov);
+			}
+
+			stu_log_error(stu_errno, "Failed to send admin response: fd=%d.", c->fd);
+			return STU_ERROR;
+		}
+
+		stu_metrics_add(STU_METRIC_BYTES_OUT, n);
+
+		if ((size_t) n < iov[0].iov_len) {
+			iov[0].iov_base = (u_char *) iov[0].iov_base + n;
+			iov[0].iov_len -= n;
+			continue;
+		}
+
+		n -= iov[0].iov_len;
+		iov[0].iov_len = 0;
+		iov[1].iov_base = (u_char *) iov[1].iov_base + n;
+		iov[1].iov_len -= n;
+	}
+
+	stu_log_debug(4, "sent admin response: fd=%d, status=%lu, bytes=%lu.", c->fd, status, (stu_uint_t) len);
+
+	return STU_OK;
+}
+
+/*
+ * The body belongs to the caller, so copy the unsent tail into
+ * r->response_body, with start for the memory, last for the next byte to
+ * send and end for the end of it. Returns STU_AGAIN, and the write handler
+ * closes the connection when it is done.
+ */
+static stu_int_t
+stu_http_admin_send_later(stu_http_request_t *r, struct iovec *iov) {
+	stu_connection_t *c;
+	stu_buf_t        *b;
+	u_char           *p;
+
+	c = r->connection;
+	b = &r->response_body;
+
+	p = stu_alloc(iov[0].iov_len + iov[1].iov_len);
+	if (p == NULL) {
+		stu_log_error(0, "Failed to alloc the rest of admin response: fd=%d.", c->fd);
+		return STU_ERROR;
+	}
+
+	b->start = b->last = p;
+
+	p = stu_memcpy(p, iov[0].iov_base, iov[0].iov_len);
+	b->end = stu_memcpy(p, iov[1].iov_base, iov[1].iov_len);
+
+	c->read.active = 0;
+
+	c->write.handler = stu_http_admin_write_handler;
+	if (stu_event_add(&c->write, STU_WRITE_EVENT, STU_CLEAR_EVENT) == STU_ERROR) {
+		stu_log_error(0, "Failed to add admin write event: fd=%d.", c->fd);
+		goto failed;
+	}
+
+	stu_timer_add(&c->write, STU_HTTP_ADMIN_SEND_TIMEOUT);
+
+	stu_log_debug(4, "admin response pending: fd=%d, bytes=%lu.", c->fd, (stu_uint_t) (b->end - b->last));
+
+	return STU_AGAIN;
+
+failed:
+
+	stu_free(b->start);
+	b->start = b->last = b->end = NULL;
+
+	return STU_ERROR;
+}
+
+static void
+stu_http_admin_write_handler(stu_event_t *wev) {
+	stu_connection_t   *c;
+	stu_http_request_t *r;
+	stu_buf_t          *b;
+	stu_uint_t          generation;
+	ssize_t             n;
+
+	c = (stu_connection_t *) wev->data;
+	generation = c->generation;
+
+	if (wev->timedout && stu_http_admin_write_timeout(wev) == STU_OK) {
+		return;
+	}
+
+	stu_mutex_lock(&c->lock);
+	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID || c->generation != generation) {
+		goto done;
+	}
+
+	r = (stu_http_request_t *) c->data;
+	b = &r->response_body;
+
+	while (b->last < b->end) {
+		n = send(c->fd, b->last, b->end - b->last, 0);
+		if (n == -1) {
+			if (stu_errno == EINTR) {
+				continue;
+			}
+
+			if (stu_errno == EAGAIN) {
+				goto done;
+			}
+
+			stu_log_error(stu_errno, "Failed to send admin response: fd=%d.", c->fd);
+			goto finish;
+		}
+
+		stu_metrics_add(STU_METRIC_BYTES_OUT, n);
+
+		b->last += n;
+	}
+
+	stu_log_debug(4, "sent the rest of admin response: fd=%d.", c->fd);
+
+finish:
+
+	stu_http_admin_finalize_write(c);
+
+done:
+
+	stu_mutex_unlock(&c->lock);
+}
+
+/*
+ * Called by the timer with its lock held, or by epoll while wev->timedout is
+ * set, so the timer lock is taken here to re-arm. Returns STU_DECLINED if the
+ * timeout has been taken by another thread, and the event is I/O.
+ */
+static stu_int_t
+stu_http_admin_write_timeout(stu_event_t *wev) {
+	stu_connection_t *c;
+
+	stu_mutex_lock(&stu_cycle->timer_lock);
+
+	if (wev->timedout == 0) {
+		stu_mutex_unlock(&stu_cycle->timer_lock);
+		return STU_DECLINED;
+	}
+
+	wev->timedout = 0;
+
+	c = (stu_connection_t *) wev->data;
+
+	// the owner thread of c may be waiting for the timer lock, never block on c->lock here
+	if (stu_mutex_trylock(&c->lock) != 0) {
+		stu_timer_add_locked(wev, 1);
+		stu_mutex_unlock(&stu_cycle->timer_lock);
+		return STU_OK;
+	}
+
+	if (c->fd != (stu_socket_t) STU_SOCKET_INVALID) {
+		stu_log_error(0, "Admin response timed out: fd=%d.", c->fd);
+		stu_http_admin_finalize_write(c);
+	}
+
+	stu_mutex_unlock(&c->lock);
+	stu_mutex_unlock(&stu_cycle->timer_lock);
+
+	return STU_OK;
+}
+
+/* called with c->lock held. */
+static void
+stu_http_admin_finalize_write(stu_connection_t *c) {
+	stu_http_request_t *r;
+	stu_buf_t          *b;
+
+	if (c->write.timer_set) {
+		stu_timer_del(&c->write);
+	}
+
+	r = (stu_http_request_t *) c->data;
+	b = &r->response_body;
+
+	stu_free(b->start);
+	b->start = b->last = b->end = NULL;
+
+	stu_http_close_connection(c);
+}
+
+
+/*
+ * Prometheus text format, rendered from the metrics registry without
+ * taking any lock. Histograms are exposed as summaries, as the buckets are
+ * too many to scrape. Every worker process has its own registry.
+ */
+static stu_int_t
+stu_http_admin_metrics(stu_http_request_t *r) {
+	stu_uint_t  i, n, size;
+	stu_str_t   last;
+	u_char     *body, *p;
+	stu_int_t   rc;
+
+	n = stu_metrics_n();
+
+	// TYPE, 4 quantiles, sum and count per histogram, and the channels
+	size = (n * 7 + 4) * STU_HTTP_ADMIN_LINE_MAX_LEN;
+
+	body = stu_alloc(size);
+	if (body == NULL) {
+		stu_log_error(0, "Failed to alloc metrics response.");
+		return stu_http_admin_send(r, STU_HTTP_INTERNAL_SERVER_ERROR, &STU_HTTP_ADMIN_TEXT_PLAIN, NULL, 0);
+	}
+
+	p = body;
+	last.data = NULL;
+	last.len = 0;
+
+	for (i = 0; i < n; i++) {
+		p = stu_http_admin_metric(p, body + size, i, &last);
+	}
+
+	// racy, but a word read
+	p = stu_slprintf(p, body + size, "# TYPE " STU_HTTP_ADMIN_METRIC_PREFIX "channels gauge\n"
+			STU_HTTP_ADMIN_METRIC_PREFIX "channels %ui\n", stu_cycle->channels.length);
+
+	rc = stu_http_admin_send(r, STU_HTTP_OK, &STU_HTTP_ADMIN_PROMETHEUS, body, p - body);
+
+	stu_free(body);
+
+	return rc;
+}
+
+static stu_int_t
+stu_http_admin_healthz(stu_http_request_t *r) {
+	return stu_http_admin_send(r, STU_HTTP_OK, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "ok\n", 3);
+}
+
+/* last is the name without labels of the previous metric, to write TYPE once. */
+static u_char *
+stu_http_admin_metric(u_char *p, u_char *end, stu_int_t id, stu_str_t *last) {
+	stu_metric_t            *m;
+	stu_metrics_histogram_t  h;
+	stu_str_t                base, labels;
+	u_char                  *brace;
+	const char              *type;
+	stu_uint_t               i;
+
+	m = stu_metrics_get(id);
+
+	base = m->name;
+	labels.data = (u_char *) "";
+	labels.len = 0;
+
+	brace = (u_char *) memchr(m->name.data, '{', m->name.len);
+	if (brace) {
+		base.len = brace - m->name.data;
+		labels.data = brace + 1;
+		labels.len = m->name.len - base.len - 2;
+	}
+
+	if (last->len != base.len || stu_strncmp(last->data, base.data, base.len) != 0) {
+		switch (m->type) {
+		case STU_METRICS_COUNTER:
+			type = "counter";
+			break;
+		case STU_METRICS_GAUGE:
+			type = "gauge";
+			break;
+		default:
+			type = "summary";
+			break;
+		}
+
+		p = stu_slprintf(p, end, "# TYPE " STU_HTTP_ADMIN_METRIC_PREFIX "%V %s\n", &base, type);
+		*last = base;
+	}
+
+	if (m->type != STU_METRICS_HISTOGRAM) {
+		return stu_slprintf(p, end, STU_HTTP_ADMIN_METRIC_PREFIX "%V %L\n", &m->name, stu_metrics_value(id));
+	}
+
+	stu_metrics_histogram(id, &h);
+
+	for (i = 0; stu_http_admin_quantiles[i]; i++) {
+		p = stu_slprintf(p, end, STU_HTTP_ADMIN_METRIC_PREFIX "%V{%V%squantile=\"%s\"} %ui\n",
+				&base, &labels, labels.len ? "," : "",
+				stu_http_admin_quantiles[i], (stu_uint_t) stu_metrics_percentile(&h, stu_http_admin_quantile_values[i]));
+	}
+
+	if (labels.len) {
+		p = stu_slprintf(p, end, STU_HTTP_ADMIN_METRIC_PREFIX "%V_sum{%V} %ui\n", &base, &labels, (stu_uint_t) h.sum);
+		return stu_slprintf(p, end, STU_HTTP_ADMIN_METRIC_PREFIX "%V_count{%V} %ui\n", &base, &labels, (stu_uint_t) h.count);
+	}
+
+	p = stu_slprintf(p, end, STU_HTTP_ADMIN_METRIC_PREFIX "%V_sum %ui\n", &base, (stu_uint_t) h.sum);
+
+	return stu_slprintf(p, end, STU_HTTP_ADMIN_METRIC_PREFIX "%V_count %ui\n", &base, (stu_uint_t) h.count);
+}
+
+
+/*
+ * GET /admin/channels?after=<id>&limit=<n>, ordered by id. Pass the "next"
+ * of a page as "after" to get the next one, which stays valid across
+ * snapshots.
+ */
+static stu_int_t
+stu_http_admin_channels(stu_http_request_t *r) {
+	stu_channel_snapshot_t     *s;
+	stu_channel_snapshot_elt_t *elt;
+	stu_json_t                 *res, *channels;
+	stu_str_t                   after;
+	stu_uint_t                  i, n, limit;
+	size_t                      size;
+	stu_int_t                   rc;
+
+	s = stu_channel_snapshot_acquire();
+	if (s == NULL) {
+		return stu_http_admin_send(r, STU_HTTP_SERVICE_UNAVAILABLE, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "no snapshot yet\n", 16);
+	}
+
+	limit = stu_http_admin_arg_uint(r, &STU_HTTP_ADMIN_LIMIT, STU_HTTP_ADMIN_PAGE_DEFAULT_SIZE, STU_HTTP_ADMIN_PAGE_MAX_SIZE);
+
+	i = 0;
+	if (stu_http_arg(r, STU_HTTP_ADMIN_AFTER.data, STU_HTTP_ADMIN_AFTER.len, &after) == STU_OK) {
+		i = stu_channel_snapshot_after(s, &after);
+	}
+
+	res = stu_json_create_object(NULL);
+	channels = stu_json_create_array(&STU_HTTP_ADMIN_CHANNELS);
+
+	stu_json_add_item_to_object(res, stu_json_create_number(&STU_HTTP_ADMIN_TIME, (stu_double_t) s->time));
+	stu_json_add_item_to_object(res, stu_json_create_number(&STU_PROTOCOL_TOTAL, (stu_double_t) s->n));
+
+	size = 128;
+
+	for (n = 0; n < limit && i < s->n; n++, i++) {
+		elt = &s->channels[i];
+		stu_json_add_item_to_array(channels, stu_http_admin_channel_json(elt));
+		size += elt->id.len + STU_HTTP_ADMIN_CHANNEL_JSON_LEN;
+	}
+
+	stu_json_add_item_to_object(res, channels);
+
+	if (i < s->n && n) {
+		elt = &s->channels[i - 1];
+		stu_json_add_item_to_object(res, stu_json_create_string(&STU_HTTP_ADMIN_NEXT, elt->id.data, elt->id.len));
+		size += elt->id.len + 16;
+	}
+
+	stu_channel_snapshot_release(s);
+
+	rc = stu_http_admin_send_json(r, STU_HTTP_OK, res, size);
+
+	return rc;
+}
+
+/* GET /admin/channels/top?n=<n>, the busiest by messages per second. */
+static stu_int_t
+stu_http_admin_channels_top(stu_http_request_t *r) {
+	stu_channel_snapshot_t     *s;
+	stu_channel_snapshot_elt_t *elt;
+	stu_json_t                 *res, *channels;
+	stu_uint_t                  i, n;
+	size_t                      size;
+
+	s = stu_channel_snapshot_acquire();
+	if (s == NULL) {
+		return stu_http_admin_send(r, STU_HTTP_SERVICE_UNAVAILABLE, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "no snapshot yet\n", 16);
+	}
+
+	n = stu_http_admin_arg_uint(r, &STU_HTTP_ADMIN_N, STU_HTTP_ADMIN_TOP_DEFAULT_SIZE, STU_HTTP_ADMIN_PAGE_MAX_SIZE);
+
+	res = stu_json_create_object(NULL);
+	channels = stu_json_create_array(&STU_HTTP_ADMIN_CHANNELS);
+
+	stu_json_add_item_to_object(res, stu_json_create_number(&STU_HTTP_ADMIN_TIME, (stu_double_t) s->time));
+
+	size = 64;
+
+	for (i = 0; i < n && i < s->n; i++) {
+		elt = s->busiest[i];
+		stu_json_add_item_to_array(channels, stu_http_admin_channel_json(elt));
+		size += elt->id.len + STU_HTTP_ADMIN_CHANNEL_JSON_LEN;
+	}
+
+	stu_json_add_item_to_object(res, channels);
+
+	stu_channel_snapshot_release(s);
+
+	return stu_http_admin_send_json(r, STU_HTTP_OK, res, size);
+}
+
+/* GET /admin/channel?id=<id>, with the members. */
+static stu_int_t
+stu_http_admin_channel(stu_http_request_t *r) {
+	stu_channel_snapshot_t      *s;
+	stu_channel_snapshot_elt_t  *elt;
+	stu_channel_snapshot_user_t *u;
+	stu_json_t                  *res, *users, *user;
+	stu_str_t                    id;
+	stu_uint_t                   i;
+	size_t                       size;
+
+	if (stu_http_arg(r, STU_PROTOCOL_ID.data, STU_PROTOCOL_ID.len, &id) != STU_OK) {
+		return stu_http_admin_send(r, STU_HTTP_BAD_REQUEST, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "id required\n", 12);
+	}
+
+	s = stu_channel_snapshot_acquire();
+	if (s == NULL) {
+		return stu_http_admin_send(r, STU_HTTP_SERVICE_UNAVAILABLE, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "no snapshot yet\n", 16);
+	}
+
+	elt = stu_channel_snapshot_find(s, &id);
+	if (elt == NULL) {
+		stu_channel_snapshot_release(s);
+		return stu_http_admin_send(r, STU_HTTP_NOT_FOUND, &STU_HTTP_ADMIN_TEXT_PLAIN, (u_char *) "channel not found\n", 18);
+	}
+
+	res = stu_http_admin_channel_json(elt);
+	users = stu_json_create_array(&STU_HTTP_ADMIN_USERS);
+
+	stu_json_add_item_to_object(res, stu_json_create_number(&STU_HTTP_ADMIN_TIME, (stu_double_t) s->time));
+
+	size = elt->id.len + STU_HTTP_ADMIN_CHANNEL_JSON_LEN + 64;
+
+	for (i = 0; i < elt->total; i++) {
+		u = &elt->users[i];
+
+		user = stu_json_create_object(NULL);
+		stu_json_add_item_to_object(user, stu_json_create_string(&STU_PROTOCOL_ID, u->id.data, u->id.len));
+		stu_json_add_item_to_object(user, stu_json_create_string(&STU_PROTOCOL_NAME, u->name.data, u->name.len));
+		stu_json_add_item_to_object(user, stu_json_create_number(&STU_PROTOCOL_ROLE, (stu_double_t) u->role));
+		stu_json_add_item_to_array(users, user);
+
+		size += u->id.len + u->name.len + 48;
+	}
+
+	stu_json_add_item_to_object(res, users);
+
+	stu_channel_snapshot_release(s);
+
+	return stu_http_admin_send_json(r, STU_HTTP_OK, res, size);
+}
+
+#if (STU_TRACE)
+
+/*
+ * GET /admin/trace?n=<n>, the percentiles of the time spent in each stage,
+ * and the latest n samples with the end of each stage in usec since recv.
+ */
+static stu_int_t
+stu_http_admin_trace(stu_http_request_t *r) {
+	stu_trace_t             *samples, *t;
+	stu_metrics_histogram_t  h;
+	stu_json_t              *res, *stages, *stage, *list, *item;
+	stu_uint_t               i, k, n;
+	size_t                   size;
+
+	n = stu_http_admin_arg_uint(r, &STU_HTTP_ADMIN_N, STU_HTTP_ADMIN_PAGE_DEFAULT_SIZE, STU_HTTP_ADMIN_PAGE_MAX_SIZE);
+
+	samples = stu_alloc(n * sizeof(stu_trace_t));
+	if (samples == NULL) {
+		stu_log_error(0, "Failed to alloc trace samples.");
+		return stu_http_admin_send(r, STU_HTTP_INTERNAL_SERVER_ERROR, &STU_HTTP_ADMIN_TEXT_PLAIN, NULL, 0);
+	}
+
+	n = stu_trace_samples(samples, n);
+
+	res = stu_json_create_object(NULL);
+	stages = stu_json_create_object(&STU_HTTP_ADMIN_STAGES);
+	list = stu_json_create_array(&STU_HTTP_ADMIN_SAMPLES);
+
+	for (k = 0; k < STU_TRACE_STAGES; k++) {
+		stu_trace_stage_histogram(k, &h);
+
+		stage = stu_json_create_object(stu_trace_stage_name(k));
+		stu_json_add_item_to_object(stage, stu_json_create_number(&STU_HTTP_ADMIN_COUNT, (stu_double_t) h.count));
+
+		for (i = 0; stu_http_admin_quantiles[i]; i++) {
+			stu_json_add_item_to_object(stage, stu_json_create_number(&STU_HTTP_ADMIN_PERCENTILES[i],
+					(stu_double_t) stu_metrics_percentile(&h, stu_http_admin_quantile_values[i])));
+		}
+
+		stu_json_add_item_to_object(stage, stu_json_create_number(&STU_HTTP_ADMIN_MAX, (stu_double_t) h.max));
+		stu_json_add_item_to_object(stages, stage);
+	}
+
+	for (i = 0; i < n; i++) {
+		t = &samples[i];
+
+		item = stu_json_create_object(NULL);
+		stu_json_add_item_to_object(item, stu_json_create_number(&STU_HTTP_ADMIN_START, (stu_double_t) t->start));
+		stu_json_add_item_to_object(item, stu_json_create_number(&STU_PROTOCOL_STATUS, (stu_double_t) t->status));
+		stu_json_add_item_to_object(item, stu_json_create_number(&STU_HTTP_ADMIN_RECIPIENTS, (stu_double_t) t->recipients));
+		stu_json_add_item_to_object(item, stu_json_create_number(&STU_HTTP_ADMIN_BYTES, (stu_double_t) t->bytes));
+
+		for (k = 0; k < STU_TRACE_STAGES; k++) {
+			stu_json_add_item_to_object(item, stu_json_create_number(stu_trace_stage_name(k), (stu_double_t) t->stages[k]));
+		}
+
+		stu_json_add_item_to_array(list, item);
+	}
+
+	stu_free(samples);
+
+	stu_json_add_item_to_object(res, stages);
+	stu_json_add_item_to_object(res, list);
+
+	size = STU_TRACE_STAGES * 160 + n * (96 + STU_TRACE_STAGES * 32) + 64;
+
+	return stu_http_admin_send_json(r, STU_HTTP_OK, res, size);
+}
+
+#endif
+
+static stu_bool_t
+stu_http_admin_allowed(stu_connection_t *c) {
+	struct sockaddr_in  sa;
+	socklen_t           socklen;
+	stu_cidr_t         *cidr;
+	stu_uint_t          i;
+
+	socklen = sizeof(sa);
+
+	if (getpeername(c->fd, (struct sockaddr *) &sa, &socklen) == -1 || sa.sin_family != AF_INET) {
+		stu_log_error(stu_errno, "Failed to get admin client address: fd=%d.", c->fd);
+		return FALSE;
+	}
+
+	for (i = 0; i < stu_cycle->config.admin_allow_n; i++) {
+		cidr = &stu_cycle->config.admin_allow[i];
+		if ((sa.sin_addr.s_addr & cidr->mask) == cidr->addr) {
+			return TRUE;
+		}
+	}
+
+	stu_log_debug(4, "admin client not allowed: fd=%d, addr=%s.", c->fd, inet_ntoa(sa.sin_addr));
+
+	return FALSE;
+}
+
+static stu_json_t *
+stu_http_admin_channel_json(stu_channel_snapshot_elt_t *elt) {
+	stu_json_t *item;
+
+	item = stu_json_create_object(NULL);
+
+	stu_json_add_item_to_object(item, stu_json_create_string(&STU_PROTOCOL_ID, elt->id.data, elt->id.len));
+	stu_json_add_item_to_object(item, stu_json_create_number(&STU_PROTOCOL_STATE, (stu_double_t) elt->state));
+	stu_json_add_item_to_object(item, stu_json_create_number(&STU_PROTOCOL_TOTAL, (stu_double_t) elt->total));
+	stu_json_add_item_to_object(item, stu_json_create_number(&STU_HTTP_ADMIN_MESSAGES, (stu_double_t) elt->message_n));
+	stu_json_add_item_to_object(item, stu_json_create_number(&STU_HTTP_ADMIN_RATE, elt->rate));
+
+	return item;
+}
+
+static stu_uint_t
+stu_http_admin_arg_uint(stu_http_request_t *r, stu_str_t *name, stu_uint_t def, stu_uint_t max) {
+	stu_str_t  value;
+	stu_int_t  n;
+
+	if (stu_http_arg(r, name->data, name->len, &value) != STU_OK) {
+		return def;
+	}
+
+	n = atoi((const char *) value.data);
+	if (n <= 0) {
+		return def;
+	}
+
+	return stu_min((stu_uint_t) n, max);
+}
+
+/* size is an upper bound of the stringified res, which is deleted here. */
+static stu_int_t
+stu_http_admin_send_json(stu_http_request_t *r, stu_uint_t status, stu_json_t *res, size_t size) {
+	u_char     *body;
+	size_t      n;
+	stu_int_t   rc;
+
+	body = stu_alloc(size);
+	if (body == NULL) {
+		stu_log_error(0, "Failed to alloc admin response.");
+		stu_json_delete(res);
+		return stu_http_admin_send(r, STU_HTTP_INTERNAL_SERVER_ERROR, &STU_HTTP_ADMIN_TEXT_PLAIN, NULL, 0);
+	}
+
+	n = stu_json_stringify(res, body, size);
+	if (n > size) {
+		// escaped beyond the estimate
+		stu_free(body);
+
+		body = stu_alloc(n);
+		if (body == NULL) {
+			stu_log_error(0, "Failed to alloc admin response.");
+			stu_json_delete(res);
+			return stu_http_admin_send(r, STU_HTTP_INTERNAL_SERVER_ERROR, &STU_HTTP_ADMIN_TEXT_PLAIN, NULL, 0);
+		}
+
+		stu_json_stringify(res, body, n);
+	}
+
+	stu_json_delete(res);
+
+	rc = stu_http_admin_send(r, status, &STU_HTTP_ADMIN_JSON, body, n);
+
+	stu_free(body);
+
+	return rc;
+}
@@ -0,0 +1,33 @@
+/*
+ * stu_http_admin.h
+ *
+ *  Created on: 2017-7-7
+ *      Author: Tony Lau
+ */
+
+#ifndef STU_HTTP_ADMIN_H_
+#define STU_HTTP_ADMIN_H_
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#define STU_HTTP_ADMIN_METRIC_PREFIX      "chatease_"
+#define STU_HTTP_ADMIN_LINE_MAX_LEN       (STU_METRICS_NAME_MAX_LEN + 96)
+
+#define STU_HTTP_ADMIN_PAGE_DEFAULT_SIZE  100
+#define STU_HTTP_ADMIN_PAGE_MAX_SIZE      1000
+#define STU_HTTP_ADMIN_TOP_DEFAULT_SIZE   10
+#define STU_HTTP_ADMIN_CHANNEL_JSON_LEN   128   // but the id
+#define STU_HTTP_ADMIN_SEND_TIMEOUT       10000 // msec, for a slow client to take a large page
+
+typedef stu_int_t (*stu_http_admin_handler_pt)(stu_http_request_t *r);
+
+typedef struct {
+	stu_str_t                  uri;
+	stu_http_admin_handler_pt  handler;
+} stu_http_admin_route_t;
+
+stu_int_t  stu_http_admin_handler(stu_http_request_t *r);
+stu_int_t  stu_http_admin_send(stu_http_request_t *r, stu_uint_t status, stu_str_t *type, u_char *body, size_t len);
+
+#endif /* STU_HTTP_ADMIN_H_ */
@@ -5,13 +5,24 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_HTTP
+
 #include "stu_config.h"
 #include "stu_core.h"
+#if (STU_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if (STU_HAVE_SSE2)
+static stu_inline u_char *stu_http_parse_find_uri_end(u_char *p, u_char *end, u_char **slash);
+static stu_inline u_char *stu_http_parse_find_char(u_char *p, u_char *end, u_char c);
+static stu_inline u_char *stu_http_parse_find_eol(u_char *p, u_char *end);
+#endif
 
 
 stu_int_t
 stu_http_parse_request_line(stu_http_request_t *r, stu_buf_t *b) {
-	u_char  ch, *p, *s, *v;
+	u_char  ch, *p, *q, *s, *v;
 	enum {
 		sw_start = 0,
 		sw_method,
@@ -64,6 +75,17 @@ stu_http_parse_request_line(stu_http_request_t *r, stu_buf_t *b) {
 			state = sw_uri;
 			break;
 		case sw_uri:
+#if (STU_HAVE_SSE2)
+			q = stu_http_parse_find_uri_end(p, b->end, &s);
+			if (q > p) {
+				if (s) {
+					r->target.data = s;
+				}
+
+				p = q - 1;
+				break;
+			}
+#endif
 			if (ch == '?') {
 				r->uri.len = p - r->uri.data;
 
@@ -92,6 +114,13 @@ stu_http_parse_request_line(stu_http_request_t *r, stu_buf_t *b) {
 			}
 			break;
 		case sw_args:
+#if (STU_HAVE_SSE2)
+			q = stu_http_parse_find_char(p, b->end, ' ');
+			if (q > p) {
+				p = q - 1;
+				break;
+			}
+#endif
 			if (ch == ' ') {
 				r->args.len = p - r->args.data;
 				state = sw_spaces_before_ver;
@@ -232,7 +261,7 @@ done:
 
 stu_int_t
 stu_http_parse_header_line(stu_http_request_t *r, stu_buf_t *b, stu_uint_t allow_underscores) {
-	u_char      c, ch, *p;
+	u_char      c, ch, *p, *q, *s;
 	stu_uint_t  hash, i;
 	enum {
 		sw_start = 0,
@@ -391,6 +420,23 @@ stu_http_parse_header_line(stu_http_request_t *r, stu_buf_t *b, stu_uint_t allow
 
 		/* header value */
 		case sw_value:
+#if (STU_HAVE_SSE2)
+			q = stu_http_parse_find_eol(p, b->end);
+			if (q > p) {
+				// skipped in a stride, but the trailing spaces are not of the value
+				for (s = q; s > r->header_start && s[-1] == ' '; s--) {
+					/* void */
+				}
+
+				if (s < q) {
+					r->header_end = s;
+					state = sw_space_after_value;
+				}
+
+				p = q - 1;
+				break;
+			}
+#endif
 			switch (ch) {
 			case ' ':
 				r->header_end = p;
@@ -486,6 +532,311 @@ header_done:
 }
 
 
+#if (STU_HAVE_SSE2)
+
+/*
+ * The scanners below skip the bytes no state cares about, 16 at a time.
+ * Each returns the first byte of interest, or the start of the last partial
+ * block, from which the state machine goes on byte by byte.
+ */
+
+/* the first '?' or ' ', with the last '/' before it in slash */
+static stu_inline u_char *
+stu_http_parse_find_uri_end(u_char *p, u_char *end, u_char **slash) {
+	__m128i  qm, sp, sl, v;
+	int      m, n;
+
+	qm = _mm_set1_epi8('?');
+	sp = _mm_set1_epi8(' ');
+	sl = _mm_set1_epi8('/');
+
+	*slash = NULL;
+
+	for ( ; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, qm), _mm_cmpeq_epi8(v, sp)));
+		n = _mm_movemask_epi8(_mm_cmpeq_epi8(v, sl));
+
+		if (m) {
+			n &= (m & -m) - 1;
+			if (n) {
+				*slash = p + 31 - __builtin_clz(n);
+			}
+
+			return p + __builtin_ctz(m);
+		}
+
+		if (n) {
+			*slash = p + 31 - __builtin_clz(n);
+		}
+	}
+
+	return p;
+}
+
+static stu_inline u_char *
+stu_http_parse_find_char(u_char *p, u_char *end, u_char c) {
+	__m128i  ch, v;
+	int      m;
+
+	ch = _mm_set1_epi8(c);
+
+	for ( ; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ch));
+		if (m) {
+			return p + __builtin_ctz(m);
+		}
+	}
+
+	return p;
+}
+
+/* the first CR, LF or '\0' */
+static stu_inline u_char *
+stu_http_parse_find_eol(u_char *p, u_char *end) {
+	__m128i  cr, lf, zero, v;
+	int      m;
+
+	cr = _mm_set1_epi8(CR);
+	lf = _mm_set1_epi8(LF);
+	zero = _mm_setzero_si128();
+
+	for ( ; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+				_mm_cmpeq_epi8(v, zero)));
+		if (m) {
+			return p + __builtin_ctz(m);
+		}
+	}
+
+	return p;
+}
+
+#endif
+
+
+stu_int_t
+stu_http_parse_chunked(stu_http_request_t *r, stu_buf_t *b) {
+	u_char              ch, c, *p;
+	stu_int_t           rc;
+	stu_http_chunked_t *ctx;
+	enum {
+		sw_chunk_start = 0,
+		sw_chunk_size,
+		sw_chunk_extension,
+		sw_chunk_extension_almost_done,
+		sw_chunk_data,
+		sw_after_data,
+		sw_after_data_almost_done,
+		sw_last_chunk_extension,
+		sw_last_chunk_extension_almost_done,
+		sw_trailer,
+		sw_trailer_almost_done,
+		sw_trailer_header,
+		sw_trailer_header_almost_done
+	} state;
+
+	ctx = &r->chunked;
+	state = ctx->state;
+
+	if (state == sw_chunk_data && ctx->size == 0) {
+		state = sw_after_data;
+	}
+
+	rc = STU_AGAIN;
+
+	for (p = b->last; p < b->end; p++) {
+		ch = *p;
+
+		switch (state) {
+		case sw_chunk_start:
+			if (ch >= '0' && ch <= '9') {
+				state = sw_chunk_size;
+				ctx->size = ch - '0';
+				break;
+			}
+
+			c = (u_char) (ch | 0x20);
+			if (c >= 'a' && c <= 'f') {
+				state = sw_chunk_size;
+				ctx->size = c - 'a' + 10;
+				break;
+			}
+
+			goto invalid;
+
+		case sw_chunk_size:
+			if (ctx->size > STU_HTTP_CHUNK_MAXIMUM / 16) {
+				goto invalid;
+			}
+
+			if (ch >= '0' && ch <= '9') {
+				ctx->size = ctx->size * 16 + (ch - '0');
+				break;
+			}
+
+			c = (u_char) (ch | 0x20);
+			if (c >= 'a' && c <= 'f') {
+				ctx->size = ctx->size * 16 + (c - 'a' + 10);
+				break;
+			}
+
+			if (ctx->size == 0) {
+				switch (ch) {
+				case CR:
+					state = sw_last_chunk_extension_almost_done;
+					break;
+				case LF:
+					state = sw_trailer;
+					break;
+				case ';':
+				case ' ':
+				case '\t':
+					state = sw_last_chunk_extension;
+					break;
+				default:
+					goto invalid;
+				}
+				break;
+			}
+
+			switch (ch) {
+			case CR:
+				state = sw_chunk_extension_almost_done;
+				break;
+			case LF:
+				state = sw_chunk_data;
+				break;
+			case ';':
+			case ' ':
+			case '\t':
+				state = sw_chunk_extension;
+				break;
+			default:
+				goto invalid;
+			}
+			break;
+
+		case sw_chunk_extension:
+			switch (ch) {
+			case CR:
+				state = sw_chunk_extension_almost_done;
+				break;
+			case LF:
+				state = sw_chunk_data;
+			}
+			break;
+
+		case sw_chunk_extension_almost_done:
+			if (ch == LF) {
+				state = sw_chunk_data;
+				break;
+			}
+			goto invalid;
+
+		case sw_chunk_data:
+			rc = STU_OK;
+			goto data;
+
+		case sw_after_data:
+			switch (ch) {
+			case CR:
+				state = sw_after_data_almost_done;
+				break;
+			case LF:
+				state = sw_chunk_start;
+				break;
+			default:
+				goto invalid;
+			}
+			break;
+
+		case sw_after_data_almost_done:
+			if (ch == LF) {
+				state = sw_chunk_start;
+				break;
+			}
+			goto invalid;
+
+		case sw_last_chunk_extension:
+			switch (ch) {
+			case CR:
+				state = sw_last_chunk_extension_almost_done;
+				break;
+			case LF:
+				state = sw_trailer;
+			}
+			break;
+
+		case sw_last_chunk_extension_almost_done:
+			if (ch == LF) {
+				state = sw_trailer;
+				break;
+			}
+			goto invalid;
+
+		case sw_trailer:
+			switch (ch) {
+			case CR:
+				state = sw_trailer_almost_done;
+				break;
+			case LF:
+				goto done;
+			default:
+				state = sw_trailer_header;
+			}
+			break;
+
+		case sw_trailer_almost_done:
+			if (ch == LF) {
+				goto done;
+			}
+			goto invalid;
+
+		case sw_trailer_header:
+			switch (ch) {
+			case CR:
+				state = sw_trailer_header_almost_done;
+				break;
+			case LF:
+				state = sw_trailer;
+			}
+			break;
+
+		case sw_trailer_header_almost_done:
+			if (ch == LF) {
+				state = sw_trailer;
+				break;
+			}
+			goto invalid;
+		}
+	}
+
+data:
+
+	/* on STU_OK, ctx->size bytes of chunk data start at b->last */
+	ctx->state = state;
+	b->last = p;
+
+	return rc;
+
+done:
+
+	ctx->state = sw_chunk_start;
+	b->last = p + 1;
+
+	return STU_DONE;
+
+invalid:
+
+	return STU_ERROR;
+}
+
 stu_int_t
 stu_http_parse_uri(stu_http_request_t *r) {
 	return STU_OK;
@@ -5,12 +5,15 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_HTTP
+
 #include <sys/socket.h>
 #include "stu_config.h"
 #include "stu_core.h"
 
 static void stu_http_request_handler(stu_event_t *wev);
 static stu_int_t stu_http_switch_protocol(stu_http_request_t *r);
+static u_char *stu_http_websocket_accept(stu_http_request_t *r, u_char *dst);
 
 static stu_int_t stu_http_process_request_headers(stu_http_request_t *r);
 
@@ -25,10 +28,41 @@ static stu_int_t stu_http_process_header_line(stu_http_request_t *r, stu_table_e
 static stu_int_t stu_http_process_unique_header_line(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset);
 
 
-static const stu_str_t  STU_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT = stu_string("Sec-WebSocket-Accept");
-static const stu_str_t  STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL = stu_string("Sec-WebSocket-Protocol");
+static const stu_str_t  STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL = stu_string("Sec-WebSocket-Protocol: ");
 static const stu_str_t  STU_HTTP_WEBSOCKET_SIGN_KEY = stu_string("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
 
+/* everything of a 101 before the accept value */
+static const stu_str_t  STU_HTTP_SWITCHING_PROTOCOLS_HEAD = stu_string(
+		"HTTP/1.1 101 Switching Protocols" CRLF
+		"Server: " __NAME "/" __VERSION CRLF
+		"Upgrade: websocket" CRLF
+		"Connection: upgrade" CRLF
+		"Sec-WebSocket-Accept: "
+	);
+
+static stu_str_t  stu_http_status_lines[] = {
+	stu_string("400 Bad Request"),
+	stu_string("401 Unauthorized"),
+	stu_string("402 Payment Required"),
+	stu_string("403 Forbidden"),
+	stu_string("404 Not Found"),
+	stu_string("405 Not Allowed"),
+	stu_string("406 Not Acceptable"),
+	stu_null_string,  /* "407 Proxy Authentication Required" */
+	stu_string("408 Request Time-out"),
+
+#define STU_HTTP_LAST_4XX  409
+#define STU_HTTP_OFF_5XX   (STU_HTTP_LAST_4XX - 400)
+
+	stu_string("500 Internal Server Error"),
+	stu_string("501 Not Implemented"),
+	stu_string("502 Bad Gateway"),
+	stu_string("503 Service Temporarily Unavailable"),
+	stu_string("504 Gateway Time-out")
+
+#define STU_HTTP_LAST_5XX  505
+};
+
 
 extern stu_cycle_t *stu_cycle;
 extern stu_int_t    stu_preview_auto_id;
@@ -39,8 +73,8 @@ extern stu_str_t  STU_HTTP_UPSTREAM_IDENT_RESPONSE;
 extern stu_str_t  STU_FLASH_POLICY_REQUEST;
 extern stu_str_t  STU_FLASH_POLICY_FILE;
 
-stu_hash_t         stu_http_headers_in_hash;
-stu_http_header_t  stu_http_headers_in[] = {
+stu_http_header_phash_t  stu_http_headers_in_phash;
+stu_http_header_t        stu_http_headers_in[] = {
 	{ stu_string("Host"), offsetof(stu_http_headers_in_t, host), stu_http_process_host },
 	{ stu_string("User-Agent"), offsetof(stu_http_headers_in_t, user_agent),  stu_http_process_header_line },
 
@@ -71,12 +105,19 @@ stu_http_header_t  stu_http_headers_in[] = {
 void
 stu_http_wait_request_handler(stu_event_t *rev) {
 	stu_connection_t *c;
+	stu_uint_t        generation;
 	stu_int_t         n, err;
 
 	c = (stu_connection_t *) rev->data;
+	generation = c->generation;
 
 	stu_mutex_lock(&c->lock);
-	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID) {
+	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID || c->generation != generation) {
+		goto done;
+	}
+
+	// sending the rest of an admin response
+	if (c->read.active == 0) {
 		goto done;
 	}
 
@@ -113,6 +154,8 @@ again:
 
 	stu_log_debug(4, "recv: fd=%d, bytes=%d.", c->fd, n); // str=\n%s, c->buffer.start
 
+	stu_metrics_add(STU_METRIC_BYTES_IN, n);
+
 	if (n == 1024) { // It seems to be a bad request.
 		stu_log_debug(4, "recv: fd=%d, data=%s.", c->fd, c->buffer.start);
 		stu_memzero(c->buffer.start, STU_HTTP_REQUEST_DEFAULT_SIZE);
@@ -169,9 +212,10 @@ stu_http_create_request(stu_connection_t *c) {
 	}
 
 	r->connection = c;
+	r->start = stu_metrics_usec();
 	r->header_in = &c->buffer;
-	stu_list_init(&r->headers_in.headers, (stu_list_palloc_pt) stu_calloc, stu_free);
-	stu_list_init(&r->headers_out.headers, (stu_list_palloc_pt) stu_calloc, stu_free);
+	r->headers_in.nheaders = 0;
+	r->headers_out.nheaders = 0;
 
 	return r;
 }
@@ -185,6 +229,7 @@ stu_http_process_request(stu_http_request_t *r) {
 	stu_str_t           cid, name, icon, role, state;
 	u_char             *d, *s, *p, opcode, temp[STU_HTTP_REQUEST_DEFAULT_SIZE], buf[STU_USER_ID_MAX_LEN];
 	stu_channel_t      *ch;
+	stu_json_t         *idt;
 
 	c = r->connection;
 
@@ -201,11 +246,28 @@ stu_http_process_request(stu_http_request_t *r) {
 	}
 
 	if (r->headers_in.upgrade == NULL) {
+		// served or not, the connection closes after a plain request
+		rc = stu_http_admin_handler(r);
+		if (rc == STU_AGAIN) {
+			return;
+		}
+
+		if (rc != STU_DECLINED) {
+			goto failed;
+		}
+
 		stu_log_error(0, "Not an upgrade request.");
 		stu_http_finalize_request(r, STU_HTTP_NOT_IMPLEMENTED);
 		goto failed;
 	}
 
+	if (r->headers_in.sec_websocket_key == NULL
+			&& (r->headers_in.sec_websocket_key1 == NULL || r->headers_in.sec_websocket_key2 == NULL)) {
+		stu_log_error(0, "Sec-WebSocket-Key not found.");
+		stu_http_finalize_request(r, STU_HTTP_BAD_REQUEST);
+		goto failed;
+	}
+
 	if (stu_cycle->config.edition == PREVIEW) {
 		goto preview;
 	}
@@ -226,9 +288,9 @@ stu_http_process_request(stu_http_request_t *r) {
 	c->upstream->process_response_pt = stu_http_upstream_process_response;
 	c->upstream->analyze_response_pt = stu_http_upstream_ident_analyze_response;
 	c->upstream->finalize_handler_pt = stu_http_upstream_finalize_handler;
-	c->upstream->cleanup_pt = stu_http_upstream_cleanup;
+	c->upstream->cleanup_pt = stu_http_upstream_ident_cleanup;
 
-	if (stu_upstream_init(c) == STU_ERROR) {
+	if (stu_http_upstream_ident_init(c) == STU_ERROR) {
 		stu_log_error(0, "Failed to init upstream.");
 		stu_http_finalize_request(r, STU_HTTP_INTERNAL_SERVER_ERROR);
 		goto failed;
@@ -249,7 +311,7 @@ preview:
 	cid.len = r->target.len;
 
 	// reset user ID
-	s = stu_sprintf(buf, "%ld", stu_preview_auto_id++);
+	s = stu_snprintf(buf, STU_USER_ID_MAX_LEN - 1, "%i", stu_preview_auto_id++);
 	*s = '\0';
 
 	c->user.id.len = s - buf;
@@ -318,7 +380,8 @@ preview:
 
 	// finalize request
 	protocol = r->headers_out.sec_websocket_protocol;
-	if (protocol && stu_strncmp("binary", protocol->value.data, protocol->value.len) == 0) {
+	if (c->protocol == STU_PROTOCOL_TLV
+			|| (protocol && stu_strncmp("binary", protocol->value.data, protocol->value.len) == 0)) {
 		opcode = STU_WEBSOCKET_OPCODE_BINARY;
 	} else {
 		opcode = STU_WEBSOCKET_OPCODE_TEXT;
@@ -326,14 +389,36 @@ preview:
 
 	stu_http_finalize_request(r, STU_HTTP_SWITCHING_PROTOCOLS);
 
-	p = stu_sprintf(
-			(u_char *) temp + 10, (const char *) STU_HTTP_UPSTREAM_IDENT_RESPONSE.data,
-			c->user.id.data, c->user.name.data, c->user.icon.data, c->user.role,
-			ch->id.data, ch->state, ch->userlist.length
+	// closed already, if failed to switch
+	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID) {
+		return;
+	}
+
+	p = stu_slprintf(
+			temp + 10, temp + STU_HTTP_REQUEST_DEFAULT_SIZE - 1, (const char *) STU_HTTP_UPSTREAM_IDENT_RESPONSE.data,
+			&c->user.id, &c->user.name, &c->user.icon, (int) c->user.role,
+			&ch->id, (int) ch->state, ch->userlist.length
 		);
 	*p = '\0';
 
 	size = p - temp - 10;
+
+	// no tree here to encode from
+	if (c->protocol == STU_PROTOCOL_TLV) {
+		idt = stu_json_parse(temp + 10, size);
+		if (idt == NULL) {
+			goto failed;
+		}
+
+		size = stu_protocol_encode(idt, temp + 10, STU_HTTP_REQUEST_DEFAULT_SIZE - 10);
+		stu_json_delete(idt);
+
+		if (size > STU_HTTP_REQUEST_DEFAULT_SIZE - 10) {
+			stu_log_error(0, "Ident tlv frame too large: fd=%d, size=%ld.", c->fd, size);
+			goto failed;
+		}
+	}
+
 	p = stu_websocket_encode_frame(opcode, temp, size, &extened);
 
 	n = send(c->fd, p, size + 2 + extened, 0);
@@ -348,6 +433,11 @@ preview:
 
 failed:
 
+	// closed already, if failed to send the response
+	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID) {
+		return;
+	}
+
 	c->read.active = 0;
 	stu_event_del(&c->read, STU_READ_EVENT, 0);
 
@@ -358,7 +448,6 @@ failed:
 static stu_int_t
 stu_http_process_request_headers(stu_http_request_t *r) {
 	stu_int_t          rc;
-	stu_uint_t         hk;
 	stu_table_elt_t   *h;
 	stu_http_header_t *hh;
 
@@ -377,11 +466,13 @@ stu_http_process_request_headers(stu_http_request_t *r) {
 			}
 
 			/* a header line has been parsed successfully */
-			h = stu_calloc(sizeof(stu_table_elt_t));
-			if (h == NULL) {
-				return STU_HTTP_INTERNAL_SERVER_ERROR;
+			if (r->headers_in.nheaders == STU_HTTP_HEADERS_IN_MAX_N) {
+				stu_log_error(0, "client sent too many header lines: n=%d.", r->headers_in.nheaders);
+				return STU_HTTP_BAD_REQUEST;
 			}
 
+			h = &r->headers_in.headers[r->headers_in.nheaders++];
+
 			h->hash = r->header_hash;
 
 			h->key.len = r->header_name_end - r->header_name_start;
@@ -392,24 +483,16 @@ stu_http_process_request_headers(stu_http_request_t *r) {
 			h->value.data = r->header_start;
 			h->value.data[h->value.len] = '\0';
 
-			h->lowcase_key = stu_calloc(h->key.len + 1);
-			if (h->lowcase_key == NULL) {
-				return STU_HTTP_INTERNAL_SERVER_ERROR;
-			}
+			// only valid until the next line is parsed
+			h->lowcase_key = NULL;
 
-			if (h->key.len == r->lowcase_index) {
-				memcpy(h->lowcase_key, r->lowcase_header, h->key.len);
-			} else {
-				stu_strlow(h->lowcase_key, h->key.data, h->key.len);
+			// longer names wrapped in lowcase_header, and are none of ours
+			if (h->key.len != r->lowcase_index) {
+				continue;
 			}
-			h->lowcase_key[h->key.len] = '\0';
+			r->lowcase_header[h->key.len] = '\0';
 
-			if (stu_list_push(&r->headers_in.headers, h, sizeof(stu_table_elt_t)) == STU_ERROR) {
-				return STU_HTTP_INTERNAL_SERVER_ERROR;
-			}
-
-			hk = stu_hash_key(h->lowcase_key, h->key.len);
-			hh = stu_hash_find_locked(&stu_http_headers_in_hash, hk, h->lowcase_key, h->key.len);
+			hh = stu_http_header_phash_find(&stu_http_headers_in_phash, h->hash, r->lowcase_header, h->key.len);
 			if (hh) {
 				rc = hh->handler(r, h, hh->offset);
 				if (rc != STU_OK) {
@@ -471,147 +554,32 @@ stu_http_process_content_length(stu_http_request_t *r, stu_table_elt_t *h, stu_u
 	return stu_http_process_header_line(r, h, offset);
 }
 
+/* the accept value is computed on the stack while the 101 is written. */
 static stu_int_t
 stu_http_process_sec_websocket_key(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset) {
-	stu_table_elt_t *e;
-	stu_sha1_t       sha1;
-	stu_str_t        sha1_signed;
-
-	stu_http_process_unique_header_line(r, h, offset);
-
-	e = stu_calloc(sizeof(stu_table_elt_t));
-	if (e == NULL) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
-	}
-
-	e->key.data = STU_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT.data;
-	e->key.len = STU_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT.len;
-
-	sha1_signed.len = SHA_DIGEST_LENGTH;
-	sha1_signed.data = stu_calloc(sha1_signed.len + 1);
-
-	e->value.len = stu_base64_encoded_length(SHA_DIGEST_LENGTH);
-	e->value.data = stu_calloc(e->value.len + 1);
-
-	if (sha1_signed.data == NULL || e->value.data == NULL) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
-	}
-
-	stu_sha1_init(&sha1);
-	stu_sha1_update(&sha1, h->value.data, h->value.len);
-	stu_sha1_update(&sha1, STU_HTTP_WEBSOCKET_SIGN_KEY.data, STU_HTTP_WEBSOCKET_SIGN_KEY.len);
-	stu_sha1_final(sha1_signed.data, &sha1);
-
-	stu_base64_encode(&e->value, &sha1_signed);
-
-	r->headers_out.sec_websocket_accept = e;
-
-	if (stu_list_push(&r->headers_out.headers, h, sizeof(stu_table_elt_t)) == STU_ERROR) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
-	}
-
-	return STU_OK;
+	return stu_http_process_unique_header_line(r, h, offset);
 }
 
 static stu_int_t
 stu_http_process_sec_websocket_key_for_safari(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset) {
-	stu_table_elt_t *e, *h1, *h2;
-	stu_md5_t        md5;
-	stu_str_t        md5_signed;
-	u_char           s1[16], s2[16], key[16], *c, *s;
-	stu_int_t        index, n, k1, k2;
-
-	stu_http_process_unique_header_line(r, h, offset);
-
-	if (r->headers_in.sec_websocket_key1 == NULL || r->headers_in.sec_websocket_key2 == NULL) {
-		return STU_AGAIN;
-	}
-
-	e = stu_calloc(sizeof(stu_table_elt_t));
-	if (e == NULL) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
-	}
-
-	h1 = r->headers_in.sec_websocket_key1;
-	h2 = r->headers_in.sec_websocket_key2;
-	stu_memzero(s1, 16);
-	stu_memzero(s2, 16);
-
-	for (index = 0, c = h1->value.data, s = s1, n = 0; index < h1->value.len; index++, c++) {
-		if (*c >= '0' && *c <= '9') {
-			*s++ = *c;
-		} else if (*c == ' ') {
-			n++;
-		}
-	}
-	k1 = atoi((const char *) s1) / n;
-
-	for (index = 0, c = h2->value.data, s = s2, n = 0; index < h2->value.len; index++, c++) {
-		if (*c >= '0' && *c <= '9') {
-			*s++ = *c;
-		} else if (*c == ' ') {
-			n++;
-		}
-	}
-	k2 = atoi((const char *) s2) / n;
-
-	key[0] = k1 >> 24;
-	key[1] = k1 >> 16;
-	key[2] = k1 >> 8;
-	key[3] = k1;
-	key[4] = k2 >> 24;
-	key[5] = k2 >> 16;
-	key[6] = k2 >> 8;
-	key[7] = k2;
-
-	e->key.data = STU_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT.data;
-	e->key.len = STU_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT.len;
-
-	md5_signed.len = 16;
-	md5_signed.data = stu_calloc(md5_signed.len + 1);
-
-	e->value.len = 16;
-	e->value.data = stu_calloc(e->value.len + 1);
-
-	if (md5_signed.data == NULL || e->value.data == NULL) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
-	}
-
-	stu_md5_init(&md5);
-	stu_md5_update(&md5, key, 16);
-	stu_md5_final(md5_signed.data, &md5);
-
-	r->headers_out.sec_websocket_accept = e;
-
-	if (stu_list_push(&r->headers_out.headers, e, sizeof(stu_table_elt_t)) == STU_ERROR) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
-	}
-
-	return STU_OK;
+	return stu_http_process_unique_header_line(r, h, offset);
 }
 
 static stu_int_t
 stu_http_process_sec_websocket_protocol(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset) {
-	stu_table_elt_t *e;
+	stu_int_t  rc;
 
-	stu_http_process_unique_header_line(r, h, offset);
+	rc = stu_http_process_unique_header_line(r, h, offset);
+	if (rc == STU_OK) {
+		r->headers_out.sec_websocket_protocol = h;
 
-	e = stu_calloc(sizeof(stu_table_elt_t));
-	if (e == NULL) {
-		return STU_HTTP_INTERNAL_SERVER_ERROR;
+		if (h->value.len == STU_PROTOCOL_SUBPROTOCOL_TLV.len
+				&& stu_strncmp(h->value.data, STU_PROTOCOL_SUBPROTOCOL_TLV.data, h->value.len) == 0) {
+			r->connection->protocol = STU_PROTOCOL_TLV;
+		}
 	}
 
-	e->key.data = STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL.data;
-	e->key.len = STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL.len;
-
-	e->value.data = stu_calloc(h->value.len + 1);
-	e->value.len = h->value.len;
-
-	memcpy(e->value.data, h->value.data, h->value.len);
-
-	r->headers_out.sec_websocket_protocol = e;
-
-	return STU_OK;
+	return rc;
 }
 
 static stu_int_t
@@ -663,11 +631,10 @@ static void
 stu_http_request_handler(stu_event_t *wev) {
 	stu_http_request_t *r;
 	stu_connection_t   *c;
-	stu_channel_t      *ch;
-	stu_buf_t          *buf;
-	stu_table_elt_t    *accept;
 	stu_table_elt_t    *protocol;
-	stu_int_t           n;
+	stu_str_t          *status_line;
+	stu_int_t           n, status;
+	u_char             *p, temp[STU_HTTP_REQUEST_DEFAULT_SIZE];
 
 	c = (stu_connection_t *) wev->data;
 
@@ -678,48 +645,67 @@ stu_http_request_handler(stu_event_t *wev) {
 
 	stu_event_del(&c->write, STU_WRITE_EVENT, 0);
 
-	buf = &c->buffer;
-	buf->last = buf->start;
-	stu_memzero(buf->start, buf->end - buf->start);
-
 	r = (stu_http_request_t *) c->data;
-	accept = r->headers_out.sec_websocket_accept;
 	protocol = r->headers_out.sec_websocket_protocol;
 
 	if (r->headers_out.status == STU_HTTP_SWITCHING_PROTOCOLS) {
-		buf->last = stu_sprintf(buf->last, "HTTP/1.1 101 Switching Protocols" CRLF);
-		buf->last = stu_sprintf(buf->last, "Server: " __NAME "/" __VERSION CRLF);
-		buf->last = stu_sprintf(buf->last, "Upgrade: websocket" CRLF);
-		buf->last = stu_sprintf(buf->last, "Connection: upgrade" CRLF);
-		buf->last = stu_strncpy(buf->last, accept->key.data, accept->key.len);
-		buf->last = stu_sprintf(buf->last, ": ");
-		buf->last = stu_strncpy(buf->last, accept->value.data, accept->value.len);
-		buf->last = stu_sprintf(buf->last, CRLF);
+		// the request headers still slice c->buffer, so write on the stack
+		if (protocol && protocol->value.len > STU_HTTP_REQUEST_DEFAULT_SIZE - STU_HTTP_SWITCHING_PROTOCOLS_HEAD.len
+				- STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL.len - stu_base64_encoded_length(SHA_DIGEST_LENGTH) - 6) {
+			stu_log_error(0, "Sec-WebSocket-Protocol too long: fd=%d, len=%d.", c->fd, protocol->value.len);
+			goto failed;
+		}
+
+		p = stu_memcpy(temp, STU_HTTP_SWITCHING_PROTOCOLS_HEAD.data, STU_HTTP_SWITCHING_PROTOCOLS_HEAD.len);
+
+		p = stu_http_websocket_accept(r, p);
+		if (p == NULL) {
+			stu_log_error(0, "Failed to compute Sec-WebSocket-Accept: fd=%d.", c->fd);
+			goto failed;
+		}
+		*p++ = CR; *p++ = LF;
+
 		if (protocol) {
-			buf->last = stu_strncpy(buf->last, protocol->key.data, protocol->key.len);
-			buf->last = stu_sprintf(buf->last, ": ");
-			buf->last = stu_strncpy(buf->last, protocol->value.data, protocol->value.len);
-			buf->last = stu_sprintf(buf->last, CRLF);
+			p = stu_memcpy(p, STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL.data, STU_HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL.len);
+			p = stu_memcpy(p, protocol->value.data, protocol->value.len);
+			*p++ = CR; *p++ = LF;
 		}
-		buf->last = stu_sprintf(buf->last, CRLF);
+
+		*p++ = CR; *p++ = LF;
 	} else {
-		buf->last = stu_sprintf(buf->last, "HTTP/1.1 400 Bad Request" CRLF);
-		buf->last = stu_sprintf(buf->last, "Server: " __NAME "/" __VERSION CRLF);
-		buf->last = stu_sprintf(buf->last, "Content-type: text/html" CRLF);
-		buf->last = stu_sprintf(buf->last, "Content-length: %d" CRLF, stu_strlen(__NAME "/" __VERSION "\n"));
-		buf->last = stu_sprintf(buf->last, "Connection: close" CRLF CRLF);
-		buf->last = stu_sprintf(buf->last, __NAME "/" __VERSION "\n");
+		status = r->headers_out.status;
+
+		if (status >= STU_HTTP_INTERNAL_SERVER_ERROR && status < STU_HTTP_LAST_5XX) {
+			status_line = &stu_http_status_lines[status - STU_HTTP_INTERNAL_SERVER_ERROR + STU_HTTP_OFF_5XX];
+		} else if (status >= STU_HTTP_BAD_REQUEST && status < STU_HTTP_LAST_4XX && stu_http_status_lines[status - STU_HTTP_BAD_REQUEST].len) {
+			status_line = &stu_http_status_lines[status - STU_HTTP_BAD_REQUEST];
+		} else {
+			status_line = &stu_http_status_lines[0];
+		}
+
+		p = stu_slprintf(temp, temp + STU_HTTP_REQUEST_DEFAULT_SIZE,
+				"HTTP/1.1 %V" CRLF
+				"Server: " __NAME "/" __VERSION CRLF
+				"Content-type: text/html" CRLF
+				"Content-length: %uz" CRLF
+				"Connection: close" CRLF CRLF
+				__NAME "/" __VERSION "\n",
+				status_line, sizeof(__NAME "/" __VERSION "\n") - 1);
 	}
 
-	n = send(c->fd, buf->start, buf->last - buf->start, 0);
+	n = send(c->fd, temp, p - temp, 0);
 	if (n == -1) {
 		stu_log_error(stu_errno, "Failed to send data: fd=%d.", c->fd);
 		goto failed;
 	}
 
-	stu_log_debug(4, "sent: fd=%d, bytes=%d.", c->fd, n); // str=\n%s, buf->start
+	stu_log_debug(4, "sent: fd=%d, bytes=%d.", c->fd, n); // str=\n%s, temp
+
+	stu_metrics_add(STU_METRIC_BYTES_OUT, n);
 
 	if (r->headers_out.status == STU_HTTP_SWITCHING_PROTOCOLS) {
+		stu_metrics_observe(STU_METRIC_HANDSHAKE_USEC, stu_metrics_usec() - r->start);
+
 		if (stu_http_switch_protocol(r) == STU_ERROR) {
 			stu_log_error(0, "Failed to switch protocol: fd=%d.", c->fd);
 			goto failed;
@@ -733,11 +719,6 @@ failed:
 	c->read.active = 0;
 	stu_event_del(&c->read, STU_READ_EVENT, 0);
 
-	ch = c->user.channel;
-	if (ch) {
-		stu_channel_remove(ch, c);
-	}
-
 	stu_http_close_connection(c);
 
 //done:
@@ -751,8 +732,12 @@ stu_http_switch_protocol(stu_http_request_t *r) {
 
 	c = r->connection;
 
-	c->buffer.start = c->buffer.last =c->buffer.end = NULL;
+	// hand the receive buffer over to websocket, both are of the same size
+	c->buffer.last = c->buffer.end = c->buffer.start;
+	stu_memzero(c->buffer.start, STU_HTTP_REQUEST_DEFAULT_SIZE);
+
 	c->data = NULL;
+	stu_free(r);
 
 	c->read.handler = stu_websocket_wait_request_handler;
 	c->write.handler = stu_websocket_request_handler;
@@ -760,6 +745,71 @@ stu_http_switch_protocol(stu_http_request_t *r) {
 	return STU_OK;
 }
 
+/*
+ * RFC 6455 takes base64(SHA-1(key + GUID)), and the old draft 76 takes
+ * MD5 of both keys. Returns the end of the value written to dst.
+ */
+static u_char *
+stu_http_websocket_accept(stu_http_request_t *r, u_char *dst) {
+	stu_table_elt_t *h;
+	stu_sha1_t       sha1;
+	stu_md5_t        md5;
+	stu_str_t        digest, value;
+	u_char           md[SHA_DIGEST_LENGTH], key[16], *c;
+	stu_uint_t       i, k, n, index;
+	uint64_t         num;
+
+	h = r->headers_in.sec_websocket_key;
+	if (h) {
+		stu_sha1_init(&sha1);
+		stu_sha1_update(&sha1, h->value.data, h->value.len);
+		stu_sha1_update(&sha1, STU_HTTP_WEBSOCKET_SIGN_KEY.data, STU_HTTP_WEBSOCKET_SIGN_KEY.len);
+		stu_sha1_final(md, &sha1);
+
+		digest.data = md;
+		digest.len = SHA_DIGEST_LENGTH;
+
+		value.data = dst;
+		stu_base64_encode(&value, &digest);
+
+		return dst + value.len;
+	}
+
+	if (r->headers_in.sec_websocket_key1 == NULL || r->headers_in.sec_websocket_key2 == NULL) {
+		return NULL;
+	}
+
+	stu_memzero(key, 16);
+
+	for (k = 0; k < 2; k++) {
+		h = k ? r->headers_in.sec_websocket_key2 : r->headers_in.sec_websocket_key1;
+
+		for (index = 0, c = h->value.data, num = 0, n = 0; index < h->value.len; index++, c++) {
+			if (*c >= '0' && *c <= '9') {
+				num = num * 10 + *c - '0';
+			} else if (*c == ' ') {
+				n++;
+			}
+		}
+
+		if (n == 0) {
+			return NULL;
+		}
+
+		num /= n;
+
+		for (i = 0; i < 4; i++) {
+			key[k * 4 + i] = num >> (24 - i * 8);
+		}
+	}
+
+	stu_md5_init(&md5);
+	stu_md5_update(&md5, key, 16);
+	stu_md5_final(dst, &md5);
+
+	return dst + 16;
+}
+
 
 void
 stu_http_close_request(stu_http_request_t *r, stu_int_t rc) {
@@ -778,6 +828,18 @@ stu_http_free_request(stu_http_request_t *r, stu_int_t rc) {
 
 void
 stu_http_close_connection(stu_connection_t *c) {
+	stu_channel_t *ch;
+
+	if (c->fd != (stu_socket_t) STU_SOCKET_INVALID) {
+		stu_metrics_dec(STU_METRIC_CONNECTIONS);
+	}
+
+	// on any path, as a released connection must not be left in the userlist
+	ch = c->user.channel;
+	if (ch) {
+		stu_channel_remove(ch, c);
+	}
+
 	stu_connection_close(c);
 }
 
@@ -13,6 +13,9 @@
 
 #define STU_HTTP_REQUEST_DEFAULT_SIZE      1024
 #define STU_HTTP_LC_HEADER_LEN             32
+#define STU_HTTP_HEADERS_IN_MAX_N          32
+#define STU_HTTP_HEADERS_OUT_MAX_N         32
+#define STU_HTTP_CHUNK_MAXIMUM             0x7fffffff
 
 #define STU_HTTP_VERSION_10                10
 #define STU_HTTP_VERSION_11                11
@@ -57,7 +60,20 @@ typedef struct {
 } stu_http_header_out_t;
 
 typedef struct {
-	stu_list_t       headers;
+	stu_http_header_t          *header;
+	stu_uint_t                  hash;
+	u_char                      lowcase[STU_HTTP_LC_HEADER_LEN];
+} stu_http_header_phash_elt_t;
+
+/* read only once built, so looked up without any lock */
+typedef struct {
+	stu_http_header_phash_elt_t *elts;
+	stu_uint_t                   size;
+} stu_http_header_phash_t;
+
+typedef struct {
+	stu_table_elt_t  headers[STU_HTTP_HEADERS_IN_MAX_N]; // slices of header_in
+	stu_uint_t       nheaders;
 
 	stu_table_elt_t *host;
 	stu_table_elt_t *user_agent;
@@ -87,7 +103,8 @@ typedef struct {
 } stu_http_headers_in_t;
 
 typedef struct {
-	stu_list_t       headers;
+	stu_table_elt_t  headers[STU_HTTP_HEADERS_OUT_MAX_N]; // slices of an upstream response
+	stu_uint_t       nheaders;
 
 	stu_uint_t       status;
 	stu_str_t        status_line;
@@ -98,20 +115,27 @@ typedef struct {
 	stu_table_elt_t *content_length;
 	stu_table_elt_t *content_encoding;
 
-	stu_table_elt_t *sec_websocket_accept;
 	stu_table_elt_t *sec_websocket_protocol;
 	stu_table_elt_t *sec_websocket_extensions;
 	stu_table_elt_t *upgrade;
 
 	stu_table_elt_t *connection;
+	stu_table_elt_t *transfer_encoding;
 	stu_table_elt_t *date;
 
 	stu_int_t        content_length_n;
 	uint8_t          connection_type;
+	stu_bool_t       chunked;
 } stu_http_headers_out_t;
 
+typedef struct {
+	stu_uint_t       state;
+	stu_int_t        size;
+} stu_http_chunked_t;
+
 struct stu_http_request_s {
 	stu_connection_t       *connection;
+	uint64_t                start;      // usec
 
 	stu_short_t             method;
 	uint8_t                 http_version;
@@ -140,6 +164,12 @@ struct stu_http_request_s {
 	u_char                 *header_name_end;
 	u_char                 *header_start;
 	u_char                 *header_end;
+
+	// used for reading response.
+	uint8_t                 response_state;
+	stu_http_chunked_t      chunked;
+	u_char                 *body_pos;   // raw body received, but not decoded yet
+	u_char                 *body_last;
 };
 
 void stu_http_wait_request_handler(stu_event_t *rev);
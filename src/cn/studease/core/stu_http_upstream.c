@@ -5,22 +5,37 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_UPSTREAM
+
 #include "stu_config.h"
 #include "stu_core.h"
 
-static stu_int_t stu_http_upstream_process_response_headers(stu_http_request_t *r);
+extern stu_cycle_t *stu_cycle;
+
+static stu_int_t stu_http_upstream_timeout(stu_event_t *ev);
+static void      stu_http_upstream_next(stu_connection_t *c, stu_int_t rc);
+
+static u_char   *stu_http_upstream_reserve_buffer(stu_connection_t *pc, size_t *size);
+static stu_int_t stu_http_upstream_grow_body(stu_http_request_t *r);
+static void      stu_http_upstream_free_response(stu_connection_t *pc);
+static stu_int_t stu_http_upstream_process_input(stu_connection_t *pc, size_t n);
+static u_char   *stu_http_upstream_find_header_end(u_char *p, u_char *last);
+static stu_int_t stu_http_upstream_process_response_headers(stu_http_request_t *r, u_char *end);
+static stu_int_t stu_http_upstream_process_body(stu_http_request_t *r);
 
 static stu_int_t stu_http_upstream_process_content_length(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset);
+static stu_int_t stu_http_upstream_process_transfer_encoding(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset);
 static stu_int_t stu_http_upstream_process_connection(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset);
 static stu_int_t stu_http_upstream_process_header_line(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset);
 static stu_int_t stu_http_upstream_process_unique_header_line(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset);
 
-stu_hash_t         stu_http_upstream_headers_in_hash;
-stu_http_header_t  stu_http_upstream_headers_in[] = {
+stu_http_header_phash_t  stu_http_upstream_headers_in_phash;
+stu_http_header_t        stu_http_upstream_headers_in[] = {
 	{ stu_string("Server"), offsetof(stu_http_headers_out_t, server), stu_http_upstream_process_unique_header_line },
 
 	{ stu_string("Content-Length"), offsetof(stu_http_headers_out_t, content_length), stu_http_upstream_process_content_length },
 	{ stu_string("Content-Type"), offsetof(stu_http_headers_out_t, content_type), stu_http_upstream_process_header_line },
+	{ stu_string("Transfer-Encoding"), offsetof(stu_http_headers_out_t, transfer_encoding), stu_http_upstream_process_transfer_encoding },
 #if (STU_HTTP_GZIP)
 	{ stu_string("Content-Encoding"), offsetof(stu_http_headers_out_t, content_encoding), stu_http_upstream_process_header_line },
 #endif
@@ -67,6 +82,8 @@ stu_http_upstream_reinit_request(stu_connection_t *c) {
 	pr = (stu_http_request_t *) pc->data;
 	pr->state = 0;
 
+	stu_http_upstream_free_response(pc);
+
 	return STU_OK;
 }
 
@@ -77,7 +94,6 @@ stu_http_upstream_generate_request(stu_connection_t *c) {
 	stu_http_request_t *r, *pr;
 	stu_conf_bitmask_t *method;
 	stu_str_t          *method_name;
-	u_char             *p;
 	size_t              size;
 
 	r = (stu_http_request_t *) c->data;
@@ -98,33 +114,50 @@ stu_http_upstream_generate_request(stu_connection_t *c) {
 		return STU_ERROR;
 	}
 
-	if (pc->buffer.start == NULL) {
-		pc->buffer.start = (u_char *) stu_calloc(STU_HTTP_REQUEST_DEFAULT_SIZE);
-		pc->buffer.end = pc->buffer.start + STU_HTTP_REQUEST_DEFAULT_SIZE;
-	}
-
-	p = stu_sprintf(pc->buffer.start, "%s %s%s HTTP/1.1" CRLF,
-			method_name->data,
-			u->server->target.data,
-			u->server->method == STU_HTTP_GET ? (const char *) pr->request_body.start : "");
-	p = stu_sprintf(p, "Host: ");
-	p = stu_strncpy(p, r->headers_in.host->value.data, r->headers_in.host->value.len);
-	p = stu_sprintf(p, CRLF);
-	p = stu_sprintf(p, "User-Agent: " __NAME "/" __VERSION CRLF);
-	p = stu_sprintf(p, "Accept: application/json" CRLF);
-	p = stu_sprintf(p, "Accept-Charset: utf-8" CRLF);
-	p = stu_sprintf(p, "Accept-Language: zh-CN,zh;q=0.8" CRLF);
-	p = stu_sprintf(p, "Connection: keep-alive" CRLF);
-	if (u->server->method == STU_HTTP_POST && pr->request_body.start && (size = pr->request_body.last - pr->request_body.start)) {
-		p = stu_sprintf(p, "Content-Type: application/json" CRLF);
-		p = stu_sprintf(p, "Content-Length: %ld" CRLF CRLF, size);
-		p = stu_strncpy(p, pr->request_body.start, size);
+	size = 0;
+	if (pr->request_body.start) {
+		size = pr->request_body.last - pr->request_body.start;
+	}
+
+	// the body may have outgrown the default size, so leave that for the head
+	if (pc->buffer.start == NULL || (size_t) (pc->buffer.end - pc->buffer.start) < STU_HTTP_REQUEST_DEFAULT_SIZE + size) {
+		if (pc->buffer.start) {
+			stu_free(pc->buffer.start);
+		}
+
+		pc->buffer.start = (u_char *) stu_calloc(STU_HTTP_REQUEST_DEFAULT_SIZE + size);
+		if (pc->buffer.start == NULL) {
+			stu_log_error(0, "Failed to palloc() upstream buffer: fd=%d, size=%lu.", c->fd, STU_HTTP_REQUEST_DEFAULT_SIZE + size);
+			pc->buffer.end = NULL;
+			return STU_ERROR;
+		}
+
+		pc->buffer.end = pc->buffer.start + STU_HTTP_REQUEST_DEFAULT_SIZE + size;
+	}
+
+	// the args of a GET, or the body of a POST
+	pc->buffer.last = pc->buffer.start;
+	stu_buf_printf(&pc->buffer, "%V %s%*s HTTP/1.1" CRLF "Host: %V" CRLF
+			"User-Agent: " __NAME "/" __VERSION CRLF
+			"Accept: application/json" CRLF
+			"Accept-Charset: utf-8" CRLF
+			"Accept-Language: zh-CN,zh;q=0.8" CRLF
+			"Connection: keep-alive" CRLF,
+			method_name, u->server->target.data,
+			u->server->method == STU_HTTP_GET ? size : 0, pr->request_body.start,
+			&r->headers_in.host->value);
+	if (u->server->method == STU_HTTP_POST && size) {
+		stu_buf_printf(&pc->buffer, "Content-Type: application/json" CRLF "Content-Length: %uz" CRLF CRLF "%*s",
+				size, size, pr->request_body.start);
 	} else {
-		p = stu_sprintf(p, CRLF);
+		stu_buf_printf(&pc->buffer, CRLF);
 	}
-	*p = '\0';
 
-	pc->buffer.last = p;
+	if (pc->buffer.last == pc->buffer.end) {
+		stu_log_error(0, "Upstream request too large: fd=%d.", c->fd);
+		return STU_ERROR;
+	}
+	*pc->buffer.last = '\0';
 
 	return STU_OK;
 }
@@ -132,52 +165,100 @@ stu_http_upstream_generate_request(stu_connection_t *c) {
 
 void
 stu_http_upstream_read_handler(stu_event_t *ev) {
-	stu_connection_t *c, *pc;
-	stu_upstream_t   *u;
-	stu_int_t         n, err;
+	stu_connection_t   *c, *pc;
+	stu_upstream_t     *u;
+	stu_http_request_t *pr;
+	u_char             *p;
+	size_t              size;
+	stu_uint_t          generation;
+	stu_int_t           n, err, rc;
+	uint64_t            latency;
+
+	if (ev->timedout && stu_http_upstream_timeout(ev) == STU_OK) {
+		return;
+	}
 
 	c = (stu_connection_t *) ev->data;
-	u = c->upstream;
-	pc = u->peer.connection;
+	generation = c->generation;
 
 	stu_mutex_lock(&c->lock);
 
+	if (c->generation != generation || c->upstream == NULL) {
+		goto done;
+	}
+
+	u = c->upstream;
+	pc = u->peer.connection;
+
 	if (pc == NULL || pc->fd == (stu_socket_t) STU_SOCKET_INVALID) {
 		goto done;
 	}
 
-	if (pc->buffer.start == NULL) {
-		pc->buffer.start = (u_char *) stu_calloc(STU_HTTP_REQUEST_DEFAULT_SIZE);
-		pc->buffer.end = pc->buffer.start + STU_HTTP_REQUEST_DEFAULT_SIZE;
+	pr = (stu_http_request_t *) pc->data;
+	if (pr->response_state == STU_HTTP_UPSTREAM_READ_DONE) {
+		goto done;
 	}
-	pc->buffer.last = pc->buffer.start;
-	stu_memzero(pc->buffer.start, STU_HTTP_REQUEST_DEFAULT_SIZE);
+
+	/* edge triggered, so read until EAGAIN or the whole response is received. */
+	for ( ;; ) {
+		p = stu_http_upstream_reserve_buffer(pc, &size);
+		if (p == NULL) {
+			goto failed;
+		}
 
 again:
 
-	n = recv(pc->fd, pc->buffer.start, STU_HTTP_REQUEST_DEFAULT_SIZE, 0);
-	if (n == -1) {
-		err = stu_errno;
-		if (err == EAGAIN) {
-			stu_log_debug(4, "Already received by other threads: fd=%d, errno=%d.", pc->fd, err);
-			goto done;
+		n = recv(pc->fd, p, size, 0);
+		if (n == -1) {
+			err = stu_errno;
+			if (err == EAGAIN) {
+				// the read timer armed after sending is the deadline of the response
+				stu_log_debug(4, "upstream response not complete: fd=%d.", pc->fd);
+				goto done;
+			}
+
+			if (err == EINTR) {
+				stu_log_debug(4, "recv trying again: fd=%d, errno=%d.", pc->fd, err);
+				goto again;
+			}
+
+			stu_log_error(err, "Failed to recv data: fd=%d.", pc->fd);
+			goto failed;
 		}
 
-		if (err == EINTR) {
-			stu_log_debug(4, "recv trying again: fd=%d, errno=%d.", pc->fd, err);
-			goto again;
+		if (n == 0) {
+			if (pr->response_state == STU_HTTP_UPSTREAM_READ_CLOSE) {
+				pr->response_state = STU_HTTP_UPSTREAM_READ_DONE;
+				*pr->response_body.last = '\0';
+				break;
+			}
+
+			stu_log_error(0, "upstream %s prematurely closed connection: fd=%d.", u->server->name.data, pc->fd);
+			goto failed;
 		}
 
-		stu_log_error(err, "Failed to recv data: fd=%d.", pc->fd);
-		goto failed;
+		stu_log_debug(4, "upstream %s recv: fd=%d, bytes=%d.", u->server->name.data, pc->fd, n);
+
+		rc = stu_http_upstream_process_input(pc, n);
+		if (rc == STU_ERROR) {
+			goto failed;
+		}
+
+		if (rc == STU_OK) {
+			break;
+		}
 	}
 
-	if (n == 0) {
-		stu_log_debug(4, "Remote upstream peer has closed connection: fd=%d.", pc->fd);
-		goto failed;
+	stu_log_debug(4, "upstream %s response received: fd=%d, status=%lu, body=%ld.",
+			u->server->name.data, pc->fd, pr->headers_out.status, pr->response_body.last - pr->response_body.start);
+
+	if (pc->read.timer_set) {
+		stu_timer_del(&pc->read);
 	}
 
-	stu_log_debug(4, "upstream %s recv: fd=%d, bytes=%d.", u->server->name.data, pc->fd, n);//str=\n%s, c->buffer.start
+	latency = stu_metrics_usec() - u->start;
+	stu_metrics_observe(STU_METRIC_UPSTREAM_USEC, latency);
+	stu_metrics_observe(u->server->metric, latency);
 
 	u->peer.state = STU_UPSTREAM_PEER_LOADED;
 	u->process_response_pt(c);
@@ -188,7 +269,7 @@ again:
 
 failed:
 
-	u->cleanup_pt(c);
+	stu_http_upstream_next(c, STU_HTTP_BAD_GATEWAY);
 
 done:
 
@@ -197,20 +278,11 @@ done:
 
 stu_int_t
 stu_http_upstream_process_response(stu_connection_t *c) {
-	stu_http_request_t *pr;
-	stu_upstream_t     *u;
-	stu_int_t           rc;
+	stu_upstream_t *u;
 
 	u = c->upstream;
-	pr = (stu_http_request_t *) u->peer.connection->data;
-
-	rc = stu_http_upstream_process_response_headers(pr);
-	if (rc != STU_OK) {
-		stu_log_error(0, "Failed to process upstream ident response headers.");
-		u->finalize_handler_pt(c, STU_HTTP_BAD_GATEWAY);
-		return STU_ERROR;
-	}
 
+	/* headers & body have been read by stu_http_upstream_read_handler(). */
 	if (u->analyze_response_pt(c) == STU_ERROR) {
 		//stu_log_error(0, "Failed to analyze upstream ident response.");
 		u->finalize_handler_pt(c, STU_HTTP_INTERNAL_SERVER_ERROR);
@@ -220,20 +292,253 @@ stu_http_upstream_process_response(stu_connection_t *c) {
 	return STU_OK;
 }
 
+static u_char *
+stu_http_upstream_reserve_buffer(stu_connection_t *pc, size_t *size) {
+	stu_http_request_t *pr;
+	stu_buf_t          *b;
+	u_char             *p;
+	size_t              n;
+
+	pr = (stu_http_request_t *) pc->data;
+
+	switch (pr->response_state) {
+	case STU_HTTP_UPSTREAM_READ_HEADER:
+		b = &pc->buffer;
+
+		if (b->start == NULL) {
+			b->start = (u_char *) stu_calloc(STU_HTTP_REQUEST_DEFAULT_SIZE);
+			if (b->start == NULL) {
+				stu_log_error(0, "Failed to calloc() upstream header buffer: fd=%d.", pc->fd);
+				return NULL;
+			}
+
+			b->last = b->start;
+			b->end = b->start + STU_HTTP_REQUEST_DEFAULT_SIZE;
+		}
+
+		// nothing parsed yet, so the header buffer could be moved.
+		if (b->last == b->end) {
+			n = b->end - b->start;
+			if (n >= STU_HTTP_UPSTREAM_HEADER_MAXIMUM) {
+				stu_log_error(0, "upstream sent too big header: fd=%d, size=%lu.", pc->fd, n);
+				return NULL;
+			}
+
+			p = (u_char *) stu_calloc(n * 2);
+			if (p == NULL) {
+				stu_log_error(0, "Failed to calloc() upstream header buffer: fd=%d, size=%lu.", pc->fd, n * 2);
+				return NULL;
+			}
+
+			memcpy(p, b->start, n);
+			stu_free(b->start);
+
+			b->start = p;
+			b->last = p + n;
+			b->end = p + n * 2;
+		}
+
+		*size = b->end - b->last;
+		return b->last;
+
+	case STU_HTTP_UPSTREAM_READ_CHUNKED:
+	case STU_HTTP_UPSTREAM_READ_CLOSE:
+		if (pr->body_last == pr->response_body.end && stu_http_upstream_grow_body(pr) == STU_ERROR) {
+			return NULL;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	*size = pr->response_body.end - pr->body_last;
+
+	return pr->body_last;
+}
+
+static stu_int_t
+stu_http_upstream_grow_body(stu_http_request_t *r) {
+	stu_buf_t *b;
+	u_char    *p;
+	size_t     n, size;
+
+	b = &r->response_body;
+
+	// reclaim the chunk framing decoded already
+	if (r->body_pos > b->last) {
+		n = r->body_last - r->body_pos;
+		memmove(b->last, r->body_pos, n);
+
+		r->body_pos = b->last;
+		r->body_last = b->last + n;
+
+		return STU_OK;
+	}
+
+	size = b->end - b->start;
+	if (size >= STU_HTTP_UPSTREAM_BODY_MAXIMUM) {
+		stu_log_error(0, "upstream sent too big body: size=%lu.", size);
+		return STU_ERROR;
+	}
+
+	size = stu_min(size * 2, STU_HTTP_UPSTREAM_BODY_MAXIMUM);
+
+	p = (u_char *) stu_calloc(size + 1);
+	if (p == NULL) {
+		stu_log_error(0, "Failed to calloc() upstream body buffer: size=%lu.", size);
+		return STU_ERROR;
+	}
+
+	n = r->body_last - b->start;
+	memcpy(p, b->start, n);
+
+	r->body_pos = p + (r->body_pos - b->start);
+	r->body_last = p + n;
+	b->last = p + (b->last - b->start);
+
+	stu_free(b->start);
+
+	b->start = p;
+	b->end = p + size;
+
+	return STU_OK;
+}
+
+static void
+stu_http_upstream_free_response(stu_connection_t *pc) {
+	stu_http_request_t *pr;
+
+	pr = (stu_http_request_t *) pc->data;
+	if (pr == NULL) {
+		return;
+	}
+
+	if (pr->response_body.start) {
+		stu_free(pr->response_body.start);
+	}
+
+	pr->response_body.start = pr->response_body.last = pr->response_body.end = NULL;
+	pr->body_pos = pr->body_last = NULL;
+
+	pr->response_state = STU_HTTP_UPSTREAM_READ_HEADER;
+	pr->chunked.state = 0;
+	pr->chunked.size = 0;
+
+	// the headers slice pc->buffer, which the next attempt rewrites
+	stu_memzero(&pr->headers_out, sizeof(stu_http_headers_out_t));
+}
+
 static stu_int_t
-stu_http_upstream_process_response_headers(stu_http_request_t *r) {
+stu_http_upstream_process_input(stu_connection_t *pc, size_t n) {
+	stu_http_request_t *pr;
+	stu_buf_t          *b;
+	u_char             *p, *end;
+	size_t              size, rest;
+
+	pr = (stu_http_request_t *) pc->data;
+
+	if (pr->response_state != STU_HTTP_UPSTREAM_READ_HEADER) {
+		pr->body_last += n;
+		return stu_http_upstream_process_body(pr);
+	}
+
+	b = &pc->buffer;
+
+	// the terminating empty line may begin in the previous read
+	p = stu_max(b->last - 3, b->start);
+	b->last += n;
+
+	end = stu_http_upstream_find_header_end(p, b->last);
+	if (end == NULL) {
+		return STU_AGAIN;
+	}
+
+	if (stu_http_upstream_process_response_headers(pr, end) != STU_OK) {
+		stu_log_error(0, "Failed to process upstream response headers: fd=%d.", pc->fd);
+		return STU_ERROR;
+	}
+
+	rest = b->last - end;
+
+	if (pr->headers_out.status < STU_HTTP_OK || pr->headers_out.status == 204 || pr->headers_out.status == 304) {
+		pr->headers_out.content_length_n = 0;
+	}
+
+	if (pr->headers_out.chunked) {
+		pr->response_state = STU_HTTP_UPSTREAM_READ_CHUNKED;
+		size = stu_max(rest, STU_HTTP_REQUEST_DEFAULT_SIZE);
+	} else if (pr->headers_out.content_length_n >= 0) {
+		pr->response_state = STU_HTTP_UPSTREAM_READ_LENGTH;
+		size = pr->headers_out.content_length_n;
+		rest = stu_min(rest, size);
+	} else {
+		pr->response_state = STU_HTTP_UPSTREAM_READ_CLOSE;
+		size = stu_max(rest, STU_HTTP_REQUEST_DEFAULT_SIZE);
+	}
+
+	if (size > STU_HTTP_UPSTREAM_BODY_MAXIMUM) {
+		stu_log_error(0, "upstream sent too big body: fd=%d, size=%lu.", pc->fd, size);
+		return STU_ERROR;
+	}
+
+	// one more byte for the terminating '\0'
+	pr->response_body.start = (u_char *) stu_calloc(size + 1);
+	if (pr->response_body.start == NULL) {
+		stu_log_error(0, "Failed to calloc() upstream body buffer: fd=%d, size=%lu.", pc->fd, size);
+		return STU_ERROR;
+	}
+
+	pr->response_body.last = pr->response_body.start;
+	pr->response_body.end = pr->response_body.start + size;
+
+	memcpy(pr->response_body.start, end, rest);
+
+	pr->body_pos = pr->response_body.start;
+	pr->body_last = pr->response_body.start + rest;
+
+	return stu_http_upstream_process_body(pr);
+}
+
+static u_char *
+stu_http_upstream_find_header_end(u_char *p, u_char *last) {
+	for ( /* void */ ; p < last; p++) {
+		if (*p != LF) {
+			continue;
+		}
+
+		if (p + 1 < last && p[1] == LF) {
+			return p + 2;
+		}
+
+		if (p + 2 < last && p[1] == CR && p[2] == LF) {
+			return p + 3;
+		}
+	}
+
+	return NULL;
+}
+
+static stu_int_t
+stu_http_upstream_process_response_headers(stu_http_request_t *r, u_char *end) {
+	stu_buf_t          b;
 	stu_int_t          rc;
-	stu_uint_t         hk;
 	stu_table_elt_t   *h;
 	stu_http_header_t *hh;
 
-	if (stu_http_parse_status_line(r, r->header_in) == STU_ERROR) {
+	/* parse the whole header block received, with b.last as cursor. */
+	b.start = b.last = r->header_in->start;
+	b.end = end;
+
+	r->headers_out.content_length_n = -1;
+
+	if (stu_http_parse_status_line(r, &b) != STU_OK) {
 		stu_log_error(0, "Failed to parse http status line.");
 		return STU_ERROR;
 	}
 
 	for ( ;; ) {
-		rc = stu_http_parse_header_line(r, r->header_in, 1);
+		rc = stu_http_parse_header_line(r, &b, 1);
 
 		if (rc == STU_OK) {
 			if (r->invalid_header) {
@@ -242,11 +547,13 @@ stu_http_upstream_process_response_headers(stu_http_request_t *r) {
 			}
 
 			/* a header line has been parsed successfully */
-			h = stu_calloc(sizeof(stu_table_elt_t));
-			if (h == NULL) {
-				return STU_HTTP_INTERNAL_SERVER_ERROR;
+			if (r->headers_out.nheaders == STU_HTTP_HEADERS_OUT_MAX_N) {
+				stu_log_error(0, "Upstream replied too many header lines: n=%d.", r->headers_out.nheaders);
+				return STU_ERROR;
 			}
 
+			h = &r->headers_out.headers[r->headers_out.nheaders++];
+
 			h->hash = r->header_hash;
 
 			h->key.len = r->header_name_end - r->header_name_start;
@@ -257,23 +564,16 @@ stu_http_upstream_process_response_headers(stu_http_request_t *r) {
 			h->value.data = r->header_start;
 			h->value.data[h->value.len] = '\0';
 
-			h->lowcase_key = stu_calloc(h->key.len);
-			if (h->lowcase_key == NULL) {
-				return STU_HTTP_INTERNAL_SERVER_ERROR;
-			}
-
-			if (h->key.len == r->lowcase_index) {
-				memcpy(h->lowcase_key, r->lowcase_header, h->key.len);
-			} else {
-				stu_strlow(h->lowcase_key, h->key.data, h->key.len);
-			}
+			// only valid until the next line is parsed
+			h->lowcase_key = NULL;
 
-			if (stu_list_push(&r->headers_out.headers, h, sizeof(stu_table_elt_t)) == STU_ERROR) {
-				return STU_HTTP_INTERNAL_SERVER_ERROR;
+			// longer names wrapped in lowcase_header, and are none of ours
+			if (h->key.len != r->lowcase_index) {
+				continue;
 			}
+			r->lowcase_header[h->key.len] = '\0';
 
-			hk = stu_hash_key(h->lowcase_key, h->key.len);
-			hh = stu_hash_find_locked(&stu_http_upstream_headers_in_hash, hk, h->lowcase_key, h->key.len);
+			hh = stu_http_header_phash_find(&stu_http_upstream_headers_in_phash, h->hash, r->lowcase_header, h->key.len);
 			if (hh) {
 				rc = hh->handler(r, h, hh->offset);
 				if (rc != STU_OK) {
@@ -292,8 +592,8 @@ stu_http_upstream_process_response_headers(stu_http_request_t *r) {
 		}
 
 		if (rc == STU_AGAIN) {
-			stu_log_debug(4, "A header line parsing is still not complete.");
-			continue;
+			stu_log_error(0, "Upstream header is not complete.");
+			return STU_ERROR;
 		}
 
 		stu_log_error(0, "Upstream replied invalid header line: \"%s\"", r->header_name_start);
@@ -306,6 +606,67 @@ stu_http_upstream_process_response_headers(stu_http_request_t *r) {
 	return STU_ERROR;
 }
 
+static stu_int_t
+stu_http_upstream_process_body(stu_http_request_t *r) {
+	stu_buf_t  b;
+	stu_int_t  rc, size;
+
+	switch (r->response_state) {
+	case STU_HTTP_UPSTREAM_READ_LENGTH:
+		r->response_body.last = r->body_pos = r->body_last;
+		if (r->body_last < r->response_body.end) {
+			return STU_AGAIN;
+		}
+		break;
+
+	case STU_HTTP_UPSTREAM_READ_CLOSE:
+		r->response_body.last = r->body_pos = r->body_last;
+		return STU_AGAIN;
+
+	case STU_HTTP_UPSTREAM_READ_CHUNKED:
+		for ( ;; ) {
+			b.start = b.last = r->body_pos;
+			b.end = r->body_last;
+
+			rc = stu_http_parse_chunked(r, &b);
+			r->body_pos = b.last;
+
+			if (rc == STU_OK) {
+				/* decode in place, the data never moves forward. */
+				size = stu_min(r->chunked.size, r->body_last - r->body_pos);
+				memmove(r->response_body.last, r->body_pos, size);
+
+				r->response_body.last += size;
+				r->body_pos += size;
+				r->chunked.size -= size;
+
+				continue;
+			}
+
+			if (rc == STU_DONE) {
+				break;
+			}
+
+			if (rc == STU_AGAIN) {
+				return STU_AGAIN;
+			}
+
+			stu_log_error(0, "upstream sent invalid chunked response.");
+
+			return STU_ERROR;
+		}
+		break;
+
+	default:
+		return STU_ERROR;
+	}
+
+	r->response_state = STU_HTTP_UPSTREAM_READ_DONE;
+	*r->response_body.last = '\0';
+
+	return STU_OK;
+}
+
 stu_int_t
 stu_http_upstream_analyze_response(stu_connection_t *c) {
 	stu_upstream_t     *u;
@@ -338,19 +699,26 @@ void
 stu_http_upstream_write_handler(stu_event_t *ev) {
 	stu_connection_t   *c, *pc;
 	stu_upstream_t     *u;
+	stu_uint_t          generation;
 	stu_int_t           n;
 
-	c = (stu_connection_t *) ev->data;
-	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID || c->upstream == NULL) {
+	if (ev->timedout && stu_http_upstream_timeout(ev) == STU_OK) {
 		return;
 	}
 
-	u = c->upstream;
-	pc = u->peer.connection;
+	c = (stu_connection_t *) ev->data;
+	generation = c->generation;
 
 	// Lock pc rather than c
 	stu_mutex_lock(&c->lock);
 
+	if (c->fd == (stu_socket_t) STU_SOCKET_INVALID || c->generation != generation || c->upstream == NULL) {
+		goto done;
+	}
+
+	u = c->upstream;
+	pc = u->peer.connection;
+
 	if (pc == NULL || pc->fd == (stu_socket_t) STU_SOCKET_INVALID) {
 		goto done;
 	}
@@ -368,8 +736,17 @@ stu_http_upstream_write_handler(stu_event_t *ev) {
 
 	stu_log_debug(4, "sent to upstream %s: c->fd=%d, u->fd=%d, bytes=%d.", u->server->name.data, c->fd, pc->fd, n);
 
+	// reuse the request buffer for the response header
+	pc->buffer.last = pc->buffer.start;
+
 	u->peer.state = STU_UPSTREAM_PEER_LOADING;
 
+	if (pc->write.timer_set) {
+		stu_timer_del(&pc->write);
+	}
+
+	stu_timer_add(&pc->read, u->server->timeout * 1000);
+
 	ev->data = pc;
 	stu_event_del(&pc->write, STU_WRITE_EVENT, STU_READ_EVENT);
 	ev->active = 0;
@@ -378,7 +755,7 @@ stu_http_upstream_write_handler(stu_event_t *ev) {
 
 failed:
 
-	u->cleanup_pt(c);
+	stu_http_upstream_next(c, STU_HTTP_BAD_GATEWAY);
 
 done:
 
@@ -388,9 +765,78 @@ done:
 
 void stu_inline
 stu_http_upstream_cleanup(stu_connection_t *c) {
+	if (c->upstream && c->upstream->peer.connection) {
+		stu_http_upstream_free_response(c->upstream->peer.connection);
+	}
+
 	stu_upstream_cleanup(c);
 }
 
+/*
+ * Called by the timer with its lock held, or by epoll while ev->timedout is
+ * set, so the timer lock is taken here to re-arm. Returns STU_DECLINED if
+ * the timeout has been taken by another thread, and the event is I/O.
+ */
+static stu_int_t
+stu_http_upstream_timeout(stu_event_t *ev) {
+	stu_connection_t *c, *pc;
+	stu_upstream_t   *u;
+
+	stu_mutex_lock(&stu_cycle->timer_lock);
+
+	if (ev->timedout == 0) {
+		stu_mutex_unlock(&stu_cycle->timer_lock);
+		return STU_DECLINED;
+	}
+
+	ev->timedout = 0;
+
+	c = (stu_connection_t *) ev->data;
+
+	// the owner thread of c may be waiting for the timer lock, never block on c->lock here
+	if (stu_mutex_trylock(&c->lock) != 0) {
+		stu_timer_add_locked(ev, 1);
+		stu_mutex_unlock(&stu_cycle->timer_lock);
+		return STU_OK;
+	}
+
+	u = c->upstream;
+	pc = u ? u->peer.connection : NULL;
+
+	// stale timer of a peer already cleaned up
+	if (pc == NULL || (ev != &pc->read && ev != &pc->write)) {
+		goto done;
+	}
+
+	stu_log_error(0, "upstream %s timed out while %s: c->fd=%d, u->fd=%d.",
+			u->server->name.data, ev == &pc->write ? "connecting" : "reading", c->fd, pc->fd);
+
+	stu_http_upstream_next(c, STU_HTTP_GATEWAY_TIMEOUT);
+
+done:
+
+	stu_mutex_unlock(&c->lock);
+	stu_mutex_unlock(&stu_cycle->timer_lock);
+
+	return STU_OK;
+}
+
+static void
+stu_http_upstream_next(stu_connection_t *c, stu_int_t rc) {
+	stu_upstream_t *u;
+
+	u = c->upstream;
+
+	if (u->peer.connection) {
+		stu_http_upstream_free_response(u->peer.connection);
+	}
+
+	if (stu_upstream_next(c) == STU_ERROR) {
+		stu_log_error(0, "All upstream servers of %s failed: fd=%d.", u->server->name.data, c->fd);
+		u->finalize_handler_pt(c, rc);
+	}
+}
+
 
 static stu_int_t
 stu_http_upstream_process_content_length(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset) {
@@ -402,6 +848,15 @@ stu_http_upstream_process_content_length(stu_http_request_t *r, stu_table_elt_t
 	return stu_http_upstream_process_header_line(r, h, offset);
 }
 
+static stu_int_t
+stu_http_upstream_process_transfer_encoding(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset) {
+	if (stu_strnstr(h->value.data, "chunked", h->value.len)) {
+		r->headers_out.chunked = TRUE;
+	}
+
+	return stu_http_upstream_process_header_line(r, h, offset);
+}
+
 static stu_int_t
 stu_http_upstream_process_connection(stu_http_request_t *r, stu_table_elt_t *h, stu_uint_t offset) {
 	if (stu_strnstr(h->value.data, "Keep-Alive", h->value.len)) {
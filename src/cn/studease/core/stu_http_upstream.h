@@ -11,6 +11,15 @@
 #include "stu_config.h"
 #include "stu_core.h"
 
+#define STU_HTTP_UPSTREAM_HEADER_MAXIMUM  8192
+#define STU_HTTP_UPSTREAM_BODY_MAXIMUM    (1024 * 1024)
+
+#define STU_HTTP_UPSTREAM_READ_HEADER     0x00
+#define STU_HTTP_UPSTREAM_READ_LENGTH     0x01
+#define STU_HTTP_UPSTREAM_READ_CHUNKED    0x02
+#define STU_HTTP_UPSTREAM_READ_CLOSE      0x03
+#define STU_HTTP_UPSTREAM_READ_DONE       0x04
+
 void stu_http_upstream_read_handler(stu_event_t *ev);
 void stu_http_upstream_write_handler(stu_event_t *ev);
 
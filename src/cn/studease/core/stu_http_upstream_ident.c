@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_UPSTREAM
+
 #include "stu_config.h"
 #include "stu_core.h"
 
@@ -14,24 +16,225 @@ stu_str_t  STU_HTTP_UPSTREAM_IDENT_PARAM_CHANNEL = stu_string("channel");
 stu_str_t  STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN = stu_string("token");
 
 stu_str_t  STU_HTTP_UPSTREAM_IDENT_RESPONSE = stu_string(
-		"{\"raw\":\"ident\",\"user\":{\"id\":\"%ld\",\"name\":\"%s\",\"icon\":\"%s\",\"role\":%d},\"channel\":{\"id\":\"%s\",\"state\":%d,\"total\":%lu}}"
+		"{\"raw\":\"ident\",\"user\":{\"id\":\"%V\",\"name\":\"%V\",\"icon\":\"%V\",\"role\":%d},\"channel\":{\"id\":\"%V\",\"state\":%d,\"total\":%ui}}"
 	);
 
+stu_hash_t                               stu_http_upstream_ident_flights;
+
+static stu_str_t *stu_http_upstream_ident_keys[] = {
+	&STU_PROTOCOL_STATUS,
+	&STU_PROTOCOL_CHANNEL,
+	&STU_PROTOCOL_USER
+};
+
+static stu_str_t *stu_http_upstream_ident_channel_keys[] = {
+	&STU_PROTOCOL_ID,
+	&STU_PROTOCOL_STATE
+};
+
+static stu_str_t *stu_http_upstream_ident_user_keys[] = {
+	&STU_PROTOCOL_ID,
+	&STU_PROTOCOL_NAME,
+	&STU_PROTOCOL_ROLE
+};
+
+static stu_http_upstream_ident_batch_t  *stu_http_upstream_ident_batch;
+static stu_connection_t                 *stu_http_upstream_ident_batch_timer;
+
+static stu_http_upstream_ident_flight_t *stu_http_upstream_ident_resumes;
+static stu_connection_t                 *stu_http_upstream_ident_resume_timer;
+
+static stu_int_t  stu_http_upstream_ident_generate_batch_request(stu_connection_t *c, stu_http_upstream_ident_batch_t *b);
+static void       stu_http_upstream_ident_batch_handler(stu_event_t *ev);
+
+static stu_int_t  stu_http_upstream_ident_key(stu_connection_t *c, stu_str_t *key, u_char *buf, size_t size);
+static stu_int_t  stu_http_upstream_ident_check(stu_json_t *idt, stu_json_t **idchannel, stu_json_t **iduser);
+static void       stu_http_upstream_ident_release(stu_connection_t *c, stu_json_t *idt);
+static stu_int_t  stu_http_upstream_ident_resume_locked(stu_http_upstream_ident_flight_t *f, stu_connection_t *c, stu_json_t *idt);
+static stu_int_t  stu_http_upstream_ident_resume_waiters_locked(stu_http_upstream_ident_flight_t *f, stu_json_t *idt);
+static void       stu_http_upstream_ident_resume_handler(stu_event_t *ev);
+static void       stu_http_upstream_ident_remove_locked(stu_list_t *list, void *obj);
+static stu_int_t  stu_http_upstream_ident_join(stu_connection_t *c, stu_json_t *idchannel, stu_json_t *iduser);
+
+
+stu_int_t
+stu_http_upstream_ident_init_flights() {
+	stu_connection_t *c;
+
+	if (stu_hash_init(&stu_http_upstream_ident_flights, NULL, STU_HTTP_UPSTREAM_IDENT_FLIGHT_MAXIMUM,
+			(stu_hash_palloc_pt) stu_calloc, stu_free) == STU_ERROR) {
+		return STU_ERROR;
+	}
+
+	c = stu_connection_get((stu_socket_t) -2);
+	if (c == NULL) {
+		stu_log_error(0, "Failed to get connection for ident batch timer.");
+		return STU_ERROR;
+	}
+
+	c->write.handler = stu_http_upstream_ident_batch_handler;
+	stu_http_upstream_ident_batch_timer = c;
+
+	c = stu_connection_get((stu_socket_t) -2);
+	if (c == NULL) {
+		stu_log_error(0, "Failed to get connection for ident resume timer.");
+		return STU_ERROR;
+	}
+
+	c->write.handler = stu_http_upstream_ident_resume_handler;
+	stu_http_upstream_ident_resume_timer = c;
+
+	return STU_OK;
+}
+
+stu_int_t
+stu_http_upstream_ident_init(stu_connection_t *c) {
+	stu_upstream_t                   *u;
+	stu_http_upstream_ident_flight_t *f;
+	stu_http_upstream_ident_batch_t  *b;
+	stu_str_t                         key;
+	stu_uint_t                        hk;
+	stu_msec_t                        window;
+	u_char                            temp[STU_HTTP_REQUEST_DEFAULT_SIZE];
+
+	u = c->upstream;
+	window = 0;
+
+	if (stu_http_upstream_ident_key(c, &key, temp, STU_HTTP_REQUEST_DEFAULT_SIZE) == STU_ERROR) {
+		stu_log_error(0, "Ident key too long, fd=%d.", c->fd);
+		return STU_ERROR;
+	}
+
+	hk = stu_hash_key(key.data, key.len);
+
+	stu_mutex_lock(&stu_http_upstream_ident_flights.lock);
+
+	f = stu_hash_find_locked(&stu_http_upstream_ident_flights, hk, key.data, key.len);
+	if (f) {
+		if (stu_list_push(&f->waiters, c, sizeof(stu_connection_t *)) == STU_ERROR) {
+			stu_log_error(0, "Failed to push ident waiter, fd=%d.", c->fd);
+			goto failed;
+		}
+
+		u->data = f;
+
+		stu_log_debug(4, "ident coalesced: fd=%d, waiters=%lu.", c->fd, f->waiters.length);
+
+		stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+		return STU_OK;
+	}
+
+	f = stu_calloc(sizeof(stu_http_upstream_ident_flight_t));
+	if (f == NULL) {
+		stu_log_error(0, "Failed to pcalloc ident flight, fd=%d.", c->fd);
+		goto failed;
+	}
+
+	f->key.data = stu_calloc(key.len + 1);
+	if (f->key.data == NULL) {
+		stu_log_error(0, "Failed to pcalloc ident flight key, fd=%d.", c->fd);
+		stu_free(f);
+		goto failed;
+	}
+
+	memcpy(f->key.data, key.data, key.len);
+	f->key.len = key.len;
+
+	f->channel.data = f->key.data;
+	f->channel.len = ((stu_http_request_t *) c->data)->target.len;
+	f->token.data = f->channel.data + f->channel.len + 1;
+	f->token.len = f->key.len - f->channel.len - 1;
+
+	f->leader = c;
+
+	stu_list_init(&f->waiters, (stu_list_palloc_pt) stu_calloc, stu_free);
+
+	if (stu_hash_insert_locked(&stu_http_upstream_ident_flights, &f->key, f, 0) == STU_ERROR) {
+		stu_log_error(0, "Failed to insert ident flight, fd=%d.", c->fd);
+		stu_free(f->key.data);
+		stu_free(f);
+		goto failed;
+	}
+
+	/* from now on, the cleanup handler takes care of the flight. */
+	u->data = f;
+
+	if (u->server->batch <= 1 || u->server->method != STU_HTTP_POST) {
+		stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+		return stu_upstream_init(c);
+	}
+
+	// batched
+	b = stu_http_upstream_ident_batch;
+	if (b == NULL) {
+		b = stu_calloc(sizeof(stu_http_upstream_ident_batch_t));
+		if (b == NULL) {
+			stu_log_error(0, "Failed to pcalloc ident batch, fd=%d.", c->fd);
+			goto failed;
+		}
+
+		stu_list_init(&b->flights, (stu_list_palloc_pt) stu_calloc, stu_free);
+
+		stu_http_upstream_ident_batch = b;
+		window = u->server->batch_window;
+	}
+
+	if (stu_list_push(&b->flights, f, sizeof(stu_http_upstream_ident_flight_t *)) == STU_ERROR) {
+		stu_log_error(0, "Failed to push ident flight into batch, fd=%d.", c->fd);
+		goto failed;
+	}
+
+	f->batch = b;
+
+	if (b->flights.length >= u->server->batch) {
+		stu_http_upstream_ident_batch = NULL;
+		b->carrier = c;
+
+		stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+		stu_log_debug(4, "ident batch full: fd=%d, flights=%lu.", c->fd, b->flights.length);
+
+		return stu_upstream_init(c);
+	}
+
+	stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+	/* not under the flights lock, as the timer handler takes it. */
+	if (window) {
+		stu_timer_add(&stu_http_upstream_ident_batch_timer->write, window);
+	}
+
+	return STU_OK;
+
+failed:
+
+	stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+	return STU_ERROR;
+}
 
 stu_int_t
 stu_http_upstream_ident_generate_request(stu_connection_t *c) {
-	stu_http_request_t *r, *pr;
-	stu_upstream_t     *u;
-	stu_connection_t   *pc;
-	stu_str_t           arg;
-	u_char             *p;
-	stu_json_t         *res, *rschannel, *rstoken;
+	stu_http_request_t               *r, *pr;
+	stu_upstream_t                   *u;
+	stu_connection_t                 *pc;
+	stu_http_upstream_ident_flight_t *f;
+	stu_str_t                         arg;
+	u_char                           *p;
+	size_t                            size;
+	stu_json_t                       *res, *rschannel, *rstoken;
 
 	r = (stu_http_request_t *) c->data;
 	u = c->upstream;
 	pc = u->peer.connection;
 	pr = (stu_http_request_t *) pc->data;
 
+	f = (stu_http_upstream_ident_flight_t *) u->data;
+	if (f && f->batch) {
+		return stu_http_upstream_ident_generate_batch_request(c, f->batch);
+	}
+
 	stu_str_null(&arg);
 	if (stu_http_arg(r, STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN.data, STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN.len, &arg) != STU_OK) {
 		stu_log_debug(4, "Param \"%s\" not found while sending upstream %s: c->fd=%d, u->fd=%d.",
@@ -50,10 +253,8 @@ stu_http_upstream_ident_generate_request(stu_connection_t *c) {
 
 	switch (u->server->method) {
 	case STU_HTTP_GET:
-		p = stu_sprintf(pr->request_body.start, "?%s=", STU_HTTP_UPSTREAM_IDENT_PARAM_CHANNEL.data);
-		p = stu_strncpy(p, r->target.data, r->target.len);
-		p = stu_sprintf(p, "&%s=", STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN.data);
-		p = stu_strncpy(p, arg.data, arg.len);
+		p = stu_slprintf(pr->request_body.start, pr->request_body.end - 1, "?%V=%V&%V=%V",
+				&STU_HTTP_UPSTREAM_IDENT_PARAM_CHANNEL, &r->target, &STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN, &arg);
 		break;
 	case STU_HTTP_POST:
 		res = stu_json_create_object(NULL);
@@ -62,10 +263,17 @@ stu_http_upstream_ident_generate_request(stu_connection_t *c) {
 		stu_json_add_item_to_object(res, rschannel);
 		stu_json_add_item_to_object(res, rstoken);
 
-		p = stu_json_stringify(res, pr->request_body.start);
-		*p = '\0';
+		size = stu_json_stringify(res, pr->request_body.start, pr->request_body.end - pr->request_body.start - 1);
 
 		stu_json_delete(res);
+
+		if (size > (size_t) (pr->request_body.end - pr->request_body.start - 1)) {
+			stu_log_error(0, "Ident request body too large: fd=%d, size=%lu.", c->fd, size);
+			return STU_ERROR;
+		}
+
+		p = pr->request_body.start + size;
+		*p = '\0';
 		break;
 	default:
 		stu_log_error(0, "Http method unknown while generating upstream request: fd=%d, method=%hd.", c->fd, u->server->method);
@@ -74,29 +282,117 @@ stu_http_upstream_ident_generate_request(stu_connection_t *c) {
 
 	pr->request_body.last = p;
 
-	stu_http_upstream_generate_request(c);
+	return stu_http_upstream_generate_request(c);
+}
 
-	return STU_OK;
+static stu_int_t
+stu_http_upstream_ident_generate_batch_request(stu_connection_t *c, stu_http_upstream_ident_batch_t *b) {
+	stu_http_request_t               *pr;
+	stu_upstream_t                   *u;
+	stu_connection_t                 *pc;
+	stu_http_upstream_ident_flight_t *f;
+	stu_list_elt_t                   *elts, *e;
+	stu_queue_t                      *q;
+	u_char                           *p;
+	size_t                            size;
+	stu_json_t                       *res, *item, *rschannel, *rstoken;
+
+	u = c->upstream;
+	pc = u->peer.connection;
+	pr = (stu_http_request_t *) pc->data;
+
+	elts = &b->flights.elts;
+
+	size = 2;
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		f = (stu_http_upstream_ident_flight_t *) e->obj;
+
+		size += f->key.len + STU_HTTP_UPSTREAM_IDENT_BATCH_ITEM_OVERHEAD;
+	}
+
+	if (pr->request_body.start == NULL || (size_t) (pr->request_body.end - pr->request_body.start) < size) {
+		if (pr->request_body.start) {
+			stu_free(pr->request_body.start);
+		}
+
+		pr->request_body.start = stu_calloc(size);
+		if (pr->request_body.start == NULL) {
+			stu_log_error(0, "Failed to palloc() batch request body: fd=%d, size=%lu.", c->fd, size);
+			return STU_ERROR;
+		}
+
+		pr->request_body.end = pr->request_body.start + size;
+	}
+
+	// make room for the request headers, as well as the response array
+	size += STU_HTTP_REQUEST_DEFAULT_SIZE + b->flights.length * STU_HTTP_UPSTREAM_IDENT_BATCH_ITEM_SIZE;
+
+	if (pc->buffer.start == NULL || (size_t) (pc->buffer.end - pc->buffer.start) < size) {
+		if (pc->buffer.start) {
+			stu_free(pc->buffer.start);
+		}
+
+		pc->buffer.start = stu_calloc(size);
+		if (pc->buffer.start == NULL) {
+			stu_log_error(0, "Failed to palloc() batch buffer: fd=%d, size=%lu.", c->fd, size);
+			return STU_ERROR;
+		}
+
+		pc->buffer.last = pc->buffer.start;
+		pc->buffer.end = pc->buffer.start + size;
+	}
+
+	res = stu_json_create_array(NULL);
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		f = (stu_http_upstream_ident_flight_t *) e->obj;
+
+		item = stu_json_create_object(NULL);
+		rschannel = stu_json_create_string(&STU_HTTP_UPSTREAM_IDENT_PARAM_CHANNEL, f->channel.data, f->channel.len);
+		rstoken = stu_json_create_string(&STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN, f->token.data, f->token.len);
+		stu_json_add_item_to_object(item, rschannel);
+		stu_json_add_item_to_object(item, rstoken);
+
+		stu_json_add_item_to_array(res, item);
+	}
+
+	size = stu_json_stringify(res, pr->request_body.start, pr->request_body.end - pr->request_body.start - 1);
+
+	stu_json_delete(res);
+
+	if (size > (size_t) (pr->request_body.end - pr->request_body.start - 1)) {
+		stu_log_error(0, "Ident batch request body too large: fd=%d, size=%lu.", c->fd, size);
+		return STU_ERROR;
+	}
+
+	p = pr->request_body.start + size;
+	*p = '\0';
+
+	pr->request_body.last = p;
+
+	stu_log_debug(4, "ident batch request: fd=%d, flights=%lu, bytes=%lu.", c->fd, b->flights.length, p - pr->request_body.start);
+
+	return stu_http_upstream_generate_request(c);
 }
 
 stu_int_t
 stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
-	stu_http_request_t *r, *pr;
-	stu_upstream_t     *u;
-	stu_connection_t   *pc;
-	stu_table_elt_t    *protocol;
-	stu_int_t           m, n, size, extened;
-	stu_str_t          *cid, *uid, *uname, channel;
-	u_char             *data, temp[STU_HTTP_REQUEST_DEFAULT_SIZE], opcode;
-	stu_channel_t      *ch;
-	stu_json_t         *idt, *sta, *idchannel, *idcid, *idcstate, *iduser, *iduid, *iduname, *idurole;
-	stu_json_t         *res, *raw, *rschannel, *rsctotal, *rsuser;
+	stu_http_request_t               *pr;
+	stu_upstream_t                   *u;
+	stu_connection_t                 *pc;
+	stu_http_upstream_ident_flight_t *f;
+	stu_list_elt_t                   *elts, *e;
+	stu_queue_t                      *q;
+	stu_json_t                       *idt, *item, *idchannel, *iduser;
+	u_char                           *p;
+	size_t                            size;
+	stu_int_t                         rc, i;
 
-	r = (stu_http_request_t *) c->data;
 	u = c->upstream;
 	pc = u->peer.connection;
 	pr = (stu_http_request_t *) pc->data;
-	protocol = r->headers_out.sec_websocket_protocol;
 
 	if (pr->headers_out.status != STU_HTTP_OK) {
 		stu_log_error(0, "Failed to load ident data: status=%ld.", pr->headers_out.status);
@@ -104,38 +400,456 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 	}
 
 	// parse JSON string
-	stu_utf8_decode(&pc->buffer.last, pr->headers_out.content_length_n);
-	idt = stu_json_parse(pc->buffer.last, pr->headers_out.content_length_n);
+	p = pr->response_body.start;
+	size = pr->response_body.last - p;
+
+	if (stu_utf8_validate(p, size) != STU_OK) {
+		stu_log_error(0, "Invalid UTF-8 in ident response: fd=%d, size=%lu.", c->fd, size);
+		return STU_ERROR;
+	}
+
+	// skip the BOM
+	if (size >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+		p += 3;
+		size -= 3;
+	}
+
+	idt = stu_json_parse(p, size);
 	if (idt == NULL) {
 		stu_log_error(0, "Failed to parse ident response.");
 		return STU_ERROR;
 	}
 
-	sta = stu_json_get_object_item_by(idt, &STU_PROTOCOL_STATUS);
-	if (sta == NULL || sta->type != STU_JSON_TYPE_BOOLEAN) {
-		stu_log_error(0, "Failed to analyze ident response: item status not found, fd=%d.", c->fd);
+	item = idt;
+
+	/* the batch is detached, so nobody else modifies the flights list. */
+	f = (stu_http_upstream_ident_flight_t *) u->data;
+	if (f && f->batch) {
+		if (idt->type != STU_JSON_TYPE_ARRAY) {
+			stu_log_error(0, "Failed to analyze ident batch response: not an array, fd=%d.", c->fd);
+			goto failed;
+		}
+
+		item = NULL;
+		elts = &f->batch->flights.elts;
+
+		for (i = 0, q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); i++, q = stu_queue_next(q)) {
+			e = stu_queue_data(q, stu_list_elt_t, queue);
+			if (e->obj == f) {
+				item = stu_json_get_array_item_at(idt, i);
+				break;
+			}
+		}
+	}
+
+	// resume the coalesced connections first, the leader's cleanup would fail them.
+	stu_http_upstream_ident_release(c, idt);
+
+	if (stu_http_upstream_ident_check(item, &idchannel, &iduser) == STU_ERROR) {
 		goto failed;
 	}
 
+	rc = stu_http_upstream_ident_join(c, idchannel, iduser);
+
+	stu_json_delete(idt);
+
+	return rc;
+
+failed:
+
+	stu_json_delete(idt);
+
+	return STU_ERROR;
+}
+
+void
+stu_http_upstream_ident_cleanup(stu_connection_t *c) {
+	stu_upstream_t                   *u;
+	stu_http_upstream_ident_flight_t *f;
+	stu_http_upstream_ident_batch_t  *b;
+	stu_list_elt_t                   *e;
+	stu_queue_t                      *q;
+	stu_uint_t                        hk;
+
+	u = c->upstream;
+
+	/* only the owner thread sets u->data, others may just reset it. */
+	if (u && u->data) {
+		stu_mutex_lock(&stu_http_upstream_ident_flights.lock);
+
+		f = (stu_http_upstream_ident_flight_t *) u->data;
+		b = f ? f->batch : NULL;
+
+		if (f && f->leader != c) {
+			stu_http_upstream_ident_remove_locked(&f->waiters, c);
+			u->data = NULL;
+
+		} else if (f && b && b->carrier != c) {
+			/* another connection carries the batch, hand the flight over to a waiter. */
+			if (f->waiters.length) {
+				q = stu_queue_head(&f->waiters.elts.queue);
+				e = stu_queue_data(q, stu_list_elt_t, queue);
+
+				f->leader = (stu_connection_t *) e->obj;
+				stu_list_remove(&f->waiters, e);
+
+			} else if (b == stu_http_upstream_ident_batch) {
+				stu_http_upstream_ident_remove_locked(&b->flights, f);
+
+				hk = stu_hash_key(f->key.data, f->key.len);
+				stu_hash_remove_locked(&stu_http_upstream_ident_flights, hk, f->key.data, f->key.len);
+
+				stu_free(f->key.data);
+				stu_free(f);
+
+			} else {
+				// already sent, keep the entry to match the response array
+				f->leader = NULL;
+			}
+
+			u->data = NULL;
+		}
+
+		stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+		if (u->data) {
+			stu_http_upstream_ident_release(c, NULL);
+		}
+	}
+
+	stu_http_upstream_cleanup(c);
+}
+
+
+static void
+stu_http_upstream_ident_batch_handler(stu_event_t *ev) {
+	stu_http_upstream_ident_batch_t  *b;
+	stu_http_upstream_ident_flight_t *f;
+	stu_connection_t                 *c;
+	stu_list_elt_t                   *e;
+	stu_queue_t                      *q;
+
+	stu_mutex_lock(&stu_http_upstream_ident_flights.lock);
+
+	b = stu_http_upstream_ident_batch;
+	if (b == NULL) {
+		goto done;
+	}
+
+	if (b->flights.length == 0) {
+		stu_http_upstream_ident_batch = NULL;
+		stu_free(b);
+		goto done;
+	}
+
+	q = stu_queue_head(&b->flights.elts.queue);
+	e = stu_queue_data(q, stu_list_elt_t, queue);
+	f = (stu_http_upstream_ident_flight_t *) e->obj;
+	c = f->leader;
+
+	/*
+	 * Called with the timer lock held, while the leader's owner thread may
+	 * be waiting for it, so never block on the connection lock here.
+	 */
+	if (stu_mutex_trylock(&c->lock) != 0) {
+		stu_timer_add_locked(ev, 1);
+		goto done;
+	}
+
+	stu_http_upstream_ident_batch = NULL;
+	b->carrier = c;
+
+	stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+	stu_log_debug(4, "ident batch timed out: fd=%d, flights=%lu.", c->fd, b->flights.length);
+
+	if (stu_upstream_init(c) == STU_ERROR) {
+		stu_log_error(0, "Failed to init upstream.");
+		c->upstream->finalize_handler_pt(c, STU_HTTP_INTERNAL_SERVER_ERROR);
+	}
+
+	stu_mutex_unlock(&c->lock);
+
+	return;
+
+done:
+
+	stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+}
+
+static stu_int_t
+stu_http_upstream_ident_key(stu_connection_t *c, stu_str_t *key, u_char *buf, size_t size) {
+	stu_http_request_t *r;
+	stu_str_t           arg;
+	u_char             *p;
+
+	r = (stu_http_request_t *) c->data;
+
+	stu_str_null(&arg);
+	stu_http_arg(r, STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN.data, STU_HTTP_UPSTREAM_IDENT_PARAM_TOKEN.len, &arg);
+
+	if (r->target.len + arg.len + 2 > size) {
+		return STU_ERROR;
+	}
+
+	// LF never appears in a request line
+	p = stu_memcpy(buf, r->target.data, r->target.len);
+	*p++ = LF;
+	p = stu_memcpy(p, arg.data, arg.len);
+	*p = '\0';
+
+	key->data = buf;
+	key->len = p - buf;
+
+	return STU_OK;
+}
+
+static stu_int_t
+stu_http_upstream_ident_check(stu_json_t *idt, stu_json_t **idchannel, stu_json_t **iduser) {
+	stu_json_t *sta, *items[3];
+
+	if (idt == NULL || idt->type != STU_JSON_TYPE_OBJECT) {
+		stu_log_error(0, "Failed to analyze ident response: item not found.");
+		return STU_ERROR;
+	}
+
+	stu_json_pluck(idt, stu_http_upstream_ident_keys, items, 3);
+
+	sta = items[0];
+	if (sta == NULL || sta->type != STU_JSON_TYPE_BOOLEAN) {
+		stu_log_error(0, "Failed to analyze ident response: item status not found.");
+		return STU_ERROR;
+	}
+
 	if (sta->value == FALSE) {
-		stu_log_error(0, "Access denied while joining channel, fd=%d.", c->fd);
-		goto failed;
+		stu_log_error(0, "Access denied while joining channel.");
+		return STU_ERROR;
 	}
 
-	idchannel = stu_json_get_object_item_by(idt, &STU_PROTOCOL_CHANNEL);
-	iduser = stu_json_get_object_item_by(idt, &STU_PROTOCOL_USER);
-	if (idchannel == NULL || idchannel->type != STU_JSON_TYPE_OBJECT
-			|| iduser == NULL || iduser->type != STU_JSON_TYPE_OBJECT) {
+	*idchannel = items[1];
+	*iduser = items[2];
+	if (*idchannel == NULL || (*idchannel)->type != STU_JSON_TYPE_OBJECT
+			|| *iduser == NULL || (*iduser)->type != STU_JSON_TYPE_OBJECT) {
 		stu_log_error(0, "Failed to analyze ident response: necessary item[s] not found.");
-		goto failed;
+		return STU_ERROR;
 	}
 
-	idcid = stu_json_get_object_item_by(idchannel, &STU_PROTOCOL_ID);
-	idcstate = stu_json_get_object_item_by(idchannel, &STU_PROTOCOL_STATE);
+	return STU_OK;
+}
+
+static void
+stu_http_upstream_ident_release(stu_connection_t *c, stu_json_t *idt) {
+	stu_http_upstream_ident_flight_t *f;
+	stu_http_upstream_ident_batch_t  *b;
+	stu_list_elt_t                   *elts, *e;
+	stu_queue_t                      *q;
+	stu_json_t                       *item;
+	stu_int_t                         rc;
+
+	rc = STU_OK;
 
-	iduid = stu_json_get_object_item_by(iduser, &STU_PROTOCOL_ID);
-	iduname = stu_json_get_object_item_by(iduser, &STU_PROTOCOL_NAME);
-	idurole = stu_json_get_object_item_by(iduser, &STU_PROTOCOL_ROLE);
+	stu_mutex_lock(&stu_http_upstream_ident_flights.lock);
+
+	f = (stu_http_upstream_ident_flight_t *) c->upstream->data;
+	if (f == NULL || f->leader != c) {
+		goto done;
+	}
+
+	c->upstream->data = NULL;
+
+	b = f->batch;
+	if (b == NULL) {
+		rc = stu_http_upstream_ident_resume_locked(f, c, idt);
+		goto done;
+	}
+
+	// the response array is in the order of the request
+	item = idt && idt->type == STU_JSON_TYPE_ARRAY ? (stu_json_t *) idt->value : NULL;
+
+	elts = &b->flights.elts;
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); ) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		q = stu_queue_next(q);
+
+		if (stu_http_upstream_ident_resume_locked((stu_http_upstream_ident_flight_t *) e->obj, c, item) == STU_AGAIN) {
+			rc = STU_AGAIN;
+		}
+
+		stu_list_remove(&b->flights, e);
+
+		item = item ? item->next : NULL;
+	}
+
+	stu_free(b);
+
+done:
+
+	stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+
+	/* not under the flights lock, as the timer handler takes it. */
+	if (rc == STU_AGAIN) {
+		stu_timer_add(&stu_http_upstream_ident_resume_timer->write, 1);
+	}
+}
+
+/*
+ * Resumes everyone waiting on the flight except c, which resumes itself.
+ * Returns STU_AGAIN if some waiters were busy, and the flight is left to
+ * the resume timer with a copy of the result.
+ */
+static stu_int_t
+stu_http_upstream_ident_resume_locked(stu_http_upstream_ident_flight_t *f, stu_connection_t *c, stu_json_t *idt) {
+	stu_uint_t  hk, n;
+
+	hk = stu_hash_key(f->key.data, f->key.len);
+	stu_hash_remove_locked(&stu_http_upstream_ident_flights, hk, f->key.data, f->key.len);
+
+	if (f->leader && f->leader != c) {
+		stu_list_push(&f->waiters, f->leader, sizeof(stu_connection_t *));
+	}
+
+	// just a waiter from now on, and the batch is freed by the carrier
+	f->leader = NULL;
+	f->batch = NULL;
+
+	n = f->waiters.length;
+
+	if (stu_http_upstream_ident_resume_waiters_locked(f, idt) == STU_OK) {
+		stu_log_debug(4, "ident released: key=%s, waiters=%lu.", f->key.data, n);
+
+		stu_free(f->key.data);
+		stu_free(f);
+
+		return STU_OK;
+	}
+
+	stu_log_debug(4, "ident released: key=%s, waiters=%lu, busy=%lu.", f->key.data, n, f->waiters.length);
+
+	if (idt) {
+		f->result = stu_json_duplicate(idt, TRUE);
+	}
+
+	f->next = stu_http_upstream_ident_resumes;
+	stu_http_upstream_ident_resumes = f;
+
+	return STU_AGAIN;
+}
+
+/*
+ * Joins or finalizes the waiters with w->lock held, so that their owner
+ * threads can not close them meanwhile. Those closing already may be
+ * waiting for the flights lock in their cleanup, so never block on w->lock
+ * here, and leave the busy ones on the flight.
+ */
+static stu_int_t
+stu_http_upstream_ident_resume_waiters_locked(stu_http_upstream_ident_flight_t *f, stu_json_t *idt) {
+	stu_connection_t *w;
+	stu_list_elt_t   *elts, *e;
+	stu_queue_t      *q;
+	stu_json_t       *idchannel, *iduser;
+	stu_int_t         rc;
+
+	rc = STU_HTTP_BAD_GATEWAY;
+
+	if (idt) {
+		rc = stu_http_upstream_ident_check(idt, &idchannel, &iduser) == STU_OK ? STU_HTTP_SWITCHING_PROTOCOLS : STU_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	elts = &f->waiters.elts;
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); ) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		q = stu_queue_next(q);
+
+		w = (stu_connection_t *) e->obj;
+
+		if (stu_mutex_trylock(&w->lock) != 0) {
+			continue;
+		}
+
+		w->upstream->data = NULL;
+		stu_list_remove(&f->waiters, e);
+
+		if (w->fd != (stu_socket_t) STU_SOCKET_INVALID
+				&& (rc != STU_HTTP_SWITCHING_PROTOCOLS || stu_http_upstream_ident_join(w, idchannel, iduser) != STU_OK)) {
+			w->upstream->finalize_handler_pt(w, rc == STU_HTTP_SWITCHING_PROTOCOLS ? STU_HTTP_INTERNAL_SERVER_ERROR : rc);
+		}
+
+		stu_mutex_unlock(&w->lock);
+	}
+
+	return f->waiters.length ? STU_AGAIN : STU_OK;
+}
+
+static void
+stu_http_upstream_ident_resume_handler(stu_event_t *ev) {
+	stu_http_upstream_ident_flight_t *f, **next;
+
+	stu_mutex_lock(&stu_http_upstream_ident_flights.lock);
+
+	for (next = &stu_http_upstream_ident_resumes; *next; ) {
+		f = *next;
+
+		if (stu_http_upstream_ident_resume_waiters_locked(f, f->result) == STU_AGAIN) {
+			next = &f->next;
+			continue;
+		}
+
+		*next = f->next;
+
+		stu_log_debug(4, "ident resumed: key=%s.", f->key.data);
+
+		stu_json_delete(f->result);
+		stu_free(f->key.data);
+		stu_free(f);
+	}
+
+	if (stu_http_upstream_ident_resumes) {
+		stu_timer_add_locked(ev, 1);
+	}
+
+	stu_mutex_unlock(&stu_http_upstream_ident_flights.lock);
+}
+
+static void
+stu_http_upstream_ident_remove_locked(stu_list_t *list, void *obj) {
+	stu_list_elt_t *elts, *e;
+	stu_queue_t    *q;
+
+	elts = &list->elts;
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		if (e->obj == obj) {
+			stu_list_remove(list, e);
+			break;
+		}
+	}
+}
+
+static stu_int_t
+stu_http_upstream_ident_join(stu_connection_t *c, stu_json_t *idchannel, stu_json_t *iduser) {
+	stu_http_request_t *r;
+	stu_upstream_t     *u;
+	stu_table_elt_t    *protocol;
+	stu_int_t           m, n, size, extened;
+	stu_str_t          *cid, *uid, *uname;
+	u_char             *data, temp[STU_HTTP_REQUEST_DEFAULT_SIZE], opcode;
+	stu_channel_t      *ch;
+	stu_json_t         *idcid, *idcstate, *iduid, *iduname, *idurole, *items[3];
+	stu_json_t         *res, *raw, *rschannel, *rsctotal, *rsuser;
+
+	r = (stu_http_request_t *) c->data;
+	u = c->upstream;
+	protocol = r->headers_out.sec_websocket_protocol;
+
+	stu_json_pluck(idchannel, stu_http_upstream_ident_channel_keys, items, 2);
+	idcid = items[0];
+	idcstate = items[1];
+
+	stu_json_pluck(iduser, stu_http_upstream_ident_user_keys, items, 3);
+	iduid = items[0];
+	iduname = items[1];
+	idurole = items[2];
 
 	if (idcid == NULL || idcid->type != STU_JSON_TYPE_STRING
 			|| idcstate == NULL || idcstate->type != STU_JSON_TYPE_NUMBER
@@ -143,22 +857,14 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 			|| iduname == NULL || iduname->type != STU_JSON_TYPE_STRING
 			|| idurole == NULL || idurole->type != STU_JSON_TYPE_NUMBER) {
 		stu_log_error(0, "Failed to analyze ident response: necessary item[s] not found.");
-		goto failed;
-	}
-
-	// get channel ID
-	channel.data = stu_calloc(r->target.len + 1);
-	if (channel.data == NULL) {
-		stu_log_error(0, "Failed to pcalloc memory for channel id, fd=%d.", c->fd);
-		goto failed;
+		return STU_ERROR;
 	}
-	stu_strncpy(channel.data, r->target.data, r->target.len);
-	channel.len = r->target.len;
 
+	// check channel ID
 	cid = (stu_str_t *) idcid->value;
-	if (stu_strncmp(cid->data, channel.data, channel.len) != 0) {
-		stu_log_error(0, "Failed to analyze ident response: channel (%s != %s) not match.", cid->data, channel.data);
-		goto failed;
+	if (stu_strncmp(cid->data, r->target.data, r->target.len) != 0) {
+		stu_log_error(0, "Failed to analyze ident response: channel (%s != %.*s) not match.", cid->data, (int) r->target.len, r->target.data);
+		return STU_ERROR;
 	}
 
 	// reset user info
@@ -167,7 +873,7 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 	c->user.id.data = stu_calloc(uid->len + 1);
 	if (c->user.id.data == NULL) {
 		stu_log_error(0, "Failed to pcalloc memory for user id, fd=%d.", c->fd);
-		goto failed;
+		return STU_ERROR;
 	}
 
 	c->user.id.len = uid->len;
@@ -177,7 +883,7 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 	c->user.name.data = stu_calloc(uname->len + 1);
 	if (c->user.name.data == NULL) {
 		stu_log_error(0, "Failed to pcalloc memory for user name, fd=%d.", c->fd);
-		goto failed;
+		return STU_ERROR;
 	}
 	stu_strncpy(c->user.name.data, uname->data, uname->len);
 	c->user.name.len = uname->len;
@@ -188,7 +894,7 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 	// insert user into channel
 	if (stu_channel_insert(cid, c) == STU_ERROR) {
 		stu_log_error(0, "Failed to insert connection: fd=%d.", c->fd);
-		goto failed;
+		return STU_ERROR;
 	}
 
 	ch = c->user.channel;
@@ -207,14 +913,19 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 	stu_json_add_item_to_object(res, rschannel);
 	stu_json_add_item_to_object(res, rsuser);
 
-	data = stu_json_stringify(res, (u_char *) temp + 10);
-	*data = '\0';
+	size = stu_protocol_serialize(c->protocol, res, temp + 10, STU_HTTP_REQUEST_DEFAULT_SIZE - 10 - 1);
 
-	stu_json_delete(idt);
 	stu_json_delete(res);
 
+	if (size > STU_HTTP_REQUEST_DEFAULT_SIZE - 10 - 1) {
+		stu_log_error(0, "Ident frame too large: fd=%d, size=%ld.", c->fd, size);
+		return STU_ERROR;
+	}
+	temp[10 + size] = '\0';
+
 	// finalize request
-	if (protocol && stu_strncmp("binary", protocol->value.data, protocol->value.len) == 0) {
+	if (c->protocol == STU_PROTOCOL_TLV
+			|| (protocol && stu_strncmp("binary", protocol->value.data, protocol->value.len) == 0)) {
 		opcode = STU_WEBSOCKET_OPCODE_BINARY;
 	} else {
 		opcode = STU_WEBSOCKET_OPCODE_TEXT;
@@ -222,22 +933,16 @@ stu_http_upstream_ident_analyze_response(stu_connection_t *c) {
 
 	u->finalize_handler_pt(c, STU_HTTP_SWITCHING_PROTOCOLS);
 
-	size = data - temp - 10;
 	data = stu_websocket_encode_frame(opcode, temp, size, &extened);
 
 	n = send(c->fd, data, size + 2 + extened, 0);
 	if (n == -1) {
+		// finalized already, the read handler sees the close
 		stu_log_debug(4, "Failed to send \"ident\" frame: fd=%d.", c->fd);
-		return STU_ERROR;
+		return STU_OK;
 	}
 
 	stu_log_debug(4, "sent: fd=%d, bytes=%d.", c->fd, n);
 
 	return STU_OK;
-
-failed:
-
-	stu_json_delete(idt);
-
-	return STU_ERROR;
 }
@@ -13,7 +13,51 @@
 
 //#define STU_HTTP_UPSTREAM_IDENT_TOKEN_MAX_LEN 128
 
+#if (__WORDSIZE == 64)
+#define STU_HTTP_UPSTREAM_IDENT_FLIGHT_MAXIMUM  512
+#else
+#define STU_HTTP_UPSTREAM_IDENT_FLIGHT_MAXIMUM  1024
+#endif
+
+#define STU_HTTP_UPSTREAM_IDENT_BATCH_ITEM_OVERHEAD  32
+#define STU_HTTP_UPSTREAM_IDENT_BATCH_ITEM_SIZE      512
+
+typedef struct stu_http_upstream_ident_flight_s stu_http_upstream_ident_flight_t;
+typedef struct stu_http_upstream_ident_batch_s stu_http_upstream_ident_batch_t;
+
+/*
+ * An ident lookup in flight. Connections asking for the same channel & token
+ * while the leader's upstream request is pending wait here, and are resumed
+ * with the leader's result instead of sending their own request.
+ */
+struct stu_http_upstream_ident_flight_s {
+	stu_str_t                         key;     // channel LF token
+	stu_str_t                         channel;
+	stu_str_t                         token;
+
+	stu_connection_t                 *leader;
+	stu_list_t                        waiters; // type: stu_connection_t *
+
+	stu_http_upstream_ident_batch_t  *batch;
+
+	stu_json_t                       *result;  // kept for the waiters busy on release
+	stu_http_upstream_ident_flight_t *next;    // of the flights still resuming
+};
+
+/*
+ * Flights collected within the batch window of the upstream server, sent as
+ * a JSON array by the carrier, which is the leader of one of them.
+ */
+struct stu_http_upstream_ident_batch_s {
+	stu_list_t                        flights; // type: stu_http_upstream_ident_flight_t *
+	stu_connection_t                 *carrier;
+};
+
+stu_int_t  stu_http_upstream_ident_init_flights();
+
+stu_int_t  stu_http_upstream_ident_init(stu_connection_t *c);
 stu_int_t  stu_http_upstream_ident_generate_request(stu_connection_t *c);
 stu_int_t  stu_http_upstream_ident_analyze_response(stu_connection_t *c);
+void       stu_http_upstream_ident_cleanup(stu_connection_t *c);
 
 #endif /* STU_UPSTREAM_IDENT_H_ */
@@ -17,4 +17,9 @@ typedef struct {
 	stu_str_t           name;
 } stu_addr_t;
 
+typedef struct {
+	in_addr_t           addr;   // network order, masked
+	in_addr_t           mask;
+} stu_cidr_t;
+
 #endif /* STU_INET_H_ */
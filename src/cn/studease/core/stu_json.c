@@ -5,11 +5,13 @@
  *      Author: Tony Lau
  */
 
-#include <float.h>
-#include <limits.h>
 #include "stu_config.h"
 #include "stu_core.h"
 
+#if (STU_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 static void *(*stu_json_malloc)(size_t size) = malloc;
 static void (*stu_json_free)(void *ptr) = free;
 
@@ -17,7 +19,45 @@ static const stu_str_t  STU_JSON_VALUE_NULL = stu_string("null");
 static const stu_str_t  STU_JSON_VALUE_TRUE = stu_string("true");
 static const stu_str_t  STU_JSON_VALUE_FALSE = stu_string("false");
 
+#define STU_JSON_INT_EXACT  9007199254740992.0 /* 2^53 */
+#define STU_JSON_INT_LEN    (sizeof("18446744073709551615") - 1)
+
+static const u_char  stu_json_hex[] = "0123456789abcdef";
+
+/* the quote, the backslash and the control bytes */
+static const u_char  stu_json_escape[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0
+};
+
+static const u_char  stu_json_digits[] =
+		"0001020304050607080910111213141516171819"
+		"2021222324252627282930313233343536373839"
+		"4041424344454647484950515253545556575859"
+		"6061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+
+typedef struct {
+	stu_uint_t   hash;
+	stu_json_t  *item;
+} stu_json_slot_t;
+
+/* open addressing, at most half full */
+struct stu_json_index_s {
+	stu_uint_t       mask;
+	stu_json_slot_t *slots;
+};
+
 static stu_int_t  stu_json_set_key(stu_json_t *item, stu_str_t *key);
+static void       stu_json_detach(stu_json_t *parent, stu_json_t *item);
+
+static stu_int_t   stu_json_index_build(stu_json_t *object);
+static stu_json_t *stu_json_index_find(stu_json_index_t *index, stu_str_t *key);
+static void        stu_json_index_free(stu_json_t *object);
 
 static size_t  stu_json_parse_value(stu_json_t *item, u_char *data, size_t len, u_char **err);
 static size_t  stu_json_parse_specific(stu_json_t *item, u_char *data, size_t len, u_char **err);
@@ -26,16 +66,16 @@ static size_t  stu_json_parse_number(stu_json_t *item, u_char *data, size_t len,
 static size_t  stu_json_parse_array(stu_json_t *item, u_char *data, size_t len, u_char **err);
 static size_t  stu_json_parse_object(stu_json_t *item, u_char *data, size_t len, u_char **err);
 
-static u_char *stu_json_print_value(stu_json_t *item, u_char *dst);
-static u_char *stu_json_print_null(stu_json_t *item, u_char *dst);
-static u_char *stu_json_print_true(stu_json_t *item, u_char *dst);
-static u_char *stu_json_print_false(stu_json_t *item, u_char *dst);
-static u_char *stu_json_print_string(stu_json_t *item, u_char *dst);
-static u_char *stu_json_print_number(stu_json_t *item, u_char *dst);
-static u_char *stu_json_print_array(stu_json_t *array, u_char *dst);
-static u_char *stu_json_print_object(stu_json_t *object, u_char *dst);
+static u_char *stu_json_print_value(stu_json_t *item, u_char *dst, u_char *last);
+static u_char *stu_json_print_string(stu_str_t *str, u_char *dst, u_char *last);
+static u_char *stu_json_print_number(stu_json_t *item, u_char *dst, u_char *last);
+static u_char *stu_json_print_integer(int64_t i, u_char *dst);
+static u_char *stu_json_print_array(stu_json_t *array, u_char *dst, u_char *last);
+static u_char *stu_json_print_object(stu_json_t *object, u_char *dst, u_char *last);
 
-static u_char *stu_json_print_key(stu_json_t *item, u_char *dst);
+static stu_inline stu_uint_t  stu_json_is_escape(u_char *p, u_char *end);
+static stu_inline u_char     *stu_json_write(u_char *dst, u_char *last, u_char *src, size_t n);
+static stu_inline u_char     *stu_json_put(u_char *dst, u_char *last, u_char c);
 
 
 void
@@ -206,6 +246,10 @@ stu_json_duplicate(stu_json_t *item, stu_bool_t recurse) {
 		copy = stu_json_create_number(&item->key, *num);
 		break;
 
+	case STU_JSON_TYPE_BOOLEAN:
+		copy = stu_json_create_bool(&item->key, (stu_bool_t) item->value);
+		break;
+
 	case STU_JSON_TYPE_ARRAY:
 	case STU_JSON_TYPE_OBJECT:
 		copy = stu_json_create(item->type, &item->key);
@@ -270,6 +314,8 @@ stu_json_add_item_to_object(stu_json_t *object, stu_json_t *item) {
 		return;
 	}
 
+	stu_json_index_free(object);
+
 	if ((void *) object->value == NULL) {
 		object->value = (uintptr_t) item;
 		item->prev = item; // already set when creating
@@ -298,15 +344,29 @@ stu_json_get_array_item_at(stu_json_t *array, stu_int_t index) {
 	return item;
 }
 
+/*
+ * Indexes the keys of a large object on the first lookup passing the first
+ * STU_JSON_INDEX_MIN members. Not to be called concurrently on a shared tree.
+ */
 stu_json_t *
 stu_json_get_object_item_by(stu_json_t *object, stu_str_t *key) {
 	stu_json_t *item;
+	stu_uint_t  n;
 
 	if (object == NULL) {
 		return NULL;
 	}
 
-	for (item = (stu_json_t *) object->value; item; item = item->next) {
+	if (object->index) {
+		return stu_json_index_find(object->index, key);
+	}
+
+	for (item = (stu_json_t *) object->value, n = 0; item; item = item->next, n++) {
+		if (n == STU_JSON_INDEX_MIN && object->type == STU_JSON_TYPE_OBJECT
+				&& stu_json_index_build(object) == STU_OK) {
+			return stu_json_index_find(object->index, key);
+		}
+
 		if (item->key.len != key->len) {
 			continue;
 		}
@@ -319,20 +379,162 @@ stu_json_get_object_item_by(stu_json_t *object, stu_str_t *key) {
 	return item;
 }
 
-
-stu_json_t *
-stu_json_remove_item_from_array(stu_json_t *array, stu_int_t index) {
+/*
+ * Finds n keys in one pass over the members, the first of duplicates as
+ * stu_json_get_object_item_by() does. Returns how many were found.
+ */
+stu_uint_t
+stu_json_pluck(stu_json_t *object, stu_str_t **keys, stu_json_t **items, stu_uint_t n) {
 	stu_json_t *item;
+	stu_uint_t  i, found;
 
-	item = stu_json_get_array_item_at(array, index);
-	if (item != NULL) {
+	for (i = 0; i < n; i++) {
+		items[i] = NULL;
+	}
+
+	if (object == NULL || object->type != STU_JSON_TYPE_OBJECT) {
+		return 0;
+	}
+
+	found = 0;
+
+	if (object->index) {
+		for (i = 0; i < n; i++) {
+			items[i] = stu_json_index_find(object->index, keys[i]);
+			if (items[i]) {
+				found++;
+			}
+		}
+
+		return found;
+	}
+
+	for (item = (stu_json_t *) object->value; item && found < n; item = item->next) {
+		for (i = 0; i < n; i++) {
+			if (items[i] || item->key.len != keys[i]->len) {
+				continue;
+			}
+
+			if (stu_strncmp(item->key.data, keys[i]->data, item->key.len) == 0) {
+				items[i] = item;
+				found++;
+			}
+		}
+	}
+
+	return found;
+}
+
+
+static stu_int_t
+stu_json_index_build(stu_json_t *object) {
+	stu_json_index_t *index;
+	stu_json_slot_t  *slot;
+	stu_json_t       *item;
+	stu_uint_t        n, size, hk, i;
+
+	for (item = (stu_json_t *) object->value, n = 0; item; item = item->next) {
+		n++;
+	}
+
+	for (size = STU_JSON_INDEX_MIN * 2; size < n * 2; size <<= 1) {
+		/* void */
+	}
+
+	index = stu_json_malloc(sizeof(stu_json_index_t) + size * sizeof(stu_json_slot_t));
+	if (index == NULL) {
+		return STU_ERROR;
+	}
+
+	index->mask = size - 1;
+	index->slots = (stu_json_slot_t *) (index + 1);
+	stu_memzero(index->slots, size * sizeof(stu_json_slot_t));
+
+	for (item = (stu_json_t *) object->value; item; item = item->next) {
+		hk = stu_hash_key(item->key.data, item->key.len);
+
+		for (i = hk & index->mask; index->slots[i].item; i = (i + 1) & index->mask) {
+			slot = &index->slots[i];
+
+			// keep the first of duplicates
+			if (slot->hash == hk && slot->item->key.len == item->key.len
+					&& stu_strncmp(slot->item->key.data, item->key.data, item->key.len) == 0) {
+				break;
+			}
+		}
+
+		if (index->slots[i].item == NULL) {
+			index->slots[i].hash = hk;
+			index->slots[i].item = item;
+		}
+	}
+
+	object->index = index;
+
+	return STU_OK;
+}
+
+static stu_json_t *
+stu_json_index_find(stu_json_index_t *index, stu_str_t *key) {
+	stu_json_slot_t *slot;
+	stu_uint_t       hk, i;
+
+	hk = stu_hash_key(key->data, key->len);
+
+	for (i = hk & index->mask; index->slots[i].item; i = (i + 1) & index->mask) {
+		slot = &index->slots[i];
+
+		if (slot->hash == hk && slot->item->key.len == key->len
+				&& stu_strncmp(slot->item->key.data, key->data, key->len) == 0) {
+			return slot->item;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+stu_json_index_free(stu_json_t *object) {
+	if (object->index) {
+		stu_json_free(object->index);
+		object->index = NULL;
+	}
+}
+
+
+static void
+stu_json_detach(stu_json_t *parent, stu_json_t *item) {
+	stu_json_t *head;
+
+	stu_json_index_free(parent);
+
+	head = (stu_json_t *) parent->value;
+
+	if (item == head) {
+		parent->value = (uintptr_t) item->next;
+		if (item->next != NULL) {
+			item->next->prev = item->prev;
+		}
+	} else {
 		item->prev->next = item->next;
 		if (item->next != NULL) {
 			item->next->prev = item->prev;
+		} else {
+			head->prev = item->prev;
 		}
+	}
 
-		item->prev = item;
-		item->next = NULL;
+	item->prev = item;
+	item->next = NULL;
+}
+
+stu_json_t *
+stu_json_remove_item_from_array(stu_json_t *array, stu_int_t index) {
+	stu_json_t *item;
+
+	item = stu_json_get_array_item_at(array, index);
+	if (item != NULL) {
+		stu_json_detach(array, item);
 	}
 
 	return item;
@@ -344,13 +546,7 @@ stu_json_remove_item_from_object(stu_json_t *object, stu_str_t *key) {
 
 	item = stu_json_get_object_item_by(object, key);
 	if (item != NULL) {
-		item->prev->next = item->next;
-		if (item->next != NULL) {
-			item->next->prev = item->prev;
-		}
-
-		item->prev = item;
-		item->next = NULL;
+		stu_json_detach(object, item);
 	}
 
 	return item;
@@ -359,7 +555,7 @@ stu_json_remove_item_from_object(stu_json_t *object, stu_str_t *key) {
 
 void
 stu_json_delete(stu_json_t *item) {
-	stu_json_t *child;
+	stu_json_t *child, *next;
 	stu_str_t  *str;
 
 	if (item == NULL) {
@@ -380,9 +576,12 @@ stu_json_delete(stu_json_t *item) {
 		break;
 	case STU_JSON_TYPE_ARRAY:
 	case STU_JSON_TYPE_OBJECT:
-		for (child = (stu_json_t *) item->value; child; child = child->next) {
+		for (child = (stu_json_t *) item->value; child; child = next) {
+			next = child->next;
 			stu_json_delete(child);
 		}
+
+		stu_json_index_free(item);
 		break;
 	default:
 		break;
@@ -531,6 +730,7 @@ stu_json_parse_string(stu_json_t *item, u_char *data, size_t len, u_char **err)
 		sw_start = 0,
 		sw_str_start,
 		sw_str,
+		sw_str_escape,
 		sw_str_end
 	} state;
 
@@ -563,6 +763,8 @@ stu_json_parse_string(stu_json_t *item, u_char *data, size_t len, u_char **err)
 				str->data = NULL;
 				str->len = 0;
 				state = sw_str_end;
+			} else if (c == '\\') {
+				state = sw_str_escape;
 			} else {
 				state = sw_str;
 			}
@@ -581,11 +783,17 @@ stu_json_parse_string(stu_json_t *item, u_char *data, size_t len, u_char **err)
 				stu_strncpy(str->data, s, str->len);
 
 				state = sw_str_end;
+			} else if (c == '\\') {
+				state = sw_str_escape;
 			} else {
 				// appending
 			}
 			break;
 
+		case sw_str_escape:
+			state = sw_str;
+			break;
+
 		case sw_str_end:
 			goto done;
 			break;
@@ -608,21 +816,32 @@ failed:
 
 static size_t
 stu_json_parse_number(stu_json_t *item, u_char *data, size_t len, u_char **err) {
-	size_t        pos;
-	u_char       *p, c, *endptr;
+	u_char       *p, *last, *digits, *endptr;
+	uint64_t      n;
 	stu_double_t  num;
+	stu_uint_t    negative;
 
-	pos = 0;
 	p = data;
-	endptr = NULL;
+	last = data + len;
 
-	for (c = *p; c == ' ' || c == CR || c == LF || c == '\t'; p++, pos++, c = *p) {
-		/* void */
+	negative = p < last && *p == '-';
+	if (negative) {
+		p++;
 	}
 
-	num = strtod((const char*) data, (char**) &endptr);
-	if (data == endptr) {
-		goto failed;
+	for (n = 0, digits = p; p < last && *p >= '0' && *p <= '9'; p++) {
+		n = n * 10 + (*p - '0');
+	}
+
+	// integers of up to 15 digits are exact in a double, and need no strtod
+	if (p > digits && p - digits <= 15 && (p == last || (*p != '.' && *p != 'e' && *p != 'E'))) {
+		num = negative ? -(stu_double_t) n : (stu_double_t) n;
+		endptr = p;
+	} else {
+		num = strtod((const char *) data, (char **) &endptr);
+		if (data == endptr) {
+			goto failed;
+		}
 	}
 
 	item->value = (uintptr_t) stu_json_malloc(8);
@@ -632,15 +851,13 @@ stu_json_parse_number(stu_json_t *item, u_char *data, size_t len, u_char **err)
 
 	*(stu_double_t *) item->value = num;
 
-	pos += endptr - data;
-
-	return pos;
+	return endptr - data;
 
 failed:
 
-	*err = p;
+	*err = data;
 
-	return pos;
+	return 0;
 }
 
 static size_t
@@ -861,154 +1078,322 @@ failed:
 }
 
 
-u_char *
-stu_json_stringify(stu_json_t *item, u_char *dst) {
-	return stu_json_print_value(item, dst);
+/*
+ * Never writes at or beyond dst + size, and returns the length of the whole
+ * text, so a result greater than size means it was cut short.
+ */
+size_t
+stu_json_stringify(stu_json_t *item, u_char *dst, size_t size) {
+	return stu_json_print_value(item, dst, dst + size) - dst;
 }
 
 static u_char *
-stu_json_print_value(stu_json_t *item, u_char *dst) {
+stu_json_print_value(stu_json_t *item, u_char *dst, u_char *last) {
 	u_char *p;
 
 	switch (item->type) {
 	case STU_JSON_TYPE_NULL:
-		p = stu_json_print_null(item, dst);
+		p = stu_json_write(dst, last, STU_JSON_VALUE_NULL.data, STU_JSON_VALUE_NULL.len);
 		break;
 
 	case STU_JSON_TYPE_BOOLEAN:
 		if (item->value == FALSE) {
-			p = stu_json_print_false(item, dst);
+			p = stu_json_write(dst, last, STU_JSON_VALUE_FALSE.data, STU_JSON_VALUE_FALSE.len);
 		} else {
-			p = stu_json_print_true(item, dst);
+			p = stu_json_write(dst, last, STU_JSON_VALUE_TRUE.data, STU_JSON_VALUE_TRUE.len);
 		}
 		break;
 
 	case STU_JSON_TYPE_STRING:
-		p = stu_json_print_string(item, dst);
+		p = stu_json_print_string((stu_str_t *) item->value, dst, last);
 		break;
 
 	case STU_JSON_TYPE_NUMBER:
-		p = stu_json_print_number(item, dst);
+		p = stu_json_print_number(item, dst, last);
 		break;
 
 	case STU_JSON_TYPE_ARRAY:
-		p = stu_json_print_array(item, dst);
+		p = stu_json_print_array(item, dst, last);
 		break;
 
 	case STU_JSON_TYPE_OBJECT:
-		p = stu_json_print_object(item, dst);
+		p = stu_json_print_object(item, dst, last);
 		break;
 
 	default:
+		p = dst;
 		break;
 	}
 
 	return p;
 }
 
+/*
+ * Strings keep the escapes they were parsed with, so a valid escape is copied
+ * through, while a bare quote, a stray backslash or a control byte is escaped.
+ */
 static u_char *
-stu_json_print_null(stu_json_t *item, u_char *dst) {
-	return stu_strncpy(dst, STU_JSON_VALUE_NULL.data, STU_JSON_VALUE_NULL.len);
-}
+stu_json_print_string(stu_str_t *str, u_char *dst, u_char *last) {
+	u_char   *p, *end, *q, c, temp[6];
+#if (STU_HAVE_SSE2)
+	__m128i   qt, bs, ctl, v;
+	int       m, n;
+
+	qt = _mm_set1_epi8('\"');
+	bs = _mm_set1_epi8('\\');
+	ctl = _mm_set1_epi8(0x1F);
+#endif
+
+	dst = stu_json_put(dst, last, '\"');
+
+	p = str->data;
+	end = p + str->len;
+
+	for ( ;; ) {
+#if (STU_HAVE_SSE2)
+		// chat text is mostly plain bytes, stored a block at a time while it fits
+		while (end - p >= 16 && last - dst >= 16) {
+			v = _mm_loadu_si128((const __m128i *) p);
+			_mm_storeu_si128((__m128i *) dst, v);
+
+			m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, qt), _mm_cmpeq_epi8(v, bs)),
+					_mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)));
+			if (m) {
+				n = __builtin_ctz(m);
+				p += n;
+				dst += n;
+				break;
+			}
 
-static u_char *
-stu_json_print_true(stu_json_t *item, u_char *dst) {
-	return stu_strncpy(dst, STU_JSON_VALUE_TRUE.data, STU_JSON_VALUE_TRUE.len);
-}
+			p += 16;
+			dst += 16;
+		}
+#endif
 
-static u_char *
-stu_json_print_false(stu_json_t *item, u_char *dst) {
-	return stu_strncpy(dst, STU_JSON_VALUE_FALSE.data, STU_JSON_VALUE_FALSE.len);
+		if (last - dst >= end - p) {
+			while (p < end && stu_json_escape[*p] == 0) {
+				*dst++ = *p++;
+			}
+		} else {
+			for ( ; p < end && stu_json_escape[*p] == 0; p++) {
+				dst = stu_json_put(dst, last, *p);
+			}
+		}
+
+		if (p == end) {
+			break;
+		}
+
+		q = p;
+		c = *q++;
+
+		if (c == '\\' && q < end && stu_json_is_escape(q, end)) {
+			dst = stu_json_put(dst, last, '\\');
+			dst = stu_json_put(dst, last, *q++);
+			p = q;
+			continue;
+		}
+
+		temp[0] = '\\';
+
+		switch (c) {
+		case '\"':
+		case '\\':
+			temp[1] = c;
+			break;
+		case '\b':
+			temp[1] = 'b';
+			break;
+		case '\f':
+			temp[1] = 'f';
+			break;
+		case LF:
+			temp[1] = 'n';
+			break;
+		case CR:
+			temp[1] = 'r';
+			break;
+		case '\t':
+			temp[1] = 't';
+			break;
+		default:
+			temp[1] = 'u';
+			temp[2] = '0';
+			temp[3] = '0';
+			temp[4] = stu_json_hex[c >> 4];
+			temp[5] = stu_json_hex[c & 0xF];
+
+			dst = stu_json_write(dst, last, temp, 6);
+			p = q;
+			continue;
+		}
+
+		dst = stu_json_write(dst, last, temp, 2);
+		p = q;
+	}
+
+	return stu_json_put(dst, last, '\"');
 }
 
-static u_char *
-stu_json_print_string(stu_json_t *item, u_char *dst) {
-	stu_str_t *str;
+/* p follows a backslash */
+static stu_inline stu_uint_t
+stu_json_is_escape(u_char *p, u_char *end) {
+	u_char      c;
+	stu_uint_t  i;
 
-	str = (stu_str_t *) item->value;
+	switch (*p) {
+	case '\"':
+	case '\\':
+	case '/':
+	case 'b':
+	case 'f':
+	case 'n':
+	case 'r':
+	case 't':
+		return TRUE;
+
+	case 'u':
+		if (end - p < 5) {
+			return FALSE;
+		}
+
+		for (i = 1; i < 5; i++) {
+			c = p[i] | 0x20;
+			if ((c < '0' || c > '9') && (c < 'a' || c > 'f')) {
+				return FALSE;
+			}
+		}
 
-	*dst++ = '\"';
-	dst = stu_strncpy(dst, str->data, str->len);
-	*dst++ = '\"';
+		return TRUE;
 
-	return dst;
+	default:
+		return FALSE;
+	}
 }
 
 static u_char *
-stu_json_print_number(stu_json_t *item, u_char *dst) {
+stu_json_print_number(stu_json_t *item, u_char *dst, u_char *last) {
+	u_char        temp[32];
 	stu_double_t  d;
-	stu_int_t     i;
+	int64_t       i;
+	int           n, precision;
 
 	d = *(stu_double_t *) item->value;
-	i = (stu_int_t) d;
 
-	if (d == 0) {
-		*dst++ = '0';
-	} else if ((fabs(d - (stu_double_t) i) <= DBL_EPSILON) && (d <= INT_MAX) && (d >= INT_MIN)) {
-		dst = stu_sprintf(dst, "%d", i);
-	} else {
-		if ((d * 0) != 0) { // NaN or Infinity
-			dst = stu_strncpy(dst, STU_JSON_VALUE_NULL.data, STU_JSON_VALUE_NULL.len);
-		} else if ((fabs(floor(d) - d) <= DBL_EPSILON) && (fabs(d) < 1.0e60)) {
-			dst = stu_sprintf(dst, "%.0f", d);
-		} else if ((fabs(d) < 1.0e-6) || (fabs(d) > 1.0e9)) {
-			dst = stu_sprintf(dst, "%e", d);
-		} else {
-			dst = stu_sprintf(dst, "%f", d);
+	// req, role, state and total are all small integers
+	if (d > -STU_JSON_INT_EXACT && d < STU_JSON_INT_EXACT) {
+		i = (int64_t) d;
+		if ((stu_double_t) i == d) {
+			if (last - dst > (ssize_t) STU_JSON_INT_LEN) {
+				return stu_json_print_integer(i, dst);
+			}
+
+			return stu_json_write(dst, last, temp, stu_json_print_integer(i, temp) - temp);
+		}
+	}
+
+	if ((d * 0) != 0) { // NaN or Infinity
+		return stu_json_write(dst, last, STU_JSON_VALUE_NULL.data, STU_JSON_VALUE_NULL.len);
+	}
+
+	// the fewest significant digits that read back the same double
+	for (precision = 15; /* void */; precision++) {
+		n = snprintf((char *) temp, sizeof(temp), "%.*g", precision, d);
+		if (precision == 17 || strtod((const char *) temp, NULL) == d) {
+			break;
 		}
 	}
 
-	return dst;
+	return stu_json_write(dst, last, temp, n);
+}
+
+static u_char *
+stu_json_print_integer(int64_t i, u_char *dst) {
+	u_char      temp[STU_JSON_INT_LEN], *p;
+	uint64_t    n;
+	stu_uint_t  k;
+
+	if (i < 0) {
+		*dst++ = '-';
+		n = -(uint64_t) i;
+	} else {
+		n = i;
+	}
+
+	p = temp + STU_JSON_INT_LEN;
+
+	// two digits a time
+	while (n >= 100) {
+		k = (n % 100) * 2;
+		n /= 100;
+
+		*--p = stu_json_digits[k + 1];
+		*--p = stu_json_digits[k];
+	}
+
+	if (n >= 10) {
+		k = n * 2;
+
+		*--p = stu_json_digits[k + 1];
+		*--p = stu_json_digits[k];
+	} else {
+		*--p = (u_char) ('0' + n);
+	}
+
+	return stu_memcpy(dst, p, temp + STU_JSON_INT_LEN - p);
 }
 
 static u_char *
-stu_json_print_array(stu_json_t *array, u_char *dst) {
+stu_json_print_array(stu_json_t *array, u_char *dst, u_char *last) {
 	stu_json_t *item;
 
-	*dst++ = '[';
+	dst = stu_json_put(dst, last, '[');
 
 	for (item = (stu_json_t *) array->value; item; item = item->next) {
-		dst = stu_json_print_value(item, dst);
+		dst = stu_json_print_value(item, dst, last);
 
 		if (item->next != NULL) {
-			*dst++ = ',';
+			dst = stu_json_put(dst, last, ',');
 		}
 	}
 
-	*dst++ = ']';
-
-	return dst;
+	return stu_json_put(dst, last, ']');
 }
 
 static u_char *
-stu_json_print_object(stu_json_t *object, u_char *dst) {
+stu_json_print_object(stu_json_t *object, u_char *dst, u_char *last) {
 	stu_json_t *item;
 
-	*dst++ = '{';
+	dst = stu_json_put(dst, last, '{');
 
 	for (item = (stu_json_t *) object->value; item; item = item->next) {
-		dst = stu_json_print_key(item, dst);
-
-		*dst++ = ':';
-
-		dst = stu_json_print_value(item, dst);
+		dst = stu_json_print_string(&item->key, dst, last);
+		dst = stu_json_put(dst, last, ':');
+		dst = stu_json_print_value(item, dst, last);
 
 		if (item->next != NULL) {
-			*dst++ = ',';
+			dst = stu_json_put(dst, last, ',');
 		}
 	}
 
-	*dst++ = '}';
-
-	return dst;
+	return stu_json_put(dst, last, '}');
 }
 
-static u_char *
-stu_json_print_key(stu_json_t *item, u_char *dst) {
-	*dst++ = '\"';
-	dst = stu_strncpy(dst, item->key.data, item->key.len);
-	*dst++ = '\"';
+/* the writers below only count what would not fit */
+static stu_inline u_char *
+stu_json_write(u_char *dst, u_char *last, u_char *src, size_t n) {
+	if (dst < last) {
+		memcpy(dst, src, stu_min(n, (size_t) (last - dst)));
+	}
 
-	return dst;
+	return dst + n;
 }
 
+static stu_inline u_char *
+stu_json_put(u_char *dst, u_char *last, u_char c) {
+	if (dst < last) {
+		*dst = c;
+	}
+
+	return dst + 1;
+}
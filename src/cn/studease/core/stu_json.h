@@ -19,15 +19,20 @@
 #define STU_JSON_TYPE_ARRAY   0x10
 #define STU_JSON_TYPE_OBJECT  0x20
 
+#define STU_JSON_INDEX_MIN    16
+
 typedef struct stu_json_s stu_json_t;
+typedef struct stu_json_index_s stu_json_index_t;
 
 struct stu_json_s {
-	uint8_t     type;
-	stu_str_t   key;
-	uintptr_t   value;
+	uint8_t           type;
+	stu_str_t         key;
+	uintptr_t         value;
+
+	stu_json_t       *prev;
+	stu_json_t       *next;
 
-	stu_json_t *prev;
-	stu_json_t *next;
+	stu_json_index_t *index; // of an object's keys, built on lookups
 };
 
 typedef struct {
@@ -55,6 +60,7 @@ void  stu_json_add_item_to_object(stu_json_t *object, stu_json_t *item);
 
 stu_json_t *stu_json_get_array_item_at(stu_json_t *array, stu_int_t index);
 stu_json_t *stu_json_get_object_item_by(stu_json_t *object, stu_str_t *key);
+stu_uint_t  stu_json_pluck(stu_json_t *object, stu_str_t **keys, stu_json_t **items, stu_uint_t n);
 
 stu_json_t *stu_json_remove_item_from_array(stu_json_t *array, stu_int_t index);
 stu_json_t *stu_json_remove_item_from_object(stu_json_t *object, stu_str_t *key);
@@ -65,6 +71,6 @@ void  stu_json_delete_item_from_array(stu_json_t *array, stu_int_t index);
 void  stu_json_delete_item_from_object(stu_json_t *object, stu_str_t *key);
 
 stu_json_t *stu_json_parse(u_char *data, size_t len);
-u_char *stu_json_stringify(stu_json_t *item, u_char *dst);
+size_t stu_json_stringify(stu_json_t *item, u_char *dst, size_t size);
 
 #endif /* STU_JSON_H_ */
@@ -11,13 +11,52 @@
 
 stu_file_t *stu_logger = NULL;
 
+/* shared by the worker processes once stu_log_init() mapped them. */
+static stu_int_t           stu_log_levels_default[STU_LOG_MODULES];
+volatile stu_int_t        *stu_log_levels = stu_log_levels_default;
+
+static stu_str_t  stu_log_modules[] = {
+	stu_string("core"),
+	stu_string("event"),
+	stu_string("process"),
+	stu_string("channel"),
+	stu_string("http"),
+	stu_string("websocket"),
+	stu_string("upstream"),
+	stu_string("resolver"),
+	stu_string("flash")
+};
+
+static stu_log_ring_t     *stu_log_rings[STU_LOG_RINGS_MAXIMUM];
+static volatile uint32_t   stu_log_rings_n;
+static stu_thread_key_t    stu_log_key;
+
+static stu_tid_t           stu_log_writer;
+static volatile stu_bool_t stu_log_running;
+static volatile stu_bool_t stu_log_quit;
+static stu_mutex_t         stu_log_lock;
+static stu_cond_t          stu_log_cond;
+static stu_uint_t          stu_log_dropped_reported;
+static volatile stu_bool_t stu_log_reopening;
+static time_t              stu_log_opened;
+static u_char              stu_log_batch[STU_LOG_BATCH_SIZE];
+
+static void            stu_log_write(u_char *buf, size_t n);
+static void            stu_log_write_sync(u_char *buf, size_t n);
+static stu_log_ring_t *stu_log_get_ring();
+static stu_thread_value_t stu_log_writer_cycle(void *data);
+static size_t          stu_log_flush();
+static stu_int_t       stu_log_reopen_file();
+
 static u_char *stu_log_prefix(u_char *buf, const stu_str_t prefix);
+static u_char *stu_log_vsprintf(u_char *buf, u_char *last, const char *fmt, va_list args);
 static u_char *stu_log_errno(u_char *buf, u_char *last, stu_int_t err);
 
 
 stu_int_t
 stu_log_init(stu_file_t *file) {
 	u_char    *p, *last, temp[STU_FILE_PATH_MAX_LEN];
+	stu_shm_t  shm;
 
 	last = file->name.data + file->name.len;
 
@@ -41,10 +80,184 @@ stu_log_init(stu_file_t *file) {
 	}
 
 	stu_logger = file;
+	stu_log_opened = time(NULL);
+
+	shm.size = sizeof(stu_log_levels_default);
+	if (stu_shm_alloc(&shm) == STU_ERROR) {
+		stu_log_error(0, "Failed to alloc shm for log levels, changes will not reach workers.");
+		return STU_OK;
+	}
+
+	memcpy(shm.addr, stu_log_levels_default, shm.size);
+	stu_log_levels = (stu_int_t *) shm.addr;
+
+	return STU_OK;
+}
+
+/*
+ * With the writer running, it reopens the file between two batches, so the
+ * other threads never wait for it.
+ */
+stu_int_t
+stu_log_reopen() {
+	if (stu_log_running) {
+		stu_log_reopening = TRUE;
+		stu_cond_signal(&stu_log_cond);
+		return STU_OK;
+	}
+
+	return stu_log_reopen_file();
+}
+
+/*
+ * Called by the master process, which renames the file once it grew larger
+ * than max_size, or was opened interval seconds ago. 0 disables either.
+ * Returns STU_DECLINED if not rotated, the workers should reopen otherwise.
+ */
+stu_int_t
+stu_log_rotate(size_t max_size, time_t interval) {
+	u_char          *p, name[STU_FILE_PATH_MAX_LEN + 32];
+	stu_file_info_t  fi;
+	stu_tm_t         tm;
+	stu_uint_t       n;
+	time_t           now;
+
+	if (stu_logger == NULL || (max_size == 0 && interval == 0)) {
+		return STU_DECLINED;
+	}
+
+	now = time(NULL);
+
+	if (interval == 0 || now - stu_log_opened < interval) {
+		if (max_size == 0) {
+			return STU_DECLINED;
+		}
+
+		if (fstat(stu_logger->fd, &fi) == -1) {
+			stu_log_error(stu_errno, "fstat() log file failed.");
+			return STU_ERROR;
+		}
+
+		if ((size_t) fi.st_size < max_size) {
+			return STU_DECLINED;
+		}
+	}
+
+	stu_localtime(now, &tm);
+
+	// leaves room for the ".n" of a name taken
+	p = stu_slprintf(name, name + sizeof(name) - 4, "%s.%4d%02d%02d-%02d%02d%02d%Z", stu_logger->name.data,
+			tm.stu_tm_year, tm.stu_tm_mon, tm.stu_tm_mday,
+			tm.stu_tm_hour, tm.stu_tm_min, tm.stu_tm_sec);
+
+	for (n = 1; stu_file_exist(name) == 0 && n < 100; n++) {
+		stu_sprintf(p - 1, ".%ui%Z", n);
+	}
+
+	if (rename((const char *) stu_logger->name.data, (const char *) name) == -1) {
+		stu_log_error(stu_errno, "rename() log file to \"%s\" failed.", name);
+		return STU_ERROR;
+	}
+
+	if (stu_log_reopen_file() == STU_ERROR) {
+		return STU_ERROR;
+	}
+
+	stu_log("log rotated: %s.", name);
 
 	return STU_OK;
 }
 
+stu_int_t
+stu_log_set_level(stu_str_t *module, stu_int_t level) {
+	stu_int_t  i;
+
+	if (level < 0) {
+		level = 0;
+	}
+
+	if (module->len == 1 && module->data[0] == '*') {
+		for (i = 0; i < STU_LOG_MODULES; i++) {
+			stu_log_levels[i] = level;
+		}
+
+		return STU_OK;
+	}
+
+	for (i = 0; i < STU_LOG_MODULES; i++) {
+		if (stu_log_modules[i].len == module->len
+				&& stu_strncasecmp(stu_log_modules[i].data, module->data, module->len) == 0) {
+			stu_log_levels[i] = level;
+			return STU_OK;
+		}
+	}
+
+	return STU_DECLINED;
+}
+
+/*
+ * spec: "module=level" pairs separated by ',' or spaces, in which module
+ * "*" stands for all, and level "off" mutes the debug records.
+ * e.g. "*=off, websocket=3".
+ */
+stu_int_t
+stu_log_set_levels(u_char *spec, size_t len) {
+	u_char     *p, *q, *last, *eq;
+	stu_str_t   module, value;
+	stu_int_t   level, rc;
+
+	rc = STU_OK;
+	last = spec + len;
+
+	for (p = spec; p < last; /* void */) {
+		if (*p == ',' || *p == ' ' || *p == '\t' || *p == CR || *p == LF) {
+			p++;
+			continue;
+		}
+
+		module.data = p;
+		for (eq = NULL; p < last && *p != ',' && *p != ' ' && *p != CR && *p != LF; p++) {
+			if (*p == '=' && eq == NULL) {
+				eq = p;
+			}
+		}
+
+		if (eq == NULL || eq == module.data || eq + 1 == p) {
+			stu_log_error(0, "Bad log level \"%.*s\".", (int) (p - module.data), module.data);
+			rc = STU_ERROR;
+			continue;
+		}
+
+		module.len = eq - module.data;
+		value.data = eq + 1;
+		value.len = p - value.data;
+
+		if (value.len == 3 && stu_strncasecmp(value.data, (u_char *) "off", 3) == 0) {
+			level = STU_LOG_LEVEL_OFF;
+		} else {
+			for (level = 0, q = value.data; q < p && *q >= '0' && *q <= '9'; q++) {
+				level = level * 10 + *q - '0';
+			}
+
+			if (q < p || level > STU_LOG_LEVEL_OFF) {
+				stu_log_error(0, "Bad log level \"%.*s\".", (int) (p - module.data), module.data);
+				rc = STU_ERROR;
+				continue;
+			}
+		}
+
+		if (stu_log_set_level(&module, level) != STU_OK) {
+			stu_log_error(0, "Unknown log module \"%.*s\".", (int) module.len, module.data);
+			rc = STU_ERROR;
+			continue;
+		}
+
+		stu_log("log level: %.*s=%ld.", (int) module.len, module.data, level);
+	}
+
+	return rc;
+}
+
 void
 stu_log_c(const char *fmt, ...) {
 	u_char   temp[STU_LOG_RECORD_MAX_LEN];
@@ -54,7 +267,7 @@ stu_log_c(const char *fmt, ...) {
 	p = stu_log_prefix(temp, STU_LOG_PREFIX);
 
 	va_start(args, fmt);
-	p = stu_vsprintf(p, fmt, args);
+	p = stu_log_vsprintf(p, last, fmt, args);
 	va_end(args);
 
 	if (p >= last - 1) {
@@ -63,11 +276,7 @@ stu_log_c(const char *fmt, ...) {
 	*p++ = LF;
 	*p = '\0';
 
-	if (stu_logger) {
-		stu_file_write(stu_logger, temp, p - temp, stu_atomic_fetch(&stu_logger->offset));
-	}
-
-	stu_printf((const char *) temp);
+	stu_log_write(temp, p - temp);
 }
 
 void
@@ -76,15 +285,11 @@ stu_log_c_debug(stu_int_t level, const char *fmt, ...) {
 	u_char  *p, *last = temp + STU_LOG_RECORD_MAX_LEN;
 	va_list  args;
 
-	if (level < __LOGGER) {
-		return;
-	}
-
 	p = stu_log_prefix(temp, STU_DEBUG_PREFIX);
-	p = stu_sprintf(p, "[%d]", level);
+	p = stu_sprintf(p, "[%i]", level);
 
 	va_start(args, fmt);
-	p = stu_vsprintf(p, fmt, args);
+	p = stu_log_vsprintf(p, last, fmt, args);
 	va_end(args);
 
 	if (p >= last - 1) {
@@ -93,11 +298,7 @@ stu_log_c_debug(stu_int_t level, const char *fmt, ...) {
 	*p++ = LF;
 	*p = '\0';
 
-	if (stu_logger) {
-		stu_file_write(stu_logger, temp, p - temp, stu_atomic_fetch(&stu_logger->offset));
-	}
-
-	stu_printf((const char *) temp);
+	stu_log_write(temp, p - temp);
 }
 
 void
@@ -109,7 +310,7 @@ stu_log_c_error(stu_int_t err, const char *fmt, ...) {
 	p = stu_log_prefix(temp, STU_ERROR_PREFIX);
 
 	va_start(args, fmt);
-	p = stu_vsprintf(p, fmt, args);
+	p = stu_log_vsprintf(p, last, fmt, args);
 	va_end(args);
 
 	if (err) {
@@ -124,13 +325,298 @@ stu_log_c_error(stu_int_t err, const char *fmt, ...) {
 	*p++ = LF;
 	*p = '\0';
 
+	stu_log_write(temp, p - temp);
+}
+
+/*
+ * Started in a worker process, after fork(). The master process, and any
+ * thread of which the ring is not available, writes synchronously. Stopped
+ * on exit() as well, to drain the records of a fatal error.
+ */
+stu_int_t
+stu_log_writer_start() {
+	static stu_bool_t  registered;
+
+	if (stu_log_running) {
+		return STU_OK;
+	}
+
+	if (registered == FALSE) {
+		if (atexit(stu_log_writer_stop) != 0) {
+			stu_log_error(0, "Failed to register log writer stop on exit.");
+			return STU_ERROR;
+		}
+
+		registered = TRUE;
+	}
+
+	if (stu_thread_key_create(&stu_log_key) != 0) {
+		stu_log_error(stu_errno, "Failed to create log thread key.");
+		return STU_ERROR;
+	}
+
+	stu_mutex_init(&stu_log_lock, NULL);
+	if (stu_cond_init(&stu_log_cond) == STU_ERROR) {
+		return STU_ERROR;
+	}
+
+	stu_log_quit = FALSE;
+
+	if (stu_thread_create(&stu_log_writer, stu_log_writer_cycle, NULL) == STU_ERROR) {
+		stu_log_error(0, "Failed to create log writer thread.");
+		return STU_ERROR;
+	}
+
+	stu_log_running = TRUE;
+
+	return STU_OK;
+}
+
+void
+stu_log_writer_stop() {
+	if (stu_log_running == FALSE) {
+		return;
+	}
+
+	stu_log_quit = TRUE;
+	stu_cond_signal(&stu_log_cond);
+
+	stu_thread_join(stu_log_writer, NULL);
+
+	stu_log_running = FALSE;
+}
+
+stu_uint_t
+stu_log_dropped() {
+	stu_log_ring_t *ring;
+	stu_uint_t      i, n;
+
+	n = 0;
+
+	for (i = 0; i < stu_log_rings_n && i < STU_LOG_RINGS_MAXIMUM; i++) {
+		ring = stu_log_rings[i];
+		if (ring) {
+			n += ring->dropped;
+		}
+	}
+
+	return n;
+}
+
+
+static void
+stu_log_write(u_char *buf, size_t n) {
+	stu_log_ring_t *ring;
+	uint32_t        head, tail, i, m;
+
+	ring = stu_log_get_ring();
+	if (ring == NULL) {
+		stu_log_write_sync(buf, n);
+		return;
+	}
+
+	head = ring->head;
+	tail = ring->tail;
+
+	// never wait for the writer, drop the record.
+	if (STU_LOG_RING_SIZE - (head - tail) < n) {
+		stu_atomic_fetch_add(&ring->dropped, 1);
+		stu_cond_signal(&stu_log_cond);
+		return;
+	}
+
+	i = head & (STU_LOG_RING_SIZE - 1);
+	m = stu_min(n, STU_LOG_RING_SIZE - i);
+
+	memcpy(ring->data + i, buf, m);
+	memcpy(ring->data, buf + m, n - m);
+
+	// the record must be visible before the head moves.
+	stu_memory_barrier();
+	ring->head = head + n;
+
+	if (head + n - tail > STU_LOG_RING_SIZE / 2) {
+		stu_cond_signal(&stu_log_cond);
+	}
+}
+
+static void
+stu_log_write_sync(u_char *buf, size_t n) {
 	if (stu_logger) {
-		stu_file_write(stu_logger, temp, p - temp, stu_atomic_fetch(&stu_logger->offset));
+		stu_file_write(stu_logger, buf, n, stu_atomic_fetch(&stu_logger->offset));
+	}
+
+	if (write(STDOUT_FILENO, buf, n) == -1) {
+		/* void */
+	}
+}
+
+static stu_log_ring_t *
+stu_log_get_ring() {
+	stu_log_ring_t *ring;
+	uint32_t        i;
+
+	if (stu_log_running == FALSE || stu_log_quit) {
+		return NULL;
+	}
+
+	ring = (stu_log_ring_t *) stu_thread_get_specific(stu_log_key);
+	if (ring) {
+		return ring == (stu_log_ring_t *) -1 ? NULL : ring;
+	}
+
+	// stu_calloc() logs as well, write those synchronously.
+	stu_thread_set_specific(stu_log_key, (void *) -1);
+
+	i = stu_atomic_fetch_add(&stu_log_rings_n, 1);
+	if (i >= STU_LOG_RINGS_MAXIMUM) {
+		return NULL;
 	}
 
-	stu_printf((const char *) temp);
+	ring = stu_calloc(sizeof(stu_log_ring_t));
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	ring->data = stu_calloc(STU_LOG_RING_SIZE);
+	if (ring->data == NULL) {
+		return NULL;
+	}
+
+	stu_memory_barrier();
+	stu_log_rings[i] = ring;
+
+	stu_thread_set_specific(stu_log_key, ring);
+
+	return ring;
 }
 
+static stu_thread_value_t
+stu_log_writer_cycle(void *data) {
+	struct timespec  ts;
+	struct timeval   tv;
+	size_t           n;
+
+	for ( ;; ) {
+		n = stu_log_flush();
+
+		if (stu_log_reopening) {
+			stu_log_reopening = FALSE;
+			stu_log_reopen_file();
+		}
+
+		if (n) {
+			continue;
+		}
+
+		if (stu_log_quit) {
+			break;
+		}
+
+		stu_gettimeofday(&tv);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = (tv.tv_usec + STU_LOG_FLUSH_INTERVAL * 1000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		stu_mutex_lock(&stu_log_lock);
+		stu_cond_timedwait(&stu_log_cond, &stu_log_lock, &ts);
+		stu_mutex_unlock(&stu_log_lock);
+	}
+
+	return NULL;
+}
+
+/* drain the rings into large writes, returns the bytes written. */
+static size_t
+stu_log_flush() {
+	stu_log_ring_t *ring;
+	u_char         *p, *last;
+	uint32_t        head, tail, i, n;
+	stu_uint_t      k, dropped;
+	size_t          total;
+
+	total = 0;
+	p = stu_log_batch;
+	last = stu_log_batch + STU_LOG_BATCH_SIZE;
+
+	for (k = 0; k < stu_log_rings_n && k < STU_LOG_RINGS_MAXIMUM; k++) {
+		ring = stu_log_rings[k];
+		if (ring == NULL) {
+			continue;
+		}
+
+		head = ring->head;
+		stu_memory_barrier();
+
+		for (tail = ring->tail; tail != head; tail += n) {
+			if (p == last) {
+				stu_log_write_sync(stu_log_batch, p - stu_log_batch);
+				total += p - stu_log_batch;
+				p = stu_log_batch;
+			}
+
+			i = tail & (STU_LOG_RING_SIZE - 1);
+			n = stu_min(head - tail, STU_LOG_RING_SIZE - i);
+			n = stu_min(n, (uint32_t) (last - p));
+
+			memcpy(p, ring->data + i, n);
+			p += n;
+		}
+
+		// the space may be reused by the producer since now.
+		stu_memory_barrier();
+		ring->tail = head;
+	}
+
+	dropped = stu_log_dropped();
+	if (dropped != stu_log_dropped_reported && last - p >= STU_LOG_RECORD_MAX_LEN) {
+		p = stu_log_prefix(p, STU_ERROR_PREFIX);
+		p = stu_sprintf(p, "%ui log records dropped, ring full.\n", dropped - stu_log_dropped_reported);
+		stu_log_dropped_reported = dropped;
+	}
+
+	if (p > stu_log_batch) {
+		stu_log_write_sync(stu_log_batch, p - stu_log_batch);
+		total += p - stu_log_batch;
+	}
+
+	return total;
+}
+
+/*
+ * The new file takes the place of the old fd, so threads writing
+ * synchronously at the moment never use a closed one.
+ */
+static stu_int_t
+stu_log_reopen_file() {
+	stu_fd_t  fd;
+
+	if (stu_logger == NULL) {
+		return STU_DECLINED;
+	}
+
+	fd = stu_file_open(stu_logger->name.data, STU_FILE_APPEND, STU_FILE_CREATE_OR_OPEN, STU_FILE_DEFAULT_ACCESS);
+	if (fd == STU_FILE_INVALID) {
+		stu_log_error(stu_errno, "Failed to " stu_file_open_n " log file \"%s\".", stu_logger->name.data);
+		return STU_ERROR;
+	}
+
+	if (dup2(fd, stu_logger->fd) == -1) {
+		stu_log_error(stu_errno, "dup2() log file failed.");
+		stu_file_close(fd);
+		return STU_ERROR;
+	}
+
+	stu_file_close(fd);
+
+	stu_logger->offset = 0;
+	stu_log_opened = time(NULL);
+
+	return STU_OK;
+}
 
 static u_char *
 stu_log_prefix(u_char *buf, const stu_str_t prefix) {
@@ -142,6 +628,19 @@ stu_log_prefix(u_char *buf, const stu_str_t prefix) {
 	return p;
 }
 
+/* records keep the printf formats of all the callers, but are bounded. */
+static u_char *
+stu_log_vsprintf(u_char *buf, u_char *last, const char *fmt, va_list args) {
+	int  n;
+
+	n = vsnprintf((char *) buf, last - buf, fmt, args);
+	if (n < 0) {
+		return buf;
+	}
+
+	return stu_min(buf + n, last - 1);
+}
+
 static u_char *
 stu_log_errno(u_char *buf, u_char *last, stu_int_t err) {
 	if (buf > last - 50) {
@@ -151,7 +650,7 @@ stu_log_errno(u_char *buf, u_char *last, stu_int_t err) {
 		*buf++ = '.';
 	}
 
-	buf = stu_sprintf(buf, " (%d: ", err);
+	buf = stu_sprintf(buf, " (%i: ", err);
 
 	buf = stu_strerror(err, buf, last - buf);
 	if (buf < last - 1) {
@@ -14,16 +14,74 @@
 
 #define STU_LOG_RECORD_MAX_LEN  1024
 
+#define STU_LOG_RING_SIZE       65536             // per thread, power of 2
+#define STU_LOG_RINGS_MAXIMUM   (STU_THREADS_MAXIMUM + 4)
+#define STU_LOG_BATCH_SIZE      (STU_LOG_RING_SIZE * 4)
+#define STU_LOG_FLUSH_INTERVAL  100               // milliseconds
+#define STU_LOG_ROTATE_CHECK    1                 // seconds
+
+/*
+ * Debug records below the floor are compiled out. Build with
+ * -DSTU_LOG_DEBUG_FLOOR=n to strip the verbose levels of a release.
+ */
+#ifndef STU_LOG_DEBUG_FLOOR
+#define STU_LOG_DEBUG_FLOOR     __LOGGER
+#endif
+
+#define STU_LOG_LEVEL_OFF       16
+
+/* A source file sets STU_LOG_MODULE before including stu_core.h. */
+#define STU_LOG_CORE            0
+#define STU_LOG_EVENT           1
+#define STU_LOG_PROCESS         2
+#define STU_LOG_CHANNEL         3
+#define STU_LOG_HTTP            4
+#define STU_LOG_WEBSOCKET       5
+#define STU_LOG_UPSTREAM        6
+#define STU_LOG_RESOLVER        7
+#define STU_LOG_FLASH           8
+#define STU_LOG_MODULES         9
+
+#ifndef STU_LOG_MODULE
+#define STU_LOG_MODULE          STU_LOG_CORE
+#endif
+
+/*
+ * Records of a thread, which is the only producer, and the writer thread is
+ * the only consumer. head and tail are free running offsets.
+ */
+typedef struct {
+	u_char             *data;
+	volatile uint32_t   head;
+	volatile uint32_t   tail;
+	volatile uint32_t   dropped;
+} stu_log_ring_t;
+
 static const stu_str_t STU_LOG_PREFIX = stu_string("[L O G]");
 static const stu_str_t STU_DEBUG_PREFIX = stu_string("[DEBUG]");
 static const stu_str_t STU_ERROR_PREFIX = stu_string("[ERROR]");
 
 #define STU_LOG_FILE_LINE                  "[" __FILE__ ":%d] " LFHT
 #define stu_log(fmt, args...)              stu_log_c(STU_LOG_FILE_LINE fmt "\n", __LINE__, ##args)
-#define stu_log_debug(level, fmt, args...) stu_log_c_debug(level, STU_LOG_FILE_LINE fmt "\n", __LINE__, ##args)
+#define stu_log_debug(level, fmt, args...)                                      \
+	do {                                                                        \
+		if ((level) >= STU_LOG_DEBUG_FLOOR                                      \
+				&& (level) >= stu_log_levels[STU_LOG_MODULE]) {                 \
+			stu_log_c_debug(level, STU_LOG_FILE_LINE fmt "\n", __LINE__, ##args); \
+		}                                                                       \
+	} while (0)
 #define stu_log_error(errno, fmt, args...) stu_log_c_error(errno, STU_LOG_FILE_LINE fmt, __LINE__, ##args)
 
+extern volatile stu_int_t *stu_log_levels;
+
 stu_int_t  stu_log_init(stu_file_t *file);
+stu_int_t  stu_log_reopen();
+stu_int_t  stu_log_rotate(size_t max_size, time_t interval);
+stu_int_t  stu_log_set_level(stu_str_t *module, stu_int_t level);
+stu_int_t  stu_log_set_levels(u_char *spec, size_t len);
+stu_int_t  stu_log_writer_start();
+void       stu_log_writer_stop();
+stu_uint_t stu_log_dropped();
 
 void stu_log_c(const char *fmt, ...);
 void stu_log_c_debug(stu_int_t level, const char *fmt, ...);
@@ -0,0 +1,305 @@
+/*
+ * stu_metrics.c
+ *
+ *  Created on: 2017-7-6
+ *      Author: Tony Lau
+ */
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+static stu_metric_t  stu_metrics[STU_METRICS_MAXIMUM] = {
+	{ stu_string("connections_accepted_total"), STU_METRICS_COUNTER, 0 },
+	{ stu_string("connections_active"), STU_METRICS_GAUGE, 0 },
+	{ stu_string("bytes_in_total"), STU_METRICS_COUNTER, 0 },
+	{ stu_string("bytes_out_total"), STU_METRICS_COUNTER, 0 },
+	{ stu_string("messages_total"), STU_METRICS_COUNTER, 0 },
+	{ stu_string("handshake_usec"), STU_METRICS_HISTOGRAM, 0 },
+	{ stu_string("fanout_usec"), STU_METRICS_HISTOGRAM, 1 },
+	{ stu_string("upstream_usec"), STU_METRICS_HISTOGRAM, 2 },
+	{ stu_string("timer_lag_msec"), STU_METRICS_HISTOGRAM, 3 },
+	{ stu_string("events_per_wait"), STU_METRICS_HISTOGRAM, 4 }
+};
+
+static stu_uint_t           stu_metrics_n_ = STU_METRICS_BUILTIN;
+static stu_uint_t           stu_metrics_histograms_n = 5;
+
+static stu_thread_key_t     stu_metrics_key;
+static stu_bool_t           stu_metrics_ready;
+static stu_metrics_slot_t  *stu_metrics_slots[STU_METRICS_SLOTS_MAXIMUM];
+static volatile uint32_t    stu_metrics_slots_n;
+
+/* for the threads without a slot of their own, written atomically. */
+static stu_metrics_slot_t   stu_metrics_shared;
+
+static stu_metrics_slot_t *stu_metrics_get_slot();
+static stu_uint_t          stu_metrics_bucket(uint64_t value);
+static void                stu_metrics_merge(stu_metrics_histogram_t *dst, stu_metrics_histogram_t *src);
+
+
+stu_int_t
+stu_metrics_init() {
+	if (stu_thread_key_create(&stu_metrics_key) != 0) {
+		stu_log_error(stu_errno, "Failed to create metrics thread key.");
+		return STU_ERROR;
+	}
+
+	stu_metrics_ready = TRUE;
+
+	return STU_OK;
+}
+
+/*
+ * Must be called before any thread writes, i.e. while parsing the conf file.
+ * Returns the id of the metric.
+ */
+stu_int_t
+stu_metrics_register(u_char *name, size_t len, uint8_t type) {
+	stu_metric_t *m;
+
+	if (stu_metrics_n_ == STU_METRICS_MAXIMUM) {
+		stu_log_error(0, "Too many metrics, \"%s\" ignored.", name);
+		return STU_ERROR;
+	}
+
+	if (type == STU_METRICS_HISTOGRAM && stu_metrics_histograms_n == STU_METRICS_HISTOGRAMS_MAXIMUM) {
+		stu_log_error(0, "Too many histograms, \"%s\" ignored.", name);
+		return STU_ERROR;
+	}
+
+	m = &stu_metrics[stu_metrics_n_];
+
+	m->name.data = stu_calloc(len + 1);
+	if (m->name.data == NULL) {
+		return STU_ERROR;
+	}
+
+	memcpy(m->name.data, name, len);
+	m->name.len = len;
+	m->type = type;
+
+	if (type == STU_METRICS_HISTOGRAM) {
+		m->index = stu_metrics_histograms_n++;
+	}
+
+	return stu_metrics_n_++;
+}
+
+void
+stu_metrics_add(stu_int_t id, int64_t n) {
+	stu_metrics_slot_t *slot;
+
+	if (id < 0) {
+		return;
+	}
+
+	slot = stu_metrics_get_slot();
+	if (slot == &stu_metrics_shared) {
+		stu_atomic_fetch_add(&slot->values[id], n);
+		return;
+	}
+
+	slot->values[id] += n;
+}
+
+void
+stu_metrics_observe(stu_int_t id, uint64_t value) {
+	stu_metrics_slot_t      *slot;
+	stu_metrics_histogram_t *h;
+	stu_uint_t               i;
+
+	if (id < 0) {
+		return;
+	}
+
+	slot = stu_metrics_get_slot();
+	h = &slot->histograms[stu_metrics[id].index];
+	i = stu_metrics_bucket(value);
+
+	if (slot == &stu_metrics_shared) {
+		stu_atomic_fetch_add(&h->count, 1);
+		stu_atomic_fetch_add(&h->sum, value);
+		stu_atomic_fetch_add(&h->buckets[i], 1);
+		return;
+	}
+
+	h->count++;
+	h->sum += value;
+	h->buckets[i]++;
+
+	if (h->max < value) {
+		h->max = value;
+	}
+}
+
+
+stu_uint_t
+stu_metrics_n() {
+	return stu_metrics_n_;
+}
+
+stu_metric_t *
+stu_metrics_get(stu_int_t id) {
+	if (id < 0 || (stu_uint_t) id >= stu_metrics_n_) {
+		return NULL;
+	}
+
+	return &stu_metrics[id];
+}
+
+int64_t
+stu_metrics_value(stu_int_t id) {
+	stu_uint_t  i;
+	int64_t     n;
+
+	n = stu_metrics_shared.values[id];
+
+	for (i = 0; i < stu_metrics_slots_n && i < STU_METRICS_SLOTS_MAXIMUM; i++) {
+		if (stu_metrics_slots[i]) {
+			n += stu_metrics_slots[i]->values[id];
+		}
+	}
+
+	return n;
+}
+
+/* sums up the histogram of all threads into h. */
+stu_int_t
+stu_metrics_histogram(stu_int_t id, stu_metrics_histogram_t *h) {
+	stu_uint_t  i, n, index;
+
+	if (stu_metrics[id].type != STU_METRICS_HISTOGRAM) {
+		return STU_ERROR;
+	}
+
+	index = stu_metrics[id].index;
+	stu_memzero(h, sizeof(stu_metrics_histogram_t));
+
+	stu_metrics_merge(h, &stu_metrics_shared.histograms[index]);
+
+	n = stu_min(stu_metrics_slots_n, STU_METRICS_SLOTS_MAXIMUM);
+	for (i = 0; i < n; i++) {
+		if (stu_metrics_slots[i]) {
+			stu_metrics_merge(h, &stu_metrics_slots[i]->histograms[index]);
+		}
+	}
+
+	return STU_OK;
+}
+
+/* the upper bound of the bucket in which the q quantile falls, 0 < q <= 1. */
+uint64_t
+stu_metrics_percentile(stu_metrics_histogram_t *h, double q) {
+	uint64_t    rank, n, upper;
+	stu_uint_t  i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t) (q * h->count + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	for (n = 0, i = 0; i < STU_METRICS_BUCKETS; i++) {
+		n += h->buckets[i];
+		if (n >= rank) {
+			upper = stu_metrics_bucket_upper(i);
+			return h->max && h->max < upper ? h->max : upper;
+		}
+	}
+
+	return h->max;
+}
+
+uint64_t
+stu_metrics_bucket_upper(stu_uint_t i) {
+	stu_uint_t  e, m;
+
+	if (i < STU_METRICS_SUB_BUCKETS) {
+		return i;
+	}
+
+	e = i / STU_METRICS_SUB_BUCKETS + STU_METRICS_SUB_BITS - 1;
+	m = i % STU_METRICS_SUB_BUCKETS;
+
+	return ((uint64_t) (STU_METRICS_SUB_BUCKETS + m + 1) << (e - STU_METRICS_SUB_BITS)) - 1;
+}
+
+uint64_t
+stu_metrics_usec() {
+	struct timeval  tv;
+
+	stu_gettimeofday(&tv);
+
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static stu_metrics_slot_t *
+stu_metrics_get_slot() {
+	stu_metrics_slot_t *slot;
+	uint32_t            i;
+
+	if (stu_metrics_ready == FALSE) {
+		return &stu_metrics_shared;
+	}
+
+	slot = stu_thread_get_specific(stu_metrics_key);
+	if (slot) {
+		return slot;
+	}
+
+	i = stu_atomic_fetch_add(&stu_metrics_slots_n, 1);
+	if (i >= STU_METRICS_SLOTS_MAXIMUM) {
+		slot = &stu_metrics_shared;
+		goto done;
+	}
+
+	slot = stu_calloc(sizeof(stu_metrics_slot_t));
+	if (slot == NULL) {
+		slot = &stu_metrics_shared;
+		goto done;
+	}
+
+	stu_memory_barrier();
+	stu_metrics_slots[i] = slot;
+
+done:
+
+	stu_thread_set_specific(stu_metrics_key, slot);
+
+	return slot;
+}
+
+static stu_uint_t
+stu_metrics_bucket(uint64_t value) {
+	stu_uint_t  e;
+
+	if (value < STU_METRICS_SUB_BUCKETS) {
+		return value;
+	}
+
+	if (value >> STU_METRICS_VALUE_BITS) {
+		return STU_METRICS_BUCKETS - 1;
+	}
+
+	e = 63 - __builtin_clzll(value);
+
+	return (e - STU_METRICS_SUB_BITS + 1) * STU_METRICS_SUB_BUCKETS
+			+ (stu_uint_t) (value >> (e - STU_METRICS_SUB_BITS)) - STU_METRICS_SUB_BUCKETS;
+}
+
+static void
+stu_metrics_merge(stu_metrics_histogram_t *dst, stu_metrics_histogram_t *src) {
+	stu_uint_t  k;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->max = stu_max(dst->max, src->max);
+
+	for (k = 0; k < STU_METRICS_BUCKETS; k++) {
+		dst->buckets[k] += src->buckets[k];
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * stu_metrics.h
+ *
+ *  Created on: 2017-7-6
+ *      Author: Tony Lau
+ */
+
+#ifndef STU_METRICS_H_
+#define STU_METRICS_H_
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#define STU_METRICS_MAXIMUM             64
+#define STU_METRICS_HISTOGRAMS_MAXIMUM  24
+#define STU_METRICS_SLOTS_MAXIMUM       (STU_THREADS_MAXIMUM + 4)
+#define STU_METRICS_NAME_MAX_LEN        96
+
+/*
+ * Log-linear buckets, as HdrHistogram does: every power of 2 is split into
+ * 2^SUB_BITS linear buckets, so a bucket is at most 12.5% wide. Values
+ * beyond 2^VALUE_BITS fall into the last bucket.
+ */
+#define STU_METRICS_SUB_BITS            3
+#define STU_METRICS_SUB_BUCKETS         (1 << STU_METRICS_SUB_BITS)
+#define STU_METRICS_VALUE_BITS          40
+#define STU_METRICS_BUCKETS             ((STU_METRICS_VALUE_BITS - STU_METRICS_SUB_BITS + 1) * STU_METRICS_SUB_BUCKETS)
+
+#define STU_METRICS_COUNTER             1
+#define STU_METRICS_GAUGE               2    // summed over threads, which add and subtract
+#define STU_METRICS_HISTOGRAM           3
+
+/* built in, in the order of stu_metrics[] */
+#define STU_METRIC_ACCEPTED             0
+#define STU_METRIC_CONNECTIONS          1
+#define STU_METRIC_BYTES_IN             2
+#define STU_METRIC_BYTES_OUT            3
+#define STU_METRIC_MESSAGES             4
+#define STU_METRIC_HANDSHAKE_USEC       5
+#define STU_METRIC_FANOUT_USEC          6
+#define STU_METRIC_UPSTREAM_USEC        7
+#define STU_METRIC_TIMER_LAG_MSEC       8
+#define STU_METRIC_EVENTS_PER_WAIT      9
+#define STU_METRICS_BUILTIN             10
+
+typedef struct {
+	stu_str_t          name;        // may carry labels, e.g. upstream_usec{server="a"}
+	uint8_t            type;
+	stu_uint_t         index;       // of the histogram, if it is
+} stu_metric_t;
+
+typedef struct {
+	uint64_t           count;
+	uint64_t           sum;
+	uint64_t           max;
+	uint64_t           buckets[STU_METRICS_BUCKETS];
+} stu_metrics_histogram_t;
+
+/* written by the owner thread only, and read racily by the aggregator. */
+typedef struct {
+	int64_t                  values[STU_METRICS_MAXIMUM];
+	stu_metrics_histogram_t  histograms[STU_METRICS_HISTOGRAMS_MAXIMUM];
+} stu_metrics_slot_t;
+
+stu_int_t   stu_metrics_init();
+stu_int_t   stu_metrics_register(u_char *name, size_t len, uint8_t type);
+
+void        stu_metrics_add(stu_int_t id, int64_t n);
+void        stu_metrics_observe(stu_int_t id, uint64_t value);
+
+stu_uint_t    stu_metrics_n();
+stu_metric_t *stu_metrics_get(stu_int_t id);
+int64_t       stu_metrics_value(stu_int_t id);
+stu_int_t     stu_metrics_histogram(stu_int_t id, stu_metrics_histogram_t *h);
+uint64_t      stu_metrics_percentile(stu_metrics_histogram_t *h, double q);
+uint64_t      stu_metrics_bucket_upper(stu_uint_t i);
+
+uint64_t      stu_metrics_usec();
+
+#define stu_metrics_inc(id)  stu_metrics_add(id, 1)
+#define stu_metrics_dec(id)  stu_metrics_add(id, -1)
+
+#endif /* STU_METRICS_H_ */
@@ -21,4 +21,17 @@
 #define stu_mutex_trylock pthread_mutex_trylock
 #define stu_mutex_unlock  pthread_mutex_unlock
 
+#define stu_mutexattr_init     pthread_mutexattr_init
+#define stu_mutexattr_settype  pthread_mutexattr_settype
+#define stu_mutexattr_destroy  pthread_mutexattr_destroy
+
+#define STU_MUTEX_RECURSIVE    PTHREAD_MUTEX_RECURSIVE
+
+#define stu_rwlock_t      pthread_rwlock_t
+
+#define stu_rwlock_init    pthread_rwlock_init
+#define stu_rwlock_rdlock  pthread_rwlock_rdlock
+#define stu_rwlock_wrlock  pthread_rwlock_wrlock
+#define stu_rwlock_unlock  pthread_rwlock_unlock
+
 #endif /* STU_MUTEX_H_ */
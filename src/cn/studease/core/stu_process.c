@@ -5,14 +5,20 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_PROCESS
+
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <signal.h>
 #include <unistd.h>
 #include "stu_config.h"
 #include "stu_core.h"
 
+extern stu_str_t  STU_CONF_FILE_DEFAULT_PATH;
+
 stu_pid_t      stu_pid;
 
 stu_int_t      stu_process_slot;
@@ -23,11 +29,17 @@ stu_int_t      stu_process_last;
 
 sig_atomic_t   stu_quit;
 sig_atomic_t   stu_restart;
+sig_atomic_t   stu_reload_log_level;
+sig_atomic_t   stu_reopen;
+sig_atomic_t   stu_sigalrm;
 
 stu_thread_t   stu_threads[STU_THREADS_MAXIMUM];
 stu_int_t      stu_threads_n;
 
 static void  stu_process_signal_worker_processes(stu_cycle_t *cycle, int signo);
+static void  stu_process_wait_worker_processes(stu_cycle_t *cycle);
+static void  stu_process_set_shutdown_handlers();
+static void  stu_process_signal_handler(int signo);
 static void  stu_process_pass_open_filedes(stu_cycle_t *cycle, stu_filedes_t *fds);
 static void  stu_process_worker_cycle(stu_cycle_t *cycle, void *data);
 static void  stu_process_worker_init(stu_cycle_t *cycle, stu_int_t worker);
@@ -173,7 +185,7 @@ stu_process_signal_worker_processes(stu_cycle_t *cycle, int signo) {
 	stu_filedes_t  fds;
 	stu_int_t      i;
 
-	stu_memzero(&fds, sizeof(stu_channel_t));
+	stu_memzero(&fds, sizeof(stu_filedes_t));
 
 	switch (signo) {
 	case stu_signal_value(STU_SHUTDOWN_SIGNAL):
@@ -182,6 +194,9 @@ stu_process_signal_worker_processes(stu_cycle_t *cycle, int signo) {
 	case stu_signal_value(STU_CHANGEBIN_SIGNAL):
 		fds.command = STU_CMD_RESTART;
 		break;
+	case stu_signal_value(STU_REOPEN_SIGNAL):
+		fds.command = STU_CMD_REOPEN;
+		break;
 	default:
 		fds.command = 0;
 		break;
@@ -200,6 +215,12 @@ stu_process_signal_worker_processes(stu_cycle_t *cycle, int signo) {
 			if (stu_filedes_write(stu_processes[i].filedes[0], &fds, sizeof(stu_filedes_t)) == STU_OK) {
 				continue;
 			}
+
+			// workers do not handle the signal, which would kill them.
+			if (fds.command == STU_CMD_REOPEN) {
+				stu_log_error(0, "Failed to pass reopen command to pid=%d.", stu_processes[i].pid);
+				continue;
+			}
 		}
 
 		stu_log_debug(3, "kill (%P, %d)", stu_processes[i].pid, signo);
@@ -210,8 +231,47 @@ stu_process_signal_worker_processes(stu_cycle_t *cycle, int signo) {
 	}
 }
 
+static void
+stu_process_wait_worker_processes(stu_cycle_t *cycle) {
+	stu_int_t  i;
+
+	for (i = 0; i < stu_process_last; i++) {
+		if (stu_processes[i].pid == STU_INVALID_PID) {
+			continue;
+		}
+
+		if (waitpid(stu_processes[i].pid, NULL, 0) == -1) {
+			stu_log_error(stu_errno, "waitpid(%d) failed.", stu_processes[i].pid);
+		}
+
+		stu_processes[i].pid = STU_INVALID_PID;
+	}
+}
+
+static void
+stu_process_set_shutdown_handlers() {
+	struct sigaction  sa;
+
+	stu_memzero(&sa, sizeof(struct sigaction));
+	sa.sa_handler = stu_process_signal_handler;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(stu_signal_value(STU_SHUTDOWN_SIGNAL), &sa, NULL) == -1) {
+		stu_log_error(stu_errno, "sigaction(SIGQUIT) failed.");
+	}
+
+	if (sigaction(SIGINT, &sa, NULL) == -1) {
+		stu_log_error(stu_errno, "sigaction(SIGINT) failed.");
+	}
+
+	if (sigaction(SIGTERM, &sa, NULL) == -1) {
+		stu_log_error(stu_errno, "sigaction(SIGTERM) failed.");
+	}
+}
+
 static void
 stu_process_worker_cycle(stu_cycle_t *cycle, void *data) {
+	sigset_t          set;
 	stu_int_t         worker;
 	stu_int_t         threads_n;
 	stu_int_t         n, err;
@@ -226,6 +286,10 @@ stu_process_worker_cycle(stu_cycle_t *cycle, void *data) {
 		exit(2);
 	}
 
+	if (stu_evlog_init(&cycle->config) == STU_ERROR) {
+		stu_log_error(0, "Failed to init evlog, events are not logged.");
+	}
+
 	err = stu_thread_key_create(&stu_thread_key);
 	if (err != STU_OK) {
 		stu_log_error(err, "stu_thread_key_create failed");
@@ -244,23 +308,41 @@ stu_process_worker_cycle(stu_cycle_t *cycle, void *data) {
 		}
 	}
 
+	if (stu_log_writer_start() == STU_ERROR) {
+		stu_log_error(0, "Failed to start log writer, logging synchronously.");
+	}
+
 	if (stu_channel_add_timers() == STU_ERROR) {
 		stu_log_error(0, "Failed to add channel timers.");
 		exit(2);
 	}
 
-	// main thread of sub process, wait for signal
+	if (stu_upstream_add_timers() == STU_ERROR) {
+		stu_log_error(0, "Failed to add upstream timers.");
+		exit(2);
+	}
+
+	if (stu_resolver_add_timers() == STU_ERROR) {
+		stu_log_error(0, "Failed to add resolver timers.");
+		exit(2);
+	}
+
+	// main thread of sub process, the only one to take the shutdown signals
+	sigemptyset(&set);
+
 	for ( ;; ) {
 		if (stu_quit) {
 			stu_log("Closing worker process...");
-			break;
+			stu_evlog_close();
+			stu_log_writer_stop();
+			exit(0);
 		}
 
 		if (stu_restart) {
 			stu_log("Restarting worker process...");
 		}
 
-		sleep(-1);
+		sigsuspend(&set);
 	}
 }
 
@@ -269,12 +351,18 @@ stu_process_worker_init(stu_cycle_t *cycle, stu_int_t worker) {
 	sigset_t   set;
 	stu_int_t  n;
 
+	// blocked in the threads created later, unblocked in sigsuspend of the main thread.
 	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, stu_signal_value(STU_SHUTDOWN_SIGNAL));
 
 	if (sigprocmask(SIG_SETMASK, &set, NULL) == -1) {
 		stu_log_error(stu_errno, "sigprocmask() failed");
 	}
 
+	stu_process_set_shutdown_handlers();
+
 	for (n = 0; n < stu_process_last; n++) {
 		if (n == stu_process_slot) {
 			continue;
@@ -332,10 +420,18 @@ stu_process_filedes_handler(stu_event_t *ev) {
 		switch (ch.command) {
 		case STU_CMD_QUIT:
 			stu_quit = 1;
+
+			// wake up the main thread in sigsuspend.
+			if (kill(stu_pid, stu_signal_value(STU_SHUTDOWN_SIGNAL)) == -1) {
+				stu_log_error(stu_errno, "kill(%d, SIGQUIT) failed.", stu_pid);
+			}
 			break;
 		case STU_CMD_RESTART:
 			stu_restart = 1;
 			break;
+		case STU_CMD_REOPEN:
+			stu_log_reopen();
+			break;
 		case STU_CMD_OPEN_FILEDES:
 			stu_log_debug(3, "open filedes: s=%i, pid=%d, fd=%d.", ch.slot, ch.pid, ch.fd);
 
@@ -378,19 +474,43 @@ stu_process_worker_thread_cycle(void *data) {
 
 void
 stu_process_master_cycle(stu_cycle_t *cycle) {
-	sigset_t  set;
+	sigset_t          set;
+	struct sigaction  sa;
+	struct itimerval  itv;
 
 	if (cycle->config.master_process == FALSE) {
 		return;
 	}
 
+	stu_memzero(&sa, sizeof(struct sigaction));
+	sa.sa_handler = stu_process_signal_handler;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(stu_signal_value(STU_LOGLEVEL_SIGNAL), &sa, NULL) == -1) {
+		stu_log_error(stu_errno, "sigaction(SIGUSR2) failed.");
+	}
+
+	if (sigaction(stu_signal_value(STU_REOPEN_SIGNAL), &sa, NULL) == -1) {
+		stu_log_error(stu_errno, "sigaction(SIGUSR1) failed.");
+	}
+
+	if (sigaction(SIGALRM, &sa, NULL) == -1) {
+		stu_log_error(stu_errno, "sigaction(SIGALRM) failed.");
+	}
+
+	stu_process_set_shutdown_handlers();
+
 	sigemptyset(&set);
 	sigaddset(&set, SIGCHLD);
 	sigaddset(&set, SIGALRM);
 	sigaddset(&set, SIGIO);
+	sigaddset(&set, SIGPIPE);
 	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
 	sigaddset(&set, stu_signal_value(STU_SHUTDOWN_SIGNAL));
 	sigaddset(&set, stu_signal_value(STU_CHANGEBIN_SIGNAL));
+	sigaddset(&set, stu_signal_value(STU_LOGLEVEL_SIGNAL));
+	sigaddset(&set, stu_signal_value(STU_REOPEN_SIGNAL));
 
 	if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
 		stu_log_error(stu_errno, "sigprocmask() failed.");
@@ -398,17 +518,73 @@ stu_process_master_cycle(stu_cycle_t *cycle) {
 
 	sigemptyset(&set);
 
+	// checks the log for rotation
+	if (cycle->config.log_max_size || cycle->config.log_rotate_interval) {
+		itv.it_interval.tv_sec = STU_LOG_ROTATE_CHECK;
+		itv.it_interval.tv_usec = 0;
+		itv.it_value = itv.it_interval;
+
+		if (setitimer(ITIMER_REAL, &itv, NULL) == -1) {
+			stu_log_error(stu_errno, "setitimer() failed.");
+		}
+	}
+
 	for ( ;; ) {
 		stu_log_debug(3, "sigsuspending...");
 		sigsuspend(&set);
 
+		// workers close their evlog on quit, wait for them before exiting.
 		if (stu_quit) {
+			stu_log("Shutting down server...");
 			stu_process_signal_worker_processes(cycle, stu_signal_value(STU_SHUTDOWN_SIGNAL));
+			stu_process_wait_worker_processes(cycle);
+			return;
 		}
 
 		if (stu_restart) {
 			stu_log("Restarting server...");
 			// respawn processes
 		}
+
+		// the levels are in shared memory, workers see them at once.
+		if (stu_reload_log_level) {
+			stu_reload_log_level = 0;
+			stu_conf_file_reload_log_level(STU_CONF_FILE_DEFAULT_PATH.data);
+		}
+
+		if (stu_sigalrm) {
+			stu_sigalrm = 0;
+			if (stu_log_rotate(cycle->config.log_max_size, cycle->config.log_rotate_interval) == STU_OK) {
+				stu_process_signal_worker_processes(cycle, stu_signal_value(STU_REOPEN_SIGNAL));
+			}
+		}
+
+		// renamed by someone else, e.g. logrotate.
+		if (stu_reopen) {
+			stu_reopen = 0;
+			stu_log("Reopening log file...");
+			stu_log_reopen();
+			stu_process_signal_worker_processes(cycle, stu_signal_value(STU_REOPEN_SIGNAL));
+		}
+	}
+}
+
+static void
+stu_process_signal_handler(int signo) {
+	switch (signo) {
+	case stu_signal_value(STU_LOGLEVEL_SIGNAL):
+		stu_reload_log_level = 1;
+		break;
+	case stu_signal_value(STU_REOPEN_SIGNAL):
+		stu_reopen = 1;
+		break;
+	case SIGALRM:
+		stu_sigalrm = 1;
+		break;
+	case stu_signal_value(STU_SHUTDOWN_SIGNAL):
+	case SIGINT:
+	case SIGTERM:
+		stu_quit = 1;
+		break;
 	}
 }
@@ -17,6 +17,7 @@
 #define STU_CMD_CLOSE_FILEDES  2
 #define STU_CMD_QUIT           3
 #define STU_CMD_RESTART        4
+#define STU_CMD_REOPEN         5
 
 #define STU_INVALID_PID        -1
 
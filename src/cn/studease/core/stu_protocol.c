@@ -8,6 +8,10 @@
 #include "stu_config.h"
 #include "stu_core.h"
 
+#if (STU_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 stu_str_t  STU_PROTOCOL_CMD = stu_string("cmd");
 stu_str_t  STU_PROTOCOL_RAW = stu_string("raw");
 stu_str_t  STU_PROTOCOL_REQ = stu_string("req");
@@ -40,3 +44,648 @@ stu_str_t  STU_PROTOCOL_RAWS_MUTE = stu_string("mute");
 stu_str_t  STU_PROTOCOL_RAWS_KICKOUT = stu_string("kickout");
 stu_str_t  STU_PROTOCOL_RAWS_ERROR = stu_string("error");
 stu_str_t  STU_PROTOCOL_RAWS_PONG = stu_string("pong");
+
+stu_str_t  STU_PROTOCOL_SUBPROTOCOL_TLV = stu_string("tlv");
+
+/*
+ * The "tlv" subprotocol carries the same messages in binary frames:
+ *
+ *   value  = header [key] payload
+ *   header = varint, field << 3 | type
+ *   key    = string; only for field 0 within an object
+ *
+ * Fields 1.. stand for the keys below. Integers are zigzag varints, doubles
+ * 8 bytes in little endian, strings a varint length and the bytes in UTF-8,
+ * arrays and objects a varint count and the values. Array items and the top
+ * value have field 0 and no key.
+ *
+ * The tree keeps strings escaped as in json, so they are unescaped when
+ * encoding, and escaped again when decoding.
+ */
+static stu_str_t *stu_protocol_fields[] = {
+	NULL,
+	&STU_PROTOCOL_CMD,
+	&STU_PROTOCOL_RAW,
+	&STU_PROTOCOL_REQ,
+	&STU_PROTOCOL_DATA,
+	&STU_PROTOCOL_TYPE,
+	&STU_PROTOCOL_CHANNEL,
+	&STU_PROTOCOL_USER,
+	&STU_PROTOCOL_ID,
+	&STU_PROTOCOL_NAME,
+	&STU_PROTOCOL_ICON,
+	&STU_PROTOCOL_ROLE,
+	&STU_PROTOCOL_STATE,
+	&STU_PROTOCOL_STATUS,
+	&STU_PROTOCOL_TOTAL,
+	&STU_PROTOCOL_ERROR,
+	&STU_PROTOCOL_CODE
+};
+
+#define STU_PROTOCOL_TLV_FIELDS  (sizeof(stu_protocol_fields) / sizeof(stu_protocol_fields[0]))
+#define STU_PROTOCOL_INT_EXACT   9007199254740992.0 /* 2^53 */
+
+static const u_char  stu_protocol_hex[] = "0123456789abcdef";
+
+static u_char     *stu_protocol_encode_value(stu_json_t *item, stu_bool_t keyed, u_char *dst, u_char *last);
+static stu_json_t *stu_protocol_decode_value(u_char **pos, u_char *end, stu_bool_t keyed, stu_uint_t depth);
+
+static stu_uint_t  stu_protocol_field(stu_str_t *key);
+static u_char     *stu_protocol_put_string(u_char *dst, u_char *last, stu_str_t *str);
+static size_t      stu_protocol_unescape(u_char *dst, size_t size, u_char *src, size_t n);
+static u_char     *stu_protocol_get_string(u_char *p, u_char *end, stu_str_t *str, u_char **copy);
+static u_char     *stu_protocol_find_escape(u_char *p, u_char *last);
+static stu_int_t   stu_protocol_get_hex(u_char *p, u_char *end);
+
+static stu_inline u_char *stu_protocol_put_varint(u_char *dst, u_char *last, uint64_t v);
+static stu_inline u_char *stu_protocol_get_varint(u_char *p, u_char *end, uint64_t *v);
+static stu_inline u_char *stu_protocol_write(u_char *dst, u_char *last, u_char *src, size_t n);
+
+
+/* as stu_json_stringify(), a result greater than size means cut short. */
+size_t
+stu_protocol_encode(stu_json_t *item, u_char *dst, size_t size) {
+	return stu_protocol_encode_value(item, FALSE, dst, dst + size) - dst;
+}
+
+/* strings are checked to be UTF-8, as they may be relayed to text peers. */
+stu_json_t *
+stu_protocol_decode(u_char *data, size_t len) {
+	stu_json_t *item;
+	u_char     *p;
+
+	p = data;
+
+	item = stu_protocol_decode_value(&p, data + len, FALSE, 0);
+	if (item == NULL) {
+		stu_log_error(0, "Failed to decode tlv: pos=%ld.", p - data);
+		return NULL;
+	}
+
+	if (p != data + len) {
+		stu_log_error(0, "Failed to decode tlv: %ld bytes left.", data + len - p);
+		stu_json_delete(item);
+		return NULL;
+	}
+
+	return item;
+}
+
+size_t
+stu_protocol_serialize(stu_uint_t protocol, stu_json_t *item, u_char *dst, size_t size) {
+	if (protocol == STU_PROTOCOL_TLV) {
+		return stu_protocol_encode(item, dst, size);
+	}
+
+	return stu_json_stringify(item, dst, size);
+}
+
+
+static u_char *
+stu_protocol_encode_value(stu_json_t *item, stu_bool_t keyed, u_char *dst, u_char *last) {
+	stu_json_t   *child;
+	stu_double_t  d;
+	stu_uint_t    field, type, n;
+	int64_t       i;
+	uint64_t      u;
+
+	switch (item->type) {
+	case STU_JSON_TYPE_BOOLEAN:
+		type = item->value ? STU_PROTOCOL_TLV_TRUE : STU_PROTOCOL_TLV_FALSE;
+		break;
+
+	case STU_JSON_TYPE_STRING:
+		type = STU_PROTOCOL_TLV_STRING;
+		break;
+
+	case STU_JSON_TYPE_NUMBER:
+		d = *(stu_double_t *) item->value;
+		type = STU_PROTOCOL_TLV_DOUBLE;
+
+		if (d > -STU_PROTOCOL_INT_EXACT && d < STU_PROTOCOL_INT_EXACT && (stu_double_t) (int64_t) d == d) {
+			type = STU_PROTOCOL_TLV_INTEGER;
+		}
+		break;
+
+	case STU_JSON_TYPE_ARRAY:
+		type = STU_PROTOCOL_TLV_ARRAY;
+		break;
+
+	case STU_JSON_TYPE_OBJECT:
+		type = STU_PROTOCOL_TLV_OBJECT;
+		break;
+
+	default:
+		type = STU_PROTOCOL_TLV_NULL;
+		break;
+	}
+
+	field = keyed ? stu_protocol_field(&item->key) : 0;
+
+	dst = stu_protocol_put_varint(dst, last, field << 3 | type);
+
+	if (keyed && field == 0) {
+		dst = stu_protocol_put_string(dst, last, &item->key);
+	}
+
+	switch (type) {
+	case STU_PROTOCOL_TLV_INTEGER:
+		i = (int64_t) *(stu_double_t *) item->value;
+		dst = stu_protocol_put_varint(dst, last, ((uint64_t) i << 1) ^ (uint64_t) (i >> 63));
+		break;
+
+	case STU_PROTOCOL_TLV_DOUBLE:
+		memcpy(&u, (void *) item->value, 8);
+		for (n = 0; n < 8; n++, u >>= 8) {
+			if (dst < last) {
+				*dst = (u_char) u;
+			}
+			dst++;
+		}
+		break;
+
+	case STU_PROTOCOL_TLV_STRING:
+		dst = stu_protocol_put_string(dst, last, (stu_str_t *) item->value);
+		break;
+
+	case STU_PROTOCOL_TLV_ARRAY:
+	case STU_PROTOCOL_TLV_OBJECT:
+		for (child = (stu_json_t *) item->value, n = 0; child; child = child->next) {
+			n++;
+		}
+
+		dst = stu_protocol_put_varint(dst, last, n);
+
+		for (child = (stu_json_t *) item->value; child; child = child->next) {
+			dst = stu_protocol_encode_value(child, type == STU_PROTOCOL_TLV_OBJECT, dst, last);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return dst;
+}
+
+static stu_json_t *
+stu_protocol_decode_value(u_char **pos, u_char *end, stu_bool_t keyed, stu_uint_t depth) {
+	stu_json_t   *item, *child;
+	stu_str_t     key, str, *k;
+	stu_double_t  d;
+	u_char       *p, *kcopy, *scopy;
+	uint64_t      h, v, n;
+	stu_uint_t    field, type, i;
+	int64_t       m;
+
+	item = NULL;
+	k = NULL;
+	kcopy = NULL;
+
+	p = stu_protocol_get_varint(*pos, end, &h);
+	if (p == NULL) {
+		goto failed;
+	}
+
+	field = h >> 3;
+	type = h & 0x07;
+
+	if (keyed == FALSE) {
+		if (field != 0) {
+			goto failed;
+		}
+	} else if (field == 0) {
+		p = stu_protocol_get_string(p, end, &key, &kcopy);
+		if (p == NULL) {
+			goto failed;
+		}
+
+		k = &key;
+	} else if (field < STU_PROTOCOL_TLV_FIELDS) {
+		k = stu_protocol_fields[field];
+	} else {
+		goto failed;
+	}
+
+	switch (type) {
+	case STU_PROTOCOL_TLV_NULL:
+		item = stu_json_create_null(k);
+		break;
+
+	case STU_PROTOCOL_TLV_FALSE:
+	case STU_PROTOCOL_TLV_TRUE:
+		item = stu_json_create_bool(k, type == STU_PROTOCOL_TLV_TRUE);
+		break;
+
+	case STU_PROTOCOL_TLV_INTEGER:
+		p = stu_protocol_get_varint(p, end, &v);
+		if (p == NULL) {
+			goto failed;
+		}
+
+		m = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+		item = stu_json_create_number(k, (stu_double_t) m);
+		break;
+
+	case STU_PROTOCOL_TLV_DOUBLE:
+		if (end - p < 8) {
+			goto failed;
+		}
+
+		for (i = 8, v = 0; i > 0; i--) {
+			v = v << 8 | p[i - 1];
+		}
+
+		memcpy(&d, &v, 8);
+		p += 8;
+
+		item = stu_json_create_number(k, d);
+		break;
+
+	case STU_PROTOCOL_TLV_STRING:
+		p = stu_protocol_get_string(p, end, &str, &scopy);
+		if (p == NULL) {
+			goto failed;
+		}
+
+		item = stu_json_create_string(k, str.data, str.len);
+
+		if (scopy) {
+			stu_free(scopy);
+		}
+		break;
+
+	case STU_PROTOCOL_TLV_ARRAY:
+	case STU_PROTOCOL_TLV_OBJECT:
+		p = stu_protocol_get_varint(p, end, &n);
+
+		// each value takes a byte at least
+		if (p == NULL || n > (uint64_t) (end - p) || depth >= STU_PROTOCOL_TLV_DEPTH) {
+			goto failed;
+		}
+
+		item = type == STU_PROTOCOL_TLV_ARRAY ? stu_json_create_array(k) : stu_json_create_object(k);
+		if (item == NULL) {
+			goto failed;
+		}
+
+		for ( /* void */ ; n; n--) {
+			child = stu_protocol_decode_value(&p, end, type == STU_PROTOCOL_TLV_OBJECT, depth + 1);
+			if (child == NULL) {
+				goto failed;
+			}
+
+			stu_json_add_item_to_object(item, child);
+		}
+		break;
+	}
+
+	if (item == NULL) {
+		goto failed;
+	}
+
+	if (kcopy) {
+		stu_free(kcopy);
+	}
+
+	*pos = p;
+
+	return item;
+
+failed:
+
+	stu_json_delete(item);
+
+	if (kcopy) {
+		stu_free(kcopy);
+	}
+
+	if (p != NULL) {
+		*pos = p;
+	}
+
+	return NULL;
+}
+
+
+/* of the key, or 0 if not interned */
+static stu_uint_t
+stu_protocol_field(stu_str_t *key) {
+	stu_uint_t  field;
+
+	if (key->len < 2) {
+		return 0;
+	}
+
+	switch (key->len << 8 | key->data[0]) {
+	case 2 << 8 | 'i': field = 8;  break; // id
+	case 3 << 8 | 'c': field = 1;  break; // cmd
+	case 3 << 8 | 'r': field = key->data[1] == 'a' ? 2 : 3; break; // raw, req
+	case 4 << 8 | 'd': field = 4;  break; // data
+	case 4 << 8 | 't': field = 5;  break; // type
+	case 4 << 8 | 'u': field = 7;  break; // user
+	case 4 << 8 | 'n': field = 9;  break; // name
+	case 4 << 8 | 'i': field = 10; break; // icon
+	case 4 << 8 | 'r': field = 11; break; // role
+	case 4 << 8 | 'c': field = 16; break; // code
+	case 5 << 8 | 's': field = 12; break; // state
+	case 5 << 8 | 't': field = 14; break; // total
+	case 5 << 8 | 'e': field = 15; break; // error
+	case 6 << 8 | 's': field = 13; break; // status
+	case 7 << 8 | 'c': field = 6;  break; // channel
+	default:
+		return 0;
+	}
+
+	if (memcmp(stu_protocol_fields[field]->data, key->data, key->len) != 0) {
+		return 0;
+	}
+
+	return field;
+}
+
+static u_char *
+stu_protocol_put_string(u_char *dst, u_char *last, stu_str_t *str) {
+	size_t  n;
+
+	if (str->len == 0) {
+		return stu_protocol_put_varint(dst, last, 0);
+	}
+
+	if (memchr(str->data, '\\', str->len) == NULL) {
+		dst = stu_protocol_put_varint(dst, last, str->len);
+		return stu_protocol_write(dst, last, str->data, str->len);
+	}
+
+	n = stu_protocol_unescape(NULL, 0, str->data, str->len);
+	dst = stu_protocol_put_varint(dst, last, n);
+
+	if (dst < last) {
+		stu_protocol_unescape(dst, last - dst, str->data, str->len);
+	}
+
+	return dst + n;
+}
+
+/*
+ * Returns the length unescaped, writing what fits in size. Anything but a
+ * valid escape is kept, as stu_json_stringify() prints it.
+ */
+static size_t
+stu_protocol_unescape(u_char *dst, size_t size, u_char *src, size_t n) {
+	u_char     *p, *end, buf[4], *b;
+	stu_int_t   cp, lo;
+	stu_uint_t  i;
+	size_t      k;
+
+	k = 0;
+
+	for (p = src, end = src + n; p < end; /* void */) {
+		b = memchr(p, '\\', end - p);
+		if (b == NULL) {
+			b = end;
+		}
+
+		if (k < size) {
+			memcpy(dst + k, p, stu_min((size_t) (b - p), size - k));
+		}
+
+		k += b - p;
+		p = b;
+
+		if (p == end) {
+			break;
+		}
+
+		b = buf;
+
+		if (end - p > 1) {
+			switch (p[1]) {
+			case '"':  *b++ = '"';  break;
+			case '\\': *b++ = '\\'; break;
+			case '/':  *b++ = '/';  break;
+			case 'b':  *b++ = '\b'; break;
+			case 'f':  *b++ = '\f'; break;
+			case 'n':  *b++ = '\n'; break;
+			case 'r':  *b++ = '\r'; break;
+			case 't':  *b++ = '\t'; break;
+
+			case 'u':
+				cp = stu_protocol_get_hex(p + 2, end);
+				if (cp == -1) {
+					break;
+				}
+
+				p += 4;
+
+				// a lone surrogate is replaced
+				if (cp >= 0xD800 && cp <= 0xDFFF) {
+					lo = end - p > 3 && p[2] == '\\' && p[3] == 'u' ? stu_protocol_get_hex(p + 4, end) : -1;
+
+					if (cp < 0xDC00 && lo >= 0xDC00 && lo <= 0xDFFF) {
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+						p += 6;
+					} else {
+						cp = 0xFFFD;
+					}
+				}
+
+				if (cp < 0x80) {
+					*b++ = cp;
+				} else if (cp < 0x800) {
+					*b++ = 0xC0 | (cp >> 6);
+					*b++ = 0x80 | (cp & 0x3F);
+				} else if (cp < 0x10000) {
+					*b++ = 0xE0 | (cp >> 12);
+					*b++ = 0x80 | ((cp >> 6) & 0x3F);
+					*b++ = 0x80 | (cp & 0x3F);
+				} else {
+					*b++ = 0xF0 | (cp >> 18);
+					*b++ = 0x80 | ((cp >> 12) & 0x3F);
+					*b++ = 0x80 | ((cp >> 6) & 0x3F);
+					*b++ = 0x80 | (cp & 0x3F);
+				}
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		if (b == buf) {
+			*b++ = *p++;
+		} else {
+			p += 2;
+		}
+
+		for (i = 0; i < (stu_uint_t) (b - buf); i++, k++) {
+			if (k < size) {
+				dst[k] = buf[i];
+			}
+		}
+	}
+
+	return k;
+}
+
+/*
+ * Points str at the raw string, or at a copy escaped as in json if needed,
+ * which is returned in copy to be freed.
+ */
+static u_char *
+stu_protocol_get_string(u_char *p, u_char *end, stu_str_t *str, u_char **copy) {
+	u_char    *s, *last, *d;
+	uint64_t   v;
+	size_t     n;
+
+	*copy = NULL;
+
+	p = stu_protocol_get_varint(p, end, &v);
+	if (p == NULL || v > (uint64_t) (end - p) || stu_utf8_validate(p, v) != STU_OK) {
+		return NULL;
+	}
+
+	last = p + v;
+
+	str->data = p;
+	str->len = v;
+
+	s = stu_protocol_find_escape(p, last);
+	if (s == last) {
+		return last;
+	}
+
+	// sized exactly, as a chat line is seldom worth 6 times its length
+	for (n = v, d = s; d < last; d = stu_protocol_find_escape(d + 1, last)) {
+		n += *d < 0x20 ? 5 : 1;
+	}
+
+	d = stu_alloc(n);
+	if (d == NULL) {
+		return NULL;
+	}
+
+	*copy = str->data = d;
+	d = stu_memcpy(d, p, s - p);
+
+	while (s < last) {
+		if (*s == '"' || *s == '\\') {
+			*d++ = '\\';
+			*d++ = *s;
+		} else {
+			*d++ = '\\';
+			*d++ = 'u';
+			*d++ = '0';
+			*d++ = '0';
+			*d++ = stu_protocol_hex[*s >> 4];
+			*d++ = stu_protocol_hex[*s & 0xF];
+		}
+
+		p = s + 1;
+		s = stu_protocol_find_escape(p, last);
+		d = stu_memcpy(d, p, s - p);
+	}
+
+	str->len = d - str->data;
+
+	return last;
+}
+
+/* the quote, the backslash or a control byte */
+static u_char *
+stu_protocol_find_escape(u_char *p, u_char *last) {
+#if (STU_HAVE_SSE2)
+	__m128i  v, qt, bs, ctl;
+	int      m;
+
+	qt = _mm_set1_epi8('\"');
+	bs = _mm_set1_epi8('\\');
+	ctl = _mm_set1_epi8(0x1F);
+
+	for ( /* void */ ; last - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, qt), _mm_cmpeq_epi8(v, bs)),
+				_mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)));
+		if (m) {
+			return p + __builtin_ctz(m);
+		}
+	}
+#endif
+
+	for ( /* void */ ; p < last; p++) {
+		if (*p == '"' || *p == '\\' || *p < 0x20) {
+			break;
+		}
+	}
+
+	return p;
+}
+
+/* of the 4 hex digits at p, or -1 */
+static stu_int_t
+stu_protocol_get_hex(u_char *p, u_char *end) {
+	stu_int_t   v;
+	stu_uint_t  i;
+	u_char      c;
+
+	if (end - p < 4) {
+		return -1;
+	}
+
+	for (i = 0, v = 0; i < 4; i++) {
+		c = p[i] | 0x20;
+
+		if (p[i] >= '0' && p[i] <= '9') {
+			v = v << 4 | (p[i] - '0');
+		} else if (c >= 'a' && c <= 'f') {
+			v = v << 4 | (c - 'a' + 10);
+		} else {
+			return -1;
+		}
+	}
+
+	return v;
+}
+
+
+static stu_inline u_char *
+stu_protocol_put_varint(u_char *dst, u_char *last, uint64_t v) {
+	for ( /* void */ ; v >= 0x80; v >>= 7, dst++) {
+		if (dst < last) {
+			*dst = (u_char) v | 0x80;
+		}
+	}
+
+	if (dst < last) {
+		*dst = (u_char) v;
+	}
+
+	return dst + 1;
+}
+
+static stu_inline u_char *
+stu_protocol_get_varint(u_char *p, u_char *end, uint64_t *v) {
+	stu_uint_t  shift;
+
+	*v = 0;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t) (*p & 0x7F) << shift;
+
+		if ((*p++ & 0x80) == 0) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+static stu_inline u_char *
+stu_protocol_write(u_char *dst, u_char *last, u_char *src, size_t n) {
+	if (dst < last) {
+		memcpy(dst, src, stu_min(n, (size_t) (last - dst)));
+	}
+
+	return dst + n;
+}
@@ -44,4 +44,25 @@ extern stu_str_t  STU_PROTOCOL_RAWS_KICKOUT;
 extern stu_str_t  STU_PROTOCOL_RAWS_ERROR;
 extern stu_str_t  STU_PROTOCOL_RAWS_PONG;
 
+#define STU_PROTOCOL_JSON        0x00
+#define STU_PROTOCOL_TLV         0x01
+
+#define STU_PROTOCOL_TLV_NULL    0x00
+#define STU_PROTOCOL_TLV_FALSE   0x01
+#define STU_PROTOCOL_TLV_TRUE    0x02
+#define STU_PROTOCOL_TLV_INTEGER 0x03
+#define STU_PROTOCOL_TLV_DOUBLE  0x04
+#define STU_PROTOCOL_TLV_STRING  0x05
+#define STU_PROTOCOL_TLV_ARRAY   0x06
+#define STU_PROTOCOL_TLV_OBJECT  0x07
+
+#define STU_PROTOCOL_TLV_DEPTH   32
+
+extern stu_str_t  STU_PROTOCOL_SUBPROTOCOL_TLV;
+
+size_t      stu_protocol_encode(stu_json_t *item, u_char *dst, size_t size);
+stu_json_t *stu_protocol_decode(u_char *data, size_t len);
+
+size_t      stu_protocol_serialize(stu_uint_t protocol, stu_json_t *item, u_char *dst, size_t size);
+
 #endif /* STU_PROTOCOL_H_ */
@@ -0,0 +1,688 @@
+/*
+ * stu_resolver.c
+ *
+ *  Created on: 2017-7-3
+ *      Author: Tony Lau
+ */
+
+#define STU_LOG_MODULE  STU_LOG_RESOLVER
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+typedef struct {
+	struct sockaddr_in   nameserver;  // sin_family is 0 if there is none
+	stu_str_t            hosts;
+	time_t               valid;       // seconds
+	time_t               timeout;     // seconds
+
+	stu_list_t           nodes;       // type: stu_resolver_node_t *, not changed after parsing conf
+	stu_connection_t    *udp;
+	uint16_t             ident;
+} stu_resolver_t;
+
+static stu_resolver_t  stu_resolver;
+
+static ssize_t    stu_resolver_read_file(u_char *name, u_char *buf, size_t size);
+static stu_int_t  stu_resolver_read_conf(struct sockaddr_in *sin);
+static void       stu_resolver_read_hosts(stu_resolver_node_t *node);
+static u_char    *stu_resolver_next_token(u_char *p, u_char *last, stu_str_t *token);
+
+static void       stu_resolver_timer_handler(stu_event_t *ev);
+static void       stu_resolver_send(stu_resolver_node_t *node, stu_msec_t now);
+static void       stu_resolver_read_handler(stu_event_t *ev);
+static void       stu_resolver_process_response(u_char *buf, size_t n, stu_msec_t now);
+static u_char    *stu_resolver_skip_name(u_char *p, u_char *last);
+
+
+stu_int_t
+stu_resolver_init(stu_config_t *cf) {
+	stu_list_init(&stu_resolver.nodes, (stu_list_palloc_pt) stu_calloc, stu_free);
+
+	stu_resolver.hosts = cf->resolver_hosts;
+	stu_resolver.valid = cf->resolver_valid;
+	stu_resolver.timeout = cf->resolver_timeout;
+
+	if (cf->resolver.name.len) {
+		stu_resolver.nameserver = cf->resolver.sockaddr;
+	} else if (stu_resolver_read_conf(&stu_resolver.nameserver) == STU_ERROR) {
+		stu_log("No nameserver found, host names are resolved by \"%s\" only.", stu_resolver.hosts.data);
+	}
+
+	return STU_OK;
+}
+
+stu_resolver_node_t *
+stu_resolver_add(stu_str_t *name) {
+	stu_resolver_node_t *node;
+	stu_list_elt_t      *elts, *e;
+	stu_queue_t         *q;
+	struct in_addr       addr;
+
+	elts = &stu_resolver.nodes.elts;
+
+	// servers of the same host share the node
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		node = (stu_resolver_node_t *) e->obj;
+
+		if (node->name.len == name->len && stu_strncasecmp(node->name.data, name->data, name->len) == 0) {
+			return node;
+		}
+	}
+
+	node = stu_calloc(sizeof(stu_resolver_node_t));
+	if (node == NULL) {
+		stu_log_error(0, "Failed to calloc resolver node.");
+		return NULL;
+	}
+
+	node->name.data = stu_calloc(name->len + 1);
+	if (node->name.data == NULL) {
+		stu_log_error(0, "Failed to calloc resolver node name.");
+		return NULL;
+	}
+
+	memcpy(node->name.data, name->data, name->len);
+	node->name.len = name->len;
+
+	stu_mutex_init(&node->lock, NULL);
+
+	if (inet_aton((const char *) node->name.data, &addr)) {
+		node->addrs[0] = addr.s_addr;
+		node->naddrs = 1;
+		node->literal = TRUE;
+	} else {
+		// used until the nameserver answers, or if it never does.
+		stu_resolver_read_hosts(node);
+
+		if (node->naddrs == 0 && stu_resolver.nameserver.sin_family == 0) {
+			stu_log_error(0, "Host \"%s\" not found in \"%s\".", node->name.data, stu_resolver.hosts.data);
+			return NULL;
+		}
+
+		node->expire = stu_current_msec;
+	}
+
+	if (stu_list_push(&stu_resolver.nodes, node, sizeof(stu_resolver_node_t)) == STU_ERROR) {
+		stu_log_error(0, "Failed to push resolver node.");
+		return NULL;
+	}
+
+	stu_log_debug(4, "resolver node \"%s\": addrs=%lu, literal=%d.", node->name.data, node->naddrs, node->literal);
+
+	return node;
+}
+
+stu_int_t
+stu_resolver_get_addr(stu_resolver_node_t *node, struct in_addr *addr) {
+	stu_int_t  rc;
+
+	rc = STU_DECLINED;
+
+	stu_mutex_lock(&node->lock);
+
+	if (node->naddrs) {
+		addr->s_addr = node->addrs[node->current++ % node->naddrs];
+		rc = STU_OK;
+	}
+
+	stu_mutex_unlock(&node->lock);
+
+	return rc;
+}
+
+stu_int_t
+stu_resolver_add_timers() {
+	stu_connection_t    *c, *pc;
+	stu_resolver_node_t *node;
+	stu_list_elt_t      *elts, *e;
+	stu_queue_t         *q;
+	stu_socket_t         fd;
+	stu_uint_t           n;
+
+	if (stu_resolver.nameserver.sin_family == 0) {
+		return STU_OK;
+	}
+
+	n = 0;
+	elts = &stu_resolver.nodes.elts;
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		node = (stu_resolver_node_t *) e->obj;
+
+		if (node->literal == FALSE) {
+			n++;
+		}
+	}
+
+	if (n == 0) {
+		return STU_OK;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == (stu_socket_t) STU_SOCKET_INVALID) {
+		stu_log_error(stu_errno, "Failed to create socket for resolver.");
+		return STU_ERROR;
+	}
+
+	if (stu_nonblocking(fd) == -1) {
+		stu_log_error(stu_errno, "fcntl(O_NONBLOCK) failed while setting resolver.");
+		stu_close_socket(fd);
+		return STU_ERROR;
+	}
+
+	// connected, so that the answers from any other address are dropped.
+	if (connect(fd, (struct sockaddr *) &stu_resolver.nameserver, sizeof(struct sockaddr_in)) == -1) {
+		stu_log_error(stu_errno, "Failed to connect to nameserver.");
+		stu_close_socket(fd);
+		return STU_ERROR;
+	}
+
+	pc = stu_connection_get(fd);
+	if (pc == NULL) {
+		stu_log_error(0, "Failed to get connection for resolver.");
+		stu_close_socket(fd);
+		return STU_ERROR;
+	}
+
+	pc->read.handler = stu_resolver_read_handler;
+	if (stu_event_add(&pc->read, STU_READ_EVENT, STU_CLEAR_EVENT) == STU_ERROR) {
+		stu_log_error(0, "Failed to add read event of resolver.");
+		stu_connection_close(pc);
+		return STU_ERROR;
+	}
+
+	stu_resolver.udp = pc;
+	stu_resolver.ident = (uint16_t) (stu_getpid() ^ stu_current_msec);
+
+	c = stu_connection_get((stu_socket_t) -2);
+	if (c == NULL) {
+		stu_log_error(0, "Failed to get connection for resolver timer.");
+		return STU_ERROR;
+	}
+
+	c->write.handler = stu_resolver_timer_handler;
+	stu_timer_add(&c->write, 1);
+
+	stu_log_debug(4, "resolver: nodes=%lu.", n);
+
+	return STU_OK;
+}
+
+
+static ssize_t
+stu_resolver_read_file(u_char *name, u_char *buf, size_t size) {
+	stu_file_t  file;
+	ssize_t     n;
+
+	stu_memzero(&file, sizeof(stu_file_t));
+
+	file.name.data = name;
+	file.name.len = stu_strlen(name);
+
+	file.fd = stu_file_open(name, STU_FILE_RDONLY, STU_FILE_OPEN, STU_FILE_DEFAULT_ACCESS);
+	if (file.fd == STU_FILE_INVALID) {
+		stu_log_error(stu_errno, "Failed to " stu_file_open_n " \"%s\".", name);
+		return STU_ERROR;
+	}
+
+	n = stu_file_read(&file, buf, size, 0);
+
+	stu_file_close(file.fd);
+
+	return n;
+}
+
+static stu_int_t
+stu_resolver_read_conf(struct sockaddr_in *sin) {
+	u_char     *buf, *p, *last, temp[INET_ADDRSTRLEN];
+	stu_str_t   token;
+	ssize_t     n;
+	stu_int_t   rc;
+
+	rc = STU_ERROR;
+
+	buf = stu_calloc(STU_RESOLVER_FILE_MAX_SIZE);
+	if (buf == NULL) {
+		return STU_ERROR;
+	}
+
+	n = stu_resolver_read_file((u_char *) STU_RESOLVER_DEFAULT_CONF, buf, STU_RESOLVER_FILE_MAX_SIZE - 1);
+	if (n == STU_ERROR) {
+		goto done;
+	}
+
+	last = buf + n;
+
+	// the first IPv4 "nameserver" line
+	for (p = buf; p < last; /* void */) {
+		p = stu_resolver_next_token(p, last, &token);
+		if (token.len != 10 || stu_strncmp(token.data, "nameserver", 10) != 0) {
+			goto next;
+		}
+
+		p = stu_resolver_next_token(p, last, &token);
+		if (token.len == 0 || token.len >= INET_ADDRSTRLEN) {
+			goto next;
+		}
+
+		stu_strncpy(temp, token.data, token.len);
+		temp[token.len] = '\0';
+
+		stu_memzero(sin, sizeof(struct sockaddr_in));
+		if (inet_aton((const char *) temp, &sin->sin_addr)) {
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(53);
+			rc = STU_OK;
+
+			stu_log("Using nameserver %s.", temp);
+			break;
+		}
+
+	next:
+
+		while (p < last && *p++ != LF) { /* void */ }
+	}
+
+done:
+
+	stu_free(buf);
+
+	return rc;
+}
+
+static void
+stu_resolver_read_hosts(stu_resolver_node_t *node) {
+	u_char         *buf, *p, *last;
+	stu_str_t       token, addr;
+	ssize_t         n;
+	struct in_addr  in;
+
+	buf = stu_calloc(STU_RESOLVER_FILE_MAX_SIZE);
+	if (buf == NULL) {
+		return;
+	}
+
+	n = stu_resolver_read_file(stu_resolver.hosts.data, buf, STU_RESOLVER_FILE_MAX_SIZE - 1);
+	if (n == STU_ERROR) {
+		goto done;
+	}
+
+	last = buf + n;
+
+	// "address name [aliases...]" per line
+	for (p = buf; p < last && node->naddrs < STU_RESOLVER_ADDRS_MAXIMUM; /* void */) {
+		p = stu_resolver_next_token(p, last, &addr);
+		if (addr.len == 0) {
+			goto next;
+		}
+
+		for ( ;; ) {
+			p = stu_resolver_next_token(p, last, &token);
+			if (token.len == 0) {
+				break;
+			}
+
+			if (token.len == node->name.len && stu_strncasecmp(token.data, node->name.data, token.len) == 0) {
+				addr.data[addr.len] = '\0';
+				if (inet_aton((const char *) addr.data, &in)) {
+					node->addrs[node->naddrs++] = in.s_addr;
+				}
+				break;
+			}
+		}
+
+	next:
+
+		while (p < last && *p++ != LF) { /* void */ }
+	}
+
+done:
+
+	stu_free(buf);
+}
+
+/* token of the current line, ends with an empty one at LF or '#'. */
+static u_char *
+stu_resolver_next_token(u_char *p, u_char *last, stu_str_t *token) {
+	while (p < last && (*p == ' ' || *p == HT)) {
+		p++;
+	}
+
+	token->data = p;
+
+	while (p < last && *p != ' ' && *p != HT && *p != CR && *p != LF && *p != '#') {
+		p++;
+	}
+
+	token->len = p - token->data;
+
+	return p;
+}
+
+
+static void
+stu_resolver_timer_handler(stu_event_t *ev) {
+	stu_connection_t    *pc;
+	stu_resolver_node_t *node;
+	stu_list_elt_t      *elts, *e;
+	stu_queue_t         *q;
+	stu_msec_t           now;
+
+	pc = stu_resolver.udp;
+	now = stu_current_msec;
+
+	// the read handler holds pc->lock, while the timer lock is held here.
+	if (stu_mutex_trylock(&pc->lock) != 0) {
+		goto done;
+	}
+
+	elts = &stu_resolver.nodes.elts;
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		node = (stu_resolver_node_t *) e->obj;
+
+		if (node->literal) {
+			continue;
+		}
+
+		stu_mutex_lock(&node->lock);
+
+		if (node->sent && now - node->sent >= (stu_msec_t) stu_resolver.timeout * 1000) {
+			stu_log_error(0, "resolving \"%s\" timed out, addrs=%lu.", node->name.data, node->naddrs);
+
+			node->sent = 0;
+			node->expire = now + STU_RESOLVER_RETRY_INTERVAL * 1000;
+		}
+
+		if (node->sent == 0 && (stu_msec_int_t) (now - node->expire) >= 0) {
+			stu_resolver_send(node, now);
+		}
+
+		stu_mutex_unlock(&node->lock);
+	}
+
+	stu_mutex_unlock(&pc->lock);
+
+done:
+
+	stu_timer_add_locked(ev, STU_RESOLVER_TIMER_INTERVAL);
+}
+
+/* called with pc->lock & node->lock held. */
+static void
+stu_resolver_send(stu_resolver_node_t *node, stu_msec_t now) {
+	u_char    buf[STU_RESOLVER_PACKET_SIZE], *p, *s, *label;
+	size_t    len;
+	uint16_t  ident;
+
+	if (node->name.len > 253) {
+		stu_log_error(0, "Host name too long: \"%s\".", node->name.data);
+		node->literal = TRUE;
+		return;
+	}
+
+	ident = ++stu_resolver.ident;
+
+	p = buf;
+
+	// header: recursion desired, one question
+	*p++ = (u_char) (ident >> 8);
+	*p++ = (u_char) (ident & 0xff);
+	*p++ = 0x01; *p++ = 0x00;
+	*p++ = 0x00; *p++ = 0x01;
+	stu_memzero(p, 6);
+	p += 6;
+
+	// question: labels of the name, type A, class IN
+	label = p++;
+	len = 0;
+
+	for (s = node->name.data; s < node->name.data + node->name.len; s++) {
+		if (*s != '.') {
+			*p++ = *s;
+			len++;
+			continue;
+		}
+
+		if (len == 0 || len > 63) {
+			goto invalid;
+		}
+
+		*label = (u_char) len;
+		label = p++;
+		len = 0;
+	}
+
+	if (len > 63) {
+		goto invalid;
+	}
+
+	*label = (u_char) len;
+	if (len) {
+		*p++ = '\0';
+	}
+
+	*p++ = 0x00; *p++ = 0x01;
+	*p++ = 0x00; *p++ = 0x01;
+
+	if (send(stu_resolver.udp->fd, buf, p - buf, 0) == -1) {
+		stu_log_error(stu_errno, "Failed to send query of \"%s\".", node->name.data);
+		node->expire = now + STU_RESOLVER_RETRY_INTERVAL * 1000;
+		return;
+	}
+
+	node->ident = ident;
+	node->sent = now;
+
+	stu_log_debug(4, "resolver query sent: name=\"%s\", ident=%d.", node->name.data, ident);
+
+	return;
+
+invalid:
+
+	stu_log_error(0, "Invalid host name: \"%s\".", node->name.data);
+	node->literal = TRUE;
+}
+
+static void
+stu_resolver_read_handler(stu_event_t *ev) {
+	stu_connection_t *pc;
+	u_char            buf[STU_RESOLVER_PACKET_SIZE];
+	stu_uint_t        generation;
+	stu_int_t         n, err;
+
+	pc = (stu_connection_t *) ev->data;
+	generation = pc->generation;
+
+	stu_mutex_lock(&pc->lock);
+
+	if (pc->fd == (stu_socket_t) STU_SOCKET_INVALID || pc->generation != generation) {
+		goto done;
+	}
+
+	// edge triggered, read all of the datagrams.
+	for ( ;; ) {
+		n = recv(pc->fd, buf, STU_RESOLVER_PACKET_SIZE, 0);
+		if (n == -1) {
+			err = stu_errno;
+			if (err == EAGAIN) {
+				break;
+			}
+
+			if (err == EINTR || err == ECONNREFUSED) {
+				stu_log_debug(4, "resolver recv: errno=%d.", err);
+				continue;
+			}
+
+			stu_log_error(err, "Failed to recv from nameserver.");
+			break;
+		}
+
+		stu_resolver_process_response(buf, n, stu_current_msec);
+	}
+
+done:
+
+	stu_mutex_unlock(&pc->lock);
+}
+
+static void
+stu_resolver_process_response(u_char *buf, size_t n, stu_msec_t now) {
+	stu_resolver_node_t *node, *found;
+	stu_list_elt_t      *elts, *e;
+	stu_queue_t         *q;
+	u_char              *p, *last;
+	in_addr_t            addrs[STU_RESOLVER_ADDRS_MAXIMUM];
+	stu_uint_t           naddrs, qdcount, ancount, i, type, class, len, rcode;
+	uint32_t             ttl, min;
+	uint16_t             ident;
+
+	if (n < 12) {
+		stu_log_error(0, "Short response from nameserver: size=%lu.", n);
+		return;
+	}
+
+	ident = (buf[0] << 8) | buf[1];
+	rcode = buf[3] & 0x0f;
+	qdcount = (buf[4] << 8) | buf[5];
+	ancount = (buf[6] << 8) | buf[7];
+
+	if ((buf[2] & 0x80) == 0) {
+		return;
+	}
+
+	found = NULL;
+	elts = &stu_resolver.nodes.elts;
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		node = (stu_resolver_node_t *) e->obj;
+
+		if (node->sent && node->ident == ident) {
+			found = node;
+			break;
+		}
+	}
+
+	if (found == NULL) {
+		stu_log_debug(4, "unexpected response from nameserver: ident=%d.", ident);
+		return;
+	}
+
+	node = found;
+
+	stu_mutex_lock(&node->lock);
+
+	if (node->sent == 0 || node->ident != ident) {
+		goto done;
+	}
+
+	node->sent = 0;
+
+	if (rcode) {
+		stu_log_error(0, "Failed to resolve \"%s\": rcode=%lu.", node->name.data, rcode);
+		goto failed;
+	}
+
+	if (qdcount != 1) {
+		goto invalid;
+	}
+
+	p = buf + 12;
+	last = buf + n;
+
+	p = stu_resolver_skip_name(p, last);
+	if (p == NULL || p + 4 > last) {
+		goto invalid;
+	}
+
+	p += 4;
+
+	naddrs = 0;
+	min = 0xffffffff;
+
+	for (i = 0; i < ancount; i++) {
+		p = stu_resolver_skip_name(p, last);
+		if (p == NULL || p + 10 > last) {
+			goto invalid;
+		}
+
+		type = (p[0] << 8) | p[1];
+		class = (p[2] << 8) | p[3];
+		ttl = ((uint32_t) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+		len = (p[8] << 8) | p[9];
+
+		p += 10;
+		if (p + len > last) {
+			goto invalid;
+		}
+
+		// CNAMEs are followed by the A records of the canonical name
+		if (type == 1 && class == 1 && len == 4 && naddrs < STU_RESOLVER_ADDRS_MAXIMUM) {
+			memcpy(&addrs[naddrs++], p, 4);
+			min = stu_min(min, ttl);
+		}
+
+		p += len;
+	}
+
+	if (naddrs == 0) {
+		stu_log_error(0, "No address of \"%s\" found.", node->name.data);
+		goto failed;
+	}
+
+	if (stu_resolver.valid) {
+		min = stu_resolver.valid;
+	}
+
+	memcpy(node->addrs, addrs, naddrs * sizeof(in_addr_t));
+	node->naddrs = naddrs;
+	node->expire = now + (stu_msec_t) stu_max(min, 1) * 1000;
+
+	stu_log_debug(4, "resolved \"%s\": addrs=%lu, valid=%u.", node->name.data, naddrs, min);
+
+	goto done;
+
+invalid:
+
+	stu_log_error(0, "Invalid response of \"%s\" from nameserver.", node->name.data);
+
+failed:
+
+	// keep the addresses known, and try again later.
+	node->expire = now + STU_RESOLVER_RETRY_INTERVAL * 1000;
+
+done:
+
+	stu_mutex_unlock(&node->lock);
+}
+
+static u_char *
+stu_resolver_skip_name(u_char *p, u_char *last) {
+	stu_uint_t  len;
+
+	while (p < last) {
+		len = *p;
+
+		if (len == 0) {
+			return p + 1;
+		}
+
+		// compression pointer ends the name
+		if ((len & 0xc0) == 0xc0) {
+			return p + 2 <= last ? p + 2 : NULL;
+		}
+
+		if (len & 0xc0) {
+			return NULL;
+		}
+
+		p += len + 1;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * stu_resolver.h
+ *
+ *  Created on: 2017-7-3
+ *      Author: Tony Lau
+ */
+
+#ifndef STU_RESOLVER_H_
+#define STU_RESOLVER_H_
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#define STU_RESOLVER_ADDRS_MAXIMUM     8
+#define STU_RESOLVER_DEFAULT_TIMEOUT   3      // seconds
+#define STU_RESOLVER_DEFAULT_VALID     30     // seconds, of the hosts file records
+#define STU_RESOLVER_RETRY_INTERVAL    5      // seconds, after a failed query
+
+#define STU_RESOLVER_TIMER_INTERVAL    1000
+#define STU_RESOLVER_PACKET_SIZE       512
+#define STU_RESOLVER_FILE_MAX_SIZE     65536
+
+#define STU_RESOLVER_DEFAULT_CONF      "/etc/resolv.conf"
+#define STU_RESOLVER_DEFAULT_HOSTS     "/etc/hosts"
+
+/*
+ * Addresses of a host name, which are shared by the upstream servers with
+ * the same address, and re-resolved by the worker once they expired.
+ */
+typedef struct {
+	stu_str_t         name;
+	stu_mutex_t       lock;
+
+	in_addr_t         addrs[STU_RESOLVER_ADDRS_MAXIMUM];
+	stu_uint_t        naddrs;
+	stu_uint_t        current;   // round robin
+
+	stu_bool_t        literal;   // never re-resolved
+	stu_msec_t        expire;
+	stu_msec_t        sent;      // 0 if no query in flight
+	uint16_t          ident;
+} stu_resolver_node_t;
+
+stu_int_t            stu_resolver_init(stu_config_t *cf);
+stu_resolver_node_t *stu_resolver_add(stu_str_t *name);
+stu_int_t            stu_resolver_get_addr(stu_resolver_node_t *node, struct in_addr *addr);
+
+stu_int_t            stu_resolver_add_timers();
+
+#endif /* STU_RESOLVER_H_ */
@@ -9,6 +9,18 @@
 #include "stu_config.h"
 #include "stu_core.h"
 
+#if (STU_HAVE_SSSE3)
+#include <tmmintrin.h>
+#elif (STU_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#define STU_INT64_LEN         (sizeof("-9223372036854775808") - 1)
+#define STU_MAX_UINT32_VALUE  (uint32_t) 0xffffffff
+
+static u_char *stu_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, stu_uint_t hexadecimal, stu_uint_t width);
+
+
 void
 stu_strlow(u_char *dst, u_char *src, size_t n) {
 	while (n) {
@@ -126,34 +138,366 @@ stu_printf(const char *fmt, ...) {
 }
 
 u_char *
-stu_sprintf(u_char *s, const char *fmt, ...) {
+stu_sprintf(u_char *buf, const char *fmt, ...) {
 	va_list    args;
 	u_char    *p;
 
 	va_start(args, fmt);
-	p = stu_vsprintf(s, fmt, args);
+	p = stu_vslprintf(buf, (void *) -1, fmt, args);
 	va_end(args);
 
 	return p;
 }
 
+u_char *
+stu_snprintf(u_char *buf, size_t max, const char *fmt, ...) {
+	va_list    args;
+	u_char    *p;
+
+	va_start(args, fmt);
+	p = stu_vslprintf(buf, buf + max, fmt, args);
+	va_end(args);
+
+	return p;
+}
+
+u_char *
+stu_slprintf(u_char *buf, u_char *last, const char *fmt, ...) {
+	va_list    args;
+	u_char    *p;
+
+	va_start(args, fmt);
+	p = stu_vslprintf(buf, last, fmt, args);
+	va_end(args);
+
+	return p;
+}
+
+/* appends at b->last, and never beyond b->end. */
+u_char *
+stu_buf_printf(stu_buf_t *b, const char *fmt, ...) {
+	va_list    args;
+
+	va_start(args, fmt);
+	b->last = stu_vslprintf(b->last, b->end, fmt, args);
+	va_end(args);
+
+	return b->last;
+}
+
 stu_int_t
 stu_vprintf(const char *fmt, va_list args) {
 	return vprintf(fmt, args);
 }
 
+/*
+ * Not of libc, so no locale and no second pass over the output:
+ *    %[0][width][x][X]O        off_t
+ *    %[0][width][u][x|X]z      ssize_t / size_t
+ *    %[0][width][u][x|X]d      int / u_int
+ *    %[0][width][u][x|X]l      long / u_long
+ *    %[0][width][u][x|X]i      stu_int_t / stu_uint_t
+ *    %[0][width][u][x|X]D      int32_t / uint32_t
+ *    %[0][width][u][x|X]L      int64_t / uint64_t
+ *    %[0][width][.width]f      double, within the range of int64_t
+ *    %p                        void *
+ *    %V                        stu_str_t *
+ *    %s                        null-terminated string, nothing if NULL
+ *    %*s                       length and string
+ *    %c                        char
+ *    %Z                        '\0'
+ *    %N                        '\n'
+ *    %%                        %
+ *
+ * Never writes at or beyond last, and adds no '\0' unless told with %Z.
+ */
 u_char *
-stu_vsprintf(u_char *s, const char *fmt, va_list args) {
-	stu_int_t  n;
-	u_char    *p = s;
+stu_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args) {
+	u_char      *p, zero;
+	int          d;
+	double       f;
+	size_t       len, slen;
+	int64_t      i64;
+	uint64_t     ui64, frac, scale;
+	stu_str_t   *v;
+	stu_uint_t   width, sign, hex, frac_width, n;
+
+	while (*fmt && buf < last) {
+		if (*fmt != '%') {
+			*buf++ = *fmt++;
+			continue;
+		}
+
+		i64 = 0;
+		ui64 = 0;
+
+		zero = (u_char) ((*++fmt == '0') ? '0' : ' ');
+		width = 0;
+		sign = 1;
+		hex = 0;
+		frac_width = 0;
+		slen = (size_t) -1;
+
+		while (*fmt >= '0' && *fmt <= '9') {
+			width = width * 10 + (*fmt++ - '0');
+		}
+
+		for ( ;; ) {
+			switch (*fmt) {
+			case 'u':
+				sign = 0;
+				fmt++;
+				continue;
+
+			case 'X':
+				hex = 2;
+				sign = 0;
+				fmt++;
+				continue;
+
+			case 'x':
+				hex = 1;
+				sign = 0;
+				fmt++;
+				continue;
+
+			case '.':
+				fmt++;
+				while (*fmt >= '0' && *fmt <= '9') {
+					frac_width = frac_width * 10 + (*fmt++ - '0');
+				}
+				break;
+
+			case '*':
+				slen = va_arg(args, size_t);
+				fmt++;
+				continue;
+
+			default:
+				break;
+			}
+
+			break;
+		}
+
+		switch (*fmt) {
+		case 'V':
+			v = va_arg(args, stu_str_t *);
+
+			len = stu_min((size_t) (last - buf), v->len);
+			if (len) {
+				buf = stu_memcpy(buf, v->data, len);
+			}
+
+			fmt++;
+			continue;
+
+		case 's':
+			p = va_arg(args, u_char *);
+			if (p == NULL) {
+				fmt++;
+				continue;
+			}
+
+			if (slen == (size_t) -1) {
+				while (*p && buf < last) {
+					*buf++ = *p++;
+				}
+			} else {
+				len = stu_min((size_t) (last - buf), slen);
+				buf = stu_memcpy(buf, p, len);
+			}
+
+			fmt++;
+			continue;
+
+		case 'O':
+			i64 = (int64_t) va_arg(args, off_t);
+			sign = 1;
+			break;
+
+		case 'z':
+			if (sign) {
+				i64 = (int64_t) va_arg(args, ssize_t);
+			} else {
+				ui64 = (uint64_t) va_arg(args, size_t);
+			}
+			break;
+
+		case 'i':
+			if (sign) {
+				i64 = (int64_t) va_arg(args, stu_int_t);
+			} else {
+				ui64 = (uint64_t) va_arg(args, stu_uint_t);
+			}
+			break;
+
+		case 'l':
+			if (sign) {
+				i64 = (int64_t) va_arg(args, long);
+			} else {
+				ui64 = (uint64_t) va_arg(args, u_long);
+			}
+			break;
+
+		case 'D':
+			if (sign) {
+				i64 = (int64_t) va_arg(args, int32_t);
+			} else {
+				ui64 = (uint64_t) va_arg(args, uint32_t);
+			}
+			break;
+
+		case 'L':
+			if (sign) {
+				i64 = va_arg(args, int64_t);
+			} else {
+				ui64 = va_arg(args, uint64_t);
+			}
+			break;
+
+		case 'd':
+			if (sign) {
+				i64 = (int64_t) va_arg(args, int);
+			} else {
+				ui64 = (uint64_t) va_arg(args, u_int);
+			}
+			break;
+
+		case 'f':
+			f = va_arg(args, double);
 
-	n = vsprintf((char *) s, fmt, args);
-	if (n < 0) {
-		return NULL;
+			if (f < 0) {
+				*buf++ = '-';
+				f = -f;
+			}
+
+			ui64 = (int64_t) f;
+			frac = 0;
+
+			if (frac_width) {
+				for (scale = 1, n = frac_width; n; n--) {
+					scale *= 10;
+				}
+
+				frac = (uint64_t) ((f - (double) ui64) * scale + 0.5);
+				if (frac == scale) {
+					ui64++;
+					frac = 0;
+				}
+			}
+
+			buf = stu_sprintf_num(buf, last, ui64, zero, 0, width);
+
+			if (frac_width) {
+				if (buf < last) {
+					*buf++ = '.';
+				}
+
+				buf = stu_sprintf_num(buf, last, frac, '0', 0, frac_width);
+			}
+
+			fmt++;
+			continue;
+
+		case 'p':
+			ui64 = (uintptr_t) va_arg(args, void *);
+			hex = 2;
+			sign = 0;
+			zero = '0';
+			width = 2 * sizeof(void *);
+			break;
+
+		case 'c':
+			d = va_arg(args, int);
+			*buf++ = (u_char) (d & 0xff);
+			fmt++;
+			continue;
+
+		case 'Z':
+			*buf++ = '\0';
+			fmt++;
+			continue;
+
+		case 'N':
+			*buf++ = LF;
+			fmt++;
+			continue;
+
+		case '%':
+			*buf++ = '%';
+			fmt++;
+			continue;
+
+		case '\0':
+			continue;
+
+		default:
+			*buf++ = *fmt++;
+			continue;
+		}
+
+		if (sign) {
+			if (i64 < 0) {
+				*buf++ = '-';
+				ui64 = (uint64_t) -i64;
+			} else {
+				ui64 = (uint64_t) i64;
+			}
+		}
+
+		buf = stu_sprintf_num(buf, last, ui64, zero, hex, width);
+		fmt++;
 	}
-	p += n;
 
-	return p;
+	return buf;
+}
+
+static u_char *
+stu_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, stu_uint_t hexadecimal, stu_uint_t width) {
+	u_char         *p, temp[STU_INT64_LEN + 1];
+	size_t          len;
+	uint32_t        ui32;
+	static u_char   hex[] = "0123456789abcdef";
+	static u_char   HEX[] = "0123456789ABCDEF";
+
+	p = temp + STU_INT64_LEN;
+
+	if (hexadecimal == 0) {
+		if (ui64 <= (uint64_t) STU_MAX_UINT32_VALUE) {
+			// 32-bit division is much faster than 64-bit one
+			ui32 = (uint32_t) ui64;
+
+			do {
+				*--p = (u_char) (ui32 % 10 + '0');
+			} while (ui32 /= 10);
+		} else {
+			do {
+				*--p = (u_char) (ui64 % 10 + '0');
+			} while (ui64 /= 10);
+		}
+	} else if (hexadecimal == 1) {
+		do {
+			*--p = hex[(uint32_t) (ui64 & 0xf)];
+		} while (ui64 >>= 4);
+	} else {
+		do {
+			*--p = HEX[(uint32_t) (ui64 & 0xf)];
+		} while (ui64 >>= 4);
+	}
+
+	len = (temp + STU_INT64_LEN) - p;
+
+	while (len++ < width && buf < last) {
+		*buf++ = zero;
+	}
+
+	len = (temp + STU_INT64_LEN) - p;
+	if (buf + len > last) {
+		len = last - buf;
+	}
+
+	return stu_memcpy(buf, p, len);
 }
 
 
@@ -203,6 +547,238 @@ uint32_t stu_utf8_decode(u_char **p, size_t n) {
 	return 0xffffffff;
 }
 
+#if (STU_HAVE_SSSE3)
+
+/*
+ * Validates 16 bytes at a time, by looking up the high and the low nibbles of
+ * each byte and of the one before it (Keiser & Lemire, "Validating UTF-8 In
+ * Less Than One Instruction Per Byte"). The bits below name the errors.
+ */
+#define STU_UTF8_TOO_SHORT       (1 << 0)
+#define STU_UTF8_TOO_LONG        (1 << 1)
+#define STU_UTF8_OVERLONG_3      (1 << 2)
+#define STU_UTF8_TOO_LARGE       (1 << 3)
+#define STU_UTF8_SURROGATE       (1 << 4)
+#define STU_UTF8_OVERLONG_2      (1 << 5)
+#define STU_UTF8_TOO_LARGE_1000  (1 << 6)
+#define STU_UTF8_OVERLONG_4      (1 << 6)
+#define STU_UTF8_TWO_CONTS       (1 << 7)
+#define STU_UTF8_CARRY           (STU_UTF8_TOO_SHORT | STU_UTF8_TOO_LONG | STU_UTF8_TWO_CONTS)
+
+static stu_inline __m128i
+stu_utf8_check_block(__m128i input, __m128i prev_input) {
+	__m128i  byte_1_high_table, byte_1_low_table, byte_2_high_table, nibble;
+	__m128i  prev1, prev2, prev3, sc, must23;
+
+	byte_1_high_table = _mm_setr_epi8(
+		STU_UTF8_TOO_LONG, STU_UTF8_TOO_LONG, STU_UTF8_TOO_LONG, STU_UTF8_TOO_LONG,
+		STU_UTF8_TOO_LONG, STU_UTF8_TOO_LONG, STU_UTF8_TOO_LONG, STU_UTF8_TOO_LONG,
+		STU_UTF8_TWO_CONTS, STU_UTF8_TWO_CONTS, STU_UTF8_TWO_CONTS, STU_UTF8_TWO_CONTS,
+		STU_UTF8_TOO_SHORT | STU_UTF8_OVERLONG_2,
+		STU_UTF8_TOO_SHORT,
+		STU_UTF8_TOO_SHORT | STU_UTF8_OVERLONG_3 | STU_UTF8_SURROGATE,
+		STU_UTF8_TOO_SHORT | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000 | STU_UTF8_OVERLONG_4
+	);
+
+	byte_1_low_table = _mm_setr_epi8(
+		STU_UTF8_CARRY | STU_UTF8_OVERLONG_3 | STU_UTF8_OVERLONG_2 | STU_UTF8_OVERLONG_4,
+		STU_UTF8_CARRY | STU_UTF8_OVERLONG_2,
+		STU_UTF8_CARRY,
+		STU_UTF8_CARRY,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000 | STU_UTF8_SURROGATE,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000,
+		STU_UTF8_CARRY | STU_UTF8_TOO_LARGE | STU_UTF8_TOO_LARGE_1000
+	);
+
+	byte_2_high_table = _mm_setr_epi8(
+		STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT,
+		STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT,
+		STU_UTF8_TOO_LONG | STU_UTF8_OVERLONG_2 | STU_UTF8_TWO_CONTS | STU_UTF8_OVERLONG_3 | STU_UTF8_TOO_LARGE_1000 | STU_UTF8_OVERLONG_4,
+		STU_UTF8_TOO_LONG | STU_UTF8_OVERLONG_2 | STU_UTF8_TWO_CONTS | STU_UTF8_OVERLONG_3 | STU_UTF8_TOO_LARGE,
+		STU_UTF8_TOO_LONG | STU_UTF8_OVERLONG_2 | STU_UTF8_TWO_CONTS | STU_UTF8_SURROGATE | STU_UTF8_TOO_LARGE,
+		STU_UTF8_TOO_LONG | STU_UTF8_OVERLONG_2 | STU_UTF8_TWO_CONTS | STU_UTF8_SURROGATE | STU_UTF8_TOO_LARGE,
+		STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT, STU_UTF8_TOO_SHORT
+	);
+
+	nibble = _mm_set1_epi8(0x0F);
+
+	prev1 = _mm_alignr_epi8(input, prev_input, 15);
+
+	sc = _mm_and_si128(_mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+			_mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble)));
+	sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+	// the third and the fourth bytes of a sequence must be continuations
+	prev2 = _mm_alignr_epi8(input, prev_input, 14);
+	prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+	must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xE0 - 0x80))),
+			_mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xF0 - 0x80))));
+
+	return _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char) 0x80)), sc);
+}
+
+/* non zero, if the block ends within a sequence */
+static stu_inline __m128i
+stu_utf8_check_incomplete(__m128i input) {
+	return _mm_subs_epu8(input, _mm_setr_epi8(
+			(char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF,
+			(char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF,
+			(char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1)));
+}
+
+stu_int_t
+stu_utf8_validate(u_char *p, size_t n) {
+	u_char   *end, temp[16];
+	__m128i   input, prev_input, prev_incomplete, error;
+
+	end = p + n;
+
+	prev_input = _mm_setzero_si128();
+	prev_incomplete = _mm_setzero_si128();
+	error = _mm_setzero_si128();
+
+	for ( ;; ) {
+		if (end - p >= 16) {
+			input = _mm_loadu_si128((const __m128i *) p);
+			p += 16;
+		} else if (p < end) {
+			// the tail, padded with ASCII
+			stu_memzero(temp, 16);
+			memcpy(temp, p, end - p);
+
+			input = _mm_loadu_si128((const __m128i *) temp);
+			p = end;
+		} else {
+			break;
+		}
+
+		if (_mm_movemask_epi8(input) == 0) {
+			// ASCII, which only fails on a sequence left open before
+			error = _mm_or_si128(error, prev_incomplete);
+			prev_incomplete = _mm_setzero_si128();
+		} else {
+			error = _mm_or_si128(error, stu_utf8_check_block(input, prev_input));
+			prev_incomplete = stu_utf8_check_incomplete(input);
+		}
+
+		prev_input = input;
+	}
+
+	error = _mm_or_si128(error, prev_incomplete);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF ? STU_OK : STU_ERROR;
+}
+
+#else
+
+/*
+ * Validates up to the end, or returns at the first ASCII byte after a
+ * multibyte sequence, so that the caller may go on a block at a time.
+ */
+static u_char *
+stu_utf8_validate_scalar(u_char *p, u_char *end) {
+	u_char  c, lo, hi;
+	size_t  len;
+
+	while (p < end) {
+		c = *p;
+
+		if (c < 0x80) {
+			p++;
+			continue;
+		}
+
+		// the bounds of the second byte, narrowed for overlongs and surrogates
+		lo = 0x80;
+		hi = 0xBF;
+
+		if (c < 0xC2) {
+			return NULL;
+		} else if (c < 0xE0) {
+			len = 2;
+		} else if (c < 0xF0) {
+			len = 3;
+
+			if (c == 0xE0) {
+				lo = 0xA0;
+			} else if (c == 0xED) {
+				hi = 0x9F;
+			}
+		} else if (c < 0xF5) {
+			len = 4;
+
+			if (c == 0xF0) {
+				lo = 0x90;
+			} else if (c == 0xF4) {
+				hi = 0x8F;
+			}
+		} else {
+			return NULL;
+		}
+
+		if ((size_t) (end - p) < len || p[1] < lo || p[1] > hi) {
+			return NULL;
+		}
+
+		if (len > 2 && (p[2] & 0xC0) != 0x80) {
+			return NULL;
+		}
+
+		if (len > 3 && (p[3] & 0xC0) != 0x80) {
+			return NULL;
+		}
+
+		p += len;
+
+		if (p < end && *p < 0x80) {
+			break;
+		}
+	}
+
+	return p;
+}
+
+stu_int_t
+stu_utf8_validate(u_char *p, size_t n) {
+	u_char  *end;
+#if (STU_HAVE_SSE2)
+	__m128i  v;
+#endif
+
+	end = p + n;
+
+	while (p < end) {
+#if (STU_HAVE_SSE2)
+		// no lookup without SSSE3, but the runs of ASCII go 16 bytes at a time
+		for ( ; end - p >= 16; p += 16) {
+			v = _mm_loadu_si128((const __m128i *) p);
+			if (_mm_movemask_epi8(v)) {
+				break;
+			}
+		}
+#endif
+
+		p = stu_utf8_validate_scalar(p, end);
+		if (p == NULL) {
+			return STU_ERROR;
+		}
+	}
+
+	return STU_OK;
+}
+
+#endif
+
 void
 stu_unescape_uri(u_char **dst, u_char **src, size_t size, stu_uint_t type) {
 	u_char  *d, *s, ch, c, decoded;
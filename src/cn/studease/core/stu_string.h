@@ -43,16 +43,21 @@ u_char *stu_strnstr(u_char *s1, char *s2, size_t n);
 stu_int_t stu_strncasecmp(u_char *s1, u_char *s2, size_t n);
 
 stu_int_t stu_printf(const char *fmt, ...);
-u_char *stu_sprintf(u_char *s, const char *fmt, ...);
-
 stu_int_t stu_vprintf(const char *fmt, va_list args);
-u_char *stu_vsprintf(u_char *s, const char *fmt, va_list args);
+
+u_char *stu_sprintf(u_char *buf, const char *fmt, ...);
+u_char *stu_snprintf(u_char *buf, size_t max, const char *fmt, ...);
+u_char *stu_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
+u_char *stu_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args);
+#define stu_vsnprintf(buf, max, fmt, args) \
+	stu_vslprintf(buf, buf + (max), fmt, args)
 
 
 #define STU_UNESCAPE_URI       1
 #define STU_UNESCAPE_REDIRECT  2
 
 uint32_t stu_utf8_decode(u_char **p, size_t n);
+stu_int_t stu_utf8_validate(u_char *p, size_t n);
 void stu_unescape_uri(u_char **dst, u_char **src, size_t size, stu_uint_t type);
 
 #endif /* STU_STRING_H_ */
@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_PROCESS
+
 #include <pthread.h>
 #include "stu_config.h"
 #include "stu_core.h"
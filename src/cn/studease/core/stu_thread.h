@@ -21,7 +21,13 @@ typedef pthread_t        stu_tid_t;
 typedef pthread_key_t    stu_thread_key_t;
 typedef pthread_cond_t   stu_cond_t;
 
-#define stu_thread_key_create(key)  pthread_key_create(key, NULL)
+#define stu_thread_key_create(key)          pthread_key_create(key, NULL)
+#define stu_thread_get_specific(key)        pthread_getspecific(key)
+#define stu_thread_set_specific(key, value) pthread_setspecific(key, value)
+#define stu_thread_join(tid, value)         pthread_join(tid, value)
+
+#define stu_cond_signal                     pthread_cond_signal
+#define stu_cond_timedwait                  pthread_cond_timedwait
 
 typedef struct {
 	stu_tid_t   id;
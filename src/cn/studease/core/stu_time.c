@@ -134,7 +134,7 @@ stu_time_update(void) {
 	(void) stu_sprintf(p2, "%02d/%s/%d:%02d:%02d:%02d %c%02d%02d",
 			tm.stu_tm_mday, months[tm.stu_tm_mon - 1], tm.stu_tm_year,
 			tm.stu_tm_hour, tm.stu_tm_min, tm.stu_tm_sec,
-			tp->gmtoff < 0 ? '-' : '+', stu_abs(tp->gmtoff / 60), stu_abs(tp->gmtoff % 60));
+			tp->gmtoff < 0 ? '-' : '+', (int) stu_abs(tp->gmtoff / 60), (int) stu_abs(tp->gmtoff % 60));
 
 	stu_memory_barrier();
 
@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_EVENT
+
 #include "stu_config.h"
 #include "stu_core.h"
 
@@ -18,7 +20,13 @@ extern stu_cycle_t *stu_cycle;
 
 stu_int_t
 stu_timer_init(stu_cycle_t *cycle) {
-	stu_mutex_init(&cycle->timer_lock, NULL);
+	stu_mutexattr_t  attr;
+
+	/* timer handlers may add or delete timers, while expiring. */
+	stu_mutexattr_init(&attr);
+	stu_mutexattr_settype(&attr, STU_MUTEX_RECURSIVE);
+	stu_mutex_init(&cycle->timer_lock, &attr);
+	stu_mutexattr_destroy(&attr);
 	stu_rbtree_init(&cycle->timer_rbtree, &cycle->timer_sentinel, stu_rbtree_insert_timer_value);
 
 	return STU_OK;
@@ -86,6 +94,8 @@ stu_timer_expire(void) {
 		ev->timedout = 1;
 		ev->timer_set = 0;
 
+		stu_metrics_observe(STU_METRIC_TIMER_LAG_MSEC, stu_current_msec - node->key);
+
 		ev->handler(ev);
 	}
 
@@ -184,6 +194,10 @@ stu_timer_del(stu_event_t *ev) {
 
 void
 stu_timer_del_locked(stu_event_t *ev) {
+	if (ev->timer_set == 0) {
+		return;
+	}
+
 	stu_rbtree_delete(&stu_cycle->timer_rbtree, &ev->timer);
 	stu_log_debug(3, "timer delete: fd=%d, key=%lu.", stu_timer_ident(ev->data), ev->timer.key);
 
@@ -0,0 +1,135 @@
+/*
+ * stu_trace.c
+ *
+ *  Created on: 2017-7-9
+ *      Author: Tony Lau
+ */
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#if (STU_TRACE)
+
+static stu_str_t          stu_trace_stage_names[] = {
+	stu_string("recv"),
+	stu_string("frame"),
+	stu_string("json"),
+	stu_string("rights"),
+	stu_string("serialize"),
+	stu_string("enqueue"),
+	stu_string("first_send"),
+	stu_string("last_send")
+};
+
+static stu_int_t          stu_trace_metrics[STU_TRACE_STAGES];
+
+static stu_trace_t        stu_trace_ring[STU_TRACE_RING_SIZE];
+static volatile uint32_t  stu_trace_next;
+
+
+/* registers a histogram of the time spent in each stage. */
+stu_int_t
+stu_trace_init() {
+	u_char      name[STU_METRICS_NAME_MAX_LEN], *p;
+	stu_uint_t  i;
+
+	for (i = 0; i < STU_TRACE_STAGES; i++) {
+		p = stu_snprintf(name, STU_METRICS_NAME_MAX_LEN, "trace_usec{stage=\"%V\"}", &stu_trace_stage_names[i]);
+
+		stu_trace_metrics[i] = stu_metrics_register(name, p - name, STU_METRICS_HISTOGRAM);
+		if (stu_trace_metrics[i] == STU_ERROR) {
+			return STU_ERROR;
+		}
+	}
+
+	return STU_OK;
+}
+
+/*
+ * Lock free: a slot is claimed with an atomic add, and seq is stored last,
+ * so a reader skips the slots being written.
+ */
+void
+stu_trace_write(stu_trace_t *t) {
+	stu_trace_t *slot;
+	uint32_t     i, seq, last;
+	stu_uint_t   k;
+
+	// not begun on a recv
+	if (t->start == 0) {
+		return;
+	}
+
+	if (t->status == STU_HTTP_OK) {
+		for (k = 0, last = 0; k < STU_TRACE_STAGES; k++) {
+			if (t->stages[k] == 0) {
+				continue;
+			}
+
+			stu_metrics_observe(stu_trace_metrics[k], t->stages[k] - last);
+			last = t->stages[k];
+		}
+	}
+
+	i = stu_atomic_fetch_add(&stu_trace_next, 1);
+	seq = i + 1;
+	slot = &stu_trace_ring[i & (STU_TRACE_RING_SIZE - 1)];
+
+	slot->seq = 0;
+	stu_memory_barrier();
+
+	slot->start = t->start;
+	memcpy(slot->stages, t->stages, sizeof(t->stages));
+	slot->recipients = t->recipients;
+	slot->bytes = t->bytes;
+	slot->status = t->status;
+
+	stu_memory_barrier();
+	slot->seq = seq;
+}
+
+/* copies the latest n samples at most into dst, the newest first. */
+stu_uint_t
+stu_trace_samples(stu_trace_t *dst, stu_uint_t n) {
+	stu_trace_t *slot;
+	uint32_t     next, seq, i;
+	stu_uint_t   k;
+
+	next = stu_trace_next;
+	n = stu_min(n, stu_min(next, STU_TRACE_RING_SIZE));
+
+	for (k = 0, i = next; k < n && i > next - n; i--) {
+		slot = &stu_trace_ring[(i - 1) & (STU_TRACE_RING_SIZE - 1)];
+
+		seq = slot->seq;
+		stu_memory_barrier();
+
+		if (seq != i) {
+			continue;
+		}
+
+		dst[k] = *slot;
+
+		// overwritten while copying
+		stu_memory_barrier();
+		if (slot->seq != seq) {
+			continue;
+		}
+
+		k++;
+	}
+
+	return k;
+}
+
+stu_str_t *
+stu_trace_stage_name(stu_uint_t stage) {
+	return &stu_trace_stage_names[stage];
+}
+
+stu_int_t
+stu_trace_stage_histogram(stu_uint_t stage, stu_metrics_histogram_t *h) {
+	return stu_metrics_histogram(stu_trace_metrics[stage], h);
+}
+
+#endif
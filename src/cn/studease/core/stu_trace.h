@@ -0,0 +1,76 @@
+/*
+ * stu_trace.h
+ *
+ *  Created on: 2017-7-9
+ *      Author: Tony Lau
+ */
+
+#ifndef STU_TRACE_H_
+#define STU_TRACE_H_
+
+#include "stu_config.h"
+#include "stu_core.h"
+
+#define STU_TRACE_RING_SIZE       4096    // power of 2
+
+/* in the order a message passes them */
+#define STU_TRACE_RECV            0
+#define STU_TRACE_FRAME           1
+#define STU_TRACE_JSON            2
+#define STU_TRACE_RIGHTS          3
+#define STU_TRACE_SERIALIZE       4
+#define STU_TRACE_ENQUEUE         5
+#define STU_TRACE_FIRST_SEND      6
+#define STU_TRACE_LAST_SEND       7
+#define STU_TRACE_STAGES          8
+
+/*
+ * The stages are usec since start, marked at the end of each stage, or 0 if
+ * the message never got there.
+ */
+typedef struct {
+	uint64_t            start;
+	uint32_t            stages[STU_TRACE_STAGES];
+	uint32_t            recipients;
+	uint32_t            bytes;
+	uint16_t            status;
+	volatile uint32_t   seq;       // 0 while being written
+} stu_trace_t;
+
+#if (STU_TRACE)
+
+stu_int_t    stu_trace_init();
+void         stu_trace_write(stu_trace_t *t);
+
+stu_uint_t   stu_trace_samples(stu_trace_t *dst, stu_uint_t n);
+stu_str_t   *stu_trace_stage_name(stu_uint_t stage);
+stu_int_t    stu_trace_stage_histogram(stu_uint_t stage, stu_metrics_histogram_t *h);
+
+#define stu_trace_begin(t, usec)                                                \
+	do {                                                                        \
+		stu_memzero(t, sizeof(stu_trace_t));                                    \
+		(t)->start = usec;                                                      \
+	} while (0)
+
+#define stu_trace_mark(t, stage)                                                \
+	(t)->stages[stage] = (uint32_t) (stu_metrics_usec() - (t)->start)
+
+#define stu_trace_end(t, st, n, size)                                           \
+	do {                                                                        \
+		(t)->status = st;                                                       \
+		(t)->recipients = n;                                                    \
+		(t)->bytes = size;                                                      \
+		stu_trace_write(t);                                                     \
+		stu_memzero((t)->stages, sizeof((t)->stages));                          \
+	} while (0)
+
+#else
+
+#define stu_trace_init()                  STU_OK
+#define stu_trace_begin(t, usec)
+#define stu_trace_mark(t, stage)
+#define stu_trace_end(t, st, n, size)
+
+#endif
+
+#endif /* STU_TRACE_H_ */
@@ -5,6 +5,8 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_UPSTREAM
+
 #include "stu_config.h"
 #include "stu_core.h"
 
@@ -14,7 +16,22 @@ stu_str_t  STU_HTTP_UPSTREAM_IDENT = stu_string("ident");
 stu_str_t  STU_HTTP_UPSTREAM_STATUS = stu_string("status");
 
 static stu_int_t stu_upstream_connect(stu_connection_t *c);
-static stu_int_t stu_upstream_next(stu_connection_t *c);
+
+static stu_upstream_server_t *stu_upstream_get_peer(stu_list_t *upstream, stu_uint_t tried);
+static void                   stu_upstream_free_peer(stu_upstream_t *u, stu_int_t rc);
+static stu_bool_t             stu_upstream_server_is_alive(stu_upstream_server_t *s, stu_msec_t now);
+static void                   stu_upstream_server_update(stu_upstream_server_t *s, stu_bool_t failed, stu_bool_t force);
+static stu_int_t              stu_upstream_server_sockaddr(stu_upstream_server_t *s, struct sockaddr_in *sin);
+
+static void stu_upstream_check_handler(stu_event_t *ev);
+static void stu_upstream_check_upstream(stu_str_t *key, void *value);
+static void stu_upstream_check_server(stu_upstream_server_t *s, stu_msec_t now);
+static void stu_upstream_check_write_handler(stu_event_t *ev);
+static void stu_upstream_check_read_handler(stu_event_t *ev);
+static void stu_upstream_check_finalize(stu_connection_t *pc, stu_bool_t failed);
+static void stu_upstream_check_count(stu_str_t *key, void *value);
+
+static stu_uint_t  stu_upstream_check_servers;
 
 
 stu_int_t
@@ -23,8 +40,6 @@ stu_upstream_create(stu_connection_t *c, u_char *name, size_t len) {
 	stu_list_t            *upstream;
 	stu_upstream_t        *u;
 	stu_upstream_server_t *s;
-	stu_queue_t           *q;
-	stu_list_elt_t        *e;
 
 	hk = stu_hash_key(name, len);
 	upstream = stu_hash_find(stu_upstreams, hk, name, len);
@@ -48,28 +63,13 @@ stu_upstream_create(stu_connection_t *c, u_char *name, size_t len) {
 		u->cleanup_pt(c);
 	}
 
-	// get upstream server
-	e = (stu_list_elt_t *) upstream->elts.obj;
-	if (e == NULL) {
-		q = stu_queue_head(&upstream->elts.queue);
-		e = stu_queue_data(q, stu_list_elt_t, queue);
-
-		upstream->elts.obj = e;  // current server
-		upstream->elts.size = 0; // lost weight
-	}
-
-	s = (stu_upstream_server_t *) e->obj;
-	while (upstream->elts.size++ >= s->weight) {
-		q = stu_queue_next(&e->queue);
-		if (q == stu_queue_sentinel(&upstream->elts.queue)) {
-			q = stu_queue_head(&upstream->elts.queue);
-		}
-
-		e = stu_queue_data(q, stu_list_elt_t, queue);
-		s = (stu_upstream_server_t *) e->obj;
+	u->tried = 0;
 
-		upstream->elts.obj = e;
-		upstream->elts.size = 0;
+	// get upstream server
+	s = stu_upstream_get_peer(upstream, u->tried);
+	if (s == NULL) {
+		stu_log_error(0, "No live upstream server of %s.", name);
+		return STU_ERROR;
 	}
 
 	u->server = s;
@@ -83,6 +83,7 @@ stu_upstream_init(stu_connection_t *c) {
 	stu_int_t       rc;
 
 	u = c->upstream;
+	u->start = stu_metrics_usec();
 
 	if (u->peer.state) {
 		if (c->upstream->reinit_request_pt(c) == STU_ERROR) {
@@ -115,16 +116,22 @@ stu_upstream_init(stu_connection_t *c) {
 
 static stu_int_t
 stu_upstream_connect(stu_connection_t *c) {
-	stu_upstream_t   *u;
-	stu_connection_t *pc;
-	stu_socket_t      fd;
-	int               rc;
-	stu_int_t         err;
+	stu_upstream_t     *u;
+	stu_connection_t   *pc;
+	stu_socket_t        fd;
+	struct sockaddr_in  sin;
+	int                 rc;
+	stu_int_t           err;
 
 	u = c->upstream;
 	pc = u->peer.connection;
 
-	fd = socket(u->server->addr.sockaddr.sin_family, SOCK_STREAM, 0);
+	if (stu_upstream_server_sockaddr(u->server, &sin) != STU_OK) {
+		stu_log_error(0, "No address of upstream %s resolved, fd=%d.", u->server->name.data, c->fd);
+		return STU_DECLINED;
+	}
+
+	fd = socket(sin.sin_family, SOCK_STREAM, 0);
 	if (fd == (stu_socket_t) STU_SOCKET_INVALID) {
 		stu_log_error(stu_errno, "Failed to create socket for upstream %s, fd=%d.", u->server->name.data, c->fd);
 		return STU_ERROR;
@@ -168,7 +175,7 @@ stu_upstream_connect(stu_connection_t *c) {
 	}
 	pc->read.data = pc->write.data = c;
 
-	rc = connect(fd, (struct sockaddr *) &u->server->addr.sockaddr, u->server->addr.socklen);
+	rc = connect(fd, (struct sockaddr *) &sin, u->server->addr.socklen);
 	if (rc == -1) {
 		err = stu_errno;
 		if (err != EINPROGRESS
@@ -200,53 +207,35 @@ stu_upstream_connect(stu_connection_t *c) {
 		}
 	}
 
+	stu_mutex_lock(&u->server->upstream->lock);
+	u->server->conns++;
+	stu_mutex_unlock(&u->server->upstream->lock);
+
 	u->peer.state = STU_UPSTREAM_PEER_CONNECTED;
 
+	// connect & send, the read timer is added after sending
+	stu_timer_add(&pc->write, u->server->timeout * 1000);
+
 	return STU_OK;
 }
 
-static stu_int_t
+stu_int_t
 stu_upstream_next(stu_connection_t *c) {
-	stu_uint_t             hk;
-	stu_list_t            *upstream;
 	stu_upstream_t        *u;
 	stu_upstream_server_t *s;
-	stu_queue_t           *q;
-	stu_list_elt_t        *e;
 
 	u = c->upstream;
 
-	stu_atomic_fetch_add(&u->server->fails, 1);
-
-	hk = stu_hash_key(u->server->name.data, u->server->name.len);
-	upstream = stu_hash_find(stu_upstreams, hk, u->server->name.data, u->server->name.len);
-	if (upstream == NULL || upstream->length == 0) {
-		stu_log_error(0, "Upstream list is empty.");
-		return STU_ERROR;
-	}
-
-	// get upstream server
-	e = (stu_list_elt_t *) upstream->elts.obj;
-	if (e == NULL) {
-		q = stu_queue_head(&upstream->elts.queue);
-		e = stu_queue_data(q, stu_list_elt_t, queue);
-
-		upstream->elts.obj = e;
-		upstream->elts.size = 0;
-	}
-
-	s = (stu_upstream_server_t *) e->obj;
-	while (upstream->elts.size++ >= s->weight) {
-		q = stu_queue_next(&e->queue);
-		if (q == stu_queue_sentinel(&upstream->elts.queue)) {
-			q = stu_queue_head(&upstream->elts.queue);
-		}
+	// the peer failed to connect, or to respond in time
+	stu_upstream_free_peer(u, STU_ERROR);
+	u->peer.state = STU_UPSTREAM_PEER_IDLE;
 
-		e = stu_queue_data(q, stu_list_elt_t, queue);
-		s = (stu_upstream_server_t *) e->obj;
+	stu_upstream_cleanup(c);
 
-		upstream->elts.obj = e;
-		upstream->elts.size = 0;
+	s = stu_upstream_get_peer(u->server->upstream, u->tried);
+	if (s == NULL) {
+		stu_log_error(0, "No more live upstream server of %s, fd=%d.", u->server->name.data, c->fd);
+		return STU_ERROR;
 	}
 
 	u->server = s;
@@ -266,8 +255,26 @@ stu_upstream_cleanup(stu_connection_t *c) {
 	u = c->upstream;
 	pc = u->peer.connection;
 
+	/*
+	 * Failures are accounted in stu_upstream_next(), so the peer is cleaned
+	 * up before the response only if the client has gone away, which tells
+	 * nothing about the peer.
+	 */
+	if (u->peer.state != STU_UPSTREAM_PEER_IDLE) {
+		stu_upstream_free_peer(u, u->peer.state < STU_UPSTREAM_PEER_LOADED ? STU_DECLINED : STU_OK);
+	}
+
 	if (pc) {
 		stu_log_debug(4, "cleaning up upstream: fd=%d.", pc->fd);
+
+		if (pc->read.timer_set) {
+			stu_timer_del(&pc->read);
+		}
+
+		if (pc->write.timer_set) {
+			stu_timer_del(&pc->write);
+		}
+
 /*
 		pc->read.active = 1;
 		pc->read.data = pc;
@@ -283,3 +290,444 @@ stu_upstream_cleanup(stu_connection_t *c) {
 	u->peer.connection = NULL;
 	u->peer.state = STU_UPSTREAM_PEER_IDLE;
 }
+
+stu_int_t
+stu_upstream_add_timers() {
+	stu_connection_t *c;
+
+	stu_upstream_check_servers = 0;
+	stu_hash_foreach(stu_upstreams, stu_upstream_check_count);
+
+	if (stu_upstream_check_servers == 0) {
+		return STU_OK;
+	}
+
+	c = stu_connection_get((stu_socket_t) -2);
+	if (c == NULL) {
+		stu_log_error(0, "Failed to get connection for upstream checks.");
+		return STU_ERROR;
+	}
+
+	c->write.handler = stu_upstream_check_handler;
+	stu_timer_add(&c->write, STU_UPSTREAM_CHECK_TIMER_INTERVAL);
+
+	stu_log_debug(4, "upstream checks: servers=%lu.", stu_upstream_check_servers);
+
+	return STU_OK;
+}
+
+
+/*
+ * Smooth weighted round-robin over the live servers which are not tried yet.
+ * With least_conn, only the servers having the least conns/weight take part.
+ */
+static stu_upstream_server_t *
+stu_upstream_get_peer(stu_list_t *upstream, stu_uint_t tried) {
+	stu_upstream_server_t *s, *best, *least;
+	stu_list_elt_t        *elts, *e;
+	stu_queue_t           *q;
+	stu_msec_t             now;
+	stu_uint_t             i;
+	stu_int_t              total;
+	uint8_t                balance;
+
+	best = least = NULL;
+	total = 0;
+	now = stu_current_msec;
+
+	stu_mutex_lock(&upstream->lock);
+
+	elts = &upstream->elts;
+	if (stu_queue_empty(&elts->queue)) {
+		goto done;
+	}
+
+	e = stu_queue_data(stu_queue_head(&elts->queue), stu_list_elt_t, queue);
+	balance = ((stu_upstream_server_t *) e->obj)->balance;
+
+	if (balance == STU_UPSTREAM_BALANCE_LEAST_CONN) {
+		for (i = 0, q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); i++, q = stu_queue_next(q)) {
+			e = stu_queue_data(q, stu_list_elt_t, queue);
+			s = (stu_upstream_server_t *) e->obj;
+
+			if ((i < sizeof(stu_uint_t) * 8 && (tried & ((stu_uint_t) 1 << i))) || !stu_upstream_server_is_alive(s, now)) {
+				continue;
+			}
+
+			if (least == NULL || s->conns * least->weight < least->conns * s->weight) {
+				least = s;
+			}
+		}
+
+		if (least == NULL) {
+			goto done;
+		}
+	}
+
+	for (i = 0, q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); i++, q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		s = (stu_upstream_server_t *) e->obj;
+
+		if ((i < sizeof(stu_uint_t) * 8 && (tried & ((stu_uint_t) 1 << i))) || !stu_upstream_server_is_alive(s, now)) {
+			continue;
+		}
+
+		if (least && s->conns * least->weight != least->conns * s->weight) {
+			continue;
+		}
+
+		s->current_weight += s->effective_weight;
+		total += s->effective_weight;
+
+		if (s->effective_weight < (stu_int_t) s->weight) {
+			s->effective_weight++;
+		}
+
+		if (best == NULL || s->current_weight > best->current_weight) {
+			best = s;
+		}
+	}
+
+	if (best) {
+		best->current_weight -= total;
+
+		// only one trial per fail_timeout while down
+		if (best->state & STU_UPSTREAM_SERVER_DOWN) {
+			best->checked = now;
+		}
+	}
+
+done:
+
+	stu_mutex_unlock(&upstream->lock);
+
+	return best;
+}
+
+/* rc is STU_OK if the peer responded, STU_ERROR if it failed, or STU_DECLINED if aborted. */
+static void
+stu_upstream_free_peer(stu_upstream_t *u, stu_int_t rc) {
+	stu_upstream_server_t *s;
+	stu_list_elt_t        *elts, *e;
+	stu_queue_t           *q;
+	stu_uint_t             i;
+
+	s = u->server;
+	elts = &s->upstream->elts;
+
+	stu_mutex_lock(&s->upstream->lock);
+
+	if (u->peer.state != STU_UPSTREAM_PEER_IDLE && s->conns) {
+		s->conns--;
+	}
+
+	if (rc == STU_ERROR) {
+		for (i = 0, q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); i++, q = stu_queue_next(q)) {
+			e = stu_queue_data(q, stu_list_elt_t, queue);
+			if (e->obj == s) {
+				if (i < sizeof(stu_uint_t) * 8) {
+					u->tried |= (stu_uint_t) 1 << i;
+				}
+				break;
+			}
+		}
+	}
+
+	if (rc != STU_DECLINED) {
+		stu_upstream_server_update(s, rc == STU_ERROR, FALSE);
+	}
+
+	stu_mutex_unlock(&s->upstream->lock);
+}
+
+static stu_bool_t
+stu_upstream_server_is_alive(stu_upstream_server_t *s, stu_msec_t now) {
+	// not resolved yet
+	if (s->resolved->naddrs == 0) {
+		return FALSE;
+	}
+
+	if ((s->state & STU_UPSTREAM_SERVER_DOWN) == 0) {
+		return TRUE;
+	}
+
+	// give it a try after fail_timeout
+	return now - s->checked > (stu_msec_t) s->fail_timeout * 1000;
+}
+
+/*
+ * Passive: down after max_fails within fail_timeout, if max_fails is set.
+ * Active (force): down on any failed check. Either way up on success.
+ */
+static void
+stu_upstream_server_update(stu_upstream_server_t *s, stu_bool_t failed, stu_bool_t force) {
+	stu_msec_t  now;
+
+	now = stu_current_msec;
+
+	if (failed == FALSE) {
+		if (s->state & STU_UPSTREAM_SERVER_DOWN) {
+			stu_log("upstream server %s:%d is up.", s->addr.name.data, s->port);
+		}
+
+		s->fails = 0;
+		s->state &= ~STU_UPSTREAM_SERVER_DOWN;
+
+		return;
+	}
+
+	if (now - s->checked > (stu_msec_t) s->fail_timeout * 1000) {
+		s->fails = 0;
+	}
+
+	s->fails++;
+	s->checked = now;
+
+	if (s->max_fails) {
+		s->effective_weight -= s->weight / s->max_fails;
+		if (s->effective_weight < 0) {
+			s->effective_weight = 0;
+		}
+	}
+
+	if ((force || (s->max_fails && s->fails >= s->max_fails)) && (s->state & STU_UPSTREAM_SERVER_DOWN) == 0) {
+		stu_log_error(0, "upstream server %s:%d is down: fails=%lu.", s->addr.name.data, s->port, s->fails);
+		s->state |= STU_UPSTREAM_SERVER_DOWN;
+	}
+}
+
+
+static stu_int_t
+stu_upstream_server_sockaddr(stu_upstream_server_t *s, struct sockaddr_in *sin) {
+	*sin = s->addr.sockaddr;
+	return stu_resolver_get_addr(s->resolved, &sin->sin_addr);
+}
+
+static void
+stu_upstream_check_handler(stu_event_t *ev) {
+	stu_hash_foreach(stu_upstreams, stu_upstream_check_upstream);
+	stu_timer_add_locked(ev, STU_UPSTREAM_CHECK_TIMER_INTERVAL);
+}
+
+static void
+stu_upstream_check_upstream(stu_str_t *key, void *value) {
+	stu_list_t            *upstream;
+	stu_upstream_server_t *s;
+	stu_list_elt_t        *elts, *e;
+	stu_queue_t           *q;
+	stu_msec_t             now;
+
+	upstream = (stu_list_t *) value;
+	elts = &upstream->elts;
+	now = stu_current_msec;
+
+	stu_mutex_lock(&upstream->lock);
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		s = (stu_upstream_server_t *) e->obj;
+
+		if (s->check.len && now - s->probed >= (stu_msec_t) s->check_interval * 1000) {
+			stu_upstream_check_server(s, now);
+		}
+	}
+
+	stu_mutex_unlock(&upstream->lock);
+}
+
+static void
+stu_upstream_check_server(stu_upstream_server_t *s, stu_msec_t now) {
+	stu_connection_t   *pc;
+	stu_socket_t        fd;
+	struct sockaddr_in  sin;
+	stu_int_t           err;
+
+	pc = s->probe;
+	if (pc) {
+		/*
+		 * The last check is still pending. Its handlers take the connection lock
+		 * before the upstream lock, so never block on it here.
+		 */
+		if (stu_mutex_trylock(&pc->lock) != 0) {
+			return;
+		}
+
+		stu_log_error(0, "upstream check of %s:%d timed out.", s->addr.name.data, s->port);
+
+		s->probe = NULL;
+		pc->data = NULL;
+		stu_upstream_server_update(s, TRUE, TRUE);
+
+		stu_mutex_unlock(&pc->lock);
+		stu_connection_close(pc);
+	}
+
+	s->probed = now;
+
+	if (stu_upstream_server_sockaddr(s, &sin) != STU_OK) {
+		stu_log_debug(4, "upstream check of %s skipped, address not resolved.", s->name.data);
+		return;
+	}
+
+	fd = socket(sin.sin_family, SOCK_STREAM, 0);
+	if (fd == (stu_socket_t) STU_SOCKET_INVALID) {
+		stu_log_error(stu_errno, "Failed to create socket for upstream check of %s.", s->name.data);
+		return;
+	}
+
+	if (stu_nonblocking(fd) == -1) {
+		stu_log_error(stu_errno, "fcntl(O_NONBLOCK) failed while setting upstream check of %s.", s->name.data);
+		stu_close_socket(fd);
+		return;
+	}
+
+	pc = stu_connection_get(fd);
+	if (pc == NULL) {
+		stu_log_error(0, "Failed to get connection for upstream check of %s.", s->name.data);
+		stu_close_socket(fd);
+		return;
+	}
+
+	pc->data = s;
+
+	pc->read.handler = stu_upstream_check_read_handler;
+	pc->write.handler = stu_upstream_check_write_handler;
+
+	if (stu_event_add(&pc->read, STU_READ_EVENT, STU_CLEAR_EVENT) == STU_ERROR
+			|| stu_event_add(&pc->write, STU_WRITE_EVENT, STU_CLEAR_EVENT) == STU_ERROR) {
+		stu_log_error(0, "Failed to add events of upstream check of %s.", s->name.data);
+		stu_connection_close(pc);
+		return;
+	}
+
+	if (connect(fd, (struct sockaddr *) &sin, s->addr.socklen) == -1) {
+		err = stu_errno;
+		if (err != EINPROGRESS) {
+			stu_log_error(err, "Failed to connect to upstream check of %s:%d.", s->addr.name.data, s->port);
+			stu_upstream_server_update(s, TRUE, TRUE);
+			stu_connection_close(pc);
+			return;
+		}
+	}
+
+	s->probe = pc;
+}
+
+static void
+stu_upstream_check_write_handler(stu_event_t *ev) {
+	stu_connection_t      *pc;
+	stu_upstream_server_t *s;
+	u_char                *p, temp[STU_HTTP_REQUEST_DEFAULT_SIZE];
+	stu_uint_t             generation;
+	stu_int_t              n;
+
+	pc = (stu_connection_t *) ev->data;
+	generation = pc->generation;
+
+	stu_mutex_lock(&pc->lock);
+
+	s = (stu_upstream_server_t *) pc->data;
+	if (s == NULL || pc->fd == (stu_socket_t) STU_SOCKET_INVALID || pc->generation != generation) {
+		stu_mutex_unlock(&pc->lock);
+		return;
+	}
+
+	p = stu_snprintf(temp, STU_HTTP_REQUEST_DEFAULT_SIZE, "GET %s HTTP/1.1" CRLF "Host: %s" CRLF
+			"User-Agent: " __NAME "/" __VERSION CRLF "Connection: close" CRLF CRLF,
+			s->check.data, s->addr.name.data);
+
+	n = send(pc->fd, temp, p - temp, 0);
+	if (n == -1) {
+		stu_log_error(stu_errno, "Failed to send upstream check of %s:%d.", s->addr.name.data, s->port);
+		stu_upstream_check_finalize(pc, TRUE);
+		return;
+	}
+
+	stu_event_del(&pc->write, STU_WRITE_EVENT, STU_READ_EVENT);
+	ev->active = 0;
+
+	stu_mutex_unlock(&pc->lock);
+}
+
+static void
+stu_upstream_check_read_handler(stu_event_t *ev) {
+	stu_connection_t      *pc;
+	stu_upstream_server_t *s;
+	u_char                 temp[STU_UPSTREAM_CHECK_RESPONSE_SIZE];
+	stu_uint_t             generation;
+	stu_int_t              n, err;
+
+	pc = (stu_connection_t *) ev->data;
+	generation = pc->generation;
+
+	stu_mutex_lock(&pc->lock);
+
+	s = (stu_upstream_server_t *) pc->data;
+	if (s == NULL || pc->fd == (stu_socket_t) STU_SOCKET_INVALID || pc->generation != generation) {
+		stu_mutex_unlock(&pc->lock);
+		return;
+	}
+
+	n = recv(pc->fd, temp, STU_UPSTREAM_CHECK_RESPONSE_SIZE - 1, 0);
+	if (n == -1) {
+		err = stu_errno;
+		if (err == EAGAIN || err == EINTR) {
+			stu_mutex_unlock(&pc->lock);
+			return;
+		}
+
+		stu_log_error(err, "Failed to recv upstream check of %s:%d.", s->addr.name.data, s->port);
+		stu_upstream_check_finalize(pc, TRUE);
+		return;
+	}
+
+	temp[n] = '\0';
+
+	// "HTTP/1.x 2xx"
+	if (n < 12 || stu_strncmp(temp, "HTTP/1.", 7) != 0 || temp[9] != '2') {
+		stu_log_error(0, "upstream check of %s:%d failed: \"%s\".", s->addr.name.data, s->port, n ? (char *) temp : "");
+		stu_upstream_check_finalize(pc, TRUE);
+		return;
+	}
+
+	stu_upstream_check_finalize(pc, FALSE);
+}
+
+/* called with pc->lock held, which is released here. */
+static void
+stu_upstream_check_finalize(stu_connection_t *pc, stu_bool_t failed) {
+	stu_upstream_server_t *s;
+
+	s = (stu_upstream_server_t *) pc->data;
+
+	stu_mutex_lock(&s->upstream->lock);
+
+	if (s->probe == pc) {
+		s->probe = NULL;
+		stu_upstream_server_update(s, failed, TRUE);
+	}
+
+	stu_mutex_unlock(&s->upstream->lock);
+
+	pc->data = NULL;
+
+	stu_mutex_unlock(&pc->lock);
+	stu_connection_close(pc);
+}
+
+static void
+stu_upstream_check_count(stu_str_t *key, void *value) {
+	stu_list_t            *upstream;
+	stu_list_elt_t        *elts, *e;
+	stu_queue_t           *q;
+
+	upstream = (stu_list_t *) value;
+	elts = &upstream->elts;
+
+	for (q = stu_queue_head(&elts->queue); q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
+		e = stu_queue_data(q, stu_list_elt_t, queue);
+		if (((stu_upstream_server_t *) e->obj)->check.len) {
+			stu_upstream_check_servers++;
+		}
+	}
+}
@@ -11,8 +11,17 @@
 #include "stu_config.h"
 #include "stu_core.h"
 
-#define STU_UPSTREAM_MAXIMUM         32
-#define STU_UPSTREAM_DEFAULT_TIMEOUT 3
+#define STU_UPSTREAM_MAXIMUM                 32
+#define STU_UPSTREAM_DEFAULT_TIMEOUT         3
+#define STU_UPSTREAM_DEFAULT_FAIL_TIMEOUT    10
+#define STU_UPSTREAM_DEFAULT_CHECK_INTERVAL  5
+#define STU_UPSTREAM_DEFAULT_BATCH_WINDOW    3
+
+#define STU_UPSTREAM_CHECK_TIMER_INTERVAL    1000
+#define STU_UPSTREAM_CHECK_RESPONSE_SIZE     128
+
+#define STU_UPSTREAM_BALANCE_ROUND_ROBIN     0x00
+#define STU_UPSTREAM_BALANCE_LEAST_CONN      0x01
 
 #define STU_UPSTREAM_SERVER_NORMAL   0x00
 #define STU_UPSTREAM_SERVER_BACKUP   0x01
@@ -34,17 +43,36 @@ struct stu_upstream_server_s {
 
 	stu_str_t                protocol;
 	stu_short_t              method;
-	stu_addr_t               addr;
+	stu_addr_t               addr;             // sin_addr is taken from resolved
+	stu_resolver_node_t     *resolved;
 	in_port_t                port;
 	stu_str_t                target;
 
 	stu_uint_t               weight;
 	stu_uint_t               max_fails;
+	time_t                   fail_timeout;     // seconds
 	time_t                   timeout;
 
+	stu_uint_t               batch;
+	stu_msec_t               batch_window;
+
+	uint8_t                  balance;          // the first server of an upstream decides
+	stu_str_t                check;            // uri of the active health check
+	time_t                   check_interval;   // seconds
+
+	stu_list_t              *upstream;         // protected by upstream->lock
+	stu_int_t                current_weight;
+	stu_int_t                effective_weight;
+	stu_uint_t               conns;
 	stu_uint_t               fails;
+	stu_msec_t               checked;
 	uint8_t                  state;
 
+	stu_connection_t        *probe;
+	stu_msec_t               probed;
+
+	stu_int_t                metric;           // response time histogram
+
 	stu_upstream_server_t   *next;
 };
 
@@ -59,6 +87,9 @@ struct stu_upstream_s {
 
 	stu_upstream_server_t   *server;
 	stu_peer_connection_t    peer;
+	stu_uint_t               tried;            // bitmap of servers, by index
+	uint64_t                 start;            // usec, of the current try
+	void                    *data;
 
 	void                  *(*create_request_pt)(stu_connection_t *c);
 	stu_int_t              (*reinit_request_pt)(stu_connection_t *c);
@@ -71,6 +102,9 @@ struct stu_upstream_s {
 
 stu_int_t  stu_upstream_create(stu_connection_t *c, u_char *name, size_t len);
 stu_int_t  stu_upstream_init(stu_connection_t *c);
+stu_int_t  stu_upstream_next(stu_connection_t *c);
 void       stu_upstream_cleanup(stu_connection_t *c);
 
+stu_int_t  stu_upstream_add_timers();
+
 #endif /* STU_UPSTREAM_H_ */
@@ -5,18 +5,36 @@
  *      Author: Tony Lau
  */
 
+#define STU_LOG_MODULE  STU_LOG_WEBSOCKET
+
 #include "stu_config.h"
 #include "stu_core.h"
 
 static void stu_websocket_analyze_request(stu_websocket_request_t *r, u_char *text, size_t size);
 
+static stu_str_t *stu_websocket_request_keys[] = {
+	&STU_PROTOCOL_REQ,
+	&STU_PROTOCOL_CMD,
+	&STU_PROTOCOL_DATA,
+	&STU_PROTOCOL_TYPE,
+	&STU_PROTOCOL_CHANNEL
+};
+
 
 void
 stu_websocket_wait_request_handler(stu_event_t *rev) {
-	stu_connection_t *c;
-	stu_int_t         n, err;
+	stu_websocket_request_t *r;
+	stu_connection_t        *c;
+	stu_uint_t               generation;
+	stu_int_t                n, err;
+#if (STU_TRACE)
+	uint64_t                 start;
+
+	start = stu_metrics_usec();
+#endif
 
 	c = (stu_connection_t *) rev->data;
+	generation = c->generation;
 
 	stu_mutex_lock(&c->lock);
 	if (c->fd == (stu_socket_t) -1) {
@@ -24,6 +42,11 @@ stu_websocket_wait_request_handler(stu_event_t *rev) {
 		goto done;
 	}
 
+	if (c->generation != generation) {
+		stu_log_debug(4, "websocket waited a reused connection: fd=%d.", c->fd);
+		goto done;
+	}
+
 	if (c->buffer.start == NULL) {
 		c->buffer.start = (u_char *) stu_calloc(STU_WEBSOCKET_REQUEST_DEFAULT_SIZE);
 		c->buffer.last = c->buffer.end = c->buffer.start;
@@ -57,13 +80,20 @@ again:
 	c->buffer.end += n;
 	stu_log_debug(4, "recv: fd=%d, bytes=%d.", c->fd, n);
 
-	c->data = (void *) stu_websocket_create_request(c);
-	if (c->data == NULL) {
+	stu_metrics_add(STU_METRIC_BYTES_IN, n);
+
+	r = stu_websocket_create_request(c);
+	if (r == NULL) {
 		stu_log_error(0, "Failed to create websocket request.");
 		goto failed;
 	}
 
-	stu_websocket_process_request(c->data);
+	c->data = (void *) r;
+
+	stu_trace_begin(&r->trace, start);
+	stu_trace_mark(&r->trace, STU_TRACE_RECV);
+
+	stu_websocket_process_request(r);
 
 	goto done;
 
@@ -89,6 +119,7 @@ stu_websocket_create_request(stu_connection_t *c) {
 	r->connection = c;
 	r->frame_in = &c->buffer;
 	r->frame = &r->frames_in;
+	r->response = NULL;
 
 	return r;
 }
@@ -139,7 +170,17 @@ stu_websocket_process_request(stu_websocket_request_t *r) {
 				f->payload_data.end = f->payload_data.start;
 			}
 
+			stu_trace_mark(&r->trace, STU_TRACE_FRAME);
+
 			size = buf.last - buf.start;
+
+			// checked once for the whole message, see RFC 6455, 8.1
+			if (r->frames_in.opcode == STU_WEBSOCKET_OPCODE_TEXT && stu_utf8_validate(temp, size) != STU_OK) {
+				stu_log_error(0, "Invalid UTF-8 in text message: fd=%d, size=%lu.", c->fd, size);
+				stu_websocket_close_connection(c);
+				return;
+			}
+
 			if (size > 0) {
 				stu_websocket_analyze_request(r, (u_char *) temp, size);
 			} else {
@@ -188,25 +229,40 @@ static void
 stu_websocket_analyze_request(stu_websocket_request_t *r, u_char *text, size_t size) {
 	stu_connection_t      *c;
 	stu_channel_t         *ch;
-	stu_json_t            *req, *cmd, *rqreq, *rqdata, *rqtype, *rqchannel;
+	stu_json_t            *req, *cmd, *rqreq, *rqdata, *rqtype, *rqchannel, *items[5];
 	stu_json_t            *res, *raw, *rsreq, *rsdata, *rstype, *rschannel, *rsuser, *rsuid, *rsuname, *rsuicon, *rsurole;
 	stu_str_t             *str;
 	stu_websocket_frame_t *out;
 	u_char                *data, temp[STU_WEBSOCKET_REQUEST_DEFAULT_SIZE];
+	size_t                 n;
 	struct timeval         tm;
 	stu_uint_t             sec;
 
 	c = r->connection;
 	ch = c->user.channel;
 
-	req = stu_json_parse(text, size);
+	if (r->frames_in.opcode == STU_WEBSOCKET_OPCODE_BINARY && c->protocol == STU_PROTOCOL_TLV) {
+		req = stu_protocol_decode(text, size);
+	} else {
+		req = stu_json_parse(text, size);
+	}
+
 	if (req == NULL || req->type != STU_JSON_TYPE_OBJECT) {
+		stu_json_delete(req);
 		stu_log_error(0, "Failed to parse websocket request.");
 		stu_websocket_finalize_request(r, STU_HTTP_BAD_REQUEST, -1);
 		return;
 	}
 
-	rqreq = stu_json_get_object_item_by(req, &STU_PROTOCOL_REQ);
+	stu_trace_mark(&r->trace, STU_TRACE_JSON);
+
+	stu_json_pluck(req, stu_websocket_request_keys, items, 5);
+
+	rqreq = items[0];
+	cmd = items[1];
+	rqdata = items[2];
+	rqtype = items[3];
+	rqchannel = items[4];
 
 	stu_gettimeofday(&tm);
 	sec = tm.tv_sec * 1000 + tm.tv_usec / 1000;
@@ -217,7 +273,6 @@ stu_websocket_analyze_request(stu_websocket_request_t *r, u_char *text, size_t s
 	}
 	c->user.active = sec;
 
-	cmd = stu_json_get_object_item_by(req, &STU_PROTOCOL_CMD);
 	if (cmd == NULL || cmd->type != STU_JSON_TYPE_STRING) {
 		stu_log_error(0, "Failed to analyze websocket request: \"cmd\" not found.");
 		stu_json_delete(req);
@@ -244,9 +299,8 @@ stu_websocket_analyze_request(stu_websocket_request_t *r, u_char *text, size_t s
 		goto unknown;
 	}
 
-	rqdata = stu_json_get_object_item_by(req, &STU_PROTOCOL_DATA);
-	rqtype = stu_json_get_object_item_by(req, &STU_PROTOCOL_TYPE);
-	rqchannel = stu_json_get_object_item_by(req, &STU_PROTOCOL_CHANNEL);
+	stu_trace_mark(&r->trace, STU_TRACE_RIGHTS);
+
 	if (rqdata == NULL || rqdata->type != STU_JSON_TYPE_STRING
 			|| rqtype == NULL || rqtype->type != STU_JSON_TYPE_STRING
 			|| rqchannel == NULL || rqchannel->type != STU_JSON_TYPE_OBJECT) {
@@ -284,20 +338,36 @@ stu_websocket_analyze_request(stu_websocket_request_t *r, u_char *text, size_t s
 	stu_json_add_item_to_object(res, rsuser);
 
 	stu_memzero(temp, STU_WEBSOCKET_REQUEST_DEFAULT_SIZE);
-	data = stu_json_stringify(res, (u_char *) temp);
+	n = stu_json_stringify(res, temp, STU_WEBSOCKET_REQUEST_DEFAULT_SIZE);
 
-	stu_json_delete(req);
-	stu_json_delete(res);
+	if (n > STU_WEBSOCKET_REQUEST_DEFAULT_SIZE) {
+		stu_log_error(0, "Websocket response too large: fd=%d, size=%lu.", c->fd, n);
+		stu_json_delete(res);
+		stu_websocket_finalize_request(r, STU_HTTP_BAD_REQUEST, rqreq ? *(stu_double_t *) rqreq->value : -1);
+		stu_json_delete(req);
+		return;
+	}
 
-	// setup out frame.
+	data = temp + n;
+
+	stu_trace_mark(&r->trace, STU_TRACE_SERIALIZE);
+
+	// setup out frame, in text for json peers of a tlv sender.
 	out = &r->frames_out;
-	out->opcode = r->frames_in.opcode;
+	out->opcode = c->protocol == STU_PROTOCOL_TLV ? STU_WEBSOCKET_OPCODE_TEXT : r->frames_in.opcode;
 	out->extended = data - temp;
 	out->payload_data.start = temp;
 	out->payload_data.end = out->payload_data.last = data;
 
+	r->response = res;
+
 	stu_websocket_finalize_request(r, STU_HTTP_OK, rqreq ? *(stu_double_t *) rqreq->value : -1);
 
+	r->response = NULL;
+
+	stu_json_delete(res);
+	stu_json_delete(req);
+
 	return;
 
 unknown:
@@ -339,18 +409,20 @@ stu_websocket_finalize_request(stu_websocket_request_t *r, stu_int_t rc, stu_dou
 		stu_json_add_item_to_object(res, rserror);
 
 		stu_memzero(temp, STU_WEBSOCKET_REQUEST_DEFAULT_SIZE);
-		data = stu_json_stringify(res, (u_char *) temp);
+		data = temp + stu_min(stu_protocol_serialize(c->protocol, res, temp, STU_WEBSOCKET_REQUEST_DEFAULT_SIZE), STU_WEBSOCKET_REQUEST_DEFAULT_SIZE);
 
 		stu_json_delete(res);
 
 		// setup out frame.
 		out = &r->frames_out;
-		out->opcode = r->frames_in.opcode;
+		out->opcode = c->protocol == STU_PROTOCOL_TLV ? STU_WEBSOCKET_OPCODE_BINARY : r->frames_in.opcode;
 		out->extended = data - temp;
 		out->payload_data.start = temp;
 		out->payload_data.end = out->payload_data.last = data;
 	}
 
+	stu_trace_mark(&r->trace, STU_TRACE_ENQUEUE);
+
 	stu_websocket_request_handler(&c->write);
 }
 
@@ -360,8 +432,10 @@ stu_websocket_request_handler(stu_event_t *wev) {
 	stu_connection_t        *c, *t;
 	stu_channel_t           *ch;
 	stu_websocket_frame_t   *f;
-	u_char                   temp[STU_WEBSOCKET_REQUEST_DEFAULT_SIZE], *data;
-	stu_int_t                extened, n, cost;
+	u_char                   temp[STU_WEBSOCKET_REQUEST_DEFAULT_SIZE + 10], *data;
+	u_char                   tlvtemp[STU_WEBSOCKET_REQUEST_DEFAULT_SIZE + 10], *tlv;
+	stu_int_t                extened, tlvextened, n, cost;
+	stu_uint_t               sent, tlvsize;
 	stu_socket_t             fd;
 	stu_list_elt_t          *elts;
 	stu_hash_elt_t          *e;
@@ -382,21 +456,53 @@ stu_websocket_request_handler(stu_event_t *wev) {
 				temp[5], temp[6], temp[7], temp[8], temp[9]);
 
 		stu_gettimeofday(&start);
+		sent = 0;
+
+		// encoded for the first tlv peer, and may be longer than json
+		tlv = NULL;
+		tlvsize = 0;
+		tlvextened = 0;
 
 		if (r->status == STU_HTTP_OK) {
 			stu_mutex_lock(&ch->userlist.lock);
 
+			ch->message_n++;
+
 			elts = &ch->userlist.keys.elts;
 			for (q = stu_queue_head(&elts->queue); q != NULL && q != stu_queue_sentinel(&elts->queue); q = stu_queue_next(q)) {
 				e = stu_queue_data(q, stu_hash_elt_t, q);
 				t = (stu_connection_t *) e->value;
 				fd = stu_atomic_fetch(&t->fd);
 
-				n = send(fd, data, f->extended + 2 + extened, 0);
+				if (t->protocol == STU_PROTOCOL_TLV && r->response) {
+					if (tlvsize == 0) {
+						tlvsize = stu_protocol_encode(r->response, tlvtemp + 10, STU_WEBSOCKET_REQUEST_DEFAULT_SIZE);
+						if (tlvsize > STU_WEBSOCKET_REQUEST_DEFAULT_SIZE) {
+							stu_log_error(0, "Tlv frame too large: fd=%d, size=%lu.", c->fd, tlvsize);
+						} else {
+							tlv = stu_websocket_encode_frame(STU_WEBSOCKET_OPCODE_BINARY, tlvtemp, tlvsize, &tlvextened);
+						}
+					}
+
+					if (tlv == NULL) {
+						continue;
+					}
+
+					n = send(fd, tlv, tlvsize + 2 + tlvextened, 0);
+				} else {
+					n = send(fd, data, f->extended + 2 + extened, 0);
+				}
+
 				if (n == -1) {
 					//stu_log_error(stu_errno, "Failed to send data: from=%d, to=%d.", c->fd, fd);
 					continue;
 				}
+
+				stu_metrics_add(STU_METRIC_BYTES_OUT, n);
+
+				if (sent++ == 0) {
+					stu_trace_mark(&r->trace, STU_TRACE_FIRST_SEND);
+				}
 			}
 
 			stu_mutex_unlock(&ch->userlist.lock);
@@ -404,12 +510,28 @@ stu_websocket_request_handler(stu_event_t *wev) {
 			n = send(c->fd, data, f->extended + 2 + extened, 0);
 			if (n == -1) {
 				stu_log_error(stu_errno, "Failed to send data: to=%d.", c->fd);
+			} else {
+				stu_metrics_add(STU_METRIC_BYTES_OUT, n);
+
+				sent++;
+				stu_trace_mark(&r->trace, STU_TRACE_FIRST_SEND);
 			}
 		}
 
+		stu_trace_mark(&r->trace, STU_TRACE_LAST_SEND);
+		stu_trace_end(&r->trace, r->status, sent, f->extended);
+
 		stu_gettimeofday(&end);
 		cost = 1000000 * (end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
-		stu_log_debug(4, "sent: fd=%d, bytes=%d, cost=%.3fms.", c->fd, n, cost / 1000.0f);
+		stu_log_debug(4, "sent: fd=%d, bytes=%d, recipients=%lu, cost=%.3fms.", c->fd, n, sent, cost / 1000.0f);
+
+		if (r->status == STU_HTTP_OK) {
+			stu_metrics_inc(STU_METRIC_MESSAGES);
+			stu_metrics_observe(STU_METRIC_FANOUT_USEC, cost);
+		}
+
+		stu_evlog_write(r->status == STU_HTTP_OK ? STU_EVLOG_MESSAGE : STU_EVLOG_REFUSED,
+				ch ? &ch->id : NULL, &c->user.id, f->extended, cost, r->status);
 	}
 }
 
@@ -462,14 +584,9 @@ stu_websocket_free_request(stu_websocket_request_t *r, stu_int_t rc) {
 
 void
 stu_websocket_close_connection(stu_connection_t *c) {
-	stu_channel_t *ch;
-
 	c->read.active = 0;
 	stu_event_del(&c->read, STU_READ_EVENT, 0);
 
-	ch = c->user.channel;
-	stu_channel_remove(ch, c);
-
 	stu_http_close_connection(c);
 }
 
@@ -43,9 +43,14 @@ typedef struct {
 
 	stu_websocket_frame_t  frames_in;
 	stu_websocket_frame_t  frames_out;
+	stu_json_t            *response; // of frames_out, encoded again for tlv peers
 
 	stu_int_t              status;
 
+#if (STU_TRACE)
+	stu_trace_t            trace;
+#endif
+
 	// used for parsing request.
 	stu_uint_t             state;
 	stu_websocket_frame_t *frame;
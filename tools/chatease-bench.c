@@ -0,0 +1,1090 @@
+/*
+ ============================================================================
+ Name        : chatease-bench.c
+ Author      : Tony Lau
+ Version     : 1.x.xx
+ Copyright   : studease.cn
+ Description : Microbenchmarks of the core data structures and codecs,
+               reported as JSON to diff between runs.
+ ============================================================================
+ */
+
+#include "stu_config.h"
+#include "stu_core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_KEYS_MAX      100000
+#define BENCH_BUFFER_SIZE   65536
+#define BENCH_USERS_N       32
+
+extern stu_http_header_t  stu_http_headers_in[];
+
+typedef struct bench_s bench_t;
+
+/* runs n operations, and returns the nsec spent in them. */
+typedef uint64_t (*bench_pt)(bench_t *b, stu_uint_t n);
+
+struct bench_s {
+	const char  *name;
+	bench_pt     handler;
+	stu_uint_t   size;
+	stu_str_t   *data;
+};
+
+typedef struct {
+	const char  *name;
+	stu_uint_t   iterations;
+	double       ns_per_op;    // median of the runs
+	double       min_ns_per_op;
+	size_t       bytes_per_op;
+} bench_result_t;
+
+static uint64_t  bench_hash_insert(bench_t *b, stu_uint_t n);
+static uint64_t  bench_hash_find(bench_t *b, stu_uint_t n);
+static uint64_t  bench_hash_remove(bench_t *b, stu_uint_t n);
+static uint64_t  bench_json_parse(bench_t *b, stu_uint_t n);
+static uint64_t  bench_json_stringify(bench_t *b, stu_uint_t n);
+static uint64_t  bench_json_lookup(bench_t *b, stu_uint_t n);
+static uint64_t  bench_protocol_encode(bench_t *b, stu_uint_t n);
+static uint64_t  bench_protocol_decode(bench_t *b, stu_uint_t n);
+static uint64_t  bench_websocket_parse_frame(bench_t *b, stu_uint_t n);
+static uint64_t  bench_websocket_encode_frame(bench_t *b, stu_uint_t n);
+static uint64_t  bench_http_parse_request_line(bench_t *b, stu_uint_t n);
+static uint64_t  bench_http_parse_header_line(bench_t *b, stu_uint_t n);
+static uint64_t  bench_http_header_dispatch(bench_t *b, stu_uint_t n);
+static uint64_t  bench_rbtree_timer_add_del(bench_t *b, stu_uint_t n);
+static uint64_t  bench_rbtree_timer_expire(bench_t *b, stu_uint_t n);
+static uint64_t  bench_sprintf_log(bench_t *b, stu_uint_t n);
+static uint64_t  bench_sprintf_metric(bench_t *b, stu_uint_t n);
+static uint64_t  bench_sprintf_integer(bench_t *b, stu_uint_t n);
+static uint64_t  bench_utf8_validate(bench_t *b, stu_uint_t n);
+
+static void      bench_hash_create(stu_hash_t *hash, stu_uint_t size);
+static void      bench_hash_destroy(stu_hash_t *hash, stu_uint_t from, stu_uint_t to);
+static void      bench_run(bench_t *b, bench_result_t *res);
+static stu_int_t bench_compare(const char *file, bench_result_t *results, stu_uint_t n, double threshold);
+static void      bench_fail(bench_t *b, const char *what);
+static int       bench_cmp_double(const void *one, const void *two);
+static uint64_t  bench_nsec();
+
+static stu_str_t  bench_json_message = stu_string(
+	"{\"cmd\":\"text\",\"data\":\"Hello, everyone! Is the stream about to start?\",\"type\":\"multi\",\"channel\":{\"id\":\"room-1024\"}}"
+);
+
+static stu_str_t  bench_json_broadcast = stu_string(
+	"{\"raw\":\"text\",\"data\":\"Hello, everyone! Is the stream about to start?\",\"type\":\"multi\","
+	"\"channel\":{\"id\":\"room-1024\"},\"user\":{\"id\":\"10086\",\"name\":\"Tony Lau\","
+	"\"icon\":\"http://www.studease.cn/images/icons/10086.png\",\"role\":1}}"
+);
+
+static stu_str_t  bench_json_ident = stu_string(
+	"{\"raw\":\"ident\",\"user\":{\"id\":\"10086\",\"name\":\"Tony Lau\",\"icon\":\"http://www.studease.cn/images/icons/10086.png\","
+	"\"role\":14},\"channel\":{\"id\":\"room-1024\",\"state\":1,\"total\":4096}}"
+);
+
+static stu_str_t  bench_json_chat = stu_string(
+	"{\"raw\":\"text\",\"req\":37,\"data\":\"The stream starts at eight tonight. Tonight we are going through the slides "
+	"from last week once again, then take questions from the chat for about half an hour. If you missed the first part, "
+	"the recording is on the channel page, under \\\"Replays\\\". Please keep the questions short, and put the number of "
+	"the slide in front of them, so that we can find it quickly.\\nSee you all there, and bring a friend or two along!\","
+	"\"type\":\"multi\",\"channel\":{\"id\":\"room-1024\"},\"user\":{\"id\":\"10086\",\"name\":\"Tony Lau\","
+	"\"icon\":\"http://www.studease.cn/images/icons/10086.png\",\"role\":1}}"
+);
+
+static stu_str_t  bench_json_upstream = stu_string(
+	"{\"protocol\":\"http\",\"method\":\"GET\",\"address\":\"192.168.4.247\",\"port\":80,"
+	"\"target\":\"/websocket/data/userinfo.json\",\"weight\":32,\"max_fails\":0,\"fail_timeout\":10,"
+	"\"timeout\":3,\"batch\":0,\"batch_window\":3,\"balance\":\"hash\",\"check\":true,\"check_interval\":5}"
+);
+
+static stu_str_t  bench_json_profile = stu_string(
+	"{\"id\":\"10086\",\"name\":\"Tony Lau\",\"nickname\":\"tony\",\"icon\":\"http://www.studease.cn/images/icons/10086.png\","
+	"\"role\":1,\"gender\":1,\"level\":12,\"exp\":20480,\"email\":\"tony@studease.cn\",\"phone\":\"\",\"country\":\"CN\","
+	"\"province\":\"Guangdong\",\"city\":\"Shenzhen\",\"language\":\"zh-CN\",\"timezone\":8,\"vip\":true,\"vip_level\":2,"
+	"\"vip_expires\":1767225600,\"followers\":1024,\"following\":256,\"created_at\":1488326400,\"updated_at\":1508371200,"
+	"\"last_login\":1508371200,\"last_ip\":\"192.168.4.247\",\"banned\":false,\"muted\":false,\"muted_until\":0,"
+	"\"badges\":\"early,host\",\"signature\":\"Hello there\",\"channel\":\"room-1024\",\"state\":1,\"status\":true}"
+);
+
+static u_char     bench_json_users_data[BENCH_USERS_N * 128 + 64];
+static stu_str_t  bench_json_users = { 0, bench_json_users_data };
+
+static stu_str_t  bench_http_request = stu_string(
+	"GET /room-1024?name=Tony%20Lau&icon=http%3A%2F%2Fwww.studease.cn%2Fimages%2Ficons%2F10086.png&role=1 HTTP/1.1\r\n"
+	"Host: chat.studease.cn\r\n"
+	"Connection: Upgrade\r\n"
+	"Pragma: no-cache\r\n"
+	"Cache-Control: no-cache\r\n"
+	"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/59.0.3071.115 Safari/537.36\r\n"
+	"Upgrade: websocket\r\n"
+	"Origin: http://www.studease.cn\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Accept-Language: zh-CN,zh;q=0.8,en;q=0.6\r\n"
+	"Cookie: uid=10086; token=6b86b273ff34fce19d6b804eff5a3f5747ada4eaa22f1d49c01e52ddb7875b4b\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+	"\r\n"
+);
+
+static u_char     bench_payload_large_data[900];
+static stu_str_t  bench_payload_small = stu_null_string;
+static stu_str_t  bench_payload_large = { sizeof(bench_payload_large_data), bench_payload_large_data };
+
+static u_char     bench_text_cjk_data[900];
+static stu_str_t  bench_text_cjk = { sizeof(bench_text_cjk_data), bench_text_cjk_data };
+
+static bench_t  benches[] = {
+	{ "hash/insert/100",                  bench_hash_insert,               100,    NULL },
+	{ "hash/insert/10000",                bench_hash_insert,               10000,  NULL },
+	{ "hash/insert/100000",               bench_hash_insert,               100000, NULL },
+	{ "hash/find/100",                    bench_hash_find,                 100,    NULL },
+	{ "hash/find/10000",                  bench_hash_find,                 10000,  NULL },
+	{ "hash/find/100000",                 bench_hash_find,                 100000, NULL },
+	{ "hash/remove/100",                  bench_hash_remove,               100,    NULL },
+	{ "hash/remove/10000",                bench_hash_remove,               10000,  NULL },
+	{ "hash/remove/100000",               bench_hash_remove,               100000, NULL },
+
+	{ "json/parse/message",               bench_json_parse,                0,      &bench_json_message },
+	{ "json/parse/broadcast",             bench_json_parse,                0,      &bench_json_broadcast },
+	{ "json/parse/ident",                 bench_json_parse,                0,      &bench_json_ident },
+	{ "json/parse/users",                 bench_json_parse,                0,      &bench_json_users },
+	{ "json/parse/chat",                  bench_json_parse,                0,      &bench_json_chat },
+	{ "json/stringify/message",           bench_json_stringify,            0,      &bench_json_message },
+	{ "json/stringify/broadcast",         bench_json_stringify,            0,      &bench_json_broadcast },
+	{ "json/stringify/ident",             bench_json_stringify,            0,      &bench_json_ident },
+	{ "json/stringify/users",             bench_json_stringify,            0,      &bench_json_users },
+	{ "json/stringify/chat",              bench_json_stringify,            0,      &bench_json_chat },
+	{ "json/lookup/chat",                 bench_json_lookup,               0,      &bench_json_chat },
+	{ "json/lookup/upstream",             bench_json_lookup,               0,      &bench_json_upstream },
+	{ "json/lookup/profile",              bench_json_lookup,               0,      &bench_json_profile },
+
+	{ "protocol/encode/broadcast",        bench_protocol_encode,           0,      &bench_json_broadcast },
+	{ "protocol/encode/chat",             bench_protocol_encode,           0,      &bench_json_chat },
+	{ "protocol/decode/message",          bench_protocol_decode,           0,      &bench_json_message },
+	{ "protocol/decode/chat",             bench_protocol_decode,           0,      &bench_json_chat },
+
+	{ "websocket/parse_frame/small",      bench_websocket_parse_frame,     0,      &bench_payload_small },
+	{ "websocket/parse_frame/large",      bench_websocket_parse_frame,     0,      &bench_payload_large },
+	{ "websocket/encode_frame/small",     bench_websocket_encode_frame,    100,    NULL },
+	{ "websocket/encode_frame/medium",    bench_websocket_encode_frame,    1000,   NULL },
+	{ "websocket/encode_frame/large",     bench_websocket_encode_frame,    100000, NULL },
+
+	{ "http/parse_request_line",          bench_http_parse_request_line,   0,      &bench_http_request },
+	{ "http/parse_header_line",           bench_http_parse_header_line,    0,      &bench_http_request },
+	{ "http/header_dispatch",             bench_http_header_dispatch,      0,      &bench_http_request },
+
+	{ "rbtree/timer/add_del/1000",        bench_rbtree_timer_add_del,      1000,   NULL },
+	{ "rbtree/timer/add_del/100000",      bench_rbtree_timer_add_del,      100000, NULL },
+	{ "rbtree/timer/expire/1000",         bench_rbtree_timer_expire,       1000,   NULL },
+	{ "rbtree/timer/expire/100000",       bench_rbtree_timer_expire,       100000, NULL },
+
+	{ "sprintf/log",                      bench_sprintf_log,               0,      NULL },
+	{ "sprintf/metric",                   bench_sprintf_metric,            0,      NULL },
+	{ "sprintf/integer",                  bench_sprintf_integer,           0,      NULL },
+
+	{ "utf8/validate/ascii",              bench_utf8_validate,             0,      &bench_payload_large },
+	{ "utf8/validate/chat",               bench_utf8_validate,             0,      &bench_json_chat },
+	{ "utf8/validate/cjk",                bench_utf8_validate,             0,      &bench_text_cjk },
+
+	{ NULL, NULL, 0, NULL }
+};
+
+static stu_str_t           bench_keys[BENCH_KEYS_MAX];
+static u_char              bench_buffer[BENCH_BUFFER_SIZE];
+static stu_rbtree_node_t   bench_nodes[BENCH_KEYS_MAX];
+
+static volatile uintptr_t  bench_sink;
+
+static uint64_t            bench_min_time = 200 * 1000000ULL;    // nsec per run
+static stu_uint_t          bench_runs = 5;
+
+
+int main(int argc, char **argv) {
+	bench_result_t  *results;
+	const char      *output, *baseline;
+	FILE            *fp;
+	u_char          *p;
+	double           threshold;
+	stu_uint_t       i, n, k;
+	int              arg, fd;
+
+	output = baseline = NULL;
+	threshold = 10;
+
+	while ((arg = getopt(argc, argv, "t:r:o:b:x:")) != -1) {
+		switch (arg) {
+		case 't':
+			bench_min_time = atoi(optarg) * 1000000ULL;
+			break;
+		case 'r':
+			bench_runs = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'x':
+			threshold = atof(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (bench_min_time == 0 || bench_runs == 0) {
+		goto usage;
+	}
+
+	// the core logs to stdout, which is kept for the JSON
+	fd = dup(STDOUT_FILENO);
+	if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+		fprintf(stderr, "Failed to dup stdout.\n");
+		return EXIT_FAILURE;
+	}
+
+	// mute the debug records of the core
+	stu_log_set_levels((u_char *) "*=off", 5);
+
+	for (i = 0; i < BENCH_KEYS_MAX; i++) {
+		bench_keys[i].data = stu_calloc(16);
+		bench_keys[i].len = stu_sprintf(bench_keys[i].data, "%ui", 10000 + i * 7) - bench_keys[i].data;
+	}
+
+	p = stu_sprintf(bench_json_users_data, "{\"raw\":\"users\",\"list\":[");
+	for (i = 0; i < BENCH_USERS_N; i++) {
+		p = stu_sprintf(p, "%s{\"id\":\"%ui\",\"name\":\"user %ui\",\"icon\":\"\",\"role\":%ui}",
+				i ? "," : "", 10000 + i, i, i % 4);
+	}
+	p = stu_sprintf(p, "],\"total\":%d}", BENCH_USERS_N);
+	bench_json_users.len = p - bench_json_users_data;
+
+	bench_payload_small = bench_json_message;
+	memset(bench_payload_large_data, 'x', sizeof(bench_payload_large_data));
+
+	// "chat" in Chinese, 3 bytes a character
+	for (i = 0; i < sizeof(bench_text_cjk_data); i += 6) {
+		memcpy(bench_text_cjk_data + i, "\xe8\x81\x8a\xe5\xa4\xa9", 6);
+	}
+
+	// only the ones matching any of the arguments
+	for (n = 0; benches[n].name; n++) {
+		/* void */
+	}
+
+	results = stu_calloc(n * sizeof(bench_result_t));
+	if (results == NULL) {
+		fprintf(stderr, "Failed to alloc results.\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0, k = 0; i < n; i++) {
+		if (optind < argc) {
+			for (arg = optind; arg < argc && strstr(benches[i].name, argv[arg]) == NULL; arg++) {
+				/* void */
+			}
+
+			if (arg == argc) {
+				continue;
+			}
+		}
+
+		bench_run(&benches[i], &results[k]);
+
+		fprintf(stderr, "%-36s %12.1f ns/op  %10lu ops\n", results[k].name, results[k].ns_per_op, results[k].iterations);
+
+		k++;
+	}
+
+	fp = output ? fopen(output, "w") : fdopen(fd, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open \"%s\".\n", output ? output : "stdout");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(fp, "{\"compiler\":\"%s\",\"runs\":%lu,\"min_time_ms\":%lu,\"benchmarks\":[\n",
+			"GCC " __VERSION__, bench_runs, (stu_uint_t) (bench_min_time / 1000000));
+
+	for (i = 0; i < k; i++) {
+		fprintf(fp, "  {\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f",
+				results[i].name, results[i].iterations, results[i].ns_per_op, results[i].min_ns_per_op);
+
+		if (results[i].bytes_per_op) {
+			fprintf(fp, ",\"bytes_per_op\":%lu,\"mb_per_sec\":%.1f", results[i].bytes_per_op,
+					results[i].bytes_per_op * 1e3 / results[i].ns_per_op);
+		}
+
+		fprintf(fp, "}%s\n", i + 1 < k ? "," : "");
+	}
+
+	fprintf(fp, "]}\n");
+
+	fclose(fp);
+
+	arg = EXIT_SUCCESS;
+
+	if (baseline && bench_compare(baseline, results, k, threshold) != STU_OK) {
+		arg = EXIT_FAILURE;
+	}
+
+	stu_free(results);
+
+	return arg;
+
+usage:
+
+	fprintf(stderr, "Usage: %s [-t msec] [-r runs] [-o file] [-b baseline.json [-x percent]] [filter...]\n"
+			"  -t msec   minimum time of each run, default 200\n"
+			"  -r runs   runs of each benchmark, the median is reported, default 5\n"
+			"  -o file   write the JSON into file instead of stdout\n"
+			"  -b file   compare with a previous output, and fail if any got slower\n"
+			"  -x pct    by more than pct percent, default 10\n", argv[0]);
+
+	return EXIT_FAILURE;
+}
+
+
+static uint64_t
+bench_hash_insert(bench_t *b, stu_uint_t n) {
+	stu_hash_t  hash;
+	stu_uint_t  i, done, m;
+	uint64_t    start, spent;
+
+	for (done = 0, spent = 0; done < n; done += m) {
+		m = stu_min(b->size, n - done);
+
+		bench_hash_create(&hash, 0);
+
+		start = bench_nsec();
+		for (i = 0; i < m; i++) {
+			stu_hash_insert_locked(&hash, &bench_keys[i], &bench_keys[i], STU_HASH_LOWCASE);
+		}
+		spent += bench_nsec() - start;
+
+		bench_hash_destroy(&hash, 0, m);
+	}
+
+	return spent;
+}
+
+static uint64_t
+bench_hash_find(bench_t *b, stu_uint_t n) {
+	stu_hash_t  hash;
+	stu_str_t  *key;
+	stu_uint_t  i, kh;
+	uint64_t    start, spent;
+
+	bench_hash_create(&hash, b->size);
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		key = &bench_keys[i % b->size];
+		kh = stu_hash_key_lc(key->data, key->len);
+		bench_sink = (uintptr_t) stu_hash_find_locked(&hash, kh, key->data, key->len);
+	}
+	spent = bench_nsec() - start;
+
+	if (bench_sink == 0) {
+		bench_fail(b, "key not found");
+	}
+
+	bench_hash_destroy(&hash, 0, b->size);
+
+	return spent;
+}
+
+static uint64_t
+bench_hash_remove(bench_t *b, stu_uint_t n) {
+	stu_hash_t  hash;
+	stu_str_t  *key;
+	stu_uint_t  i, done, m, kh;
+	uint64_t    start, spent;
+
+	for (done = 0, spent = 0; done < n; done += m) {
+		m = stu_min(b->size, n - done);
+
+		bench_hash_create(&hash, b->size);
+
+		start = bench_nsec();
+		for (i = 0; i < m; i++) {
+			key = &bench_keys[i];
+			kh = stu_hash_key_lc(key->data, key->len);
+			stu_hash_remove_locked(&hash, kh, key->data, key->len);
+		}
+		spent += bench_nsec() - start;
+
+		if (hash.length != b->size - m) {
+			bench_fail(b, "key not removed");
+		}
+
+		bench_hash_destroy(&hash, m, b->size);
+	}
+
+	return spent;
+}
+
+static uint64_t
+bench_json_parse(bench_t *b, stu_uint_t n) {
+	stu_json_t  *json;
+	stu_uint_t   i;
+	uint64_t     start, spent;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		json = stu_json_parse(b->data->data, b->data->len);
+		if (json == NULL) {
+			bench_fail(b, "failed to parse");
+		}
+
+		stu_json_delete(json);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+static uint64_t
+bench_json_stringify(bench_t *b, stu_uint_t n) {
+	stu_json_t  *json;
+	size_t       len;
+	stu_uint_t   i;
+	uint64_t     start, spent;
+
+	json = stu_json_parse(b->data->data, b->data->len);
+	if (json == NULL) {
+		bench_fail(b, "failed to parse");
+	}
+
+	len = 0;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		len = stu_json_stringify(json, bench_buffer, BENCH_BUFFER_SIZE);
+		bench_sink = len;
+	}
+	spent = bench_nsec() - start;
+
+	if (len != b->data->len || memcmp(bench_buffer, b->data->data, len) != 0) {
+		bench_fail(b, "output differs");
+	}
+
+	stu_json_delete(json);
+
+	return spent;
+}
+
+static uint64_t
+bench_protocol_encode(bench_t *b, stu_uint_t n) {
+	stu_json_t  *json;
+	size_t       len;
+	stu_uint_t   i;
+	uint64_t     start, spent;
+
+	json = stu_json_parse(b->data->data, b->data->len);
+	if (json == NULL) {
+		bench_fail(b, "failed to parse");
+	}
+
+	len = 0;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		len = stu_protocol_encode(json, bench_buffer, BENCH_BUFFER_SIZE);
+		bench_sink = len;
+	}
+	spent = bench_nsec() - start;
+
+	if (len > BENCH_BUFFER_SIZE) {
+		bench_fail(b, "buffer too small");
+	}
+
+	stu_json_delete(json);
+
+	return spent;
+}
+
+/* against json/parse, on the same message in tlv. */
+static uint64_t
+bench_protocol_decode(bench_t *b, stu_uint_t n) {
+	stu_json_t  *json;
+	size_t       len;
+	stu_uint_t   i;
+	uint64_t     start, spent;
+
+	json = stu_json_parse(b->data->data, b->data->len);
+	if (json == NULL) {
+		bench_fail(b, "failed to parse");
+	}
+
+	len = stu_protocol_encode(json, bench_buffer, BENCH_BUFFER_SIZE);
+	stu_json_delete(json);
+
+	if (len > BENCH_BUFFER_SIZE) {
+		bench_fail(b, "buffer too small");
+	}
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		json = stu_protocol_decode(bench_buffer, len);
+		if (json == NULL) {
+			bench_fail(b, "failed to decode");
+		}
+
+		stu_json_delete(json);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+/* every member of the object by its key, the last first. */
+static uint64_t
+bench_json_lookup(bench_t *b, stu_uint_t n) {
+	stu_json_t  *json, *item;
+	stu_str_t    keys[32];
+	stu_uint_t   i, k, m;
+	uint64_t     start, spent;
+
+	json = stu_json_parse(b->data->data, b->data->len);
+	if (json == NULL) {
+		bench_fail(b, "failed to parse");
+	}
+
+	m = 0;
+	for (item = (stu_json_t *) json->value; item && m < 32; item = item->next) {
+		keys[m++] = item->key;
+	}
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		for (k = m; k > 0; k--) {
+			item = stu_json_get_object_item_by(json, &keys[k - 1]);
+			bench_sink += (uintptr_t) item;
+		}
+	}
+	spent = bench_nsec() - start;
+
+	if (item != (stu_json_t *) json->value) {
+		bench_fail(b, "item differs");
+	}
+
+	stu_json_delete(json);
+
+	return spent;
+}
+
+static uint64_t
+bench_websocket_parse_frame(bench_t *b, stu_uint_t n) {
+	stu_websocket_request_t  r;
+	stu_buf_t                buf;
+	u_char                   frame[STU_WEBSOCKET_REQUEST_DEFAULT_SIZE + 16], *p;
+	stu_uint_t               i;
+	size_t                   len;
+	uint64_t                 start, spent;
+
+	// a masked text frame, as from a browser
+	len = b->data->len;
+	p = frame;
+	*p++ = 0x80 | STU_WEBSOCKET_OPCODE_TEXT;
+	if (len < 126) {
+		*p++ = 0x80 | len;
+	} else {
+		*p++ = 0x80 | 126;
+		*p++ = len >> 8;
+		*p++ = len;
+	}
+
+	memcpy(p, "\x12\x34\x56\x78", 4);
+	for (i = 0; i < len; i++) {
+		p[4 + i] = b->data->data[i] ^ p[i % 4];
+	}
+	p += 4 + len;
+
+	stu_memzero(&r, sizeof(stu_websocket_request_t));
+	r.frame = &r.frames_in;
+
+	buf.start = frame;
+	buf.end = p;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		// unmasked in place, so every other op restores the payload
+		buf.last = buf.start;
+		r.state = 0;
+
+		if (stu_websocket_parse_frame(&r, &buf) != STU_DONE) {
+			bench_fail(b, "frame not done");
+		}
+	}
+	spent = bench_nsec() - start;
+
+	if ((size_t) r.frames_in.extended != len) {
+		bench_fail(b, "payload differs in length");
+	}
+
+	return spent;
+}
+
+static uint64_t
+bench_websocket_encode_frame(bench_t *b, stu_uint_t n) {
+	stu_int_t   extended;
+	stu_uint_t  i;
+	uint64_t    start, spent;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		bench_sink = (uintptr_t) stu_websocket_encode_frame(STU_WEBSOCKET_OPCODE_TEXT, bench_buffer, b->size, &extended);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+static uint64_t
+bench_http_parse_request_line(bench_t *b, stu_uint_t n) {
+	stu_http_request_t  r;
+	stu_buf_t           buf;
+	stu_uint_t          i;
+	uint64_t            start, spent;
+
+	stu_memzero(&r, sizeof(stu_http_request_t));
+
+	buf.start = b->data->data;
+	buf.end = buf.start + b->data->len;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		buf.last = buf.start;
+		r.state = 0;
+
+		if (stu_http_parse_request_line(&r, &buf) != STU_OK) {
+			bench_fail(b, "request line not done");
+		}
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+/* an op is the whole header of a websocket upgrade request. */
+static uint64_t
+bench_http_parse_header_line(bench_t *b, stu_uint_t n) {
+	stu_http_request_t  r;
+	stu_buf_t           buf;
+	u_char             *headers;
+	stu_uint_t          i, lines;
+	stu_int_t           rc;
+	uint64_t            start, spent;
+
+	stu_memzero(&r, sizeof(stu_http_request_t));
+
+	buf.start = buf.last = b->data->data;
+	buf.end = buf.start + b->data->len;
+
+	if (stu_http_parse_request_line(&r, &buf) != STU_OK) {
+		bench_fail(b, "request line not done");
+	}
+
+	headers = buf.last;
+	lines = 0;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		buf.last = headers;
+		r.state = 0;
+
+		for (lines = 0; (rc = stu_http_parse_header_line(&r, &buf, 1)) == STU_OK; lines++) {
+			bench_sink = r.header_hash;
+		}
+
+		if (rc != STU_DONE) {
+			bench_fail(b, "header not done");
+		}
+	}
+	spent = bench_nsec() - start;
+
+	if (lines != 13) {
+		bench_fail(b, "unexpected number of header lines");
+	}
+
+	return spent;
+}
+
+/* an op is finding the handlers of all the header lines of an upgrade request. */
+static uint64_t
+bench_http_header_dispatch(bench_t *b, stu_uint_t n) {
+	stu_http_request_t       r;
+	stu_http_header_phash_t  ph;
+	stu_buf_t                buf;
+	stu_uint_t               i, k, lines, found, hashes[16], lens[16];
+	u_char                   names[16][STU_HTTP_LC_HEADER_LEN];
+	stu_int_t                rc;
+	uint64_t                 start, spent;
+
+	if (stu_http_header_phash_init(&ph, stu_http_headers_in) == STU_ERROR) {
+		bench_fail(b, "phash not built");
+	}
+
+	stu_memzero(&r, sizeof(stu_http_request_t));
+
+	buf.start = buf.last = b->data->data;
+	buf.end = buf.start + b->data->len;
+
+	if (stu_http_parse_request_line(&r, &buf) != STU_OK) {
+		bench_fail(b, "request line not done");
+	}
+
+	for (lines = 0; (rc = stu_http_parse_header_line(&r, &buf, 1)) == STU_OK && lines < 16; lines++) {
+		hashes[lines] = r.header_hash;
+		lens[lines] = r.header_name_end - r.header_name_start;
+		memcpy(names[lines], r.lowcase_header, STU_HTTP_LC_HEADER_LEN);
+	}
+
+	if (rc != STU_DONE || lines != 13) {
+		bench_fail(b, "unexpected number of header lines");
+	}
+
+	found = 0;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		for (k = 0, found = 0; k < lines; k++) {
+			found += stu_http_header_phash_find(&ph, hashes[k], names[k], lens[k]) != NULL;
+		}
+	}
+	spent = bench_nsec() - start;
+
+	bench_sink = found;
+#if (STU_HTTP_GZIP)
+	if (found != 9) {
+#else
+	if (found != 8) {
+#endif
+		bench_fail(b, "unexpected number of known headers");
+	}
+
+	stu_free(ph.elts);
+
+	return spent;
+}
+
+/* re-arms an armed timer, as stu_timer_add() does on every read. */
+static uint64_t
+bench_rbtree_timer_add_del(bench_t *b, stu_uint_t n) {
+	stu_rbtree_t        tree;
+	stu_rbtree_node_t   sentinel, *node;
+	stu_uint_t          i;
+	uint64_t            start, spent;
+
+	stu_rbtree_init(&tree, &sentinel, stu_rbtree_insert_timer_value);
+
+	srand(1);
+	for (i = 0; i < b->size; i++) {
+		bench_nodes[i].key = 1000000 + rand() % 60000;
+		stu_rbtree_insert(&tree, &bench_nodes[i]);
+	}
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		node = &bench_nodes[i % b->size];
+
+		stu_rbtree_delete(&tree, node);
+		node->key = 1000000 + i + (i * 7919) % 60000;
+		stu_rbtree_insert(&tree, node);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+/* expires the earliest timer, as stu_timer_expire() does. */
+static uint64_t
+bench_rbtree_timer_expire(bench_t *b, stu_uint_t n) {
+	stu_rbtree_t        tree;
+	stu_rbtree_node_t   sentinel, *node;
+	stu_uint_t          i, done, m;
+	uint64_t            start, spent;
+
+	srand(1);
+
+	for (done = 0, spent = 0; done < n; done += m) {
+		m = stu_min(b->size, n - done);
+
+		stu_rbtree_init(&tree, &sentinel, stu_rbtree_insert_timer_value);
+
+		for (i = 0; i < b->size; i++) {
+			bench_nodes[i].key = 1000000 + rand() % 60000;
+			stu_rbtree_insert(&tree, &bench_nodes[i]);
+		}
+
+		start = bench_nsec();
+		for (i = 0; i < m; i++) {
+			node = stu_rbtree_min(tree.root, tree.sentinel);
+			stu_rbtree_delete(&tree, node);
+		}
+		spent += bench_nsec() - start;
+	}
+
+	return spent;
+}
+
+static uint64_t
+bench_sprintf_log(bench_t *b, stu_uint_t n) {
+	stu_uint_t  i;
+	uint64_t    start, spent;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		bench_sink = (uintptr_t) stu_sprintf(bench_buffer, "%s:%d\n\tsent: fd=%d, bytes=%d, recipients=%ui, cost=%.3fms.\n",
+				__FILE__, __LINE__, 1024, 118, i, 0.125);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+static uint64_t
+bench_sprintf_metric(bench_t *b, stu_uint_t n) {
+	stu_uint_t  i;
+	uint64_t    start, spent;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		bench_sink = (uintptr_t) stu_sprintf(bench_buffer, "%s%*s{quantile=\"%s\"} %ui\n",
+				"chatease_", (size_t) 11, "fanout_usec", "0.99", i);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+static uint64_t
+bench_sprintf_integer(bench_t *b, stu_uint_t n) {
+	stu_uint_t  i;
+	uint64_t    start, spent;
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		bench_sink = (uintptr_t) stu_sprintf(bench_buffer, "%ui", 140141427556000UL + i);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+static uint64_t
+bench_utf8_validate(bench_t *b, stu_uint_t n) {
+	stu_uint_t  i;
+	uint64_t    start, spent;
+
+	if (stu_utf8_validate(b->data->data, b->data->len) != STU_OK) {
+		bench_fail(b, "invalid");
+	}
+
+	start = bench_nsec();
+	for (i = 0; i < n; i++) {
+		bench_sink += stu_utf8_validate(b->data->data, b->data->len);
+	}
+	spent = bench_nsec() - start;
+
+	return spent;
+}
+
+
+/* in the buckets of a userlist, with the first size keys. */
+static void
+bench_hash_create(stu_hash_t *hash, stu_uint_t size) {
+	stu_uint_t  i;
+
+	if (stu_hash_init(hash, NULL, STU_USER_MAXIMUM, (stu_hash_palloc_pt) stu_calloc, (stu_hash_free_pt) stu_free) == STU_ERROR) {
+		fprintf(stderr, "Failed to init hash.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < size; i++) {
+		stu_hash_insert_locked(hash, &bench_keys[i], &bench_keys[i], STU_HASH_LOWCASE);
+	}
+}
+
+static void
+bench_hash_destroy(stu_hash_t *hash, stu_uint_t from, stu_uint_t to) {
+	stu_str_t  *key;
+	stu_uint_t  i;
+
+	for (i = from; i < to; i++) {
+		key = &bench_keys[i];
+		stu_hash_remove_locked(hash, stu_hash_key_lc(key->data, key->len), key->data, key->len);
+	}
+
+	hash->free(hash->buckets);
+}
+
+/* grows the ops till a run takes bench_min_time, then runs it bench_runs times. */
+static void
+bench_run(bench_t *b, bench_result_t *res) {
+	double      *samples;
+	stu_uint_t   n, i;
+	uint64_t     spent;
+
+	for (n = 1; ; n *= 10) {
+		spent = b->handler(b, n);
+		if (spent >= bench_min_time / 10 || n >= 1000000000) {
+			break;
+		}
+	}
+
+	if (spent == 0) {
+		spent = 1;
+	}
+
+	// once more, as the first runs may be slowed by cold caches
+	n = (stu_uint_t) ((double) n * bench_min_time / spent) + 1;
+	spent = b->handler(b, n) + 1;
+
+	n = (stu_uint_t) ((double) n * bench_min_time / spent) + 1;
+
+	samples = stu_calloc(bench_runs * sizeof(double));
+	if (samples == NULL) {
+		fprintf(stderr, "Failed to alloc samples.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < bench_runs; i++) {
+		samples[i] = (double) b->handler(b, n) / n;
+	}
+
+	qsort(samples, bench_runs, sizeof(double), bench_cmp_double);
+
+	res->name = b->name;
+	res->iterations = n;
+	res->ns_per_op = samples[bench_runs / 2];
+	res->min_ns_per_op = samples[0];
+	res->bytes_per_op = b->data ? b->data->len : 0;
+
+	stu_free(samples);
+}
+
+/* prints the change of each benchmark found in the baseline. */
+static stu_int_t
+bench_compare(const char *file, bench_result_t *results, stu_uint_t n, double threshold) {
+	stu_json_t   *root, *list, *item, *name, *ns;
+	stu_str_t     key;
+	FILE         *fp;
+	u_char       *data;
+	size_t        len;
+	double        prev, diff;
+	stu_uint_t    i, slower;
+	stu_int_t     rc;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open baseline \"%s\".\n", file);
+		return STU_ERROR;
+	}
+
+	data = stu_calloc(1024 * 1024);
+	if (data == NULL) {
+		fclose(fp);
+		return STU_ERROR;
+	}
+
+	len = fread(data, 1, 1024 * 1024 - 1, fp);
+	fclose(fp);
+
+	rc = STU_ERROR;
+
+	root = stu_json_parse(data, len);
+	if (root == NULL) {
+		fprintf(stderr, "Failed to parse baseline \"%s\".\n", file);
+		goto done;
+	}
+
+	key.data = (u_char *) "benchmarks";
+	key.len = 10;
+
+	list = stu_json_get_object_item_by(root, &key);
+	if (list == NULL || list->type != STU_JSON_TYPE_ARRAY) {
+		fprintf(stderr, "No benchmarks in baseline \"%s\".\n", file);
+		goto done;
+	}
+
+	fprintf(stderr, "\n%-36s %12s %12s %9s\n", "compared with baseline", "before", "after", "change");
+
+	for (i = 0, slower = 0; i < n; i++) {
+		for (item = (stu_json_t *) list->value; item; item = item->next) {
+			key.data = (u_char *) "name";
+			key.len = 4;
+			name = stu_json_get_object_item_by(item, &key);
+
+			key.data = (u_char *) "ns_per_op";
+			key.len = 9;
+			ns = stu_json_get_object_item_by(item, &key);
+
+			if (name == NULL || ns == NULL || name->type != STU_JSON_TYPE_STRING || ns->type != STU_JSON_TYPE_NUMBER) {
+				continue;
+			}
+
+			if (strlen(results[i].name) == ((stu_str_t *) name->value)->len
+					&& stu_strncmp(results[i].name, ((stu_str_t *) name->value)->data, ((stu_str_t *) name->value)->len) == 0) {
+				break;
+			}
+		}
+
+		if (item == NULL) {
+			continue;
+		}
+
+		prev = *(stu_double_t *) ns->value;
+		diff = prev > 0 ? (results[i].ns_per_op - prev) * 100 / prev : 0;
+
+		fprintf(stderr, "%-36s %12.1f %12.1f %+8.1f%%%s\n", results[i].name, prev, results[i].ns_per_op, diff,
+				diff > threshold ? "  slower" : "");
+
+		if (diff > threshold) {
+			slower++;
+		}
+	}
+
+	if (slower) {
+		fprintf(stderr, "%lu benchmarks got slower by more than %.1f%%.\n", slower, threshold);
+		goto done;
+	}
+
+	rc = STU_OK;
+
+done:
+
+	stu_json_delete(root);
+	stu_free(data);
+
+	return rc;
+}
+
+static void
+bench_fail(bench_t *b, const char *what) {
+	fprintf(stderr, "%s: %s.\n", b->name, what);
+	exit(EXIT_FAILURE);
+}
+
+static int
+bench_cmp_double(const void *one, const void *two) {
+	double  a, b;
+
+	a = *(const double *) one;
+	b = *(const double *) two;
+
+	return a < b ? -1 : a > b;
+}
+
+static uint64_t
+bench_nsec() {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
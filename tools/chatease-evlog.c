@@ -0,0 +1,156 @@
+/*
+ ============================================================================
+ Name        : chatease-evlog.c
+ Author      : Tony Lau
+ Version     : 1.x.xx
+ Copyright   : studease.cn
+ Description : Converts evlog segments to JSON lines or CSV.
+ ============================================================================
+ */
+
+#include "stu_config.h"
+#include "stu_core.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FORMAT_JSON  0
+#define FORMAT_CSV   1
+
+static const char *types[] = {
+	"none",
+	"join",
+	"leave",
+	"message",
+	"refused"
+};
+
+static int  dump(const char *name, int format);
+static void print_string(u_char *s, size_t n, int format);
+
+
+int main(int argc, char **argv) {
+	int  arg, format, i, rc;
+
+	format = FORMAT_JSON;
+
+	while ((arg = getopt(argc, argv, "f:")) != -1) {
+		switch (arg) {
+		case 'f':
+			if (strcmp(optarg, "json") == 0) {
+				format = FORMAT_JSON;
+			} else if (strcmp(optarg, "csv") == 0) {
+				format = FORMAT_CSV;
+			} else {
+				fprintf(stderr, "Unknown format \"%s\".\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind >= argc) {
+		goto usage;
+	}
+
+	if (format == FORMAT_CSV) {
+		printf("time,type,channel,user,bytes,latency,status\n");
+	}
+
+	rc = EXIT_SUCCESS;
+
+	for (i = optind; i < argc; i++) {
+		if (dump(argv[i], format) == -1) {
+			rc = EXIT_FAILURE;
+		}
+	}
+
+	return rc;
+
+usage:
+
+	fprintf(stderr, "Usage: %s [-f json|csv] segment...\n", argv[0]);
+
+	return EXIT_FAILURE;
+}
+
+static int
+dump(const char *name, int format) {
+	FILE               *fp;
+	stu_evlog_header_t  header;
+	stu_evlog_record_t  rec;
+	const char         *type;
+	int                 rc;
+
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open \"%s\".\n", name);
+		return -1;
+	}
+
+	rc = -1;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1
+			|| memcmp(header.magic, STU_EVLOG_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "\"%s\" is not an evlog segment.\n", name);
+		goto done;
+	}
+
+	if (header.version != STU_EVLOG_VERSION || header.record_size != sizeof(stu_evlog_record_t)) {
+		fprintf(stderr, "\"%s\": unsupported version %u, record size %u.\n", name, header.version, header.record_size);
+		goto done;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.type == STU_EVLOG_NONE) {
+			continue;
+		}
+
+		type = rec.type < sizeof(types) / sizeof(types[0]) ? types[rec.type] : "unknown";
+
+		if (format == FORMAT_CSV) {
+			printf("%llu,%s,", (unsigned long long) rec.time, type);
+			print_string(rec.channel, stu_min(rec.channel_len, STU_EVLOG_ID_LEN), format);
+			printf(",");
+			print_string(rec.user, stu_min(rec.user_len, STU_EVLOG_ID_LEN), format);
+			printf(",%u,%u,%u\n", rec.bytes, rec.latency, rec.status);
+			continue;
+		}
+
+		printf("{\"time\":%llu,\"type\":\"%s\",\"channel\":", (unsigned long long) rec.time, type);
+		print_string(rec.channel, stu_min(rec.channel_len, STU_EVLOG_ID_LEN), format);
+		printf(",\"user\":");
+		print_string(rec.user, stu_min(rec.user_len, STU_EVLOG_ID_LEN), format);
+		printf(",\"bytes\":%u,\"latency\":%u,\"status\":%u}\n", rec.bytes, rec.latency, rec.status);
+	}
+
+	rc = 0;
+
+done:
+
+	fclose(fp);
+
+	return rc;
+}
+
+static void
+print_string(u_char *s, size_t n, int format) {
+	size_t  i;
+
+	putchar('"');
+
+	for (i = 0; i < n; i++) {
+		if (s[i] == '"') {
+			fputs(format == FORMAT_CSV ? "\"\"" : "\\\"", stdout);
+		} else if (format == FORMAT_JSON && s[i] == '\\') {
+			fputs("\\\\", stdout);
+		} else if (format == FORMAT_JSON && s[i] < 0x20) {
+			printf("\\u%04x", s[i]);
+		} else {
+			putchar(s[i]);
+		}
+	}
+
+	putchar('"');
+}
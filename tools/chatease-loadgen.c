@@ -0,0 +1,1117 @@
+/*
+ ============================================================================
+ Name        : chatease-loadgen.c
+ Author      : Tony Lau
+ Version     : 1.x.xx
+ Copyright   : studease.cn
+ Description : Opens websocket clients through the preview edition path,
+               spreads them across channels, sends messages at a given rate,
+               and reports join latency, fan-out latency and server CPU.
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT  24
+#endif
+
+#define FORMAT_TEXT         0
+#define FORMAT_JSON         1
+
+#define CLIENT_CONNECTING   0
+#define CLIENT_HANDSHAKE    1
+#define CLIENT_OPEN         2
+#define CLIENT_JOINED       3
+#define CLIENT_CLOSED       4
+
+#define CLIENT_BUFFER_SIZE  512
+#define CLIENT_OUTPUT_SIZE  1024
+#define MESSAGE_MAX_PADDING 900
+
+#define ROLE_UNLIMITED      0x10    // assistant, no interval between messages
+#define ADDRS_PER_SOURCE    25000   // ephemeral ports on one source address
+#define JOIN_TIMEOUT        60      // sec
+#define DRAIN_TIME          1       // sec
+#define TICK                5       // msec
+
+#define HIST_SUB_BITS       4
+#define HIST_SUB            (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        (HIST_SUB * 34)
+
+typedef struct {
+	uint64_t  buckets[HIST_BUCKETS];
+	uint64_t  count;
+	uint64_t  sum;
+	uint64_t  max;
+} hist_t;
+
+typedef struct {
+	int       fd;
+	int       state;
+	int       channel;
+	int       slow;
+	uint64_t  start;        // usec, when connecting
+
+	size_t    len;
+	size_t    skip;         // of a frame longer than the buffer
+	u_char   *buf;
+
+	size_t    out_len;
+	u_char   *out;          // pending bytes of a partial send
+} client_t;
+
+typedef struct {
+	pthread_t          tid;
+	int                id;
+	int                ep;
+
+	client_t          *clients;
+	int                n;
+	int                next_connect;
+	int                next_sender;
+
+	double             join_credit;
+	double             send_credit;
+
+	volatile uint64_t  connected;
+	volatile uint64_t  joined;
+	volatile uint64_t  failed;
+	volatile uint64_t  closed;
+	volatile uint64_t  sent;
+	volatile uint64_t  skipped;
+	volatile uint64_t  received;
+	volatile uint64_t  errors;
+
+	hist_t             join;
+	hist_t             fanout;
+} worker_t;
+
+typedef struct {
+	const char  *name;
+	int          clients;
+	int          channels;
+	double       rate;
+	double       join_rate;
+	int          duration;
+	int          slow;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+	{ "big-room",       50000,     1,   10,    0, 30,  0 },
+	{ "small-rooms",    50000, 10000, 5000,    0, 30,  0 },
+	{ "join-storm",     20000,   100,    0,    0, 10,  0 },
+	{ "slow-consumers",  1000,    10,  500,    0, 30, 10 },
+	{ NULL,                 0,     0,    0,    0,  0,  0 }
+};
+
+static const char         *host = "127.0.0.1";
+static int                 port = 80;
+static const char         *scenario = "custom";
+static int                 clients = 100;
+static int                 channels = 10;
+static double              rate = 100;
+static double              join_rate = 0;
+static int                 duration = 10;
+static int                 slow = 0;
+static int                 threads = 4;
+static int                 padding = 0;
+static int                 sources = 0;
+static int                 role = ROLE_UNLIMITED;
+static pid_t               server_pid = 0;
+static int                 format = FORMAT_TEXT;
+static int                 quiet = 0;
+
+static struct sockaddr_in  server_addr;
+static worker_t           *workers;
+
+static volatile int        sending = 0;
+static volatile int        stopping = 0;
+
+static void     *worker_cycle(void *arg);
+static void      worker_connect(worker_t *w, uint64_t now);
+static void      worker_send(worker_t *w);
+static void      client_connect(worker_t *w, client_t *c, int i);
+static void      client_write(worker_t *w, client_t *c);
+static void      client_read(worker_t *w, client_t *c);
+static int       client_handshake(client_t *c);
+static void      client_frames(worker_t *w, client_t *c);
+static void      client_payload(worker_t *w, client_t *c, u_char *p, size_t n);
+static int       client_output(worker_t *w, client_t *c, u_char *data, size_t n);
+static void      client_close(worker_t *w, client_t *c, int failed);
+
+static void      hist_add(hist_t *h, uint64_t v);
+static void      hist_merge(hist_t *dst, hist_t *src);
+static uint64_t  hist_quantile(hist_t *h, double q);
+static void      print_hist_text(const char *name, hist_t *h);
+static void      print_hist_json(const char *name, hist_t *h);
+
+static int       server_usage(uint64_t *ticks, uint64_t *rss);
+static int       apply_scenario(const char *name);
+static uint64_t  usec();
+static void      usage(const char *prog);
+
+
+int main(int argc, char **argv) {
+	worker_t        *w;
+	struct rlimit    rl;
+	hist_t           join, fanout;
+	uint64_t         start, begin, end, elapsed, ticks0, ticks1, rss, last_sent, last_received;
+	uint64_t         connected, joined, failed, closed, sent, skipped, received, errors;
+	double           cpu, secs;
+	int              arg, i, k, have_cpu;
+
+	while ((arg = getopt(argc, argv, "s:H:p:c:m:r:j:d:S:t:l:B:R:P:o:q")) != -1) {
+		switch (arg) {
+		case 's':
+			if (apply_scenario(optarg) == -1) {
+				fprintf(stderr, "Unknown scenario \"%s\".\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'm':
+			channels = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'j':
+			join_rate = atof(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'S':
+			slow = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'l':
+			padding = atoi(optarg);
+			break;
+		case 'B':
+			sources = atoi(optarg);
+			break;
+		case 'R':
+			role = atoi(optarg);
+			break;
+		case 'P':
+			server_pid = atoi(optarg);
+			break;
+		case 'o':
+			if (strcmp(optarg, "json") == 0) {
+				format = FORMAT_JSON;
+			} else if (strcmp(optarg, "text") == 0) {
+				format = FORMAT_TEXT;
+			} else {
+				fprintf(stderr, "Unknown format \"%s\".\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (clients <= 0 || channels <= 0 || threads <= 0 || duration < 0 || rate < 0 || join_rate < 0
+			|| slow < 0 || slow > 100 || padding < 0 || padding > MESSAGE_MAX_PADDING) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (channels > clients) {
+		channels = clients;
+	}
+
+	if (threads > clients) {
+		threads = clients;
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+		fprintf(stderr, "Bad server address \"%s\", expecting IPv4.\n", host);
+		return EXIT_FAILURE;
+	}
+
+	// spread over 127.0.0.x for more ephemeral ports when testing locally
+	if (sources == 0 && (ntohl(server_addr.sin_addr.s_addr) >> 24) == 127) {
+		sources = clients / ADDRS_PER_SOURCE + 1;
+	}
+
+	if (sources > 254) {
+		sources = 254;
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+
+		if (rl.rlim_cur < (rlim_t) clients + 64) {
+			fprintf(stderr, "Warning: RLIMIT_NOFILE is %lu, not enough for %d clients.\n", (unsigned long) rl.rlim_cur, clients);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = calloc(threads, sizeof(worker_t));
+	if (workers == NULL) {
+		fprintf(stderr, "Failed to alloc workers.\n");
+		return EXIT_FAILURE;
+	}
+
+	// client i is owned by worker i % threads
+	for (k = 0; k < threads; k++) {
+		w = &workers[k];
+		w->id = k;
+		w->n = clients / threads + (k < clients % threads);
+
+		w->clients = calloc(w->n, sizeof(client_t));
+		if (w->clients == NULL) {
+			fprintf(stderr, "Failed to alloc clients.\n");
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < w->n; i++) {
+			w->clients[i].fd = -1;
+			w->clients[i].state = CLIENT_CLOSED;
+		}
+
+		w->ep = epoll_create1(0);
+		if (w->ep == -1) {
+			fprintf(stderr, "epoll_create1() failed: %s.\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	start = usec();
+
+	for (k = 0; k < threads; k++) {
+		if (pthread_create(&workers[k].tid, NULL, worker_cycle, &workers[k]) != 0) {
+			fprintf(stderr, "Failed to create worker thread.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	// join phase
+	for ( ;; ) {
+		usleep(100000);
+
+		for (k = 0, joined = failed = 0; k < threads; k++) {
+			joined += workers[k].joined;
+			failed += workers[k].failed;
+		}
+
+		if (joined + failed >= (uint64_t) clients || usec() - start > JOIN_TIMEOUT * 1000000ULL) {
+			break;
+		}
+	}
+
+	if (!quiet) {
+		fprintf(stderr, "joined %lu of %d clients in %.2fs, %lu failed.\n",
+				joined, clients, (usec() - start) / 1e6, failed);
+	}
+
+	// send phase
+	have_cpu = server_pid && server_usage(&ticks0, &rss) == 0;
+
+	begin = usec();
+	last_sent = last_received = 0;
+	sending = 1;
+
+	for (i = 0; i < duration; i++) {
+		sleep(1);
+
+		if (quiet) {
+			continue;
+		}
+
+		for (k = 0, sent = received = 0; k < threads; k++) {
+			sent += workers[k].sent;
+			received += workers[k].received;
+		}
+
+		fprintf(stderr, "%3ds  sent %8lu/s  received %10lu/s\n", i + 1, sent - last_sent, received - last_received);
+
+		last_sent = sent;
+		last_received = received;
+	}
+
+	sending = 0;
+	end = usec();
+
+	if (have_cpu && server_usage(&ticks1, &rss) == -1) {
+		have_cpu = 0;
+	}
+
+	sleep(DRAIN_TIME);
+
+	stopping = 1;
+
+	memset(&join, 0, sizeof(hist_t));
+	memset(&fanout, 0, sizeof(hist_t));
+	connected = joined = failed = closed = sent = skipped = received = errors = 0;
+
+	for (k = 0; k < threads; k++) {
+		w = &workers[k];
+		pthread_join(w->tid, NULL);
+
+		connected += w->connected;
+		joined += w->joined;
+		failed += w->failed;
+		closed += w->closed;
+		sent += w->sent;
+		skipped += w->skipped;
+		received += w->received;
+		errors += w->errors;
+
+		hist_merge(&join, &w->join);
+		hist_merge(&fanout, &w->fanout);
+	}
+
+	elapsed = end - begin;
+	secs = elapsed ? elapsed / 1e6 : 1;
+	cpu = have_cpu ? (ticks1 - ticks0) * 100.0 / sysconf(_SC_CLK_TCK) / secs : -1;
+
+	if (format == FORMAT_JSON) {
+		printf("{\"scenario\":\"%s\",\"clients\":%d,\"channels\":%d,\"threads\":%d,\"duration\":%d,"
+				"\"rate\":%.0f,\"slow\":%d,\"padding\":%d,",
+				scenario, clients, channels, threads, duration, rate, slow, padding);
+		printf("\"connected\":%lu,\"joined\":%lu,\"failed\":%lu,\"closed\":%lu,", connected, joined, failed, closed);
+		print_hist_json("join_usec", &join);
+		printf(",\"sent\":%lu,\"skipped\":%lu,\"received\":%lu,\"errors\":%lu,", sent, skipped, received, errors);
+		printf("\"sent_per_sec\":%.1f,\"received_per_sec\":%.1f,", sent / secs, received / secs);
+		print_hist_json("fanout_usec", &fanout);
+
+		if (have_cpu) {
+			printf(",\"server_cpu\":%.1f,\"server_rss_kb\":%lu}\n", cpu, rss);
+		} else {
+			printf(",\"server_cpu\":null,\"server_rss_kb\":null}\n");
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	printf("scenario      %s\n", scenario);
+	printf("clients       %d in %d channels, %d threads, %d%% slow\n", clients, channels, threads, slow);
+	printf("connections   %lu connected, %lu joined, %lu failed, %lu closed by server\n", connected, joined, failed, closed);
+	print_hist_text("join", &join);
+	printf("messages      %lu sent (%.1f/s), %lu skipped, %lu received (%.1f/s), %lu errors\n",
+			sent, sent / secs, skipped, received, received / secs, errors);
+	print_hist_text("fan-out", &fanout);
+
+	if (have_cpu) {
+		printf("server        %.1f%% cpu, %lu kB rss\n", cpu, rss);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+
+static void *
+worker_cycle(void *arg) {
+	struct epoll_event  events[512];
+	worker_t           *w;
+	client_t           *c;
+	uint64_t            now, last;
+	int                 n, i;
+
+	w = (worker_t *) arg;
+	last = usec();
+
+	while (!stopping) {
+		now = usec();
+
+		w->join_credit += join_rate * (now - last) / 1e6 / threads;
+		if (sending) {
+			w->send_credit += rate * (now - last) / 1e6 / threads;
+		} else {
+			w->send_credit = 0;
+		}
+
+		last = now;
+
+		worker_connect(w, now);
+		worker_send(w);
+
+		n = epoll_wait(w->ep, events, 512, TICK);
+
+		for (i = 0; i < n; i++) {
+			c = (client_t *) events[i].data.ptr;
+
+			if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+				client_write(w, c);
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				client_read(w, c);
+			}
+		}
+	}
+
+	for (i = 0; i < w->n; i++) {
+		if (w->clients[i].fd != -1) {
+			close(w->clients[i].fd);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+worker_connect(worker_t *w, uint64_t now) {
+	int  i, n;
+
+	// at most a batch a tick, so that the handshakes get served meanwhile
+	for (n = 0; w->next_connect < w->n && n < 256; n++) {
+		if (join_rate) {
+			if (w->join_credit < 1) {
+				break;
+			}
+
+			w->join_credit--;
+		}
+
+		i = w->next_connect++;
+		w->clients[i].start = now;
+
+		client_connect(w, &w->clients[i], i * threads + w->id);
+	}
+}
+
+static void
+worker_send(worker_t *w) {
+	client_t  *c;
+	u_char     frame[16 + CLIENT_OUTPUT_SIZE], payload[CLIENT_OUTPUT_SIZE], *p;
+	size_t     n, k;
+	int        tried;
+	uint32_t   mask;
+
+	while (w->send_credit >= 1) {
+		// round robin over the joined senders
+		for (c = NULL, tried = 0; tried < w->n; tried++) {
+			c = &w->clients[w->next_sender];
+			w->next_sender = (w->next_sender + 1) % w->n;
+
+			if (c->state == CLIENT_JOINED && !c->slow) {
+				break;
+			}
+		}
+
+		if (tried == w->n) {
+			w->send_credit = 0;
+			return;
+		}
+
+		w->send_credit--;
+
+		if (c->out_len) {
+			w->skipped++;
+			continue;
+		}
+
+		n = sprintf((char *) payload, "{\"cmd\":\"text\",\"data\":\"%lu%*s\",\"type\":\"multi\",\"channel\":{\"id\":\"loadgen-%d\"}}",
+				usec(), padding, "", c->channel);
+
+		// client frames are masked
+		p = frame;
+		*p++ = 0x81;
+		if (n < 126) {
+			*p++ = 0x80 | n;
+		} else {
+			*p++ = 0x80 | 126;
+			*p++ = n >> 8;
+			*p++ = n & 0xFF;
+		}
+
+		mask = (uint32_t) rand();
+		memcpy(p, &mask, 4);
+		for (k = 0; k < n; k++) {
+			p[4 + k] = payload[k] ^ p[k & 3];
+		}
+
+		p += 4 + n;
+
+		if (client_output(w, c, frame, p - frame) == 0) {
+			w->sent++;
+		}
+	}
+}
+
+
+static void
+client_connect(worker_t *w, client_t *c, int i) {
+	struct sockaddr_in  src;
+	struct epoll_event  ee;
+	int                 fd, on;
+
+	c->channel = i % channels;
+	c->slow = slow && (i % 100) < slow;
+	c->len = c->skip = c->out_len = 0;
+
+	if (c->buf == NULL) {
+		c->buf = malloc(CLIENT_BUFFER_SIZE);
+		if (c->buf == NULL) {
+			goto failed;
+		}
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		goto failed;
+	}
+
+	c->fd = fd;
+
+	on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (sources > 1) {
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+
+		memset(&src, 0, sizeof(src));
+		src.sin_family = AF_INET;
+		src.sin_addr.s_addr = htonl(0x7F000001 + i % sources);
+
+		if (bind(fd, (struct sockaddr *) &src, sizeof(src)) == -1) {
+			goto failed;
+		}
+	}
+
+	if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS) {
+		goto failed;
+	}
+
+	c->state = CLIENT_CONNECTING;
+
+	ee.events = EPOLLOUT;
+	ee.data.ptr = c;
+	if (epoll_ctl(w->ep, EPOLL_CTL_ADD, fd, &ee) == -1) {
+		goto failed;
+	}
+
+	return;
+
+failed:
+
+	client_close(w, c, 1);
+}
+
+static void
+client_write(worker_t *w, client_t *c) {
+	struct epoll_event  ee;
+	u_char              req[256];
+	socklen_t           len;
+	ssize_t             n;
+	int                 err, i;
+
+	if (c->state == CLIENT_CLOSED) {
+		return;
+	}
+
+	if (c->state == CLIENT_CONNECTING) {
+		err = 0;
+		len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+			client_close(w, c, 1);
+			return;
+		}
+
+		w->connected++;
+
+		i = c - w->clients;
+		n = sprintf((char *) req, "GET /loadgen-%d?name=u%d&role=%d HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+				"Sec-WebSocket-Version: 13\r\n\r\n",
+				c->channel, i * threads + w->id, role, host);
+
+		c->state = CLIENT_HANDSHAKE;
+
+		ee.events = EPOLLIN;
+		ee.data.ptr = c;
+		if (epoll_ctl(w->ep, EPOLL_CTL_MOD, c->fd, &ee) == -1) {
+			client_close(w, c, 1);
+			return;
+		}
+
+		client_output(w, c, req, n);
+		return;
+	}
+
+	// flush the pending bytes
+	n = send(c->fd, c->out, c->out_len, 0);
+	if (n == -1) {
+		if (errno != EAGAIN) {
+			client_close(w, c, 0);
+		}
+		return;
+	}
+
+	c->out_len -= n;
+	memmove(c->out, c->out + n, c->out_len);
+
+	if (c->out_len == 0) {
+		ee.events = c->slow && c->state == CLIENT_JOINED ? 0 : EPOLLIN;
+		ee.data.ptr = c;
+		epoll_ctl(w->ep, EPOLL_CTL_MOD, c->fd, &ee);
+	}
+}
+
+static void
+client_read(worker_t *w, client_t *c) {
+	ssize_t  n;
+
+	while (c->state != CLIENT_CLOSED) {
+		n = recv(c->fd, c->buf + c->len, CLIENT_BUFFER_SIZE - c->len, 0);
+		if (n == -1) {
+			if (errno != EAGAIN) {
+				client_close(w, c, c->state < CLIENT_JOINED);
+			}
+			return;
+		}
+
+		if (n == 0) {
+			client_close(w, c, c->state < CLIENT_JOINED);
+			return;
+		}
+
+		c->len += n;
+
+		if (c->state == CLIENT_HANDSHAKE && client_handshake(c) == -1) {
+			client_close(w, c, 1);
+			return;
+		}
+
+		if (c->state >= CLIENT_OPEN) {
+			client_frames(w, c);
+		}
+
+		// slow consumers stop reading once joined
+		if (c->slow && c->state == CLIENT_JOINED) {
+			return;
+		}
+	}
+}
+
+static int
+client_handshake(client_t *c) {
+	u_char  *p;
+
+	p = memmem(c->buf, c->len, "\r\n\r\n", 4);
+	if (p == NULL) {
+		return c->len == CLIENT_BUFFER_SIZE ? -1 : 0;
+	}
+
+	if (c->len < 12 || memcmp(c->buf + 9, "101", 3) != 0) {
+		return -1;
+	}
+
+	p += 4;
+	c->len -= p - c->buf;
+	memmove(c->buf, p, c->len);
+
+	c->state = CLIENT_OPEN;
+
+	return 0;
+}
+
+static void
+client_frames(worker_t *w, client_t *c) {
+	u_char  *p, *end, *payload;
+	size_t   n, avail;
+	int      hdr;
+
+	p = c->buf;
+	end = c->buf + c->len;
+
+	while (c->state != CLIENT_CLOSED) {
+		if (c->skip) {
+			n = c->skip < (size_t) (end - p) ? c->skip : (size_t) (end - p);
+			p += n;
+			c->skip -= n;
+
+			if (c->skip) {
+				break;
+			}
+
+			continue;
+		}
+
+		if (end - p < 2) {
+			break;
+		}
+
+		n = p[1] & 0x7F;
+		hdr = 2;
+
+		if (n == 126) {
+			if (end - p < 4) {
+				break;
+			}
+
+			n = (p[2] << 8) | p[3];
+			hdr = 4;
+		} else if (n == 127) {
+			if (end - p < 10) {
+				break;
+			}
+
+			n = ((uint64_t) p[6] << 24) | (p[7] << 16) | (p[8] << 8) | p[9];
+			hdr = 10;
+		}
+
+		payload = p + hdr;
+		avail = end - payload;
+
+		if (avail >= n) {
+			client_payload(w, c, payload, n);
+			p = payload + n;
+			continue;
+		}
+
+		// longer than the buffer, so only the head is looked at
+		if (p == c->buf && c->len == CLIENT_BUFFER_SIZE) {
+			client_payload(w, c, payload, avail);
+			c->skip = n - avail;
+			p = end;
+			continue;
+		}
+
+		break;
+	}
+
+	c->len = end - p;
+	memmove(c->buf, p, c->len);
+}
+
+static void
+client_payload(worker_t *w, client_t *c, u_char *p, size_t n) {
+	struct epoll_event  ee;
+	u_char             *s;
+	uint64_t            now, t;
+
+	now = usec();
+
+	if (memmem(p, n, "\"raw\":\"text\"", 12)) {
+		s = memmem(p, n, "\"data\":\"", 8);
+		if (s == NULL) {
+			w->errors++;
+			return;
+		}
+
+		for (s += 8, t = 0; s < p + n && *s >= '0' && *s <= '9'; s++) {
+			t = t * 10 + *s - '0';
+		}
+
+		w->received++;
+		hist_add(&w->fanout, now > t ? now - t : 0);
+
+		return;
+	}
+
+	if (memmem(p, n, "\"raw\":\"ident\"", 13)) {
+		if (c->state != CLIENT_OPEN) {
+			return;
+		}
+
+		c->state = CLIENT_JOINED;
+		w->joined++;
+		hist_add(&w->join, now - c->start);
+
+		if (c->slow) {
+			ee.events = c->out_len ? EPOLLOUT : 0;
+			ee.data.ptr = c;
+			epoll_ctl(w->ep, EPOLL_CTL_MOD, c->fd, &ee);
+		}
+
+		return;
+	}
+
+	// users, status or error
+	if (memmem(p, n, "\"raw\":\"error\"", 13)) {
+		w->errors++;
+	}
+}
+
+static int
+client_output(worker_t *w, client_t *c, u_char *data, size_t n) {
+	struct epoll_event  ee;
+	ssize_t             k;
+
+	k = send(c->fd, data, n, 0);
+	if (k == -1) {
+		if (errno != EAGAIN) {
+			client_close(w, c, c->state < CLIENT_JOINED);
+			return -1;
+		}
+
+		k = 0;
+	}
+
+	if ((size_t) k == n) {
+		return 0;
+	}
+
+	if (c->out == NULL) {
+		c->out = malloc(CLIENT_OUTPUT_SIZE + 16);
+		if (c->out == NULL) {
+			client_close(w, c, 0);
+			return -1;
+		}
+	}
+
+	memcpy(c->out, data + k, n - k);
+	c->out_len = n - k;
+
+	ee.events = EPOLLOUT | (c->slow && c->state == CLIENT_JOINED ? 0 : EPOLLIN);
+	ee.data.ptr = c;
+	epoll_ctl(w->ep, EPOLL_CTL_MOD, c->fd, &ee);
+
+	return 0;
+}
+
+static void
+client_close(worker_t *w, client_t *c, int failed) {
+	if (c->fd != -1) {
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	if (c->state == CLIENT_CLOSED) {
+		return;
+	}
+
+	if (failed) {
+		w->failed++;
+	} else if (!stopping) {
+		w->closed++;
+	}
+
+	c->state = CLIENT_CLOSED;
+	c->len = c->skip = c->out_len = 0;
+}
+
+
+/*
+ * Log-linear: exact under 16, then 16 buckets per power of 2, so that each
+ * bucket is within 6.25%.
+ */
+static void
+hist_add(hist_t *h, uint64_t v) {
+	int  e, i;
+
+	if (v < HIST_SUB) {
+		i = v;
+	} else {
+		e = 63 - __builtin_clzll(v);
+		i = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+		if (i >= HIST_BUCKETS) {
+			i = HIST_BUCKETS - 1;
+		}
+	}
+
+	h->buckets[i]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+static void
+hist_merge(hist_t *dst, hist_t *src) {
+	int  i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+/* the upper bound of the bucket holding the q quantile. */
+static uint64_t
+hist_quantile(hist_t *h, double q) {
+	uint64_t  rank, seen, v;
+	int       i, e;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t) (q * h->count);
+	if (rank >= h->count) {
+		rank = h->count - 1;
+	}
+
+	for (i = 0, seen = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			break;
+		}
+	}
+
+	if (i < HIST_SUB) {
+		return i;
+	}
+
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	v = ((uint64_t) (HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+
+	return v < h->max ? v : h->max;
+}
+
+static void
+print_hist_text(const char *name, hist_t *h) {
+	printf("%-13s ", name);
+
+	if (h->count == 0) {
+		printf("no samples\n");
+		return;
+	}
+
+	printf("p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms  mean %.3fms\n",
+			hist_quantile(h, .5) / 1e3, hist_quantile(h, .9) / 1e3, hist_quantile(h, .99) / 1e3,
+			hist_quantile(h, .999) / 1e3, h->max / 1e3, (double) h->sum / h->count / 1e3);
+}
+
+static void
+print_hist_json(const char *name, hist_t *h) {
+	printf("\"%s\":{\"count\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu,\"mean\":%.1f}",
+			name, h->count, hist_quantile(h, .5), hist_quantile(h, .9), hist_quantile(h, .99),
+			hist_quantile(h, .999), h->max, h->count ? (double) h->sum / h->count : 0.0);
+}
+
+
+/* utime + stime in clock ticks, and rss in kB. */
+static int
+server_usage(uint64_t *ticks, uint64_t *rss) {
+	FILE                *fp;
+	char                 path[64], buf[1024], *p;
+	unsigned long long   utime, stime;
+	long                 pages;
+
+	sprintf(path, "/proc/%d/stat", (int) server_pid);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+
+	// the command may hold spaces
+	if (p == NULL || (p = strrchr(buf, ')')) == NULL) {
+		return -1;
+	}
+
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+			&utime, &stime, &pages) != 3) {
+		return -1;
+	}
+
+	*ticks = utime + stime;
+	*rss = pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+	return 0;
+}
+
+static int
+apply_scenario(const char *name) {
+	const scenario_t *s;
+
+	for (s = scenarios; s->name; s++) {
+		if (strcmp(s->name, name) == 0) {
+			scenario = s->name;
+			clients = s->clients;
+			channels = s->channels;
+			rate = s->rate;
+			join_rate = s->join_rate;
+			duration = s->duration;
+			slow = s->slow;
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static uint64_t
+usec() {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+usage(const char *prog) {
+	const scenario_t *s;
+
+	fprintf(stderr, "Usage: %s [-s scenario] [options]\n"
+			"  -s name   preset, the options after it override it\n"
+			"  -H addr   server IPv4 address, default 127.0.0.1\n"
+			"  -p port   server port, default 80\n"
+			"  -c n      clients, default 100\n"
+			"  -m n      channels, default 10\n"
+			"  -r n      messages per second in total, default 100\n"
+			"  -j n      connections per second, default 0 for all at once\n"
+			"  -d sec    seconds of sending, default 10\n"
+			"  -S pct    percent of clients which never read once joined\n"
+			"  -t n      threads, default 4\n"
+			"  -l n      bytes of padding in each message, at most %d\n"
+			"  -B n      source addresses from 127.0.0.1, default one per %d clients on loopback\n"
+			"  -R role   user role, default %d for no interval between messages\n"
+			"  -P pid    server pid, to report its CPU and RSS\n"
+			"  -o fmt    text or json\n"
+			"  -q        no progress on stderr\n"
+			"Scenarios:\n", prog, MESSAGE_MAX_PADDING, ADDRS_PER_SOURCE, ROLE_UNLIMITED);
+
+	for (s = scenarios; s->name; s++) {
+		fprintf(stderr, "  %-15s -c %d -m %d -r %.0f -d %d -S %d\n",
+				s->name, s->clients, s->channels, s->rate, s->duration, s->slow);
+	}
+}